@@ -0,0 +1,646 @@
+/*
+  aofsbench: end-to-end benchmark of a mounted AOFS (or any directory)
+
+  aofsbench [-n files] [-s size[K|M|G]] [-b io-size[K|M]] [-t threads]
+            [-f fsync-every] [-p phase,...] [-d data] [-o output] [-e [-z] [-u]]
+            directory|image
+
+  Runs each phase over files bench.0 .. bench.<files - 1> in directory,
+  split between the threads, and prints throughput and latency
+  percentiles for every phase as JSON (to output if given). The phases,
+  run in this order unless -p names a subset:
+
+    create     open(O_CREAT | O_EXCL) and close each file
+    write      write each file from the start in io-size pieces
+    randwrite  rewrite size / io-size pieces of each file at random offsets
+    read       read each file from the start in io-size pieces
+    reread     read each file again, which the kernel may serve from its cache
+    stat       stat each file
+    readdir    list the directory once per thread
+    liststat   list it once per thread and stat every entry, as ls -l does
+    unlink     remove each file
+
+  Latency is per system call: one write or read of io-size bytes, one
+  stat, a whole listing. With -f N, write and randwrite fsync after
+  every N writes in each thread, and the fsync counts towards the write
+  it follows. Defaults: 1000 files of 64K, 64K I/O, 1 thread, no fsync.
+
+  On an AOFS mount each phase also reports the requests the daemon served
+  for it, from the operation counts in /.aofs_stats.json: round_trips in
+  all and round_trips_per_op, which kernel caching (see the kcache mount
+  option) should bring down for stat and reread.
+
+  With -e the argument is an AOFS image (see mkaofs), mounted in-process
+  through filesys.h instead of going through a FUSE mount. The same run
+  with and without -e separates the cost of the engine from the cost of
+  the kernel round trips. -z has the engine compress the files it
+  creates, and -u share identical blocks; on a mount, use the compress
+  and dedup mount options instead.
+
+  The files hold what -d says: fill (the default) repeats one byte, text
+  is log lines that compress about as well as real logs, random does not
+  compress at all. write and randwrite also report bytes_stored, how much
+  the file system's usage grew, so a run with and without compression or
+  dedup compares both throughput and space.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "filesys.h"
+#include "stats.h"
+
+#define BENCH_MAX_FILES (1UL << 20)
+#define BENCH_MAX_FILE_SIZE (1ULL << 30)
+#define BENCH_MAX_THREADS 256
+
+enum {
+	PHASE_CREATE,
+	PHASE_WRITE,
+	PHASE_RANDWRITE,
+	PHASE_READ,
+	PHASE_REREAD,
+	PHASE_STAT,
+	PHASE_READDIR,
+	PHASE_LISTSTAT,
+	PHASE_UNLINK,
+	PHASE_COUNT
+};
+
+static const char *phaseNames[PHASE_COUNT] = {
+	[PHASE_CREATE] = "create",
+	[PHASE_WRITE] = "write",
+	[PHASE_RANDWRITE] = "randwrite",
+	[PHASE_READ] = "read",
+	[PHASE_REREAD] = "reread",
+	[PHASE_STAT] = "stat",
+	[PHASE_READDIR] = "readdir",
+	[PHASE_LISTSTAT] = "liststat",
+	[PHASE_UNLINK] = "unlink",
+};
+
+// BenchBackend struct, how the phases reach the files. Every call returns
+// a negative errno on failure.
+typedef struct {
+	const char *name;
+	int (*create)(const char *file);
+	int (*open)(const char *file, int write);	// Handle for the calls below
+	ssize_t (*io)(int handle, const char *file, char *buf, size_t len, off_t offset, int write);
+	int (*sync)(int handle);
+	void (*close)(int handle, const char *file);
+	int (*stat)(const char *file);
+	long (*list)(int withStat);					// Entries in the directory, with their attributes if asked
+	int (*unlink)(const char *file);
+	long long (*roundTrips)(void);				// Requests served by a daemon so far, or -1
+	long long (*used)(void);					// Bytes in use in the file system, or -1
+} BenchBackend;
+
+// BenchConfig struct, the command line
+typedef struct {
+	const char *dir;
+	unsigned long files;
+	unsigned long long fileSize;
+	size_t ioSize;
+	int threads;
+	unsigned long fsyncEvery;
+	const char *data;
+	int compress;
+	int dedup;
+} BenchConfig;
+
+// BenchThread struct, one worker's share of a phase and what it measured
+typedef struct {
+	int id;
+	int phase;
+	StatsHistogram hist;
+	unsigned long long bytes;
+	unsigned long entries;
+	unsigned long writes;
+	unsigned long seed;
+	char *buf;
+} BenchThread;
+
+static BenchConfig config = {
+	.files = 1000,
+	.fileSize = 64 * 1024,
+	.ioSize = 64 * 1024,
+	.threads = 1,
+	.data = "fill",
+};
+
+static void usage(void) {
+	fprintf(stderr, "usage: aofsbench [-n files] [-s size[K|M|G]] [-b io-size[K|M]] [-t threads] [-f fsync-every] [-p phase,...] [-d fill|text|random] [-o output] [-e [-z] [-u]] directory|image\n");
+	exit(1);
+}
+
+// Parse a count with an optional K/M/G suffix; zero is allowed
+static unsigned long long parse_size(const char *arg) {
+	char *end;
+	unsigned long long n = strtoull(arg, &end, 10);
+	if(end == arg)
+		usage();
+	switch(*end) {
+		case 'G': case 'g': n <<= 10; /* fall through */
+		case 'M': case 'm': n <<= 10; /* fall through */
+		case 'K': case 'k': n <<= 10; end++; break;
+		case '\0': break;
+		default: usage();
+	}
+	if(*end != '\0')
+		usage();
+	return n;
+}
+
+// Parse a comma separated list of phase names into a mask
+static unsigned int parse_phases(const char *arg) {
+	unsigned int mask = 0;
+	char *list = strdup(arg);
+	for(char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+		int phase = 0;
+		while(phase < PHASE_COUNT && strcmp(name, phaseNames[phase]) != 0)
+			phase++;
+		if(phase == PHASE_COUNT) {
+			fprintf(stderr, "aofsbench: unknown phase %s\n", name);
+			usage();
+		}
+		mask |= 1U << phase;
+	}
+	free(list);
+	return mask;
+}
+
+static void bench_fail(BenchThread *t, const char *file, long err) {
+	fprintf(stderr, "aofsbench: %s %s: %s\n", phaseNames[t->phase], file, strerror(-err));
+	exit(1);
+}
+
+// Files in a directory, normally on a FUSE mount
+static void posix_path(const char *file, char *path, size_t size) {
+	snprintf(path, size, "%s%s", config.dir, file);
+}
+
+static int posix_create(const char *file) {
+	char path[4096];
+	posix_path(file, path, sizeof(path));
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if(fd < 0 || close(fd) < 0)
+		return -errno;
+	return 0;
+}
+
+static int posix_open(const char *file, int write) {
+	char path[4096];
+	posix_path(file, path, sizeof(path));
+	int fd = open(path, write ? O_WRONLY | O_CREAT : O_RDONLY, 0644);
+	return fd < 0 ? -errno : fd;
+}
+
+static ssize_t posix_io(int handle, const char *file, char *buf, size_t len, off_t offset, int write) {
+	(void) file;
+	ssize_t res = write ? pwrite(handle, buf, len, offset) : pread(handle, buf, len, offset);
+	return res < 0 ? -errno : res;
+}
+
+static int posix_sync(int handle) {
+	return fsync(handle) < 0 ? -errno : 0;
+}
+
+static void posix_close(int handle, const char *file) {
+	(void) file;
+	close(handle);
+}
+
+static int posix_stat(const char *file) {
+	char path[4096];
+	struct stat st;
+	posix_path(file, path, sizeof(path));
+	return stat(path, &st) < 0 ? -errno : 0;
+}
+
+static long posix_list(int withStat) {
+	long entries = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir = opendir(config.dir);
+	if(dir == NULL)
+		return -errno;
+	while((de = readdir(dir)) != NULL) {
+		if(withStat && fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			entries = -errno;
+			break;
+		}
+		entries++;
+	}
+	closedir(dir);
+	return entries;
+}
+
+// Requests the AOFS daemon under the directory has served, the sum of the
+// operation counts in its stats file; -1 if there is none
+static long long posix_round_trips(void) {
+	static char buf[64 * 1024];
+	char path[4096];
+	long long total = 0;
+
+	snprintf(path, sizeof(path), "%s/.aofs_stats.json", config.dir);
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return -1;
+	size_t len = 0;
+	ssize_t n;
+	while(len < sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += n;
+	close(fd);
+	buf[len] = '\0';
+
+	// Operations come before the stages inside them
+	char *end = strstr(buf, "\"stages\"");
+	if(end != NULL)
+		*end = '\0';
+	for(char *p = strstr(buf, "\"count\": "); p != NULL; p = strstr(p + 1, "\"count\": "))
+		total += strtoll(p + 9, NULL, 10);
+	return total;
+}
+
+static int posix_unlink(const char *file) {
+	char path[4096];
+	posix_path(file, path, sizeof(path));
+	return unlink(path) < 0 ? -errno : 0;
+}
+
+static long long posix_used(void) {
+	struct statvfs st;
+	if(statvfs(config.dir, &st) < 0)
+		return -1;
+	return (long long) (st.f_blocks - st.f_bfree) * st.f_frsize;
+}
+
+static const BenchBackend posixBackend = {
+	"posix", posix_create, posix_open, posix_io, posix_sync, posix_close, posix_stat, posix_list, posix_unlink, posix_round_trips,
+	posix_used
+};
+
+// The engine on an image, with no kernel in between
+static FileSystem engine;
+
+static int engine_create(const char *file) {
+	return filesys_create(&engine, file, S_IFREG | 0644);
+}
+
+// Each thread has one file open at a time, read like the kernel would
+static __thread ReadStream engineStream;
+
+static int engine_open(const char *file, int write) {
+	memset(&engineStream, 0, sizeof(engineStream));
+	int res = filesys_open(&engine, file, NULL);
+	if(res == -ENOENT && write)
+		res = filesys_create(&engine, file, S_IFREG | 0644);
+	return res;
+}
+
+static ssize_t engine_io(int handle, const char *file, char *buf, size_t len, off_t offset, int write) {
+	(void) handle;
+	return write ? filesys_write(&engine, file, buf, len, offset) : filesys_read_stream(&engine, file, &engineStream, buf, len, offset);
+}
+
+static int engine_sync(int handle) {
+	(void) handle;
+	return filesys_sync(&engine);
+}
+
+static void engine_close(int handle, const char *file) {
+	(void) handle;
+	filesys_release(&engine, file);
+}
+
+static int engine_stat(const char *file) {
+	struct stat st;
+	int res = filesys_lookup(&engine, file, &st);
+	return res < 0 ? res : 0;
+}
+
+static int engine_count(void *ctx, const char *name, const struct stat *st, off_t next) {
+	(void) name;
+	(void) st;
+	(void) next;
+	(*(long *) ctx)++;
+	return 0;
+}
+
+// The engine hands out attributes with the entries, so withStat costs nothing more
+static long engine_list(int withStat) {
+	(void) withStat;
+	long entries = 2;	// "." and ".." as a directory listing has them
+	int res = filesys_readdir(&engine, "/", 0, engine_count, &entries);
+	return res < 0 ? res : entries;
+}
+
+static int engine_unlink(const char *file) {
+	return filesys_unlink(&engine, file);
+}
+
+// In-process, there are no round trips to count
+static long long engine_round_trips(void) {
+	return -1;
+}
+
+static long long engine_used(void) {
+	struct statvfs st;
+	filesys_statfs(&engine, &st);
+	return (long long) (st.f_blocks - st.f_bfree) * st.f_frsize;
+}
+
+static const BenchBackend engineBackend = {
+	"engine", engine_create, engine_open, engine_io, engine_sync, engine_close, engine_stat, engine_list, engine_unlink, engine_round_trips,
+	engine_used
+};
+
+static const BenchBackend *backend = &posixBackend;
+
+// Requests that reading the stats file once costs, taken off every count
+static long long roundTripOverhead;
+
+static unsigned long next_rand(unsigned long *state) {
+	*state = *state * 6364136223846793005UL + 1442695040888963407UL;
+	return *state >> 17;
+}
+
+// One write or read of the whole buffer, with its fsync if one is due
+static void bench_io(BenchThread *t, int handle, size_t len, off_t offset, int write, const char *file) {
+	uint64_t start = stats_now();
+	ssize_t res = backend->io(handle, file, t->buf, len, offset, write);
+	if(res < 0)
+		bench_fail(t, file, res);
+	if(write && config.fsyncEvery && ++t->writes % config.fsyncEvery == 0) {
+		int synced = backend->sync(handle);
+		if(synced < 0)
+			bench_fail(t, file, synced);
+	}
+	stats_record(&t->hist, stats_now() - start);
+	t->bytes += res;
+}
+
+static void bench_file(BenchThread *t, unsigned long n) {
+	char file[64];
+	uint64_t start;
+	int res;
+
+	snprintf(file, sizeof(file), "/bench.%lu", n);
+	switch(t->phase) {
+		case PHASE_CREATE:
+			start = stats_now();
+			res = backend->create(file);
+			if(res < 0)
+				bench_fail(t, file, res);
+			stats_record(&t->hist, stats_now() - start);
+			break;
+		case PHASE_WRITE:
+		case PHASE_READ:
+		case PHASE_REREAD:
+			res = backend->open(file, t->phase == PHASE_WRITE);
+			if(res < 0)
+				bench_fail(t, file, res);
+			for(unsigned long long pos = 0; pos < config.fileSize; pos += config.ioSize) {
+				size_t len = config.fileSize - pos < config.ioSize ? config.fileSize - pos : config.ioSize;
+				bench_io(t, res, len, pos, t->phase == PHASE_WRITE, file);
+			}
+			backend->close(res, file);
+			break;
+		case PHASE_RANDWRITE: {
+			unsigned long long pieces = config.fileSize / config.ioSize;
+			if(pieces == 0)
+				break;
+			res = backend->open(file, 1);
+			if(res < 0)
+				bench_fail(t, file, res);
+			for(unsigned long long i = 0; i < pieces; i++)
+				bench_io(t, res, config.ioSize, (off_t) (next_rand(&t->seed) % pieces) * config.ioSize, 1, file);
+			backend->close(res, file);
+			break;
+		}
+		case PHASE_STAT:
+			start = stats_now();
+			res = backend->stat(file);
+			if(res < 0)
+				bench_fail(t, file, res);
+			stats_record(&t->hist, stats_now() - start);
+			break;
+		case PHASE_UNLINK:
+			start = stats_now();
+			res = backend->unlink(file);
+			if(res < 0)
+				bench_fail(t, file, res);
+			stats_record(&t->hist, stats_now() - start);
+			break;
+	}
+}
+
+static void *bench_thread(void *arg) {
+	BenchThread *t = arg;
+
+	if(t->phase == PHASE_READDIR || t->phase == PHASE_LISTSTAT) {
+		uint64_t start = stats_now();
+		long entries = backend->list(t->phase == PHASE_LISTSTAT);
+		if(entries < 0)
+			bench_fail(t, "/", entries);
+		t->entries += entries;
+		stats_record(&t->hist, stats_now() - start);
+		return NULL;
+	}
+	// Interleaved, so every thread works across the whole name range
+	for(unsigned long n = t->id; n < config.files; n += config.threads)
+		bench_file(t, n);
+	return NULL;
+}
+
+// Fill a thread's buffer with what -d asks for
+static void bench_data(BenchThread *t) {
+	if(strcmp(config.data, "random") == 0) {
+		for(size_t i = 0; i < config.ioSize; i++)
+			t->buf[i] = next_rand(&t->seed);
+	}
+	else if(strcmp(config.data, "text") == 0) {
+		static const char *levels[] = { "INFO", "INFO", "INFO", "WARN", "DEBUG" };
+		for(size_t i = 0; i < config.ioSize; ) {
+			unsigned long r = next_rand(&t->seed);
+			char line[160];
+			int len = snprintf(line, sizeof(line), "2026-10-17T%02lu:%02lu:%02lu.%03lu %s worker=%d request=%lu path=/api/v1/items/%lu status=%d\n",
+					r % 24, r / 24 % 60, r / 1440 % 60, r / 86400 % 1000, levels[r / 7 % 5], t->id, r % 1000000, r / 3 % 10000, r % 17 ? 200 : 404);
+			size_t n = (size_t) len < config.ioSize - i ? (size_t) len : config.ioSize - i;
+			memcpy(t->buf + i, line, n);
+			i += n;
+		}
+	}
+	else {
+		memset(t->buf, 0xa5, config.ioSize);
+	}
+}
+
+// Run one phase on every thread and print its JSON object
+static void bench_phase(BenchThread *threads, int phase, FILE *out) {
+	pthread_t ids[BENCH_MAX_THREADS];
+	StatsHistogram hist;
+	unsigned long long bytes = 0;
+	unsigned long entries = 0;
+
+	for(int i = 0; i < config.threads; i++) {
+		BenchThread *t = &threads[i];
+		memset(&t->hist, 0, sizeof(t->hist));
+		t->phase = phase;
+		t->bytes = 0;
+		t->entries = 0;
+		t->writes = 0;
+	}
+	long long tripsBefore = backend->roundTrips();
+	long long usedBefore = backend->used();
+	uint64_t start = stats_now();
+	for(int i = 0; i < config.threads; i++) {
+		if(pthread_create(&ids[i], NULL, bench_thread, &threads[i]) != 0) {
+			fprintf(stderr, "aofsbench: unable to start thread %d\n", i);
+			exit(1);
+		}
+	}
+	for(int i = 0; i < config.threads; i++)
+		pthread_join(ids[i], NULL);
+	double seconds = (stats_now() - start) / 1e9;
+	long long trips = tripsBefore < 0 ? -1 : backend->roundTrips() - tripsBefore - roundTripOverhead;
+	long long usedAfter = backend->used();
+
+	memset(&hist, 0, sizeof(hist));
+	for(int i = 0; i < config.threads; i++) {
+		stats_merge(&hist, &threads[i].hist);
+		bytes += threads[i].bytes;
+		entries += threads[i].entries;
+	}
+	StatsSummary s;
+	stats_histogram_summary(&hist, &s);
+	if(seconds <= 0)
+		seconds = 1e-9;
+
+	fprintf(out, "\"%s\": {\"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.1f", phaseNames[phase],
+			(unsigned long long) s.count, seconds, s.count / seconds);
+	if(phase == PHASE_WRITE || phase == PHASE_RANDWRITE || phase == PHASE_READ || phase == PHASE_REREAD)
+		fprintf(out, ", \"bytes\": %llu, \"mb_per_sec\": %.1f", bytes, bytes / seconds / (1 << 20));
+	if((phase == PHASE_WRITE || phase == PHASE_RANDWRITE) && usedBefore >= 0 && usedAfter >= 0)
+		fprintf(out, ", \"bytes_stored\": %lld", usedAfter - usedBefore);
+	if(phase == PHASE_READDIR || phase == PHASE_LISTSTAT)
+		fprintf(out, ", \"entries\": %lu", entries);
+	if(trips >= 0)
+		fprintf(out, ", \"round_trips\": %lld, \"round_trips_per_op\": %.3f", trips, s.count ? (double) trips / s.count : 0.0);
+	fprintf(out, ", \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}",
+			s.p50Ns / 1e3, s.p99Ns / 1e3, s.p999Ns / 1e3, s.maxNs / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int phases = (1U << PHASE_COUNT) - 1;
+	const char *output = NULL;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:s:b:t:f:p:d:o:ezu")) != -1) {
+		switch(opt) {
+			case 'n': config.files = parse_size(optarg); break;
+			case 's': config.fileSize = parse_size(optarg); break;
+			case 'b': config.ioSize = parse_size(optarg); break;
+			case 't': config.threads = atoi(optarg); break;
+			case 'f': config.fsyncEvery = parse_size(optarg); break;
+			case 'p': phases = parse_phases(optarg); break;
+			case 'd': config.data = optarg; break;
+			case 'o': output = optarg; break;
+			case 'e': backend = &engineBackend; break;
+			case 'z': config.compress = 1; break;
+			case 'u': config.dedup = 1; break;
+			default: usage();
+		}
+	}
+	if(optind != argc - 1)
+		usage();
+	config.dir = argv[optind];
+	if(config.files == 0 || config.files > BENCH_MAX_FILES) {
+		fprintf(stderr, "aofsbench: file count must be 1 to %lu\n", BENCH_MAX_FILES);
+		return 1;
+	}
+	if(config.fileSize > BENCH_MAX_FILE_SIZE) {
+		fprintf(stderr, "aofsbench: file size must be at most 1G\n");
+		return 1;
+	}
+	if(config.ioSize == 0 || config.threads < 1 || config.threads > BENCH_MAX_THREADS)
+		usage();
+	if(strcmp(config.data, "fill") != 0 && strcmp(config.data, "text") != 0 && strcmp(config.data, "random") != 0)
+		usage();
+	if(config.compress && backend != &engineBackend) {
+		fprintf(stderr, "aofsbench: -z needs -e; mount with -o compress instead\n");
+		return 1;
+	}
+	if(config.dedup && backend != &engineBackend) {
+		fprintf(stderr, "aofsbench: -u needs -e; mount with -o dedup instead\n");
+		return 1;
+	}
+
+	if(backend == &engineBackend) {
+		engine.cacheBytes = (size_t) CACHE_DEFAULT_MB << 20;
+		engine.commitInterval = JOURNAL_DEFAULT_INTERVAL;
+		engine.readaheadBytes = READAHEAD_DEFAULT_MAX;
+		engine.compress = config.compress;
+		engine.dedup = config.dedup;
+		if(filesys_mount(&engine, config.dir) < 0) {
+			fprintf(stderr, "aofsbench: unable to mount %s, format it with mkaofs first\n", config.dir);
+			return 1;
+		}
+	}
+
+	// Two reads back to back differ by what a read itself costs
+	long long trips = backend->roundTrips();
+	if(trips >= 0)
+		roundTripOverhead = backend->roundTrips() - trips;
+
+	FILE *out = stdout;
+	if(output != NULL && (out = fopen(output, "w")) == NULL) {
+		fprintf(stderr, "aofsbench: unable to open %s: %s\n", output, strerror(errno));
+		return 1;
+	}
+
+	BenchThread *threads = calloc(config.threads, sizeof(BenchThread));
+	for(int i = 0; i < config.threads; i++) {
+		threads[i].id = i;
+		threads[i].seed = i + 1;
+		threads[i].buf = malloc(config.ioSize);
+		if(threads[i].buf == NULL) {
+			fprintf(stderr, "aofsbench: unable to allocate %zu byte buffers\n", config.ioSize);
+			return 1;
+		}
+		bench_data(&threads[i]);
+	}
+
+	fprintf(out, "{\"backend\": \"%s\", \"files\": %lu, \"file_size\": %llu, \"io_size\": %zu, \"threads\": %d, \"fsync_every\": %lu, \"data\": \"%s\", \"compress\": %s, \"dedup\": %s, \"phases\": {",
+			backend->name, config.files, config.fileSize, config.ioSize, config.threads, config.fsyncEvery, config.data, config.compress ? "true" : "false", config.dedup ? "true" : "false");
+	const char *sep = "";
+	for(int phase = 0; phase < PHASE_COUNT; phase++) {
+		if(!(phases & (1U << phase)))
+			continue;
+		fprintf(out, "%s", sep);
+		bench_phase(threads, phase, out);
+		fflush(out);
+		sep = ", ";
+	}
+	fprintf(out, "}}\n");
+
+	for(int i = 0; i < config.threads; i++)
+		free(threads[i].buf);
+	free(threads);
+	if(backend == &engineBackend && filesys_unmount(&engine) < 0) {
+		fprintf(stderr, "aofsbench: unable to unmount %s\n", config.dir);
+		return 1;
+	}
+	if(out != stdout)
+		fclose(out);
+	return 0;
+}
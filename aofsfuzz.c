@@ -0,0 +1,685 @@
+/*
+  aofsfuzz: randomized correctness test of the AOFS engine
+
+  aofsfuzz [-n ops] [-t threads] [-r rounds] [-s seed] [-b blocks]
+           [-c cache-MB] [-j commit-interval] image
+
+  Formats image, mounts it in-process through filesys.h and has every
+  thread run a random mix of create, write, read, truncate, fallocate,
+  getattr, readdir, release, sync, unlink, mkdir and rmdir on files and
+  directories of its own, half the reads streaming through a file so
+  that readahead prefetches alongside the other operations, checking
+  each result against an in-memory copy of what they should hold. Each
+  thread works under /fz<thread>, in subdirectories that come and go,
+  with names up to the longest allowed. Some operations go through the
+  inode API instead, holding references across unlinks the way the FUSE
+  frontend does.
+  After each of the rounds the image is unmounted and mounted again, and
+  every file is read back in full, the block bitmap is checked against
+  the extent maps and tails, the reference count of every block several
+  extents name against how many do, and every inode in use must have an
+  entry. Every other round creates its files compressed, all but the
+  last share identical blocks, and rounds take turns running I/O batches
+  on io_uring, on worker threads and one transfer at a time.
+  Last, a child process writes a file, syncs it, unlinks, truncates or
+  punches it and exits without committing, as a crash would; replaying
+  the journal must bring back the file as synced, and every other file
+  unharmed. Any difference prints the seed and operation and exits 1.
+
+  No FUSE mount is involved, so this runs anywhere the engine compiles.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "filesys.h"
+#include "format.h"
+
+#define FUZZ_FILES 8						// Files per thread
+#define FUZZ_DIRS 2							// Subdirectories the files are spread over
+#define FUZZ_PATH_LEN (AOFS_NAME_LEN + 32)
+#define FUZZ_MAX_SIZE (256 * 1024)
+#define FUZZ_MAX_IO (64 * 1024)
+#define FUZZ_MAX_THREADS 64
+
+// FuzzFile struct, what one file should hold
+typedef struct {
+	int exists;
+	off_t size;
+	char *data;							// FUZZ_MAX_SIZE bytes, valid up to size
+} FuzzFile;
+
+// FuzzThread struct
+typedef struct {
+	int id;
+	unsigned long seed;
+	long op;
+	FuzzFile files[FUZZ_FILES];
+	int dirs[FUZZ_DIRS];				// Which subdirectories exist
+	int held;							// Inode referenced until the round ends, 0 for none
+	ReadStream streams[FUZZ_FILES];		// For reads that go on where the last one stopped
+	char *buf;
+	char *out;
+} FuzzThread;
+
+static FileSystem fs;
+static long opsPerRound = 100000;
+static unsigned long baseSeed = 1;
+
+static void usage(void) {
+	fprintf(stderr, "usage: aofsfuzz [-n ops] [-t threads] [-r rounds] [-s seed] [-b blocks] [-c cache-MB] [-j commit-interval] image\n");
+	exit(1);
+}
+
+static unsigned long next_rand(unsigned long *state) {
+	*state = *state * 6364136223846793005UL + 1442695040888963407UL;
+	return *state >> 17;
+}
+
+static void fuzz_fail(FuzzThread *t, const char *path, const char *what, long got, long expected) {
+	fprintf(stderr, "aofsfuzz: seed %lu thread %d op %ld %s: %s returned %ld, expected %ld\n",
+			baseSeed, t->id, t->op, path, what, got, expected);
+	exit(1);
+}
+
+// File names get longer with the file number; the last is as long as a
+// name can be
+static void fuzz_name(int file, char *name) {
+	int len = file == FUZZ_FILES - 1 ? AOFS_NAME_LEN - 1 : 8 + file * 29;
+	int n = snprintf(name, AOFS_NAME_LEN, "f%d_", file);
+	memset(name + n, 'x', len - n);
+	name[len] = '\0';
+}
+
+static void fuzz_dir_path(FuzzThread *t, int dir, char *path, size_t size) {
+	snprintf(path, size, "/fz%d/d%d", t->id, dir);
+}
+
+static void fuzz_path(FuzzThread *t, int file, char *path, size_t size) {
+	char name[AOFS_NAME_LEN];
+	fuzz_name(file, name);
+	snprintf(path, size, "/fz%d/d%d/%s", t->id, file % FUZZ_DIRS, name);
+}
+
+// Read the whole file back and compare it with the model
+static void fuzz_verify(FuzzThread *t, int file) {
+	FuzzFile *f = &t->files[file];
+	struct stat st;
+	char path[FUZZ_PATH_LEN];
+
+	fuzz_path(t, file, path, sizeof(path));
+	int res = filesys_lookup(&fs, path, &st);
+	if(!f->exists) {
+		if(res != -ENOENT)
+			fuzz_fail(t, path, "lookup", res, -ENOENT);
+		return;
+	}
+	if(res < 0)
+		fuzz_fail(t, path, "lookup", res, 0);
+	if(st.st_size != f->size)
+		fuzz_fail(t, path, "size", st.st_size, f->size);
+	ssize_t n = filesys_read(&fs, path, t->out, FUZZ_MAX_SIZE, 0);
+	if(n != f->size)
+		fuzz_fail(t, path, "read", n, f->size);
+	for(off_t i = 0; i < n; i++) {
+		if(t->out[i] != f->data[i])
+			fuzz_fail(t, path, "byte at offset", i, -1);
+	}
+}
+
+// Names seen by a listing of one subdirectory, as a bitmask of its files;
+// anything else, a repeat or wrong attributes set bit 31. It is read in
+// pages of at most page entries.
+typedef struct {
+	FuzzThread *t;
+	unsigned int seen;
+	int page;
+	int taken;
+	off_t next;							// Where the next page starts
+} FuzzListing;
+
+static int fuzz_fill(void *ctx, const char *name, const struct stat *st, off_t next) {
+	FuzzListing *l = ctx;
+	char expected[AOFS_NAME_LEN];
+	int file;
+	if(l->taken == l->page)
+		return 1;
+	l->taken++;
+	l->next = next;
+	if(sscanf(name, "f%d_", &file) == 1 && file >= 0 && file < FUZZ_FILES && !(l->seen & (1U << file))) {
+		fuzz_name(file, expected);
+		if(strcmp(name, expected) == 0 && S_ISREG(st->st_mode) && st->st_size == l->t->files[file].size) {
+			l->seen |= 1U << file;
+			return 0;
+		}
+	}
+	l->seen |= 1U << 31;
+	return 0;
+}
+
+// Check a subdirectory and its listing against the model
+static void fuzz_verify_dir(FuzzThread *t, int dir) {
+	FuzzListing l = { t, 0, next_rand(&t->seed) % 3 + 1, 0, 0 };
+	char path[FUZZ_PATH_LEN];
+	unsigned int expected = 0;
+	long res;
+
+	fuzz_dir_path(t, dir, path, sizeof(path));
+	do {
+		l.taken = 0;
+		res = filesys_readdir(&fs, path, l.next, fuzz_fill, &l);
+	} while(res == 0 && l.taken > 0);
+	if(res != (t->dirs[dir] ? 0 : -ENOENT))
+		fuzz_fail(t, path, "readdir", res, t->dirs[dir] ? 0 : -ENOENT);
+	for(int i = dir; i < FUZZ_FILES; i += FUZZ_DIRS) {
+		if(t->files[i].exists)
+			expected |= 1U << i;
+	}
+	if(l.seen != expected)
+		fuzz_fail(t, path, "readdir listing", l.seen, expected);
+}
+
+// Fill the first len bytes of t->buf, bound for file offset offset: with
+// random bytes, with runs that compress, or with one of a few block
+// patterns every file shares, so that full blocks written repeat
+static void fuzz_content(FuzzThread *t, size_t len, off_t offset) {
+	unsigned long kind = next_rand(&t->seed) % 3;
+	if(kind == 0) {
+		for(size_t i = 0; i < len; i++)
+			t->buf[i] = next_rand(&t->seed);
+		return;
+	}
+	if(kind == 1) {
+		unsigned long pattern = next_rand(&t->seed) % 4;
+		for(size_t i = 0; i < len; i++) {
+			size_t at = (offset + i) % AOFS_DEFAULT_BLOCK_SIZE;
+			t->buf[i] = (at * 31 + pattern * 7) ^ (at >> 8);
+		}
+		return;
+	}
+	for(size_t i = 0; i < len; ) {
+		unsigned long r = next_rand(&t->seed);
+		size_t run = r % 64 + 1;
+		for(size_t j = 0; j < run && i < len; j++, i++)
+			t->buf[i] = "aofs \n0"[(r >> 8) % 7];
+	}
+}
+
+// Use a file through the inode API: look it up, or create it, read it by
+// number, maybe unlink it and check it still works by number, then forget
+// it. One reference per round may be kept until the unmount instead, which
+// leaves the next mount an unlinked inode to free.
+static void fuzz_inode(FuzzThread *t, int file) {
+	FuzzFile *f = &t->files[file];
+	int dir = file % FUZZ_DIRS;
+	char path[FUZZ_PATH_LEN];
+	char name[AOFS_NAME_LEN];
+	struct stat st;
+	long res;
+
+	fuzz_dir_path(t, dir, path, sizeof(path));
+	int parent = filesys_lookup(&fs, path, &st);
+	if(!t->dirs[dir]) {
+		if(parent != -ENOENT)
+			fuzz_fail(t, path, "lookup", parent, -ENOENT);
+		return;
+	}
+	if(parent <= 0)
+		fuzz_fail(t, path, "lookup", parent, 0);
+	fuzz_name(file, name);
+	fuzz_path(t, file, path, sizeof(path));
+	int ino = filesys_lookup_at(&fs, parent, name, &st);
+	if(!f->exists) {
+		if(ino != -ENOENT)
+			fuzz_fail(t, path, "lookup_at", ino, -ENOENT);
+		ino = filesys_create_at(&fs, parent, name, 0644, &st);
+		if(ino <= 0 || st.st_ino != (ino_t) ino || st.st_size != 0)
+			fuzz_fail(t, path, "create_at", ino, 0);
+		f->exists = 1;
+		f->size = 0;
+	}
+	else if(ino <= 0 || st.st_size != f->size) {
+		fuzz_fail(t, path, "lookup_at", ino, 0);
+	}
+
+	res = filesys_read_ino(&fs, ino, t->out, FUZZ_MAX_SIZE, 0);
+	if(res != f->size || memcmp(t->out, f->data, f->size) != 0)
+		fuzz_fail(t, path, "read_ino", res, f->size);
+	if(next_rand(&t->seed) % 2) {
+		res = filesys_unlink_at(&fs, parent, name);
+		if(res != 0)
+			fuzz_fail(t, path, "unlink_at", res, 0);
+		f->exists = 0;
+		// Gone from the directory, but not for whoever holds it
+		res = filesys_getattr_ino(&fs, ino, &st);
+		if(res != ino || st.st_nlink != 0 || st.st_size != f->size)
+			fuzz_fail(t, path, "getattr_ino after unlink", res, ino);
+		size_t len = next_rand(&t->seed) % FUZZ_MAX_IO + 1;
+		fuzz_content(t, len, 0);
+		res = filesys_write_ino(&fs, ino, t->buf, len, 0);
+		if(res != (long) len)
+			fuzz_fail(t, path, "write_ino after unlink", res, len);
+		res = filesys_read_ino(&fs, ino, t->out, len, 0);
+		if(res != (long) len || memcmp(t->out, t->buf, len) != 0)
+			fuzz_fail(t, path, "read_ino after unlink", res, len);
+		f->size = 0;
+	}
+	if(t->held == 0 && next_rand(&t->seed) % 8 == 0) {
+		t->held = ino;
+		return;
+	}
+	res = filesys_forget(&fs, ino, 1);
+	if(res != 0)
+		fuzz_fail(t, path, "forget", res, 0);
+}
+
+// A size or offset below max, half the time below a 64th of it, so small
+// files and their moves from inode to tail to blocks come up often
+static unsigned long fuzz_rand_size(FuzzThread *t, unsigned long max) {
+	unsigned long n = next_rand(&t->seed);
+	return n % 2 ? n / 2 % max : n / 2 % (max / 64);
+}
+
+static void fuzz_op(FuzzThread *t) {
+	int file = next_rand(&t->seed) % FUZZ_FILES;
+	FuzzFile *f = &t->files[file];
+	int dir = file % FUZZ_DIRS;
+	int missing = f->exists ? 0 : -ENOENT;
+	unsigned long op = next_rand(&t->seed) % 100;
+	char path[FUZZ_PATH_LEN];
+	long res;
+
+	fuzz_path(t, file, path, sizeof(path));
+	if(op < 30) {
+		off_t offset = fuzz_rand_size(t, FUZZ_MAX_SIZE);
+		size_t len = fuzz_rand_size(t, FUZZ_MAX_IO) + 1;
+		if(offset + len > FUZZ_MAX_SIZE)
+			len = FUZZ_MAX_SIZE - offset;
+		fuzz_content(t, len, offset);
+		res = filesys_write(&fs, path, t->buf, len, offset);
+		if(res != (missing ? missing : (long) len))
+			fuzz_fail(t, path, "write", res, missing ? missing : (long) len);
+		if(missing)
+			return;
+		if(offset > f->size)
+			memset(f->data + f->size, 0, offset - f->size);
+		memcpy(f->data + offset, t->buf, len);
+		if(offset + (off_t) len > f->size)
+			f->size = offset + len;
+	}
+	else if(op < 55) {
+		// Half of the reads are streams, which readahead prefetches for
+		ReadStream *rs = &t->streams[file];
+		int stream = op % 2;
+		off_t offset = next_rand(&t->seed) % (FUZZ_MAX_SIZE + FUZZ_MAX_IO);
+		size_t len = next_rand(&t->seed) % (2 * FUZZ_MAX_IO);
+		if(stream)
+			offset = rs->next < f->size ? rs->next : 0;
+		long expected = offset >= f->size ? 0 : (off_t) len < f->size - offset ? (long) len : f->size - offset;
+		res = stream ? filesys_read_stream(&fs, path, rs, t->out, len, offset) : filesys_read(&fs, path, t->out, len, offset);
+		if(res != (missing ? missing : expected))
+			fuzz_fail(t, path, "read", res, missing ? missing : expected);
+		if(!missing && memcmp(t->out, f->data + offset, expected) != 0)
+			fuzz_fail(t, path, "read content at", offset, -1);
+	}
+	else if(op < 59) {
+		off_t size = fuzz_rand_size(t, FUZZ_MAX_SIZE + 1);
+		res = filesys_truncate(&fs, path, size);
+		if(res != missing)
+			fuzz_fail(t, path, "truncate", res, missing);
+		if(missing)
+			return;
+		if(size > f->size)
+			memset(f->data + f->size, 0, size - f->size);
+		f->size = size;
+	}
+	else if(op < 63) {
+		// Blocks reserved, past the end of file or not, or a hole punched
+		static const int modes[] = { 0, AOFS_FALLOC_KEEP_SIZE, AOFS_FALLOC_KEEP_SIZE | AOFS_FALLOC_PUNCH_HOLE };
+		int mode = modes[next_rand(&t->seed) % 3];
+		off_t offset = fuzz_rand_size(t, FUZZ_MAX_SIZE);
+		off_t len = fuzz_rand_size(t, FUZZ_MAX_SIZE) + 1;
+		if(offset + len > FUZZ_MAX_SIZE)
+			len = FUZZ_MAX_SIZE - offset;
+		res = filesys_fallocate(&fs, path, mode, offset, len);
+		if(res != missing)
+			fuzz_fail(t, path, "fallocate", res, missing);
+		if(missing)
+			return;
+		if(mode & AOFS_FALLOC_PUNCH_HOLE) {
+			off_t end = offset + len < f->size ? offset + len : f->size;
+			if(offset < end)
+				memset(f->data + offset, 0, end - offset);
+		}
+		else if(!(mode & AOFS_FALLOC_KEEP_SIZE) && offset + len > f->size) {
+			memset(f->data + f->size, 0, offset + len - f->size);
+			f->size = offset + len;
+		}
+	}
+	else if(op < 67) {
+		fuzz_inode(t, file);
+	}
+	else if(op < 71) {
+		struct stat st;
+		res = filesys_lookup(&fs, path, &st);
+		if(missing ? res != missing : res <= 0)
+			fuzz_fail(t, path, "lookup", res, missing);
+		if(!missing && (st.st_size != f->size || !S_ISREG(st.st_mode)))
+			fuzz_fail(t, path, "size", st.st_size, f->size);
+		// A file in the middle of a path
+		strcat(path, "/x");
+		res = filesys_lookup(&fs, path, &st);
+		if(res != (missing ? missing : -ENOTDIR))
+			fuzz_fail(t, path, "lookup", res, missing ? missing : -ENOTDIR);
+	}
+	else if(op < 79) {
+		res = filesys_unlink(&fs, path);
+		if(res != missing)
+			fuzz_fail(t, path, "unlink", res, missing);
+		f->exists = 0;
+		f->size = 0;
+	}
+	else if(op < 88) {
+		long expected = !t->dirs[dir] ? -ENOENT : f->exists ? -EEXIST : 0;
+		res = filesys_create(&fs, path, S_IFREG | 0644);
+		if(res != expected)
+			fuzz_fail(t, path, "create", res, expected);
+		if(expected == 0) {
+			f->exists = 1;
+			f->size = 0;
+		}
+	}
+	else if(op < 92) {
+		fuzz_verify_dir(t, dir);
+	}
+	else if(op < 94) {
+		fuzz_dir_path(t, dir, path, sizeof(path));
+		res = filesys_mkdir(&fs, path, 0755);
+		if(res != (t->dirs[dir] ? -EEXIST : 0))
+			fuzz_fail(t, path, "mkdir", res, t->dirs[dir] ? -EEXIST : 0);
+		t->dirs[dir] = 1;
+	}
+	else if(op < 96) {
+		long expected = t->dirs[dir] ? 0 : -ENOENT;
+		for(int i = dir; i < FUZZ_FILES && expected == 0; i += FUZZ_DIRS) {
+			if(t->files[i].exists)
+				expected = -ENOTEMPTY;
+		}
+		fuzz_dir_path(t, dir, path, sizeof(path));
+		res = filesys_rmdir(&fs, path);
+		if(res != expected)
+			fuzz_fail(t, path, "rmdir", res, expected);
+		if(expected == 0)
+			t->dirs[dir] = 0;
+	}
+	else if(op < 98) {
+		res = filesys_release(&fs, path);
+		if(res != 0)
+			fuzz_fail(t, path, "release", res, 0);
+	}
+	else {
+		res = filesys_sync(&fs);
+		if(res != 0)
+			fuzz_fail(t, path, "sync", res, 0);
+	}
+}
+
+static void *fuzz_thread(void *arg) {
+	FuzzThread *t = arg;
+	for(long n = 0; n < opsPerRound; n++, t->op++)
+		fuzz_op(t);
+	return NULL;
+}
+
+// Inodes without an entry must be ones some thread still holds; the
+// mount after a round must have freed them all
+static void fuzz_check_unlinked(void) {
+	Superblock *sb = &fs.sb;
+	for(unsigned int i = AOFS_ROOT_INODE + 1; i < sb->inodeCount; i++) {
+		Metadata *m = &sb->metadata[i];
+		if(m->mode != 0 && m->name == NULL && m->lookups == 0) {
+			fprintf(stderr, "aofsfuzz: seed %lu: inode %u has no entry and is not held\n", baseSeed, i);
+			exit(1);
+		}
+	}
+}
+
+// Every block marked used must belong to the metadata area, an extent, an
+// indirect block or a tail block, and every one of those must be marked
+// used; the tail map must know each tail block, and the shared block map
+// how many extents name each block
+static void fuzz_check_blocks(void) {
+	Superblock *sb = &fs.sb;
+	unsigned long expected = sb->dataStart;
+	unsigned long used = 0;
+	unsigned int *refs = calloc(sb->totalNumBlocks, sizeof(unsigned int));
+	char *raw = calloc(sb->totalNumBlocks, 1);
+	char *tails = calloc(sb->totalNumBlocks, 1);
+	unsigned long tailBlocks = 0;
+
+	for(unsigned int i = 1; i < sb->inodeCount; i++) {
+		Metadata *m = &sb->metadata[i];
+		if(m->mode == 0)
+			continue;
+		if((m->flags & AOFS_INODE_TAIL) && !tails[m->tailBlock]) {
+			tails[m->tailBlock] = 1;
+			tailBlocks++;
+			refs[m->tailBlock]++;
+		}
+		for(unsigned int e = 0; e < m->extentCount; e++) {
+			unsigned int length = m->extents[e].length;
+			if(m->extents[e].flags & AOFS_EXTENT_COMPRESSED)
+				length = ((m->extents[e].flags & AOFS_EXTENT_BYTES) + sb->blockSize - 1) / sb->blockSize;
+			for(unsigned int b = 0; b < length; b++) {
+				refs[m->extents[e].start + b]++;
+				raw[m->extents[e].start + b] |= !m->extents[e].flags;
+			}
+		}
+		if(m->indirectBlock != 0)
+			refs[m->indirectBlock]++;
+	}
+	for(unsigned int b = 0; b < sb->totalNumBlocks; b++) {
+		if(refs[b] == 0)
+			continue;
+		expected++;
+		if(!bitmap_test(&sb->BitMap, b)) {
+			fprintf(stderr, "aofsfuzz: seed %lu: block %u is in use but free\n", baseSeed, b);
+			exit(1);
+		}
+		// Only raw extents share blocks, and the count must say how many do
+		unsigned int counted = raw[b] ? dedup_refs(&fs.shared, b) : 1;
+		if(refs[b] != counted) {
+			fprintf(stderr, "aofsfuzz: seed %lu: block %u is named %u times, counted %u\n", baseSeed, b, refs[b], counted);
+			exit(1);
+		}
+	}
+	free(refs);
+	free(raw);
+	free(tails);
+	if(tailBlocks != fs.tails.count) {
+		fprintf(stderr, "aofsfuzz: seed %lu: files use %lu tail blocks, the map has %u\n", baseSeed, tailBlocks, fs.tails.count);
+		exit(1);
+	}
+	for(unsigned int b = 0; b < sb->totalNumBlocks; b++)
+		used += bitmap_test(&sb->BitMap, b);
+	if(used != expected) {
+		fprintf(stderr, "aofsfuzz: seed %lu: %lu blocks in use, files account for %lu\n", baseSeed, used, expected);
+		exit(1);
+	}
+}
+
+// Sync a file in a child process, then unlink, truncate or punch it (op 0,
+// 1 or 2) from at on and leave without committing. The mount after must
+// replay the journal to the file as synced, with the blocks it had still
+// in use.
+static void fuzz_crash(const char *image, int op) {
+	static const char *names[] = { "unlink", "truncate", "punch" };
+	static char data[FUZZ_MAX_SIZE], out[FUZZ_MAX_SIZE];
+	unsigned long state = baseSeed * 104729 + op;
+	off_t size = FUZZ_MAX_SIZE / 2 + next_rand(&state) % (FUZZ_MAX_SIZE / 2);
+	off_t at = next_rand(&state) % size;
+	int status;
+
+	for(off_t i = 0; i < size; i++)
+		data[i] = next_rand(&state);
+	pid_t pid = fork();
+	if(pid == 0) {
+		// No background commit may sneak the operation in
+		fs.commitInterval = 3600;
+		if(filesys_mount(&fs, image) < 0 || filesys_create(&fs, "/crash", S_IFREG | 0644) < 0 ||
+				filesys_write(&fs, "/crash", data, size, 0) != size || filesys_sync(&fs) < 0)
+			_exit(1);
+		if(op == 0)
+			filesys_unlink(&fs, "/crash");
+		else if(op == 1)
+			filesys_truncate(&fs, "/crash", at);
+		else
+			filesys_fallocate(&fs, "/crash", AOFS_FALLOC_KEEP_SIZE | AOFS_FALLOC_PUNCH_HOLE, at, size - at);
+		_exit(0);
+	}
+	if(pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "aofsfuzz: seed %lu: crash %s: child failed\n", baseSeed, names[op]);
+		exit(1);
+	}
+	if(filesys_mount(&fs, image) < 0) {
+		fprintf(stderr, "aofsfuzz: seed %lu: mount after crash %s failed\n", baseSeed, names[op]);
+		exit(1);
+	}
+	ssize_t got = filesys_read(&fs, "/crash", out, FUZZ_MAX_SIZE, 0);
+	if(got != size || memcmp(out, data, size) != 0) {
+		fprintf(stderr, "aofsfuzz: seed %lu: crash %s at %ld: read %ld bytes, expected %ld synced\n",
+				baseSeed, names[op], (long) at, (long) got, (long) size);
+		exit(1);
+	}
+	fuzz_check_blocks();
+	if(filesys_unlink(&fs, "/crash") < 0 || filesys_unmount(&fs) < 0)
+		exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long blocks = 65536;
+	int threads = 4;
+	int rounds = 4;
+	int opt;
+
+	fs.cacheBytes = (size_t) CACHE_DEFAULT_MB << 20;
+	fs.commitInterval = JOURNAL_DEFAULT_INTERVAL;
+	fs.readaheadBytes = READAHEAD_DEFAULT_MAX;
+	while((opt = getopt(argc, argv, "n:t:r:s:b:c:j:")) != -1) {
+		switch(opt) {
+			case 'n': opsPerRound = atol(optarg); break;
+			case 't': threads = atoi(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+			case 's': baseSeed = strtoul(optarg, NULL, 10); break;
+			case 'b': blocks = strtoull(optarg, NULL, 10); break;
+			case 'c': fs.cacheBytes = (size_t) atol(optarg) << 20; break;
+			case 'j': fs.commitInterval = atoi(optarg); break;
+			default: usage();
+		}
+	}
+	if(optind != argc - 1 || threads < 1 || threads > FUZZ_MAX_THREADS || rounds < 1 || opsPerRound < 0)
+		usage();
+	const char *image = argv[optind];
+	if(blocks * AOFS_DEFAULT_BLOCK_SIZE < 2ULL * threads * FUZZ_FILES * FUZZ_MAX_SIZE) {
+		fprintf(stderr, "aofsfuzz: %llu blocks is too small for %d threads\n", blocks, threads);
+		return 1;
+	}
+
+	fs.dedup = 1;
+	fs.batchBackend = STORAGE_URING;
+	if(filesys_format(image, blocks, AOFS_DEFAULT_BLOCK_SIZE, 0) < 0 || filesys_mount(&fs, image) < 0)
+		return 1;
+
+	FuzzThread *fuzz = calloc(threads, sizeof(FuzzThread));
+	for(int i = 0; i < threads; i++) {
+		char path[FUZZ_PATH_LEN];
+		fuzz[i].id = i;
+		snprintf(path, sizeof(path), "/fz%d", i);
+		if(filesys_mkdir(&fs, path, 0755) < 0)
+			return 1;
+		for(int d = 0; d < FUZZ_DIRS; d++) {
+			fuzz_dir_path(&fuzz[i], d, path, sizeof(path));
+			if(filesys_mkdir(&fs, path, 0755) < 0)
+				return 1;
+			fuzz[i].dirs[d] = 1;
+		}
+		fuzz[i].seed = baseSeed * 7919 + i;
+		fuzz[i].buf = malloc(FUZZ_MAX_IO);
+		fuzz[i].out = malloc(FUZZ_MAX_SIZE + 2 * FUZZ_MAX_IO);
+		for(int f = 0; f < FUZZ_FILES; f++)
+			fuzz[i].files[f].data = calloc(1, FUZZ_MAX_SIZE);
+	}
+
+	for(int round = 0; round < rounds; round++) {
+		pthread_t ids[FUZZ_MAX_THREADS];
+		for(int i = 0; i < threads; i++)
+			pthread_create(&ids[i], NULL, fuzz_thread, &fuzz[i]);
+		for(int i = 0; i < threads; i++)
+			pthread_join(ids[i], NULL);
+
+		// Everything must survive an unmount, including the last commit.
+		// Blocks freed since the last commit stay taken until it.
+		if(filesys_sync(&fs) < 0) {
+			fprintf(stderr, "aofsfuzz: seed %lu: sync after round %d failed\n", baseSeed, round);
+			return 1;
+		}
+		fuzz_check_blocks();
+		fuzz_check_unlinked();
+		for(int i = 0; i < threads; i++)
+			fuzz[i].held = 0;
+		if(filesys_unmount(&fs) < 0) {
+			fprintf(stderr, "aofsfuzz: seed %lu: unmount after round %d failed\n", baseSeed, round);
+			return 1;
+		}
+		// Files created from here on are compressed in every other round;
+		// the last round shares nothing new, but must keep what is shared
+		fs.compress = round % 2 == 0;
+		fs.dedup = round < rounds - 2;
+		fs.batchBackend = round % 3 == 0 ? STORAGE_THREADS : round % 3 == 1 ? STORAGE_PIO : STORAGE_URING;
+		if(filesys_mount(&fs, image) < 0) {
+			fprintf(stderr, "aofsfuzz: seed %lu: mount after round %d failed\n", baseSeed, round);
+			return 1;
+		}
+		fuzz_check_blocks();
+		fuzz_check_unlinked();
+		for(int i = 0; i < threads; i++) {
+			for(int f = 0; f < FUZZ_FILES; f++)
+				fuzz_verify(&fuzz[i], f);
+			for(int d = 0; d < FUZZ_DIRS; d++)
+				fuzz_verify_dir(&fuzz[i], d);
+		}
+	}
+	filesys_unmount(&fs);
+
+	for(int op = 0; op < 3; op++)
+		fuzz_crash(image, op);
+	if(filesys_mount(&fs, image) < 0) {
+		fprintf(stderr, "aofsfuzz: seed %lu: mount after the crashes failed\n", baseSeed);
+		return 1;
+	}
+	fuzz_check_blocks();
+	fuzz_check_unlinked();
+	for(int i = 0; i < threads; i++) {
+		for(int f = 0; f < FUZZ_FILES; f++)
+			fuzz_verify(&fuzz[i], f);
+		for(int d = 0; d < FUZZ_DIRS; d++)
+			fuzz_verify_dir(&fuzz[i], d);
+	}
+	filesys_unmount(&fs);
+
+	printf("aofsfuzz: seed %lu, %d threads, %d rounds of %ld operations: ok\n", baseSeed, threads, rounds, opsPerRound);
+	for(int i = 0; i < threads; i++) {
+		for(int f = 0; f < FUZZ_FILES; f++)
+			free(fuzz[i].files[f].data);
+		free(fuzz[i].buf);
+		free(fuzz[i].out);
+	}
+	free(fuzz);
+	return 0;
+}
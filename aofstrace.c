@@ -0,0 +1,164 @@
+/*
+  aofstrace: decode an AOFS trace file
+
+  aofstrace [-f] [-l level] tracefile
+
+  Drains the per-thread rings of a trace file written by hello -o
+  trace=tracefile and prints the events in time order. Events are consumed
+  as they are read, so the daemon can keep recording into a ring once
+  aofstrace has emptied it. -f keeps reading until interrupted; -l hides
+  events above level (1 error, 2 info, 3 debug).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+static const char *eventNames[] = {
+#define TRACE_EVENT(id, name, format) name,
+#include "trace_events.h"
+#undef TRACE_EVENT
+};
+
+static const char *eventFormats[] = {
+#define TRACE_EVENT(id, name, format) format,
+#include "trace_events.h"
+#undef TRACE_EVENT
+};
+
+static const char *levelNames[] = { "", "ERROR", "INFO", "DEBUG" };
+
+// Event as read from a ring, with the thread that recorded it
+typedef struct {
+	TraceEvent event;
+	uint32_t tid;
+} TraceRecord;
+
+static volatile sig_atomic_t stop;
+
+static void usage(void) {
+	printf("usage: aofstrace [-f] [-l level] tracefile\n");
+	exit(1);
+}
+
+static void on_signal(int sig) {
+	(void) sig;
+	stop = 1;
+}
+
+static int record_cmp(const void *a, const void *b) {
+	const TraceRecord *x = a, *y = b;
+	return x->event.time < y->event.time ? -1 : x->event.time > y->event.time;
+}
+
+static void print_record(const TraceHeader *h, const TraceRecord *r) {
+	const TraceEvent *e = &r->event;
+	uint64_t since = e->time - h->startTime;
+
+	printf("%llu.%06llu [%u] %s ", (unsigned long long) (since / 1000000000),
+			(unsigned long long) (since % 1000000000 / 1000), r->tid,
+			e->level < sizeof(levelNames) / sizeof(levelNames[0]) ? levelNames[e->level] : "?");
+	if(e->id >= TRACE_EVENT_COUNT) {
+		printf("event %u: %d %lld %lld\n", e->id, e->a, (long long) e->b, (long long) e->c);
+		return;
+	}
+	printf("%s: ", eventNames[e->id]);
+	printf(eventFormats[e->id], e->a, (long long) e->b, (long long) e->c);
+	printf("\n");
+}
+
+// Take every event the rings hold and print them in time order. Returns
+// how many were printed.
+static size_t drain(TraceHeader *h, unsigned int maxLevel, TraceRecord **records, size_t *capacity) {
+	size_t count = 0;
+	uint32_t rings = __atomic_load_n(&h->claimed, __ATOMIC_ACQUIRE);
+	if(rings > h->ringCount)
+		rings = h->ringCount;
+
+	for(uint32_t n = 0; n < rings; n++) {
+		TraceRing *ring = trace_ring(h, n);
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = ring->tail;
+		if(head - tail > *capacity - count) {
+			size_t grown = *capacity * 2 + (head - tail);
+			TraceRecord *more = realloc(*records, grown * sizeof(TraceRecord));
+			if(more == NULL) {
+				printf("aofstrace: out of memory\n");
+				exit(1);
+			}
+			*records = more;
+			*capacity = grown;
+		}
+		for(; tail < head; tail++) {
+			const TraceEvent *e = &ring->events[tail & (h->ringEvents - 1)];
+			if(e->level > maxLevel)
+				continue;
+			(*records)[count].event = *e;
+			(*records)[count].tid = ring->tid;
+			count++;
+		}
+		// Hand the slots back to the thread only once they are copied
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+	}
+	qsort(*records, count, sizeof(TraceRecord), record_cmp);
+	for(size_t i = 0; i < count; i++)
+		print_record(h, &(*records)[i]);
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	int follow = 0;
+	unsigned int maxLevel = TRACE_LEVEL_DEBUG;
+	int opt;
+
+	while((opt = getopt(argc, argv, "fl:")) != -1) {
+		switch(opt) {
+			case 'f': follow = 1; break;
+			case 'l': maxLevel = atoi(optarg); break;
+			default: usage();
+		}
+	}
+	if(optind != argc - 1)
+		usage();
+
+	int fd = open(argv[optind], O_RDWR);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(TraceHeader)) {
+		printf("aofstrace: unable to open %s\n", argv[optind]);
+		return 1;
+	}
+	TraceHeader *h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(h == MAP_FAILED || __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC || h->version != TRACE_VERSION
+			|| h->ringEvents == 0 || (h->ringEvents & (h->ringEvents - 1)) != 0
+			|| sizeof(TraceHeader) + h->ringCount * trace_ring_bytes(h->ringEvents) > (size_t) st.st_size) {
+		printf("aofstrace: %s is not an AOFS trace file\n", argv[optind]);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	TraceRecord *records = NULL;
+	size_t capacity = 0;
+	do {
+		if(drain(h, maxLevel, &records, &capacity) == 0 && follow)
+			usleep(100000);
+	} while(follow && !stop);
+
+	uint32_t rings = h->claimed < h->ringCount ? h->claimed : h->ringCount;
+	for(uint32_t n = 0; n < rings; n++) {
+		TraceRing *ring = trace_ring(h, n);
+		if(ring->dropped)
+			printf("aofstrace: thread %u dropped %llu events\n", ring->tid, (unsigned long long) ring->dropped);
+	}
+	free(records);
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+  Lookup microbenchmark: hashed filename index vs. the linear metadata scan
+  that filesys_find_file used to do.
+
+  cc -O2 bench_lookup.c nameindex.c -o bench_lookup
+  ./bench_lookup [entries ...]		(default: 256 65536 1048576)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "layout.h"
+#include "nameindex.h"
+
+// Room for "File", the widest long, ".txt" and the NUL; the fileName
+// field the old scan walked was 24 bytes
+#define BENCH_NAME_LEN 32
+
+// Same shape as the in-use test plus strcmp of the old scan
+static long linear_scan(char (*names)[BENCH_NAME_LEN], long count, const char *name) {
+	for(long i = 0; i < count; i++) {
+		if(names[i][0] != '\0' && strcmp(names[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Random keys so neither method benefits from scanning in insertion order
+static unsigned long next_rand(unsigned long *state) {
+	*state = *state * 6364136223846793005UL + 1442695040888963407UL;
+	return *state >> 17;
+}
+
+static void bench(long count) {
+	char (*names)[BENCH_NAME_LEN] = calloc(count, BENCH_NAME_LEN);
+	NameIndex idx;
+	unsigned long seed = 42;
+	volatile long sink = 0;
+
+	if(names == NULL || nameindex_init(&idx, count) < 0) {
+		printf("bench_lookup: out of memory\n");
+		exit(1);
+	}
+	for(long i = 0; i < count; i++) {
+		snprintf(names[i], BENCH_NAME_LEN, "File%ld.txt", i);
+		nameindex_insert(&idx, AOFS_ROOT_INODE, names[i], i);
+	}
+
+	// Index: enough lookups to run for a measurable time
+	long lookups = 2000000;
+	double start = now_ns();
+	for(long n = 0; n < lookups; n++) {
+		uint32_t value;
+		if(nameindex_lookup(&idx, AOFS_ROOT_INODE, names[next_rand(&seed) % count], &value) == 0)
+			sink += value;
+	}
+	double hashNs = (now_ns() - start) / lookups;
+
+	// Linear scan: keep total work near 1e9 comparisons
+	long scans = 1000000000L / count;
+	if(scans < 20)
+		scans = 20;
+	start = now_ns();
+	for(long n = 0; n < scans; n++)
+		sink += linear_scan(names, count, names[next_rand(&seed) % count]);
+	double scanNs = (now_ns() - start) / scans;
+
+	printf("%8ld entries: index %8.1f ns/lookup, linear scan %12.1f ns/lookup, speedup %.0fx\n",
+			count, hashNs, scanNs, scanNs / hashNs);
+	nameindex_destroy(&idx);
+	free(names);
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc > 1) {
+		for(int i = 1; i < argc; i++)
+			bench(atol(argv[i]));
+	}
+	else {
+		bench(256);
+		bench(65536);
+		bench(1048576);
+	}
+	return 0;
+}
@@ -0,0 +1,296 @@
+/*
+  AOFS free-block bitmap
+
+  Allocation is next-fit: a search starts at the caller's goal block (the
+  block after a file's previous extent) or, with no goal, where the last
+  allocation ended, so consecutive creates do not rescan the full front of
+  the image. Within a word the first free block is found with a
+  count-trailing-zeros instruction.
+
+  Bitmap background:
+  http://www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html
+  http://www.cs.unh.edu/~jlw/cs610/notes/free-space-mgmt.pdf
+*/
+
+#include "bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define BITMAP_NONE UINT32_MAX
+#define BITMAP_MAX_CANDIDATES 16	// Short runs looked at before settling for the longest
+
+int bitmap_init(Bitmap *bm, uint32_t nbits) {
+	memset(bm, 0, sizeof(*bm));
+	bm->nbits = nbits;
+	bm->nwords = (nbits + 63) / 64;
+	bm->ngroups = (bm->nwords + BITMAP_GROUP_WORDS - 1) / BITMAP_GROUP_WORDS;
+	bm->words = calloc(bm->nwords, sizeof(uint64_t));
+	bm->groupFree = calloc(bm->ngroups, sizeof(uint32_t));
+	bm->ndirty = ((bm->nwords + BITMAP_DIRTY_WORDS - 1) / BITMAP_DIRTY_WORDS + 63) / 64;
+	bm->dirty = calloc(bm->ndirty, sizeof(uint64_t));
+	bm->pending = calloc(bm->nwords, sizeof(uint64_t));
+	if(bm->words == NULL || bm->groupFree == NULL || bm->dirty == NULL || bm->pending == NULL) {
+		bitmap_destroy(bm);
+		return -ENOMEM;
+	}
+	bitmap_recount(bm);
+	return 0;
+}
+
+void bitmap_destroy(Bitmap *bm) {
+	free(bm->words);
+	free(bm->groupFree);
+	free(bm->dirty);
+	free(bm->pending);
+	bm->words = NULL;
+	bm->groupFree = NULL;
+	bm->dirty = NULL;
+	bm->pending = NULL;
+}
+
+// Rebuild the summaries after words were filled in directly (mount). Bits
+// past nbits in the last word are marked occupied so they are never handed
+// out.
+void bitmap_recount(Bitmap *bm) {
+	if(bm->nbits % 64)
+		bm->words[bm->nwords - 1] |= ~0ULL << (bm->nbits % 64);
+	bm->freeCount = 0;
+	memset(bm->groupFree, 0, bm->ngroups * sizeof(uint32_t));
+	for(uint32_t w = 0; w < bm->nwords; w++) {
+		uint32_t free = 64 - __builtin_popcountll(bm->words[w]);
+		bm->groupFree[w / BITMAP_GROUP_WORDS] += free;
+		bm->freeCount += free;
+	}
+	bm->cursor = 0;
+	memset(bm->dirty, 0, bm->ndirty * sizeof(uint64_t));
+	memset(bm->pending, 0, bm->nwords * sizeof(uint64_t));
+	bm->pendingCount = 0;
+}
+
+int bitmap_test(const Bitmap *bm, uint32_t bit) {
+	return (bm->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void bitmap_mark_dirty(Bitmap *bm, uint32_t w) {
+	uint32_t chunk = w / BITMAP_DIRTY_WORDS;
+	bm->dirty[chunk / 64] |= 1ULL << (chunk % 64);
+}
+
+// Mask of bits [lo, hi) within one word, 0 <= lo < hi <= 64
+static uint64_t bitmap_mask(uint32_t lo, uint32_t hi) {
+	uint64_t upper = hi == 64 ? ~0ULL : (1ULL << hi) - 1;
+	return upper & (~0ULL << lo);
+}
+
+// Set or clear the bits of mask in word w, keeping the free counts.
+// Nonzero if any bit changed.
+static int bitmap_update_word(Bitmap *bm, uint32_t w, uint64_t mask, int set) {
+	uint64_t changed = set ? mask & ~bm->words[w] : mask & bm->words[w];
+	uint32_t n = __builtin_popcountll(changed);
+	bm->words[w] ^= changed;
+	if(set) {
+		bm->groupFree[w / BITMAP_GROUP_WORDS] -= n;
+		bm->freeCount -= n;
+	}
+	else {
+		bm->groupFree[w / BITMAP_GROUP_WORDS] += n;
+		bm->freeCount += n;
+	}
+	return n != 0;
+}
+
+// Set (occupied) or clear (free) [start, start + length), a word at a time
+static void bitmap_update_run(Bitmap *bm, uint32_t start, uint32_t length, int set) {
+	uint32_t end = start + length;
+	while(start < end) {
+		uint32_t w = start / 64;
+		uint32_t hi = end - w * 64 < 64 ? end - w * 64 : 64;
+		if(bitmap_update_word(bm, w, bitmap_mask(start % 64, hi), set))
+			bitmap_mark_dirty(bm, w);
+		start = w * 64 + hi;
+	}
+}
+
+void bitmap_set_run(Bitmap *bm, uint32_t start, uint32_t length) {
+	bitmap_update_run(bm, start, length, 1);
+}
+
+void bitmap_clear_run(Bitmap *bm, uint32_t start, uint32_t length) {
+	bitmap_update_run(bm, start, length, 0);
+}
+
+// Free [start, start + length) in the image, but keep it taken here until
+// bitmap_release_run: the image view (bitmap_image) has it free from the
+// next time the changed sectors are written, while no allocation can hand
+// it out before then.
+void bitmap_defer_run(Bitmap *bm, uint32_t start, uint32_t length) {
+	uint32_t end = start + length;
+	while(start < end) {
+		uint32_t w = start / 64;
+		uint32_t hi = end - w * 64 < 64 ? end - w * 64 : 64;
+		uint64_t added = bitmap_mask(start % 64, hi) & ~bm->pending[w];
+		if(added) {
+			bm->pending[w] |= added;
+			bm->pendingCount += __builtin_popcountll(added);
+			bitmap_mark_dirty(bm, w);
+		}
+		start = w * 64 + hi;
+	}
+}
+
+// Let the deferred blocks in [start, start + length) be allocated again.
+// The image view already has them free, so nothing becomes dirty.
+void bitmap_release_run(Bitmap *bm, uint32_t start, uint32_t length) {
+	uint32_t end = start + length;
+	while(start < end) {
+		uint32_t w = start / 64;
+		uint32_t hi = end - w * 64 < 64 ? end - w * 64 : 64;
+		uint64_t released = bitmap_mask(start % 64, hi) & bm->pending[w];
+		if(released) {
+			bm->pending[w] &= ~released;
+			bm->pendingCount -= __builtin_popcountll(released);
+			bitmap_update_word(bm, w, released, 0);
+		}
+		start = w * 64 + hi;
+	}
+}
+
+// Copy n words from word w on as the image is to hold them: with the
+// deferred blocks free
+void bitmap_image(const Bitmap *bm, uint32_t w, uint64_t *out, uint32_t n) {
+	for(uint32_t i = 0; i < n; i++)
+		out[i] = bm->words[w + i] & ~bm->pending[w + i];
+}
+
+// First free bit at or after from, skipping groups with no free blocks
+static uint32_t bitmap_find_free(const Bitmap *bm, uint32_t from) {
+	if(from >= bm->nbits)
+		return BITMAP_NONE;
+	uint32_t w = from / 64;
+	uint64_t freeBits = ~bm->words[w] & (~0ULL << (from % 64));
+	for(;;) {
+		if(freeBits)
+			return w * 64 + __builtin_ctzll(freeBits);
+		w++;
+		if(w % BITMAP_GROUP_WORDS == 0) {
+			uint32_t g = w / BITMAP_GROUP_WORDS;
+			while(g < bm->ngroups && bm->groupFree[g] == 0)
+				g++;
+			w = g * BITMAP_GROUP_WORDS;
+		}
+		if(w >= bm->nwords)
+			return BITMAP_NONE;
+		freeBits = ~bm->words[w];
+	}
+}
+
+// Free bits starting at bit, counted up to max
+static uint32_t bitmap_run_length(const Bitmap *bm, uint32_t bit, uint32_t max) {
+	uint32_t len = 0;
+	while(len < max && bit < bm->nbits) {
+		uint64_t used = bm->words[bit / 64] >> (bit % 64);
+		uint32_t avail = 64 - bit % 64;
+		uint32_t n = used ? (uint32_t) __builtin_ctzll(used) : avail;
+		if(n > avail)
+			n = avail;
+		len += n;
+		if(n < avail)
+			break;
+		bit += n;
+	}
+	return len < max ? len : max;
+}
+
+// Claim up to want free blocks in one run, searching from goal (or the
+// next-fit cursor when goal is 0) and wrapping once. The first run that is
+// long enough wins; after BITMAP_MAX_CANDIDATES shorter runs the longest one
+// seen is taken, which keeps allocation O(1) amortized on fragmented images.
+// Returns the first block and sets *got, or 0 when the image is full.
+uint32_t bitmap_alloc_run(Bitmap *bm, uint32_t goal, uint32_t want, uint32_t *got) {
+	uint32_t bestStart = 0;
+	uint32_t bestLen = 0;
+	int candidates = 0;
+
+	if(bm->freeCount == 0 || want == 0)
+		return 0;
+	if(goal == 0 || goal >= bm->nbits)
+		goal = bm->cursor;
+
+	uint32_t pos = goal;
+	int wrapped = 0;
+	while(bestLen < want && candidates < BITMAP_MAX_CANDIDATES) {
+		uint32_t b = bitmap_find_free(bm, pos);
+		if(b == BITMAP_NONE || (wrapped && b >= goal)) {
+			if(wrapped)
+				break;
+			wrapped = 1;
+			pos = 0;
+			continue;
+		}
+		uint32_t len = bitmap_run_length(bm, b, want);
+		if(len > bestLen) {
+			bestStart = b;
+			bestLen = len;
+		}
+		candidates++;
+		pos = b + len;
+	}
+	if(bestLen == 0)
+		return 0;
+	bitmap_set_run(bm, bestStart, bestLen);
+	bm->cursor = bestStart + bestLen;
+	*got = bestLen;
+	return bestStart;
+}
+
+size_t bitmap_bytes(const Bitmap *bm) {
+	return (size_t) bm->nwords * sizeof(uint64_t);
+}
+
+// Write back the sectors of words changed since the last flush, one
+// positioned write per run of adjacent ones, as bitmap_image has them.
+// offset is where the bitmap starts in the image.
+int bitmap_flush(Bitmap *bm, Storage *st, off_t offset) {
+	uint32_t lo = 0;
+	int more = bitmap_take_dirty(bm, &lo);
+	while(more) {
+		uint32_t hi = lo + BITMAP_DIRTY_WORDS;
+		uint32_t next = hi;
+		while((more = bitmap_take_dirty(bm, &next)) && next == hi)
+			next = hi += BITMAP_DIRTY_WORDS;
+		if(hi > bm->nwords)
+			hi = bm->nwords;
+		uint64_t *image = malloc((size_t) (hi - lo) * sizeof(uint64_t));
+		if(image == NULL)
+			return -ENOMEM;
+		bitmap_image(bm, lo, image, hi - lo);
+		ssize_t res = storage_write(st, image, (size_t) (hi - lo) * sizeof(uint64_t), offset + (off_t) lo * sizeof(uint64_t));
+		free(image);
+		if(res < 0)
+			return res;
+		lo = next;
+	}
+	return 0;
+}
+
+// Find the first sector's worth of words at or after *word changed since
+// the last call, for the caller to write elsewhere (e.g. a journal), and
+// stop tracking it. *word is set to the sector's first word. Returns 0
+// when nothing further changed.
+int bitmap_take_dirty(Bitmap *bm, uint32_t *word) {
+	uint32_t chunk = *word / BITMAP_DIRTY_WORDS;
+	for(uint32_t i = chunk / 64; i < bm->ndirty; i++) {
+		uint64_t bits = bm->dirty[i];
+		if(i == chunk / 64)
+			bits &= ~0ULL << (chunk % 64);
+		if(bits) {
+			uint32_t found = i * 64 + __builtin_ctzll(bits);
+			bm->dirty[i] &= ~(1ULL << (found % 64));
+			*word = found * BITMAP_DIRTY_WORDS;
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+  AOFS free-block bitmap
+
+  One bit per block, 1 = occupied, kept as 64-bit words so a search skips
+  64 occupied blocks per step. Every group of BITMAP_GROUP_WORDS words has
+  a free-block count, letting searches jump over full regions of a large
+  image without touching them. Changes are tracked per sector's worth of
+  words (BITMAP_DIRTY_WORDS), one dirty bit each, so bitmap_flush() and
+  the journal write back only the sectors that changed, however far
+  apart they lie.
+
+  A freed run can be deferred: it is free in the image view the journal
+  logs, but stays taken for allocation until released, so that its blocks
+  keep their content until the transaction freeing them is durable.
+*/
+
+#ifndef AOFS_BITMAP_H
+#define AOFS_BITMAP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "storage.h"
+
+#define BITMAP_GROUP_WORDS 64		// 4096 blocks per group
+#define BITMAP_DIRTY_WORDS 64		// Words per dirty bit, one 512-byte sector
+
+// Bitmap struct
+typedef struct {
+	uint64_t *words;				// Packed bits, the on-disk image of the bitmap
+	uint32_t nbits;					// Blocks described
+	uint32_t nwords;
+	uint32_t *groupFree;			// Free blocks in each group of words
+	uint32_t ngroups;
+	uint32_t freeCount;				// Free blocks in the whole image
+	uint32_t cursor;				// Next-fit hint: where the last allocation ended
+	uint64_t *dirty;				// One bit per BITMAP_DIRTY_WORDS words changed since the last flush
+	uint32_t ndirty;				// Words of dirty
+	uint64_t *pending;				// Deferred blocks: free in the image, taken here
+	uint32_t pendingCount;
+} Bitmap;
+
+int bitmap_init(Bitmap *bm, uint32_t nbits);
+void bitmap_destroy(Bitmap *bm);
+void bitmap_recount(Bitmap *bm);
+
+int bitmap_test(const Bitmap *bm, uint32_t bit);
+void bitmap_set_run(Bitmap *bm, uint32_t start, uint32_t length);
+void bitmap_clear_run(Bitmap *bm, uint32_t start, uint32_t length);
+void bitmap_defer_run(Bitmap *bm, uint32_t start, uint32_t length);
+void bitmap_release_run(Bitmap *bm, uint32_t start, uint32_t length);
+void bitmap_image(const Bitmap *bm, uint32_t w, uint64_t *out, uint32_t n);
+
+uint32_t bitmap_alloc_run(Bitmap *bm, uint32_t goal, uint32_t want, uint32_t *got);
+
+size_t bitmap_bytes(const Bitmap *bm);
+int bitmap_flush(Bitmap *bm, Storage *st, off_t offset);
+int bitmap_take_dirty(Bitmap *bm, uint32_t *word);
+
+#endif
@@ -0,0 +1,659 @@
+/*
+  AOFS block cache
+
+  See cache.h. Each shard keeps its entries in one array; the hash buckets
+  chain them by index. New blocks start with the reference bit clear, so
+  blocks read once by a scan are the first the CLOCK hand takes, while
+  blocks hit again survive a full sweep. Write-back sorts the dirty blocks
+  by number and writes each contiguous run with a single storage_writev.
+*/
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#define CACHE_NONE UINT32_MAX
+#define CACHE_MIN_BLOCKS 16
+#define CACHE_MAX_IOV 64
+// Transfers this large skip the cache for blocks it does not hold, so one
+// big sequential read or write does not flush out the hot blocks
+#define CACHE_BYPASS (128 * 1024)
+
+static void cache_shard_free(CacheShard *s) {
+	free(s->entries);
+	free(s->buckets);
+	free(s->order);
+	free(s->iov);
+	free(s->runs);
+	free(s->data);
+	pthread_mutex_destroy(&s->lock);
+}
+
+static int cache_shard_init(CacheShard *s, size_t blockSize, uint32_t capacity) {
+	uint32_t nbuckets = 1;
+	while(nbuckets < capacity)
+		nbuckets *= 2;
+	pthread_mutex_init(&s->lock, NULL);
+	s->capacity = capacity;
+	s->bucketMask = nbuckets - 1;
+	s->entries = calloc(capacity, sizeof(CacheEntry));
+	s->buckets = malloc(nbuckets * sizeof(uint32_t));
+	s->order = malloc(capacity * sizeof(uint64_t));
+	s->iov = malloc(capacity * sizeof(struct iovec));
+	s->runs = malloc(capacity * sizeof(IoRequest));
+	s->data = malloc((size_t) capacity * blockSize);
+	if(s->entries == NULL || s->buckets == NULL || s->order == NULL || s->iov == NULL || s->runs == NULL || s->data == NULL) {
+		cache_shard_free(s);
+		return -ENOMEM;
+	}
+	memset(s->buckets, 0xff, nbuckets * sizeof(uint32_t));
+	s->dirtyLimit = capacity / 2;
+	return 0;
+}
+
+int cache_init(Cache *c, Storage *st, size_t blockSize, size_t bytes) {
+	memset(c, 0, sizeof(*c));
+	c->storage = st;
+	c->blockSize = blockSize;
+	uint64_t blocks = bytes / blockSize;
+	if(blocks < CACHE_MIN_BLOCKS)
+		return 0;
+
+	// Small caches get fewer shards so each keeps enough blocks to be useful
+	uint32_t nshards = blocks / CACHE_MIN_BLOCKS < CACHE_SHARDS ? blocks / CACHE_MIN_BLOCKS : CACHE_SHARDS;
+	for(uint32_t i = 0; i < nshards; i++) {
+		int res = cache_shard_init(&c->shards[i], blockSize, blocks / nshards);
+		if(res < 0) {
+			printf("cache_init: unable to allocate %zu bytes\n", bytes);
+			c->nshards = i;
+			cache_destroy(c);
+			return res;
+		}
+		c->shards[i].buffer = storage_add_buffer(st, c->shards[i].data, (size_t) (blocks / nshards) * blockSize);
+	}
+	c->nshards = nshards;
+	return 0;
+}
+
+void cache_destroy(Cache *c) {
+	for(uint32_t i = 0; i < c->nshards; i++)
+		cache_shard_free(&c->shards[i]);
+	c->nshards = 0;
+}
+
+static CacheShard *cache_shard(Cache *c, uint32_t block) {
+	return &c->shards[((block / CACHE_RUN_BLOCKS) * 0x9e3779b1u >> 8) % c->nshards];
+}
+
+static uint32_t cache_bucket(const CacheShard *s, uint32_t block) {
+	return (block * 0x9e3779b1u) & s->bucketMask;
+}
+
+static char *cache_data(const Cache *c, const CacheShard *s, uint32_t i) {
+	return s->data + (size_t) i * c->blockSize;
+}
+
+static uint32_t cache_lookup(const CacheShard *s, uint32_t block) {
+	uint32_t i = s->buckets[cache_bucket(s, block)];
+	while(i != CACHE_NONE && s->entries[i].block != block)
+		i = s->entries[i].next;
+	return i;
+}
+
+static void cache_unlink(CacheShard *s, uint32_t i) {
+	uint32_t *link = &s->buckets[cache_bucket(s, s->entries[i].block)];
+	while(*link != i)
+		link = &s->entries[*link].next;
+	*link = s->entries[i].next;
+	s->entries[i].used = 0;
+}
+
+static void cache_mark_dirty(CacheShard *s, uint32_t i) {
+	if(!s->entries[i].dirty) {
+		s->entries[i].dirty = 1;
+		s->dirtyCount++;
+	}
+}
+
+static int cache_order_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+// Write back the n entries listed in s->order as (block << 32 | index),
+// a transfer per contiguous run and all of them in one batch
+static int cache_writeback(Cache *c, CacheShard *s, uint32_t n) {
+	int count = 0;
+	int ret = 0;
+
+	qsort(s->order, n, sizeof(uint64_t), cache_order_cmp);
+	for(uint32_t k = 0; k < n; ) {
+		uint32_t first = s->order[k] >> 32;
+		IoRequest *r = &s->runs[count++];
+		r->iov = &s->iov[k];
+		r->iovcnt = 0;
+		r->offset = (off_t) first * c->blockSize;
+		while(k < n && r->iovcnt < CACHE_MAX_IOV && (uint32_t) (s->order[k] >> 32) == first + r->iovcnt) {
+			s->iov[k].iov_base = cache_data(c, s, (uint32_t) s->order[k]);
+			s->iov[k].iov_len = c->blockSize;
+			r->iovcnt++;
+			k++;
+		}
+		r->buffer = r->iovcnt == 1 ? s->buffer : -1;
+	}
+	if(count == 0)
+		return 0;
+
+	storage_batch(c->storage, s->runs, count, 1);
+	for(int j = 0; j < count; j++) {
+		IoRequest *r = &s->runs[j];
+		uint32_t k = r->iov - s->iov;
+		if(r->res < 0) {
+			printf("cache_writeback: unable to write blocks %u-%u\n", (uint32_t) (s->order[k] >> 32), (uint32_t) (s->order[k] >> 32) + r->iovcnt - 1);
+			ret = r->res;
+			continue;
+		}
+		for(int b = 0; b < r->iovcnt; b++)
+			s->entries[(uint32_t) s->order[k + b]].dirty = 0;
+		s->dirtyCount -= r->iovcnt;
+		s->writebacks += r->iovcnt;
+	}
+	return ret;
+}
+
+// Write every dirty block of a shard back; the shard lock is held
+static int cache_flush_shard(Cache *c, CacheShard *s) {
+	uint32_t n = 0;
+	if(s->dirtyCount == 0)
+		return 0;
+	for(uint32_t i = 0; i < s->capacity; i++) {
+		if(s->entries[i].used && s->entries[i].dirty)
+			s->order[n++] = (uint64_t) s->entries[i].block << 32 | i;
+	}
+	return cache_writeback(c, s, n);
+}
+
+// Write every dirty block back to the image
+int cache_flush(Cache *c) {
+	int ret = 0;
+	for(uint32_t k = 0; k < c->nshards; k++) {
+		CacheShard *s = &c->shards[k];
+		pthread_mutex_lock(&s->lock);
+		int res = cache_flush_shard(c, s);
+		pthread_mutex_unlock(&s->lock);
+		if(res < 0)
+			ret = res;
+	}
+	return ret;
+}
+
+// Write back the dirty blocks among [block, block + count), e.g. one file's extent
+int cache_flush_range(Cache *c, uint32_t block, uint32_t count) {
+	int ret = 0;
+	for(uint32_t k = 0; k < c->nshards; k++) {
+		CacheShard *s = &c->shards[k];
+		uint32_t n = 0;
+		pthread_mutex_lock(&s->lock);
+		if(s->dirtyCount == 0) {
+			pthread_mutex_unlock(&s->lock);
+			continue;
+		}
+		if(count < s->capacity) {
+			for(uint32_t b = block; b < block + count; b++) {
+				if(cache_shard(c, b) != s)
+					continue;
+				uint32_t i = cache_lookup(s, b);
+				if(i != CACHE_NONE && s->entries[i].dirty)
+					s->order[n++] = (uint64_t) b << 32 | i;
+			}
+		}
+		else {
+			for(uint32_t i = 0; i < s->capacity; i++) {
+				CacheEntry *e = &s->entries[i];
+				if(e->used && e->dirty && e->block >= block && e->block - block < count)
+					s->order[n++] = (uint64_t) e->block << 32 | i;
+			}
+		}
+		int res = cache_writeback(c, s, n);
+		pthread_mutex_unlock(&s->lock);
+		if(res < 0)
+			ret = res;
+	}
+	return ret;
+}
+
+// Forget the blocks among [block, block + count), dirty or not, e.g. ones
+// just freed: nothing of them is ever written back
+void cache_discard(Cache *c, uint32_t block, uint32_t count) {
+	for(uint32_t k = 0; k < c->nshards; k++) {
+		CacheShard *s = &c->shards[k];
+		pthread_mutex_lock(&s->lock);
+		if(count < s->capacity) {
+			for(uint32_t b = block; b < block + count; b++) {
+				if(cache_shard(c, b) != s)
+					continue;
+				uint32_t i = cache_lookup(s, b);
+				if(i != CACHE_NONE) {
+					s->dirtyCount -= s->entries[i].dirty;
+					s->entries[i].dirty = 0;
+					cache_unlink(s, i);
+				}
+			}
+		}
+		else {
+			for(uint32_t i = 0; i < s->capacity; i++) {
+				CacheEntry *e = &s->entries[i];
+				if(e->used && e->block >= block && e->block - block < count) {
+					s->dirtyCount -= e->dirty;
+					e->dirty = 0;
+					cache_unlink(s, i);
+				}
+			}
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+void cache_stats(Cache *c, CacheStats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	for(uint32_t k = 0; k < c->nshards; k++) {
+		CacheShard *s = &c->shards[k];
+		pthread_mutex_lock(&s->lock);
+		stats->hits += s->hits;
+		stats->misses += s->misses;
+		stats->writebacks += s->writebacks;
+		stats->evictions += s->evictions;
+		stats->prefetches += s->prefetches;
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+// Take an entry for block with the CLOCK hand. A dirty victim means the
+// shard is full of unwritten data, so everything dirty in it is written
+// back in one sorted pass instead of one block at a time.
+static int cache_insert(Cache *c, CacheShard *s, uint32_t block, uint32_t *slot) {
+	uint32_t i;
+	for(;;) {
+		i = s->hand;
+		s->hand = s->hand + 1 == s->capacity ? 0 : s->hand + 1;
+		CacheEntry *e = &s->entries[i];
+		if(!e->used)
+			break;
+		if(e->referenced) {
+			e->referenced = 0;
+			continue;
+		}
+		if(e->dirty) {
+			int res = cache_flush_shard(c, s);
+			if(res < 0)
+				return res;
+		}
+		cache_unlink(s, i);
+		s->evictions++;
+		break;
+	}
+
+	CacheEntry *e = &s->entries[i];
+	uint32_t *head = &s->buckets[cache_bucket(s, block)];
+	e->block = block;
+	e->used = 1;
+	e->referenced = 0;
+	e->dirty = 0;
+	e->next = *head;
+	*head = i;
+	*slot = i;
+	return 0;
+}
+
+// Bring block into the cache from the image; past the end reads as zeros
+static int cache_fill(Cache *c, CacheShard *s, uint32_t block, uint32_t *slot) {
+	int res = cache_insert(c, s, block, slot);
+	if(res < 0)
+		return res;
+	ssize_t got = storage_read(c->storage, cache_data(c, s, *slot), c->blockSize, (off_t) block * c->blockSize);
+	if(got < 0) {
+		cache_unlink(s, *slot);
+		return got;
+	}
+	memset(cache_data(c, s, *slot) + got, 0, c->blockSize - got);
+	return 0;
+}
+
+// Blocks from block on, at most max, that the cache does not hold. The
+// caller's inode lock keeps other writers from caching them meanwhile.
+static uint32_t cache_missing_run(Cache *c, uint32_t block, uint32_t max) {
+	uint32_t n = 1;
+	while(n < max) {
+		CacheShard *s = cache_shard(c, block + n);
+		pthread_mutex_lock(&s->lock);
+		uint32_t i = cache_lookup(s, block + n);
+		pthread_mutex_unlock(&s->lock);
+		if(i != CACHE_NONE)
+			break;
+		n++;
+	}
+	return n;
+}
+
+ssize_t cache_read(Cache *c, void *buf, size_t len, off_t offset) {
+	size_t bs = c->blockSize;
+	size_t done = 0;
+	if(c->nshards == 0)
+		return storage_read(c->storage, buf, len, offset);
+
+	while(done < len) {
+		uint32_t block = (offset + done) / bs;
+		size_t within = (offset + done) % bs;
+		size_t chunk = bs - within < len - done ? bs - within : len - done;
+		CacheShard *s = cache_shard(c, block);
+		int res = 0;
+
+		pthread_mutex_lock(&s->lock);
+		uint32_t i = cache_lookup(s, block);
+		if(i != CACHE_NONE) {
+			s->hits++;
+			s->entries[i].referenced = 1;
+			memcpy((char *) buf + done, cache_data(c, s, i) + within, chunk);
+		}
+		else if(len < CACHE_BYPASS) {
+			s->misses++;
+			res = cache_fill(c, s, block, &i);
+			if(res == 0)
+				memcpy((char *) buf + done, cache_data(c, s, i) + within, chunk);
+		}
+		pthread_mutex_unlock(&s->lock);
+		if(res < 0)
+			return res;
+
+		if(i == CACHE_NONE) {
+			uint32_t run = cache_missing_run(c, block, (within + len - done + bs - 1) / bs);
+			chunk = (size_t) run * bs - within < len - done ? (size_t) run * bs - within : len - done;
+			pthread_mutex_lock(&s->lock);
+			s->misses += run;
+			pthread_mutex_unlock(&s->lock);
+			ssize_t got = storage_read(c->storage, (char *) buf + done, chunk, offset + done);
+			if(got < 0)
+				return got;
+			if((size_t) got < chunk)
+				return done + got;
+		}
+		done += chunk;
+	}
+	return done;
+}
+
+ssize_t cache_write(Cache *c, const void *buf, size_t len, off_t offset) {
+	size_t bs = c->blockSize;
+	size_t done = 0;
+	if(c->nshards == 0)
+		return storage_write(c->storage, buf, len, offset);
+
+	while(done < len) {
+		uint32_t block = (offset + done) / bs;
+		size_t within = (offset + done) % bs;
+		size_t chunk = bs - within < len - done ? bs - within : len - done;
+		CacheShard *s = cache_shard(c, block);
+		int bypass = 0;
+		int res = 0;
+
+		pthread_mutex_lock(&s->lock);
+		uint32_t i = cache_lookup(s, block);
+		if(i != CACHE_NONE) {
+			s->hits++;
+			s->entries[i].referenced = 1;
+		}
+		else if(len >= CACHE_BYPASS && within == 0 && chunk == bs) {
+			bypass = 1;
+		}
+		else {
+			s->misses++;
+			// A whole-block write needs nothing from the image
+			res = chunk == bs ? cache_insert(c, s, block, &i) : cache_fill(c, s, block, &i);
+		}
+		if(!bypass && res == 0) {
+			memcpy(cache_data(c, s, i) + within, (const char *) buf + done, chunk);
+			cache_mark_dirty(s, i);
+			if(s->dirtyCount > s->dirtyLimit)
+				res = cache_flush_shard(c, s);
+		}
+		pthread_mutex_unlock(&s->lock);
+		if(res < 0)
+			return res;
+
+		if(bypass) {
+			// Whole blocks nobody has cached go straight to the image
+			uint32_t run = cache_missing_run(c, block, (len - done) / bs);
+			chunk = (size_t) run * bs;
+			pthread_mutex_lock(&s->lock);
+			s->misses += run;
+			pthread_mutex_unlock(&s->lock);
+			ssize_t put = storage_write(c->storage, (const char *) buf + done, chunk, offset + done);
+			if(put < 0)
+				return put;
+		}
+		done += chunk;
+	}
+	return done;
+}
+
+// Blocks from block on, at most max, missing from the cache; all of them
+// with the cache off
+static uint32_t cache_uncached_run(Cache *c, uint32_t block, uint32_t max) {
+	if(c->nshards == 0)
+		return max;
+	uint32_t run = cache_missing_run(c, block, max);
+	CacheShard *s = cache_shard(c, block);
+	pthread_mutex_lock(&s->lock);
+	s->misses += run;
+	pthread_mutex_unlock(&s->lock);
+	return run;
+}
+
+// Room for a batch covering runs, with one transfer per block at most
+static IoRequest *cache_batch_alloc(Cache *c, const CacheRun *runs, int count, size_t *total, struct iovec **iov) {
+	size_t max = 0;
+	*total = 0;
+	for(int i = 0; i < count; i++) {
+		*total += runs[i].len;
+		max += (runs[i].offset % c->blockSize + runs[i].len + c->blockSize - 1) / c->blockSize;
+	}
+	IoRequest *reqs = malloc(max * (sizeof(IoRequest) + sizeof(struct iovec)));
+	*iov = (struct iovec *) (reqs + max);
+	return reqs;
+}
+
+static void cache_batch_add(IoRequest *reqs, struct iovec *iov, int *n, char *buf, size_t len, off_t offset) {
+	iov[*n].iov_base = buf;
+	iov[*n].iov_len = len;
+	reqs[*n].iov = &iov[*n];
+	reqs[*n].iovcnt = 1;
+	reqs[*n].offset = offset;
+	reqs[*n].buffer = -1;
+	(*n)++;
+}
+
+// Read several ranges of the image, e.g. the extents one file read
+// covers. Small reads go through the cache as cache_read does; from
+// CACHE_BYPASS on in all, what the cache does not hold is read straight
+// into the caller's buffers, every range in one storage batch.
+ssize_t cache_read_runs(Cache *c, const CacheRun *runs, int count) {
+	size_t bs = c->blockSize;
+	size_t total;
+	struct iovec *iov;
+	IoRequest *reqs = cache_batch_alloc(c, runs, count, &total, &iov);
+	if(reqs == NULL || (total < CACHE_BYPASS && c->nshards != 0)) {
+		free(reqs);
+		for(int i = 0; i < count; i++) {
+			ssize_t res = cache_read(c, runs[i].buf, runs[i].len, runs[i].offset);
+			if(res < 0)
+				return res;
+		}
+		return total;
+	}
+
+	int n = 0;
+	for(int k = 0; k < count; k++) {
+		const CacheRun *r = &runs[k];
+		for(size_t done = 0; done < r->len; ) {
+			uint32_t block = (r->offset + done) / bs;
+			size_t within = (r->offset + done) % bs;
+			size_t chunk = bs - within < r->len - done ? bs - within : r->len - done;
+			uint32_t i = CACHE_NONE;
+			if(c->nshards != 0) {
+				CacheShard *s = cache_shard(c, block);
+				pthread_mutex_lock(&s->lock);
+				i = cache_lookup(s, block);
+				if(i != CACHE_NONE) {
+					s->hits++;
+					s->entries[i].referenced = 1;
+					memcpy(r->buf + done, cache_data(c, s, i) + within, chunk);
+				}
+				pthread_mutex_unlock(&s->lock);
+			}
+			if(i == CACHE_NONE) {
+				uint32_t run = cache_uncached_run(c, block, (within + r->len - done + bs - 1) / bs);
+				chunk = (size_t) run * bs - within < r->len - done ? (size_t) run * bs - within : r->len - done;
+				cache_batch_add(reqs, iov, &n, r->buf + done, chunk, r->offset + done);
+			}
+			done += chunk;
+		}
+	}
+
+	ssize_t res = n > 0 ? storage_batch(c->storage, reqs, n, 0) : 0;
+	// Past the end of the image reads as zeros, as in cache_fill
+	for(int j = 0; j < n && res >= 0; j++)
+		memset((char *) iov[j].iov_base + reqs[j].res, 0, iov[j].iov_len - reqs[j].res);
+	free(reqs);
+	return res < 0 ? res : (ssize_t) total;
+}
+
+// Write several ranges of the image. Small writes go through the cache as
+// cache_write does; from CACHE_BYPASS on in all, whole blocks the cache
+// does not hold go straight to the image, every range in one storage
+// batch, and the rest through the cache.
+ssize_t cache_write_runs(Cache *c, const CacheRun *runs, int count) {
+	size_t bs = c->blockSize;
+	size_t total;
+	struct iovec *iov;
+	IoRequest *reqs = cache_batch_alloc(c, runs, count, &total, &iov);
+	if(reqs == NULL || (total < CACHE_BYPASS && c->nshards != 0)) {
+		free(reqs);
+		for(int i = 0; i < count; i++) {
+			ssize_t res = cache_write(c, runs[i].buf, runs[i].len, runs[i].offset);
+			if(res < 0)
+				return res;
+		}
+		return total;
+	}
+
+	int n = 0;
+	for(int k = 0; k < count; k++) {
+		const CacheRun *r = &runs[k];
+		for(size_t done = 0; done < r->len; ) {
+			uint32_t block = (r->offset + done) / bs;
+			size_t within = (r->offset + done) % bs;
+			size_t chunk = bs - within < r->len - done ? bs - within : r->len - done;
+			uint32_t i = CACHE_NONE;
+			if(c->nshards != 0) {
+				CacheShard *s = cache_shard(c, block);
+				pthread_mutex_lock(&s->lock);
+				i = cache_lookup(s, block);
+				pthread_mutex_unlock(&s->lock);
+			}
+			if(i == CACHE_NONE && (c->nshards == 0 || chunk == bs)) {
+				// Whole blocks nobody has cached; the caller's inode lock
+				// keeps it that way until the batch is written
+				uint32_t run = c->nshards == 0 ? UINT32_MAX : cache_uncached_run(c, block, (r->len - done) / bs);
+				chunk = (size_t) run * bs - within < r->len - done ? (size_t) run * bs - within : r->len - done;
+				cache_batch_add(reqs, iov, &n, r->buf + done, chunk, r->offset + done);
+			}
+			else {
+				ssize_t res = cache_write(c, r->buf + done, chunk, r->offset + done);
+				if(res < 0) {
+					free(reqs);
+					return res;
+				}
+			}
+			done += chunk;
+		}
+	}
+
+	ssize_t res = n > 0 ? storage_batch(c->storage, reqs, n, 1) : 0;
+	free(reqs);
+	return res < 0 ? res : (ssize_t) total;
+}
+
+// Read the blocks of spans the cache does not hold into it, ahead of a
+// reader. They are read in one storage batch into a buffer of their own,
+// so no shard is locked meanwhile, and enter unreferenced, so those nobody
+// reads are the first evicted; a block cached in between is left alone.
+// The caller's inode lock keeps writers of the blocks away until then.
+// With the cache off the host is asked to read them ahead instead.
+int cache_prefetch(Cache *c, const CacheSpan *spans, int count) {
+	size_t bs = c->blockSize;
+	size_t max = 0;
+	if(c->nshards == 0) {
+		for(int k = 0; k < count; k++)
+			storage_advise(c->storage, (off_t) spans[k].block * bs, (size_t) spans[k].count * bs, STORAGE_ADVICE_WILLNEED);
+		return 0;
+	}
+	for(int k = 0; k < count; k++)
+		max += spans[k].count;
+	if(max == 0)
+		return 0;
+	char *data = malloc(max * bs);
+	IoRequest *reqs = malloc(max * (sizeof(IoRequest) + sizeof(struct iovec)));
+	struct iovec *iov = (struct iovec *) (reqs + max);
+	if(data == NULL || reqs == NULL) {
+		free(data);
+		free(reqs);
+		return -ENOMEM;
+	}
+
+	int n = 0;
+	size_t used = 0;
+	for(int k = 0; k < count; k++) {
+		uint32_t end = spans[k].block + spans[k].count;
+		for(uint32_t block = spans[k].block; block < end; ) {
+			CacheShard *s = cache_shard(c, block);
+			pthread_mutex_lock(&s->lock);
+			uint32_t i = cache_lookup(s, block);
+			pthread_mutex_unlock(&s->lock);
+			if(i != CACHE_NONE) {
+				block++;
+				continue;
+			}
+			uint32_t run = cache_missing_run(c, block, end - block);
+			cache_batch_add(reqs, iov, &n, data + used * bs, (size_t) run * bs, (off_t) block * bs);
+			used += run;
+			block += run;
+		}
+	}
+
+	ssize_t res = n > 0 ? storage_batch(c->storage, reqs, n, 0) : 0;
+	for(int j = 0; j < n && res >= 0; j++) {
+		uint32_t first = reqs[j].offset / bs;
+		char *buf = iov[j].iov_base;
+		memset(buf + reqs[j].res, 0, iov[j].iov_len - reqs[j].res);
+		for(uint32_t b = 0; b < iov[j].iov_len / bs && res >= 0; b++) {
+			CacheShard *s = cache_shard(c, first + b);
+			uint32_t i;
+			pthread_mutex_lock(&s->lock);
+			if(cache_lookup(s, first + b) == CACHE_NONE) {
+				res = cache_insert(c, s, first + b, &i);
+				if(res == 0) {
+					memcpy(cache_data(c, s, i), buf + (size_t) b * bs, bs);
+					s->prefetches++;
+				}
+			}
+			pthread_mutex_unlock(&s->lock);
+		}
+	}
+	free(data);
+	free(reqs);
+	return res < 0 ? res : 0;
+}
@@ -0,0 +1,112 @@
+/*
+  AOFS block cache
+
+  A fixed number of image blocks kept in memory between the FUSE callbacks
+  and the storage backend. Blocks are found by hashing the block number and
+  evicted with the CLOCK algorithm: every hit sets a reference bit, and the
+  hand clears bits as it sweeps until it finds a block not used since its
+  last pass. Writes only dirty the cached block; dirty blocks reach the
+  image on cache_flush(), on eviction, or when too many are dirty.
+
+  The cache is split into shards, each with its own lock, hash table and
+  CLOCK hand, so callbacks running on different threads rarely contend.
+  Runs of CACHE_RUN_BLOCKS consecutive blocks share a shard, which keeps
+  write-back of a sequential range in large transfers. The transfers of
+  one write-back, and the blocks one large read or write does not find
+  cached, go to storage as one batch.
+
+  The bitmap, inode table, indirect blocks and data go through the cache;
+  metadata only once its journal transaction has committed. The superblock
+  and the journal itself are written straight to storage and never cached,
+  so the two paths never hold different copies of the same block.
+*/
+
+#ifndef AOFS_CACHE_H
+#define AOFS_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "storage.h"
+
+#define CACHE_DEFAULT_MB 32
+#define CACHE_SHARDS 16
+#define CACHE_RUN_BLOCKS 16
+
+// CacheEntry struct
+typedef struct {
+	uint32_t block;					// Image block held, valid only if used
+	uint32_t next;					// Next entry in the same hash bucket
+	uint8_t used;
+	uint8_t referenced;				// Hit since the CLOCK hand last passed
+	uint8_t dirty;					// Differs from the image
+} CacheEntry;
+
+// CacheShard struct, everything in it is guarded by lock
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t capacity;				// Blocks held
+	CacheEntry *entries;
+	char *data;						// capacity blocks, entry i at i * blockSize
+	uint32_t *buckets;				// Heads of the hash chains
+	uint32_t bucketMask;
+	uint32_t hand;					// CLOCK hand
+	uint32_t dirtyCount;
+	uint32_t dirtyLimit;			// Write the shard back past this many dirty blocks
+	uint64_t *order;				// Scratch for sorting dirty blocks at flush
+	struct iovec *iov;				// Scratch for writing them back, one per block
+	IoRequest *runs;				// and one per contiguous run
+	int buffer;						// data as a storage buffer, -1 if not registered
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t writebacks;			// Blocks written to the image
+	uint64_t evictions;
+	uint64_t prefetches;			// Blocks read ahead of a reader
+} CacheShard;
+
+// Cache struct
+typedef struct {
+	Storage *storage;
+	size_t blockSize;
+	uint32_t nshards;				// 0 when the cache is off
+	CacheShard shards[CACHE_SHARDS];
+} Cache;
+
+// CacheRun struct, one range of a transfer made of several
+typedef struct {
+	char *buf;
+	size_t len;
+	off_t offset;					// In the image
+} CacheRun;
+
+// CacheSpan struct, a run of image blocks
+typedef struct {
+	uint32_t block;
+	uint32_t count;
+} CacheSpan;
+
+// CacheStats struct, totals over all shards
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t writebacks;
+	uint64_t evictions;
+	uint64_t prefetches;
+} CacheStats;
+
+int cache_init(Cache *c, Storage *st, size_t blockSize, size_t bytes);
+void cache_destroy(Cache *c);
+
+ssize_t cache_read(Cache *c, void *buf, size_t len, off_t offset);
+ssize_t cache_write(Cache *c, const void *buf, size_t len, off_t offset);
+ssize_t cache_read_runs(Cache *c, const CacheRun *runs, int count);
+ssize_t cache_write_runs(Cache *c, const CacheRun *runs, int count);
+int cache_prefetch(Cache *c, const CacheSpan *spans, int count);
+
+int cache_flush(Cache *c);
+int cache_flush_range(Cache *c, uint32_t block, uint32_t count);
+void cache_discard(Cache *c, uint32_t block, uint32_t count);
+void cache_stats(Cache *c, CacheStats *stats);
+
+#endif
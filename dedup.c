@@ -0,0 +1,244 @@
+/*
+  AOFS shared blocks
+
+  A fingerprint is a 64-bit hash of a block, read eight bytes at a time so
+  that hashing keeps up with the copy it saves. Two blocks with the same
+  fingerprint need not be equal; the engine compares the bytes before
+  sharing, so a collision costs one read and nothing else. Only one block
+  per fingerprint is indexed.
+*/
+
+#include "dedup.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define DEDUP_MIN_SLOTS 64
+
+static uint64_t dedup_rotl(uint64_t v, int r) {
+	return v << r | v >> (64 - r);
+}
+
+uint64_t dedup_print(const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+	size_t i = 0;
+	for(; i + 8 <= len; i += 8) {
+		uint64_t k;
+		memcpy(&k, p + i, sizeof(k));
+		k *= 0x87c37b91114253d5ULL;
+		k = dedup_rotl(k, 31);
+		k *= 0x4cf5ad432745937fULL;
+		h ^= k;
+		h = dedup_rotl(h, 27) * 5 + 0x52dce729;
+	}
+	for(; i < len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	// Final mix, so every bit of the table index depends on every input bit
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint32_t dedup_block_hash(uint32_t block) {
+	return block * 2654435761u;
+}
+
+int dedup_init(DedupMap *d) {
+	memset(d, 0, sizeof(*d));
+	d->blockMask = DEDUP_MIN_SLOTS - 1;
+	d->printMask = DEDUP_MIN_SLOTS - 1;
+	d->blocks = calloc(DEDUP_MIN_SLOTS, sizeof(DedupBlock));
+	d->prints = calloc(DEDUP_MIN_SLOTS, sizeof(DedupPrint));
+	if(d->blocks == NULL || d->prints == NULL) {
+		dedup_destroy(d);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void dedup_destroy(DedupMap *d) {
+	free(d->blocks);
+	free(d->prints);
+	memset(d, 0, sizeof(*d));
+}
+
+// Slot holding block, or the empty slot where it would go
+static uint32_t dedup_block_slot(const DedupMap *d, uint32_t block) {
+	uint32_t s = dedup_block_hash(block) & d->blockMask;
+	while(d->blocks[s].block != 0 && d->blocks[s].block != block)
+		s = (s + 1) & d->blockMask;
+	return s;
+}
+
+// Slot holding print, or the empty slot where it would go
+static uint32_t dedup_print_slot(const DedupMap *d, uint64_t print) {
+	uint32_t s = (uint32_t) print & d->printMask;
+	while(d->prints[s].block != 0 && d->prints[s].print != print)
+		s = (s + 1) & d->printMask;
+	return s;
+}
+
+static int dedup_grow_blocks(DedupMap *d) {
+	DedupBlock *old = d->blocks;
+	uint32_t oldMask = d->blockMask;
+	DedupBlock *blocks = calloc((size_t) oldMask * 2 + 2, sizeof(DedupBlock));
+	if(blocks == NULL)
+		return -ENOMEM;
+	d->blocks = blocks;
+	d->blockMask = oldMask * 2 + 1;
+	for(uint32_t s = 0; s <= oldMask; s++) {
+		if(old[s].block != 0)
+			d->blocks[dedup_block_slot(d, old[s].block)] = old[s];
+	}
+	free(old);
+	return 0;
+}
+
+static int dedup_grow_prints(DedupMap *d) {
+	DedupPrint *old = d->prints;
+	uint32_t oldMask = d->printMask;
+	DedupPrint *prints = calloc((size_t) oldMask * 2 + 2, sizeof(DedupPrint));
+	if(prints == NULL)
+		return -ENOMEM;
+	d->prints = prints;
+	d->printMask = oldMask * 2 + 1;
+	for(uint32_t s = 0; s <= oldMask; s++) {
+		if(old[s].block != 0)
+			d->prints[dedup_print_slot(d, old[s].print)] = old[s];
+	}
+	free(old);
+	return 0;
+}
+
+// Empty block slot hole, moving later records of its probe run back into it
+static void dedup_unslot_block(DedupMap *d, uint32_t hole) {
+	d->blocks[hole].block = 0;
+	d->blockCount--;
+	for(uint32_t s = (hole + 1) & d->blockMask; d->blocks[s].block != 0; s = (s + 1) & d->blockMask) {
+		uint32_t home = dedup_block_hash(d->blocks[s].block) & d->blockMask;
+		if(((s - home) & d->blockMask) >= ((s - hole) & d->blockMask)) {
+			d->blocks[hole] = d->blocks[s];
+			d->blocks[s].block = 0;
+			hole = s;
+		}
+	}
+}
+
+static void dedup_unslot_print(DedupMap *d, uint32_t hole) {
+	d->prints[hole].block = 0;
+	d->printCount--;
+	for(uint32_t s = (hole + 1) & d->printMask; d->prints[s].block != 0; s = (s + 1) & d->printMask) {
+		uint32_t home = (uint32_t) d->prints[s].print & d->printMask;
+		if(((s - home) & d->printMask) >= ((s - hole) & d->printMask)) {
+			d->prints[hole] = d->prints[s];
+			d->prints[s].block = 0;
+			hole = s;
+		}
+	}
+}
+
+// The record of block, added with one reference if it has none
+static DedupBlock *dedup_record(DedupMap *d, uint32_t block) {
+	uint32_t s = dedup_block_slot(d, block);
+	if(d->blocks[s].block == 0) {
+		if(((size_t) d->blockCount + 1) * 2 > (size_t) d->blockMask + 1) {
+			if(dedup_grow_blocks(d) < 0)
+				return NULL;
+			s = dedup_block_slot(d, block);
+		}
+		memset(&d->blocks[s], 0, sizeof(DedupBlock));
+		d->blocks[s].block = block;
+		d->blocks[s].refs = 1;
+		d->blockCount++;
+	}
+	return &d->blocks[s];
+}
+
+// Take block record b out of the fingerprint table
+static void dedup_unindex(DedupMap *d, DedupBlock *b) {
+	uint32_t p = dedup_print_slot(d, b->print);
+	if(d->prints[p].block == b->block)
+		dedup_unslot_print(d, p);
+	b->indexed = 0;
+}
+
+// Drop the record in slot s once it says nothing a missing one would not
+static void dedup_trim(DedupMap *d, uint32_t s) {
+	DedupBlock *b = &d->blocks[s];
+	if(b->indexed && b->refs == 0)
+		dedup_unindex(d, b);
+	if(!b->indexed && b->refs <= 1)
+		dedup_unslot_block(d, s);
+}
+
+// The block indexed with this fingerprint, 0 if none
+uint32_t dedup_find(const DedupMap *d, uint64_t print) {
+	return d->prints[dedup_print_slot(d, print)].block;
+}
+
+// Index block, which now holds content with this fingerprint. Nothing
+// changes when another block already has it.
+int dedup_add(DedupMap *d, uint32_t block, uint64_t print) {
+	uint32_t p = dedup_print_slot(d, print);
+	if(d->prints[p].block != 0)
+		return 0;
+	if(((size_t) d->printCount + 1) * 2 > (size_t) d->printMask + 1) {
+		if(dedup_grow_prints(d) < 0)
+			return -ENOMEM;
+		p = dedup_print_slot(d, print);
+	}
+	DedupBlock *b = dedup_record(d, block);
+	if(b == NULL)
+		return -ENOMEM;
+	if(b->indexed) {
+		dedup_unindex(d, b);
+		p = dedup_print_slot(d, print);
+	}
+	b->print = print;
+	b->indexed = 1;
+	d->prints[p].print = print;
+	d->prints[p].block = block;
+	d->printCount++;
+	return 0;
+}
+
+// The content of block, named by one extent, is about to change: no later
+// write may find it by what it held
+void dedup_forget(DedupMap *d, uint32_t block) {
+	uint32_t s = dedup_block_slot(d, block);
+	if(d->blocks[s].block != 0 && d->blocks[s].indexed) {
+		dedup_unindex(d, &d->blocks[s]);
+		dedup_trim(d, s);
+	}
+}
+
+// Extents naming block; a block without a record has one
+uint32_t dedup_refs(const DedupMap *d, uint32_t block) {
+	const DedupBlock *b = &d->blocks[dedup_block_slot(d, block)];
+	return b->block != 0 ? b->refs : 1;
+}
+
+// One more extent names block
+int dedup_ref(DedupMap *d, uint32_t block) {
+	DedupBlock *b = dedup_record(d, block);
+	if(b == NULL)
+		return -ENOMEM;
+	b->refs++;
+	return 0;
+}
+
+// One extent less names block. Returns the references left; at 0 the
+// caller frees the block.
+uint32_t dedup_unref(DedupMap *d, uint32_t block) {
+	uint32_t s = dedup_block_slot(d, block);
+	if(d->blocks[s].block == 0)
+		return 0;
+	uint32_t refs = --d->blocks[s].refs;
+	dedup_trim(d, s);
+	return refs;
+}
@@ -0,0 +1,66 @@
+/*
+  AOFS shared blocks
+
+  With dedup on, a full block a file writes is first looked up by its
+  content, and when some block already holds the same bytes the file's
+  extent names that block instead of a new one. This keeps what that
+  needs: the reference count of every block more than one extent names,
+  and the fingerprints of blocks written since mount. Counts are not
+  stored; mount rebuilds them from the extent maps, as it does the tail
+  map. Fingerprints are not stored either, so after a remount only
+  blocks written from then on are found.
+
+  A block is freed in the bitmap once its last reference goes. One named
+  by a single extent may be changed in place, after its fingerprint is
+  dropped; one named by more is copied first.
+
+  Two hash tables (linear probing, backward-shift deletion): block number
+  to record, and fingerprint to block. Callers serialize every call (the
+  engine holds allocLock).
+*/
+
+#ifndef AOFS_DEDUP_H
+#define AOFS_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// DedupBlock struct, a block shared or fingerprinted; block 0 is an empty slot
+typedef struct {
+	uint32_t block;
+	uint32_t refs;					// Extents naming it
+	uint64_t print;					// Fingerprint of its content, if indexed
+	int indexed;					// In the fingerprint table
+} DedupBlock;
+
+// DedupPrint struct, block 0 is an empty slot
+typedef struct {
+	uint64_t print;
+	uint32_t block;
+} DedupPrint;
+
+// DedupMap struct
+typedef struct {
+	DedupBlock *blocks;
+	uint32_t blockCount;			// Records in use; 0 means no block is shared
+	uint32_t blockMask;				// Slots minus one, a power of two minus one
+	DedupPrint *prints;
+	uint32_t printCount;
+	uint32_t printMask;
+	uint64_t hits;					// Blocks written by sharing one instead
+} DedupMap;
+
+int dedup_init(DedupMap *d);
+void dedup_destroy(DedupMap *d);
+
+uint64_t dedup_print(const void *buf, size_t len);
+
+uint32_t dedup_find(const DedupMap *d, uint64_t print);
+int dedup_add(DedupMap *d, uint32_t block, uint64_t print);
+void dedup_forget(DedupMap *d, uint32_t block);
+
+uint32_t dedup_refs(const DedupMap *d, uint32_t block);
+int dedup_ref(DedupMap *d, uint32_t block);
+uint32_t dedup_unref(DedupMap *d, uint32_t block);
+
+#endif
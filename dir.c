@@ -0,0 +1,272 @@
+/*
+  AOFS directories
+
+  A new entry goes into the first sector with room for it, at the end of
+  the entry whose recLen holds that room (or at the start of an empty
+  sector), and a sector is appended when none has room. A removed entry's
+  bytes are handed to the entry before it, or the sector's first entry is
+  marked unused. room[] and fit keep the search for space from walking
+  sectors that cannot take the entry.
+*/
+
+#include "dir.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Smallest entry there is, a one-byte name
+#define DIR_MIN_ENTRY AOFS_DIRENT_SIZE(1)
+
+static DiskDirent *dirent_at(char *sector, uint32_t within) {
+	return (DiskDirent *) (sector + within);
+}
+
+// Bytes the entry needs, 0 for an unused first entry
+static uint32_t dirent_used(const DiskDirent *e) {
+	return e->inode ? AOFS_DIRENT_SIZE(e->nameLen) : 0;
+}
+
+// Largest entry that fits after any entry of the sector
+static uint16_t dir_sector_room(char *sector) {
+	uint32_t room = 0;
+	for(uint32_t within = 0; within < AOFS_SECTOR_SIZE; ) {
+		DiskDirent *e = dirent_at(sector, within);
+		uint32_t free = e->recLen - dirent_used(e);
+		if(free > room)
+			room = free;
+		within += e->recLen;
+	}
+	return room;
+}
+
+static void dir_empty_sector(char *sector) {
+	memset(sector, 0, AOFS_SECTOR_SIZE);
+	dirent_at(sector, 0)->recLen = AOFS_SECTOR_SIZE;
+}
+
+// A sector buffer with a NUL after it, so a lookup comparing against a name
+// being rewritten never runs off the end
+static char *dir_sector_alloc(DirPool *pool) {
+	if(pool->count > 0)
+		return pool->sectors[--pool->count];
+	char *sector = malloc(AOFS_SECTOR_SIZE + 1);
+	if(sector != NULL)
+		sector[AOFS_SECTOR_SIZE] = '\0';
+	return sector;
+}
+
+static void dir_sector_free(DirPool *pool, char *sector) {
+	if(pool->count == pool->capacity) {
+		size_t capacity = pool->capacity ? pool->capacity * 2 : 64;
+		char **sectors = realloc(pool->sectors, capacity * sizeof(char *));
+		if(sectors == NULL) {
+			// Leaked rather than freed under a lookup; unmount is not far off
+			// if memory is this short
+			return;
+		}
+		pool->sectors = sectors;
+		pool->capacity = capacity;
+	}
+	pool->sectors[pool->count++] = sector;
+}
+
+void dir_init(Directory *d) {
+	memset(d, 0, sizeof(*d));
+}
+
+void dir_destroy(Directory *d) {
+	for(uint32_t i = 0; i < d->count; i++)
+		free(d->sectors[i]);
+	free(d->sectors);
+	free(d->room);
+	dir_init(d);
+}
+
+// Hand every sector to the pool; d is left empty
+void dir_release(Directory *d, DirPool *pool) {
+	for(uint32_t i = 0; i < d->count; i++)
+		dir_sector_free(pool, d->sectors[i]);
+	d->count = 0;
+	dir_destroy(d);
+}
+
+void dir_pool_destroy(DirPool *pool) {
+	for(size_t i = 0; i < pool->count; i++)
+		free(pool->sectors[i]);
+	free(pool->sectors);
+	memset(pool, 0, sizeof(*pool));
+}
+
+// Add an empty sector at the end
+static int dir_append(Directory *d, DirPool *pool) {
+	if(d->count == UINT32_MAX / AOFS_SECTOR_SIZE)
+		return -EFBIG;
+	if(d->count == d->capacity) {
+		uint32_t capacity = d->capacity ? d->capacity * 2 : 4;
+		char **sectors = realloc(d->sectors, capacity * sizeof(char *));
+		if(sectors != NULL)
+			d->sectors = sectors;
+		uint16_t *room = realloc(d->room, capacity * sizeof(uint16_t));
+		if(room != NULL)
+			d->room = room;
+		if(sectors == NULL || room == NULL)
+			return -ENOMEM;
+		d->capacity = capacity;
+	}
+	char *sector = dir_sector_alloc(pool);
+	if(sector == NULL)
+		return -ENOMEM;
+	dir_empty_sector(sector);
+	d->sectors[d->count] = sector;
+	d->room[d->count] = AOFS_SECTOR_SIZE;
+	d->count++;
+	return 0;
+}
+
+// Check one sector read from the image and count its entries
+static int dir_check_sector(char *sector, uint32_t *entries) {
+	for(uint32_t within = 0; within < AOFS_SECTOR_SIZE; ) {
+		DiskDirent *e = dirent_at(sector, within);
+		if(e->recLen < sizeof(DiskDirent) || e->recLen % 8 != 0 || e->recLen > AOFS_SECTOR_SIZE - within)
+			return -EINVAL;
+		if(e->inode != 0) {
+			if(e->nameLen == 0 || AOFS_DIRENT_SIZE(e->nameLen) > e->recLen || e->name[e->nameLen] != '\0'
+					|| strlen(e->name) != e->nameLen || strchr(e->name, '/') != NULL)
+				return -EINVAL;
+			(*entries)++;
+		}
+		else if(within != 0) {
+			return -EINVAL;
+		}
+		within += e->recLen;
+	}
+	return 0;
+}
+
+// Take in bytes of directory content read from the image
+int dir_load(Directory *d, DirPool *pool, const char *content, size_t bytes) {
+	if(bytes % AOFS_SECTOR_SIZE != 0 || bytes / AOFS_SECTOR_SIZE >= UINT32_MAX / AOFS_SECTOR_SIZE)
+		return -EINVAL;
+	for(size_t pos = 0; pos < bytes; pos += AOFS_SECTOR_SIZE) {
+		int res = dir_append(d, pool);
+		if(res < 0)
+			return res;
+		char *sector = d->sectors[d->count - 1];
+		memcpy(sector, content + pos, AOFS_SECTOR_SIZE);
+		res = dir_check_sector(sector, &d->entries);
+		if(res < 0)
+			return res;
+		d->room[d->count - 1] = dir_sector_room(sector);
+	}
+	d->fit = 0;
+	while(d->fit < d->count && d->room[d->fit] < DIR_MIN_ENTRY)
+		d->fit++;
+	return 0;
+}
+
+// Put an entry into a sector known to have room for it
+static uint32_t dir_place(char *sector, const char *name, size_t len, uint32_t inode, uint8_t type) {
+	uint32_t need = AOFS_DIRENT_SIZE(len);
+	uint32_t within = 0;
+	for(;;) {
+		DiskDirent *e = dirent_at(sector, within);
+		uint32_t used = dirent_used(e);
+		if(e->recLen - used >= need) {
+			DiskDirent *n = dirent_at(sector, within + used);
+			// The name goes in before the entry is linked in, so a lookup
+			// never sees a half-written one at an offset it was given
+			memcpy(n->name, name, len);
+			n->name[len] = '\0';
+			n->nameLen = len;
+			n->type = type;
+			n->recLen = e->recLen - used;
+			if(used != 0)
+				e->recLen = used;
+			n->inode = inode;
+			return within + used;
+		}
+		within += e->recLen;
+	}
+}
+
+// Add name, which must not be present, and set *offset to where its entry
+// starts. A new sector is appended when none has room; the caller sees
+// count go up and has to back it with a block.
+int dir_add(Directory *d, DirPool *pool, const char *name, uint32_t inode, uint8_t type, uint32_t *offset) {
+	size_t len = strlen(name);
+	if(len == 0 || len >= AOFS_NAME_LEN)
+		return -EINVAL;
+	uint32_t need = AOFS_DIRENT_SIZE(len);
+
+	uint32_t s = d->fit;
+	while(s < d->count && d->room[s] < need)
+		s++;
+	if(s == d->count) {
+		int res = dir_append(d, pool);
+		if(res < 0)
+			return res;
+	}
+	uint32_t within = dir_place(d->sectors[s], name, len, inode, type);
+	d->room[s] = dir_sector_room(d->sectors[s]);
+	while(d->fit < d->count && d->room[d->fit] < DIR_MIN_ENTRY)
+		d->fit++;
+	d->entries++;
+	*offset = s * AOFS_SECTOR_SIZE + within;
+	return 0;
+}
+
+// Remove the entry starting at offset
+void dir_remove(Directory *d, uint32_t offset) {
+	uint32_t s = offset / AOFS_SECTOR_SIZE;
+	uint32_t target = offset % AOFS_SECTOR_SIZE;
+	char *sector = d->sectors[s];
+
+	if(target == 0) {
+		dirent_at(sector, 0)->inode = 0;
+	}
+	else {
+		uint32_t within = 0;
+		DiskDirent *prev = dirent_at(sector, 0);
+		while(within + prev->recLen != target) {
+			within += prev->recLen;
+			prev = dirent_at(sector, within);
+		}
+		prev->recLen += dirent_at(sector, target)->recLen;
+	}
+	d->room[s] = dir_sector_room(sector);
+	if(s < d->fit)
+		d->fit = s;
+	d->entries--;
+}
+
+// Undo a dir_add that appended a sector
+void dir_drop_last(Directory *d, DirPool *pool) {
+	d->count--;
+	dir_sector_free(pool, d->sectors[d->count]);
+	d->entries--;
+	if(d->fit > d->count)
+		d->fit = d->count;
+}
+
+const DiskDirent *dir_entry(const Directory *d, uint32_t offset) {
+	return dirent_at(d->sectors[offset / AOFS_SECTOR_SIZE], offset % AOFS_SECTOR_SIZE);
+}
+
+// First live entry starting at or after *offset, which is set to where it
+// starts; NULL past the last one. *offset may be anything, e.g. where an
+// entry since removed used to start.
+const DiskDirent *dir_next(const Directory *d, uint32_t *offset) {
+	for(uint32_t s = *offset / AOFS_SECTOR_SIZE; s < d->count; s++) {
+		uint32_t from = s == *offset / AOFS_SECTOR_SIZE ? *offset % AOFS_SECTOR_SIZE : 0;
+		for(uint32_t within = 0; within < AOFS_SECTOR_SIZE; ) {
+			DiskDirent *e = dirent_at(d->sectors[s], within);
+			if(within >= from && e->inode != 0) {
+				*offset = s * AOFS_SECTOR_SIZE + within;
+				return e;
+			}
+			within += e->recLen;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,60 @@
+/*
+  AOFS directories
+
+  A directory's content is a run of AOFS_SECTOR_SIZE sectors of DiskDirent
+  records, see layout.h. While mounted the whole content is held here,
+  one buffer per sector, and is the authoritative copy: the engine logs a
+  sector to the journal whenever it changes one, and reads every directory
+  in at mount to fill the name index.
+
+  An entry is addressed by its byte offset in the directory. Adding and
+  removing entries never moves another entry, so an offset and the name
+  stored at it stay valid for as long as the entry exists; the name index
+  keeps pointers to these names instead of copies.
+
+  Callers serialize every call on a directory (the engine holds
+  namespaceLock).
+*/
+
+#ifndef AOFS_DIR_H
+#define AOFS_DIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "layout.h"
+
+// Sectors released by removed directories. dir_add takes from here before
+// allocating, and nothing is freed until dir_pool_destroy(), since a
+// lookup may still be comparing a name it found in one.
+typedef struct {
+	char **sectors;
+	size_t count;
+	size_t capacity;
+} DirPool;
+
+// Directory struct
+typedef struct {
+	char **sectors;					// count sectors of content
+	uint32_t count;
+	uint32_t capacity;
+	uint16_t *room;					// Largest entry each sector can still take
+	uint32_t fit;					// No sector before this one has room for any entry
+	uint32_t entries;				// Live entries
+} Directory;
+
+void dir_init(Directory *d);
+void dir_destroy(Directory *d);
+void dir_release(Directory *d, DirPool *pool);
+void dir_pool_destroy(DirPool *pool);
+
+int dir_load(Directory *d, DirPool *pool, const char *content, size_t bytes);
+
+int dir_add(Directory *d, DirPool *pool, const char *name, uint32_t inode, uint8_t type, uint32_t *offset);
+void dir_remove(Directory *d, uint32_t offset);
+void dir_drop_last(Directory *d, DirPool *pool);
+
+const DiskDirent *dir_entry(const Directory *d, uint32_t offset);
+const DiskDirent *dir_next(const Directory *d, uint32_t *offset);
+
+#endif
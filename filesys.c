@@ -0,0 +1,2613 @@
+/*
+  AOFS engine
+
+  See filesys.h. Everything between the path a caller passes in and the
+  blocks of the image: path resolution, directory entries, inode encoding,
+  the extent map of each file, block allocation, mounting, and the
+  operations of the public API.
+*/
+
+#include "filesys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "format.h"
+#include "lz.h"
+#include "stats.h"
+#include "trace.h"
+
+static void inode_encode(const Metadata *m, DiskInode *d) {
+	memset(d, 0, sizeof(*d));
+	d->fileSize = m->fileSize;
+	d->mode = m->mode;
+	d->extentCount = m->extentCount;
+	d->timeCreated = m->timeCreated;
+	d->timeUpdated = m->timeUpdated;
+	d->timeAccessed = m->timeAccessed;
+	d->indirectBlock = m->indirectBlock;
+	d->nlink = m->nlink;
+	d->flags = m->flags;
+	d->tailBlock = m->tailBlock;
+	d->tailSector = m->tailSector;
+	d->tailSectors = m->tailSectors;
+	if(m->flags & AOFS_INODE_INLINE) {
+		if(m->data != NULL)
+			memcpy(d->data, m->data, m->fileSize);
+		return;
+	}
+	for(unsigned int i = 0; i < m->extentCount && i < AOFS_INLINE_EXTENTS; i++) {
+		d->extents[i] = m->extents[i];
+	}
+}
+
+// Decode everything but the content map, which filesys_load_content fills
+// in, and the directory entry, which filesys_build_index finds
+static void inode_decode(const DiskInode *d, Metadata *m) {
+	memset(m, 0, sizeof(*m));
+	m->fileSize = d->fileSize;
+	m->mode = d->mode;
+	m->timeCreated = d->timeCreated;
+	m->timeUpdated = d->timeUpdated;
+	m->timeAccessed = d->timeAccessed;
+	m->indirectBlock = d->indirectBlock;
+	m->nlink = d->nlink;
+	m->flags = d->flags;
+	m->tailBlock = d->tailBlock;
+	m->tailSector = d->tailSector;
+	m->tailSectors = d->tailSectors;
+}
+
+static off_t block_offset(const Superblock *sb, unsigned int block) {
+	return (off_t) block * sb->blockSize;
+}
+
+static unsigned int blocks_for(off_t bytes, unsigned int blockSize) {
+	return (bytes + blockSize - 1) / blockSize;
+}
+
+// Largest file kept in a tail; anything bigger gets blocks of its own
+#define AOFS_TAIL_LIMIT(blockSize) ((blockSize) / 2)
+
+#define AOFS_INODE_SMALL (AOFS_INODE_INLINE | AOFS_INODE_TAIL)
+
+// Image offset of the content of a file in a tail
+static off_t tail_offset(const Superblock *sb, const Metadata *m) {
+	return block_offset(sb, m->tailBlock) + (off_t) m->tailSector * AOFS_SECTOR_SIZE;
+}
+
+// Log the bitmap sectors changed since the last call, one record each, so
+// a run of allocations in one area keeps rewriting the same record
+static void filesys_write_bitmap(FileSystem *fs) {
+	Bitmap *bm = &fs->sb.BitMap;
+	off_t base = block_offset(&fs->sb, fs->sb.bitmapStart);
+	uint64_t start = stats_now();
+	uint64_t image[BITMAP_DIRTY_WORDS];
+
+	pthread_mutex_lock(&fs->allocLock);
+	for(uint32_t w = 0; bitmap_take_dirty(bm, &w); w += BITMAP_DIRTY_WORDS) {
+		uint32_t n = bm->nwords - w < BITMAP_DIRTY_WORDS ? bm->nwords - w : BITMAP_DIRTY_WORDS;
+		bitmap_image(bm, w, image, n);
+		if(journal_log(&fs->journal, base + (off_t) w * sizeof(uint64_t), image, n * sizeof(uint64_t)) < 0) {
+			TRACE_ERROR(TRACE_LOG_ERROR, 0, -ENOMEM, 0);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fs->allocLock);
+	stats_end(STAT_BITMAP, start);
+}
+
+// Claim up to want free blocks near goal, see bitmap_alloc_run
+static uint32_t filesys_alloc(FileSystem *fs, uint32_t goal, uint32_t want, uint32_t *got) {
+	uint64_t start = stats_now();
+	pthread_mutex_lock(&fs->allocLock);
+	uint32_t block = bitmap_alloc_run(&fs->sb.BitMap, goal, want, got);
+	pthread_mutex_unlock(&fs->allocLock);
+	stats_end(STAT_ALLOC, start);
+	return block;
+}
+
+// One extent less names block; nonzero when that was the last, so the
+// block goes. The caller holds allocLock.
+static int filesys_unref(FileSystem *fs, uint32_t block) {
+	return fs->shared.blockCount == 0 || dedup_unref(&fs->shared, block) == 0;
+}
+
+// Release a run of blocks. A block other extents still name only loses a
+// reference. The others are dropped from the cache, so that freeing
+// writes nothing, and are free in the bitmap the journal logs, but none
+// is handed out again until the transaction freeing them has committed,
+// see filesys_discard: until then a crash brings back the files that name
+// them, content included. If the journal cannot keep the run, it stays
+// taken until the next mount.
+static void filesys_free(FileSystem *fs, uint32_t start, uint32_t length) {
+	uint32_t end = start + length;
+	uint32_t b = start;
+	while(b < end) {
+		pthread_mutex_lock(&fs->allocLock);
+		while(b < end && !filesys_unref(fs, b))
+			b++;
+		uint32_t from = b;
+		while(b < end && filesys_unref(fs, b))
+			b++;
+		uint32_t to = b;
+		// The block that ended the run keeps its other references
+		if(b < end)
+			b++;
+		pthread_mutex_unlock(&fs->allocLock);
+		if(from == to)
+			continue;
+
+		cache_discard(&fs->cache, from, to - from);
+		journal_free(&fs->journal, from, to - from);
+		pthread_mutex_lock(&fs->allocLock);
+		bitmap_defer_run(&fs->sb.BitMap, from, to - from);
+		pthread_mutex_unlock(&fs->allocLock);
+	}
+}
+
+// The journal's discard: the transaction that freed [block, block + count)
+// is durable, so no crash can bring back a file naming those blocks. They
+// may be allocated again, and are punched out of the image for the host
+// to reclaim.
+static void filesys_discard(void *ctx, uint32_t block, uint32_t count) {
+	FileSystem *fs = ctx;
+	pthread_mutex_lock(&fs->allocLock);
+	bitmap_release_run(&fs->sb.BitMap, block, count);
+	pthread_mutex_unlock(&fs->allocLock);
+	storage_discard(&fs->storage, block_offset(&fs->sb, block), (off_t) count * fs->sb.blockSize);
+}
+
+// How many of the n image blocks from pblock on no other extent names.
+// Those are the caller's to change in place: their fingerprints go first,
+// so that no write can start sharing them meanwhile.
+static unsigned int filesys_own_run(FileSystem *fs, uint32_t pblock, unsigned int n) {
+	unsigned int i = 0;
+	pthread_mutex_lock(&fs->allocLock);
+	if(fs->shared.blockCount == 0)
+		i = n;
+	for(; i < n && dedup_refs(&fs->shared, pblock + i) <= 1; i++)
+		dedup_forget(&fs->shared, pblock + i);
+	pthread_mutex_unlock(&fs->allocLock);
+	return i;
+}
+
+// Claim a run of sectors for a tail: in a tail block with room, or at the
+// start of a new one near goal
+static int filesys_tail_alloc(FileSystem *fs, unsigned int sectors, uint32_t goal, uint32_t *block, unsigned int *sector) {
+	uint64_t start = stats_now();
+	uint32_t fresh = 0;
+	pthread_mutex_lock(&fs->allocLock);
+	int res = tail_find(&fs->tails, sectors, block, sector);
+	if(res < 0) {
+		uint32_t got;
+		fresh = bitmap_alloc_run(&fs->sb.BitMap, goal, 1, &got);
+		*block = fresh;
+		*sector = 0;
+		res = fresh ? 0 : -ENOSPC;
+	}
+	if(res == 0)
+		res = tail_take(&fs->tails, *block, *sector, sectors);
+	if(res < 0 && fresh)
+		bitmap_clear_run(&fs->sb.BitMap, fresh, 1);
+	pthread_mutex_unlock(&fs->allocLock);
+	stats_end(STAT_ALLOC, start);
+	return res;
+}
+
+// Give a tail's sectors back, and its block once no tail is left in it
+static void filesys_tail_free(FileSystem *fs, uint32_t block, unsigned int sector, unsigned int sectors) {
+	pthread_mutex_lock(&fs->allocLock);
+	int empty = tail_release(&fs->tails, block, sector, sectors);
+	pthread_mutex_unlock(&fs->allocLock);
+	// Out of the tail map, so no new tail can land in it meanwhile
+	if(empty)
+		filesys_free(fs, block, 1);
+}
+
+// File blocks per compressed cluster
+static unsigned int cluster_blocks(const FileSystem *fs) {
+	unsigned int blocks = AOFS_COMPRESS_CLUSTER / fs->sb.blockSize;
+	return blocks < 2 ? 2 : blocks;
+}
+
+// Image blocks an extent occupies
+static unsigned int extent_blocks(const FileSystem *fs, const Extent *e) {
+	if(e->flags & AOFS_EXTENT_COMPRESSED)
+		return blocks_for(e->flags & AOFS_EXTENT_BYTES, fs->sb.blockSize);
+	return e->length;
+}
+
+// Extents that fit in an inode plus its indirect block
+static unsigned int extent_limit(const FileSystem *fs) {
+	return AOFS_INLINE_EXTENTS + fs->sb.blockSize / sizeof(Extent);
+}
+
+// Map file block lblock to an image block. Returns 0 for an unmapped block.
+// *run is set to how many file blocks from lblock on map contiguously (or
+// stay unmapped), so callers can issue one transfer per run.
+static unsigned int extent_map(const Metadata *m, unsigned int lblock, unsigned int *run) {
+	int lo = 0;
+	int hi = (int) m->extentCount - 1;
+	int found = -1;
+
+	// Last extent starting at or before lblock
+	while(lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if(m->extents[mid].logical <= lblock) {
+			found = mid;
+			lo = mid + 1;
+		}
+		else {
+			hi = mid - 1;
+		}
+	}
+	if(found != -1 && lblock - m->extents[found].logical < m->extents[found].length) {
+		unsigned int into = lblock - m->extents[found].logical;
+		*run = m->extents[found].length - into;
+		return m->extents[found].start + into;
+	}
+	*run = (unsigned int) found + 1 < m->extentCount ? m->extents[found + 1].logical - lblock : UINT32_MAX;
+	return 0;
+}
+
+// File blocks covered by the extent map
+static unsigned int extent_end(const Metadata *m) {
+	if(m->extentCount == 0)
+		return 0;
+	const Extent *last = &m->extents[m->extentCount - 1];
+	return last->logical + last->length;
+}
+
+// Index of the first extent starting after lblock
+static unsigned int extent_upper(const Metadata *m, unsigned int lblock) {
+	unsigned int lo = 0;
+	unsigned int hi = m->extentCount;
+	while(lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if(m->extents[mid].logical <= lblock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// The extent covering file block lblock, NULL in a hole
+static const Extent *extent_at(const Metadata *m, unsigned int lblock) {
+	unsigned int pos = extent_upper(m, lblock);
+	if(pos == 0)
+		return NULL;
+	const Extent *e = &m->extents[pos - 1];
+	return lblock - e->logical < e->length ? e : NULL;
+}
+
+// Where a run for file block lblock should start: right after the image
+// blocks of the extent before it, so the file stays sequential in FS_FILE
+static uint32_t extent_goal(const FileSystem *fs, const Metadata *m, unsigned int lblock) {
+	unsigned int pos = extent_upper(m, lblock);
+	if(pos == 0)
+		return 0;
+	const Extent *prev = &m->extents[pos - 1];
+	return prev->start + extent_blocks(fs, prev) + (lblock - prev->logical - prev->length);
+}
+
+// Map an unmapped run of file blocks, merging with the neighbouring extents
+// when both the file blocks and the image blocks are contiguous. A
+// compressed run (flags set) never merges.
+static int extent_insert(FileSystem *fs, Metadata *m, unsigned int logical, unsigned int start, unsigned int length, uint32_t flags) {
+	unsigned int pos = extent_upper(m, logical);
+	Extent *prev = pos > 0 ? &m->extents[pos - 1] : NULL;
+	Extent *next = pos < m->extentCount ? &m->extents[pos] : NULL;
+	int mergePrev = !flags && prev && !prev->flags && prev->logical + prev->length == logical && prev->start + prev->length == start;
+	int mergeNext = !flags && next && !next->flags && logical + length == next->logical && start + length == next->start;
+
+	if(m->extentCount > AOFS_INLINE_EXTENTS)
+		m->extentsDirty = 1;
+	if(mergePrev && mergeNext) {
+		prev->length += length + next->length;
+		memmove(next, next + 1, (m->extentCount - pos - 1) * sizeof(Extent));
+		m->extentCount--;
+		return 0;
+	}
+	if(mergePrev) {
+		prev->length += length;
+		return 0;
+	}
+	if(mergeNext) {
+		next->logical = logical;
+		next->start = start;
+		next->length += length;
+		return 0;
+	}
+
+	if(m->extentCount == extent_limit(fs))
+		return -ENOSPC;
+	if(m->extentCount == m->extentCapacity) {
+		unsigned int capacity = m->extentCapacity ? m->extentCapacity * 2 : AOFS_INLINE_EXTENTS;
+		Extent *extents = realloc(m->extents, capacity * sizeof(Extent));
+		if(extents == NULL)
+			return -ENOMEM;
+		m->extents = extents;
+		m->extentCapacity = capacity;
+	}
+	memmove(&m->extents[pos + 1], &m->extents[pos], (m->extentCount - pos) * sizeof(Extent));
+	Extent *e = &m->extents[pos];
+	e->logical = logical;
+	e->start = start;
+	e->length = length;
+	e->flags = flags;
+	m->extentCount++;
+	if(m->extentCount > AOFS_INLINE_EXTENTS)
+		m->extentsDirty = 1;
+	return 0;
+}
+
+// Keep the indirect block in step with the extent count
+static int filesys_update_indirect(FileSystem *fs, Metadata *m) {
+	if(m->extentCount > AOFS_INLINE_EXTENTS && m->indirectBlock == 0) {
+		uint32_t got;
+		uint32_t block = filesys_alloc(fs, extent_end(m) ? m->extents[m->extentCount - 1].start : 0, 1, &got);
+		if(block == 0)
+			return -ENOSPC;
+		m->indirectBlock = block;
+		m->extentsDirty = 1;
+	}
+	else if(m->extentCount <= AOFS_INLINE_EXTENTS && m->indirectBlock != 0) {
+		// Older records for the block must not be replayed over whatever
+		// it holds next
+		journal_revoke(&fs->journal, block_offset(&fs->sb, m->indirectBlock));
+		filesys_free(fs, m->indirectBlock, 1);
+		m->indirectBlock = 0;
+		m->extentsDirty = 0;
+	}
+	return 0;
+}
+
+// Release every block past the first nblocks of the file. A compressed
+// run is only released whole; the caller rewrites one the end falls in.
+static void filesys_shrink(FileSystem *fs, Metadata *m, unsigned int nblocks) {
+	while(m->extentCount > 0) {
+		Extent *last = &m->extents[m->extentCount - 1];
+		if(last->logical >= nblocks) {
+			filesys_free(fs, last->start, extent_blocks(fs, last));
+			m->extentCount--;
+		}
+		else {
+			if(last->logical + last->length > nblocks && !last->flags) {
+				unsigned int keep = nblocks - last->logical;
+				filesys_free(fs, last->start + keep, last->length - keep);
+				last->length = keep;
+			}
+			break;
+		}
+	}
+	if(m->extentCount > AOFS_INLINE_EXTENTS)
+		m->extentsDirty = 1;
+	filesys_update_indirect(fs, m);
+}
+
+// Allocate image blocks for every unmapped file block in [first, first +
+// count). Each hole is placed right after the image block that precedes it
+// in the file, so a file written front to back stays sequential in FS_FILE.
+// Sets *allocated when anything was mapped.
+static int filesys_map_range(FileSystem *fs, Metadata *m, unsigned int first, unsigned int count, int *allocated) {
+	unsigned int lblock = first;
+	unsigned int end = first + count;
+
+	while(lblock < end) {
+		unsigned int run;
+		if(extent_map(m, lblock, &run) != 0) {
+			lblock = run > end - lblock ? end : lblock + run;
+			continue;
+		}
+		unsigned int want = run > end - lblock ? end - lblock : run;
+		uint32_t got;
+		uint32_t start = filesys_alloc(fs, extent_goal(fs, m, lblock), want, &got);
+		if(start == 0)
+			return -ENOSPC;
+		int res = extent_insert(fs, m, lblock, start, got, 0);
+		if(res < 0) {
+			filesys_free(fs, start, got);
+			return res;
+		}
+		*allocated = 1;
+		lblock += got;
+	}
+	return filesys_update_indirect(fs, m);
+}
+
+// Release the blocks of file blocks [first, first + count), leaving a
+// hole. A compressed run is released whole, so the range must cover it.
+static int filesys_unmap_range(FileSystem *fs, Metadata *m, unsigned int first, unsigned int count) {
+	unsigned int end = first + count;
+	unsigned int pos = extent_upper(m, first);
+	if(pos > 0 && m->extents[pos - 1].logical + m->extents[pos - 1].length > first)
+		pos--;
+
+	while(pos < m->extentCount && m->extents[pos].logical < end) {
+		Extent *e = &m->extents[pos];
+		unsigned int eEnd = e->logical + e->length;
+		unsigned int from = e->logical > first ? e->logical : first;
+		unsigned int to = eEnd < end ? eEnd : end;
+		if(e->flags || (from == e->logical && to == eEnd)) {
+			filesys_free(fs, e->start, extent_blocks(fs, e));
+			memmove(e, e + 1, (m->extentCount - pos - 1) * sizeof(Extent));
+			m->extentCount--;
+			continue;
+		}
+		if(from > e->logical && to < eEnd) {
+			// The rest after the range becomes an extent of its own
+			Extent rest = { to, e->start + (to - e->logical), eEnd - to, 0 };
+			e->length = from - e->logical;
+			int res = extent_insert(fs, m, rest.logical, rest.start, rest.length, 0);
+			if(res < 0) {
+				m->extents[pos].length = eEnd - m->extents[pos].logical;
+				return res;
+			}
+			e = &m->extents[pos];
+			filesys_free(fs, e->start + e->length, to - from);
+			break;
+		}
+		filesys_free(fs, e->start + (from - e->logical), to - from);
+		if(from == e->logical) {
+			e->start += to - from;
+			e->logical = to;
+		}
+		e->length -= to - from;
+		pos++;
+	}
+	if(m->extentCount > AOFS_INLINE_EXTENTS)
+		m->extentsDirty = 1;
+	return filesys_update_indirect(fs, m);
+}
+
+// Make the mapped blocks among file blocks [first, first + count) the
+// file's own, ahead of a write of bytes [from, to). A block other extents
+// also name is replaced by a copy, or just let go when the write covers
+// all of it. With all, so is every other block, leaving the ones the last
+// commit names as they are. Sets *allocated when anything changed.
+static int filesys_unshare(FileSystem *fs, Metadata *m, unsigned int first, unsigned int count, off_t from, off_t to, int all, int *allocated) {
+	size_t blockSize = fs->sb.blockSize;
+	unsigned int lblock = first;
+	unsigned int end = first + count;
+	char *copy = NULL;
+	int res = 0;
+
+	while(lblock < end && res == 0) {
+		unsigned int run;
+		uint32_t pblock = extent_map(m, lblock, &run);
+		unsigned int n = run > end - lblock ? end - lblock : run;
+		if(pblock == 0 || extent_at(m, lblock)->flags) {
+			lblock += n;
+			continue;
+		}
+		unsigned int own = all ? 0 : filesys_own_run(fs, pblock, n);
+		lblock += own;
+		if(own == n)
+			continue;
+
+		off_t at = (off_t) lblock * blockSize;
+		int whole = from <= at && at + (off_t) blockSize <= to;
+		if(!whole) {
+			if(copy == NULL && (copy = malloc(blockSize)) == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+			ssize_t got = cache_read(&fs->cache, copy, blockSize, block_offset(&fs->sb, pblock + own));
+			if(got != (ssize_t) blockSize)
+				res = got < 0 ? got : -EIO;
+		}
+		// Letting go of the block only drops this file's reference
+		if(res == 0)
+			res = filesys_unmap_range(fs, m, lblock, 1);
+		*allocated = 1;
+		if(res == 0 && !whole)
+			res = filesys_map_range(fs, m, lblock, 1, allocated);
+		if(res == 0 && !whole) {
+			ssize_t put = cache_write(&fs->cache, copy, blockSize, block_offset(&fs->sb, extent_map(m, lblock, &run)));
+			if(put < 0)
+				res = put;
+		}
+		lblock++;
+	}
+	free(copy);
+	return res;
+}
+
+// Reads of at least this many contiguous bytes get a readahead hint
+#define AOFS_ADVISE_MIN (128 * 1024)
+// Runs of one transfer handed to the cache, and so to storage, at a time
+#define AOFS_IO_RUNS 64
+
+// Copy len bytes at byte into of a compressed extent's content. The whole
+// cluster is decompressed, and nothing else.
+static ssize_t filesys_read_compressed(FileSystem *fs, const Extent *e, char *buf, size_t len, size_t into) {
+	size_t stored = e->flags & AOFS_EXTENT_BYTES;
+	size_t plain = (size_t) e->length * fs->sb.blockSize;
+	char *packed = malloc(stored + plain);
+	if(packed == NULL)
+		return -ENOMEM;
+	char *content = packed + stored;
+
+	ssize_t res = cache_read(&fs->cache, packed, stored, block_offset(&fs->sb, e->start));
+	if(res == (ssize_t) stored) {
+		uint64_t start = stats_now();
+		res = lz_decompress(packed, stored, content, plain);
+		stats_end(STAT_DECOMPRESS, start);
+	}
+	else if(res >= 0) {
+		res = -EIO;
+	}
+	if(res >= 0) {
+		memset(content + res, 0, plain - res);
+		memcpy(buf, content + into, len);
+		res = len;
+	}
+	free(packed);
+	return res;
+}
+
+// Transfer len bytes at file position pos. The contiguous runs of blocks
+// it covers go to the cache together, up to AOFS_IO_RUNS at a time, so
+// that what has to come from the image is one storage batch. Unmapped
+// blocks read back as zeros. Compressed runs can only be read;
+// filesys_write_cluster replaces them.
+static ssize_t filesys_io(FileSystem *fs, Metadata *m, char *buf, size_t len, off_t pos, int write) {
+	size_t blockSize = fs->sb.blockSize;
+	CacheRun runs[AOFS_IO_RUNS];
+	int count = 0;
+	size_t done = 0;
+
+	// A small file's room holds any range the caller passes
+	if(len > 0 && (m->flags & AOFS_INODE_INLINE)) {
+		if(write)
+			memcpy(m->data + pos, buf, len);
+		else
+			memcpy(buf, m->data + pos, len);
+		return len;
+	}
+	if(m->flags & AOFS_INODE_TAIL) {
+		off_t at = tail_offset(&fs->sb, m) + pos;
+		return write ? cache_write(&fs->cache, buf, len, at) : cache_read(&fs->cache, buf, len, at);
+	}
+
+	while(done < len) {
+		unsigned int lblock = (pos + done) / blockSize;
+		size_t within = (pos + done) % blockSize;
+		unsigned int run;
+		unsigned int pblock = extent_map(m, lblock, &run);
+		size_t chunk = (size_t) run * blockSize - within;
+		if(run == UINT32_MAX || chunk > len - done)
+			chunk = len - done;
+
+		ssize_t res = chunk;
+		const Extent *e = pblock != 0 ? extent_at(m, lblock) : NULL;
+		if(pblock == 0) {
+			if(write)
+				return -EIO;
+			memset(buf + done, 0, chunk);
+		}
+		else if(e->flags & AOFS_EXTENT_COMPRESSED) {
+			if(write)
+				return -EIO;
+			res = filesys_read_compressed(fs, e, buf + done, chunk, (size_t) (lblock - e->logical) * blockSize + within);
+		}
+		else {
+			// The image is advised random-access; ask for readahead on big runs
+			if(!write && chunk >= AOFS_ADVISE_MIN)
+				storage_advise(&fs->storage, block_offset(&fs->sb, pblock) + within, chunk, STORAGE_ADVICE_WILLNEED);
+			runs[count].buf = buf + done;
+			runs[count].len = chunk;
+			runs[count].offset = block_offset(&fs->sb, pblock) + within;
+			if(++count == AOFS_IO_RUNS) {
+				res = write ? cache_write_runs(&fs->cache, runs, count) : cache_read_runs(&fs->cache, runs, count);
+				count = 0;
+				if(res >= 0)
+					res = chunk;
+			}
+		}
+		if(res < 0)
+			return res;
+		if(res == 0)
+			break;
+		done += res;
+	}
+	if(count > 0) {
+		ssize_t res = write ? cache_write_runs(&fs->cache, runs, count) : cache_read_runs(&fs->cache, runs, count);
+		if(res < 0)
+			return res;
+	}
+	return done;
+}
+
+// Write len zeros at image offset at
+static int filesys_zero_image(FileSystem *fs, off_t at, off_t len) {
+	static const char zeros[4096];
+	for(off_t pos = 0; pos < len; pos += sizeof(zeros)) {
+		size_t n = len - pos < (off_t) sizeof(zeros) ? (size_t) (len - pos) : sizeof(zeros);
+		ssize_t res = cache_write(&fs->cache, zeros, n, at + pos);
+		if(res < 0)
+			return res;
+	}
+	return 0;
+}
+
+// Write zeros over the mapped parts of [from, to); holes already read as
+// zeros. A compressed run is only zeroed from its start; its bytes past
+// the end of file already read as zeros. Blocks other extents also name
+// are copied first, setting *allocated.
+static int filesys_zero(FileSystem *fs, Metadata *m, off_t from, off_t to, int *allocated) {
+	size_t blockSize = fs->sb.blockSize;
+
+	if(from < to && (m->flags & AOFS_INODE_INLINE)) {
+		memset(m->data + from, 0, to - from);
+		return 0;
+	}
+	if(m->flags & AOFS_INODE_TAIL)
+		return from < to ? filesys_zero_image(fs, tail_offset(&fs->sb, m) + from, to - from) : 0;
+	if(from < to) {
+		int res = filesys_unshare(fs, m, from / blockSize, blocks_for(to, blockSize) - from / blockSize, from, to, 0, allocated);
+		if(res < 0)
+			return res;
+	}
+
+	while(from < to) {
+		unsigned int run;
+		unsigned int pblock = extent_map(m, from / blockSize, &run);
+		size_t within = from % blockSize;
+		off_t runEnd = run == UINT32_MAX ? to : from - (off_t) within + (off_t) run * (off_t) blockSize;
+		if(runEnd > to)
+			runEnd = to;
+		const Extent *e = pblock != 0 ? extent_at(m, from / blockSize) : NULL;
+		int res = 0;
+		if(e != NULL && (e->flags & AOFS_EXTENT_COMPRESSED)) {
+			if(from == (off_t) e->logical * (off_t) blockSize)
+				res = filesys_zero_image(fs, block_offset(&fs->sb, e->start), e->flags & AOFS_EXTENT_BYTES);
+		}
+		else if(pblock != 0) {
+			res = filesys_zero_image(fs, block_offset(&fs->sb, pblock) + within, runEnd - from);
+		}
+		if(res < 0)
+			return res;
+		from = runEnd;
+	}
+	return 0;
+}
+
+// Nonzero if len bytes at buf are all zero
+static int all_zero(const char *buf, size_t len) {
+	return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+// Rewrite cluster number cluster of a compressed file with the size bytes
+// of buf at offset merged in, keeping its bytes below newSize. The old
+// content is read and its blocks released, then the cluster is stored
+// compressed if that saves a block, left a hole if it is all zeros, and
+// otherwise stored as it is. Compression stops once the extent map is
+// nearly full, so the rest of a big file goes to raw runs that merge.
+static int filesys_write_cluster(FileSystem *fs, Metadata *m, unsigned int cluster, const char *buf, size_t size, off_t offset, off_t newSize, int *allocated) {
+	size_t blockSize = fs->sb.blockSize;
+	unsigned int blocks = cluster_blocks(fs);
+	size_t clusterBytes = (size_t) blocks * blockSize;
+	unsigned int first = cluster * blocks;
+	off_t base = (off_t) first * blockSize;
+	size_t keep = newSize - base < (off_t) clusterBytes ? (size_t) (newSize - base) : clusterBytes;
+	size_t old = m->fileSize <= base ? 0 : m->fileSize - base < (off_t) clusterBytes ? (size_t) (m->fileSize - base) : clusterBytes;
+
+	char *content = malloc(2 * clusterBytes);
+	if(content == NULL)
+		return -ENOMEM;
+	char *packed = content + clusterBytes;
+	ssize_t res = filesys_io(fs, m, content, old, base, 0);
+	if(res >= 0) {
+		memset(content + old, 0, clusterBytes - old);
+		if(size > 0)
+			memcpy(content + (offset - base), buf, size);
+		memset(content + keep, 0, clusterBytes - keep);
+		*allocated = 1;
+		res = filesys_unmap_range(fs, m, first, blocks);
+	}
+	if(res < 0 || all_zero(content, keep)) {
+		free(content);
+		return res;
+	}
+
+	unsigned int used = blocks_for(keep, blockSize);
+	size_t stored = 0;
+	if(m->extentCount + 2 < extent_limit(fs)) {
+		uint64_t start = stats_now();
+		stored = lz_compress(content, keep, packed, (size_t) (used - 1) * blockSize);
+		stats_end(STAT_COMPRESS, start);
+	}
+	if(stored > 0) {
+		// The compressed bytes need consecutive blocks; without them the
+		// cluster is stored as it is
+		unsigned int want = blocks_for(stored, blockSize);
+		uint32_t got;
+		uint32_t start = filesys_alloc(fs, extent_goal(fs, m, first), want, &got);
+		if(start != 0 && got < want) {
+			filesys_free(fs, start, got);
+			start = 0;
+		}
+		if(start != 0) {
+			res = extent_insert(fs, m, first, start, used, AOFS_EXTENT_COMPRESSED | stored);
+			if(res < 0)
+				filesys_free(fs, start, want);
+			if(res == 0)
+				res = filesys_update_indirect(fs, m);
+			if(res == 0)
+				res = cache_write(&fs->cache, packed, stored, block_offset(&fs->sb, start));
+			free(content);
+			return res < 0 ? res : 0;
+		}
+	}
+	res = filesys_map_range(fs, m, first, used, allocated);
+	if(res >= 0)
+		res = filesys_io(fs, m, content, (size_t) used * blockSize, base, 1);
+	free(content);
+	return res < 0 ? res : 0;
+}
+
+// Log one inode: its own record, plus the indirect block when extents past
+// the inline ones changed. Neighbouring records are left alone, since their
+// inodes may be locked by other threads.
+static int filesys_write_inode(FileSystem *fs, int index) {
+	DiskInode d;
+	Metadata *m = &fs->sb.metadata[index];
+	ssize_t res;
+
+	if(m->extentsDirty && m->indirectBlock) {
+		res = journal_log(&fs->journal, block_offset(&fs->sb, m->indirectBlock), m->extents + AOFS_INLINE_EXTENTS,
+				(m->extentCount - AOFS_INLINE_EXTENTS) * sizeof(Extent));
+		if(res < 0) {
+			TRACE_ERROR(TRACE_LOG_ERROR, index, res, 0);
+			return res;
+		}
+		m->extentsDirty = 0;
+	}
+
+	inode_encode(m, &d);
+	off_t offset = block_offset(&fs->sb, fs->sb.inodeStart) + (off_t) index * AOFS_INODE_SIZE;
+	res = journal_log(&fs->journal, offset, &d, sizeof(d));
+	if(res < 0) {
+		TRACE_ERROR(TRACE_LOG_ERROR, index, res, 0);
+		return res;
+	}
+	return 0;
+}
+
+// Fill in a decoded inode's content map: the data of an inline file, the
+// sectors of a tail, which it claims in fs->tails, or else the extents,
+// inline ones from its record and the rest from its indirect block
+static int filesys_load_content(FileSystem *fs, Metadata *m, const DiskInode *d) {
+	uint32_t storage = d->flags & ~AOFS_INODE_COMPRESS;
+	if(storage & AOFS_INODE_INLINE) {
+		if(storage != AOFS_INODE_INLINE || d->extentCount != 0 || d->fileSize > AOFS_INLINE_DATA)
+			return -EINVAL;
+		if(d->fileSize == 0)
+			return 0;
+		m->data = malloc(AOFS_INLINE_DATA);
+		if(m->data == NULL)
+			return -ENOMEM;
+		memcpy(m->data, d->data, AOFS_INLINE_DATA);
+		return 0;
+	}
+	if(storage & AOFS_INODE_TAIL) {
+		if(storage != AOFS_INODE_TAIL || d->extentCount != 0 || d->tailBlock < fs->sb.dataStart
+				|| d->tailBlock >= fs->sb.totalNumBlocks || d->fileSize > (uint64_t) d->tailSectors * AOFS_SECTOR_SIZE)
+			return -EINVAL;
+		int res = tail_take(&fs->tails, d->tailBlock, d->tailSector, d->tailSectors);
+		return res == -ENOMEM ? res : res < 0 ? -EINVAL : 0;
+	}
+	if(storage != 0)
+		return -EINVAL;
+	if(d->extentCount == 0)
+		return 0;
+	if(d->extentCount > extent_limit(fs) || (d->extentCount > AOFS_INLINE_EXTENTS && d->indirectBlock == 0))
+		return -EINVAL;
+	m->extents = malloc(d->extentCount * sizeof(Extent));
+	if(m->extents == NULL)
+		return -ENOMEM;
+	m->extentCapacity = d->extentCount;
+	m->extentCount = d->extentCount;
+	for(unsigned int i = 0; i < d->extentCount && i < AOFS_INLINE_EXTENTS; i++) {
+		m->extents[i] = d->extents[i];
+	}
+	if(d->extentCount > AOFS_INLINE_EXTENTS) {
+		size_t bytes = (d->extentCount - AOFS_INLINE_EXTENTS) * sizeof(Extent);
+		ssize_t res = storage_read(&fs->storage, m->extents + AOFS_INLINE_EXTENTS, bytes, block_offset(&fs->sb, d->indirectBlock));
+		if(res != (ssize_t) bytes)
+			return res < 0 ? res : -EIO;
+	}
+	for(unsigned int i = 0; i < m->extentCount; i++) {
+		const Extent *e = &m->extents[i];
+		size_t stored = e->flags & AOFS_EXTENT_BYTES;
+		if(e->flags && (e->flags != (AOFS_EXTENT_COMPRESSED | stored) || stored == 0 || stored > (size_t) e->length * fs->sb.blockSize))
+			return -EINVAL;
+	}
+	return 0;
+}
+
+// Count the references to every block more than one extent names, which
+// only raw extents can
+static int filesys_count_shared(FileSystem *fs) {
+	Superblock *sb = &fs->sb;
+	Bitmap seen;
+	if(bitmap_init(&seen, sb->totalNumBlocks) < 0)
+		return -ENOMEM;
+	int res = 0;
+	for(unsigned int i = 0; i < sb->inodeCount && res == 0; i++) {
+		const Metadata *m = &sb->metadata[i];
+		for(unsigned int x = 0; x < m->extentCount && res == 0; x++) {
+			const Extent *e = &m->extents[x];
+			if(e->flags)
+				continue;
+			if(e->start < sb->dataStart || e->length > sb->totalNumBlocks - e->start) {
+				res = -EINVAL;
+				break;
+			}
+			for(uint32_t b = e->start; b < e->start + e->length && res == 0; b++) {
+				if(bitmap_test(&seen, b))
+					res = dedup_ref(&fs->shared, b);
+				else
+					bitmap_set_run(&seen, b, 1);
+			}
+		}
+	}
+	bitmap_destroy(&seen);
+	return res;
+}
+
+// Mount an existing image: one read for the superblock, a replay of the
+// journal, then one read for the bitmap and inode table behind it.
+static int filesys_load(FileSystem *fileSystem) {
+	Superblock *sb = &fileSystem->sb;
+	DiskSuperblock d;
+
+	if(storage_read(&fileSystem->storage, &d, sizeof(d), 0) != sizeof(d) || d.magic != AOFS_MAGIC) {
+		printf("filesys_load: FS_FILE is not an AOFS image, remove it to create a new one\n");
+		return -EINVAL;
+	}
+	if(format_validate(&d, fileSystem->storage.size) < 0)
+		return -EINVAL;
+	sb->magicNumber = d.magic;
+	sb->version = d.version;
+	sb->totalNumBlocks = d.totalNumBlocks;
+	sb->blockSize = d.blockSize;
+	sb->inodeCount = d.inodeCount;
+	sb->bitmapStart = d.bitmapStart;
+	sb->bitmapBlocks = d.bitmapBlocks;
+	sb->inodeStart = d.inodeStart;
+	sb->inodeBlocks = d.inodeBlocks;
+	sb->journalStart = d.journalStart;
+	sb->journalBlocks = d.journalBlocks;
+	sb->dataStart = d.dataStart;
+	sb->metadata = calloc(sb->inodeCount, sizeof(Metadata));
+	fileSystem->inodeLocks = malloc(sb->inodeCount * sizeof(pthread_rwlock_t));
+	if(sb->metadata == NULL || fileSystem->inodeLocks == NULL)
+		return -ENOMEM;
+	for(unsigned int i = 0; i < sb->inodeCount; i++)
+		pthread_rwlock_init(&fileSystem->inodeLocks[i], NULL);
+	pthread_mutex_init(&fileSystem->namespaceLock, NULL);
+	pthread_mutex_init(&fileSystem->allocLock, NULL);
+	if(tail_init(&fileSystem->tails, sb->blockSize) < 0 || dedup_init(&fileSystem->shared) < 0)
+		return -ENOMEM;
+
+	// Bring the bitmap, inode table and indirect blocks up to the last commit
+	ssize_t res = journal_open(&fileSystem->journal, &fileSystem->storage, &d);
+	if(res < 0) {
+		printf("filesys_load: unable to replay the journal of FS_FILE\n");
+		return res;
+	}
+
+	size_t tableBytes = (size_t) (sb->journalStart - sb->bitmapStart) * sb->blockSize;
+	char *table = malloc(tableBytes);
+	if(table == NULL)
+		return -ENOMEM;
+	res = storage_read(&fileSystem->storage, table, tableBytes, block_offset(sb, sb->bitmapStart));
+	if(res != (ssize_t) tableBytes) {
+		printf("filesys_load: unable to read metadata blocks of FS_FILE\n");
+		free(table);
+		return res < 0 ? res : -EIO;
+	}
+	if(bitmap_init(&sb->BitMap, sb->totalNumBlocks) < 0) {
+		free(table);
+		return -ENOMEM;
+	}
+	memcpy(sb->BitMap.words, table, bitmap_bytes(&sb->BitMap));
+	bitmap_recount(&sb->BitMap);
+	const DiskInode *inodes = (const DiskInode *) (table + (size_t) (sb->inodeStart - sb->bitmapStart) * sb->blockSize);
+	sb->freeInodes = 0;
+	sb->inodeCursor = AOFS_ROOT_INODE + 1;
+	for(unsigned int i = 0; i < sb->inodeCount; i++) {
+		inode_decode(&inodes[i], &sb->metadata[i]);
+		if(i > AOFS_ROOT_INODE && sb->metadata[i].mode == 0)
+			sb->freeInodes++;
+		res = filesys_load_content(fileSystem, &sb->metadata[i], &inodes[i]);
+		if(res < 0) {
+			printf("filesys_load: bad content map in inode %u\n", i);
+			free(table);
+			return res;
+		}
+	}
+	free(table);
+	res = filesys_count_shared(fileSystem);
+	if(res < 0) {
+		printf("filesys_load: bad extent in the content maps\n");
+		return res;
+	}
+	// Everything above read the image directly; from here on metadata and
+	// data blocks go through the cache, metadata by way of the journal
+	res = cache_init(&fileSystem->cache, &fileSystem->storage, sb->blockSize, fileSystem->cacheBytes);
+	if(res < 0)
+		return res;
+	journal_start(&fileSystem->journal, &fileSystem->cache, fileSystem->commitInterval, filesys_discard, fileSystem);
+	return 0;
+}
+
+// Index values of directories carry this bit, so a path walk can tell them
+// from files without locking anything
+#define DENTRY_DIR 0x80000000u
+
+// Read every directory and enter its entries in the index. Each entry must
+// name an in-use inode of its type that no other entry names.
+static int filesys_build_index(FileSystem *fs) {
+	Superblock *sb = &fs->sb;
+	int res = nameindex_init(&fs->index, sb->inodeCount);
+	if(res < 0)
+		return res;
+	if(!S_ISDIR(sb->metadata[AOFS_ROOT_INODE].mode)) {
+		printf("filesys_build_index: no root directory\n");
+		return -EINVAL;
+	}
+
+	char *content = NULL;
+	size_t contentSize = 0;
+	for(unsigned int i = AOFS_ROOT_INODE; i < sb->inodeCount && res == 0; i++) {
+		Metadata *m = &sb->metadata[i];
+		if(!S_ISDIR(m->mode))
+			continue;
+		if((size_t) m->fileSize > contentSize) {
+			char *grown = realloc(content, m->fileSize);
+			if(grown == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+			content = grown;
+			contentSize = m->fileSize;
+		}
+		m->dir = malloc(sizeof(Directory));
+		if(m->dir == NULL) {
+			res = -ENOMEM;
+			break;
+		}
+		dir_init(m->dir);
+		ssize_t n = filesys_io(fs, m, content, m->fileSize, 0, 0);
+		if(n != m->fileSize)
+			res = n < 0 ? n : -EIO;
+		else
+			res = dir_load(m->dir, &fs->dirPool, content, m->fileSize);
+		if(res < 0)
+			printf("filesys_build_index: bad directory in inode %u\n", i);
+	}
+	free(content);
+
+	for(unsigned int i = AOFS_ROOT_INODE; i < sb->inodeCount && res == 0; i++) {
+		Directory *d = sb->metadata[i].dir;
+		if(d == NULL)
+			continue;
+		uint32_t offset = 0;
+		for(const DiskDirent *e; res == 0 && (e = dir_next(d, &offset)) != NULL; offset += e->recLen) {
+			Metadata *c = e->inode < sb->inodeCount ? &sb->metadata[e->inode] : NULL;
+			if(c == NULL || e->inode == AOFS_ROOT_INODE || c->mode == 0 || c->name != NULL
+					|| (e->type == AOFS_DIRENT_DIR) != (S_ISDIR(c->mode) != 0)) {
+				printf("filesys_build_index: bad entry %s in inode %u\n", e->name, i);
+				res = -EINVAL;
+				break;
+			}
+			c->parent = i;
+			c->direntOffset = offset;
+			c->name = e->name;
+			res = nameindex_insert(&fs->index, i, e->name, e->inode | (c->dir ? DENTRY_DIR : 0));
+			if(res < 0)
+				printf("filesys_build_index: duplicate or unindexable entry %s in inode %u\n", e->name, i);
+		}
+	}
+	return res;
+}
+
+// Inode of name in directory parent, or -1. Sets *isDir if given.
+static int filesys_find_entry(FileSystem *fs, unsigned int parent, const char *name, int *isDir) {
+	uint64_t start = stats_now();
+	uint32_t value;
+	int index = -1;
+
+	if(nameindex_lookup(&fs->index, parent, name, &value) == 0) {
+		index = value & ~DENTRY_DIR;
+		if(isDir != NULL)
+			*isDir = (value & DENTRY_DIR) != 0;
+	}
+	stats_end(STAT_NAME_INDEX, start);
+	TRACE_DEBUG(TRACE_LOOKUP, index, 0, 0);
+	return index;
+}
+
+// Split path into the directory holding its last component and that
+// component, one index probe per directory on the way. "/" gives parent 0
+// and an empty name.
+static int filesys_walk(FileSystem *fs, const char *path, unsigned int *parent, char *name) {
+	unsigned int dir = AOFS_ROOT_INODE;
+	const char *p = path;
+
+	name[0] = '\0';
+	for(;;) {
+		while(*p == '/')
+			p++;
+		if(*p == '\0')
+			break;
+		const char *end = strchr(p, '/');
+		size_t len = end ? (size_t) (end - p) : strlen(p);
+		if(len >= AOFS_NAME_LEN)
+			return -ENAMETOOLONG;
+		// Everything before the last component must be a directory
+		if(name[0] != '\0') {
+			int isDir;
+			int index = filesys_find_entry(fs, dir, name, &isDir);
+			if(index == -1)
+				return -ENOENT;
+			if(!isDir)
+				return -ENOTDIR;
+			dir = index;
+		}
+		memcpy(name, p, len);
+		name[len] = '\0';
+		p += len;
+	}
+	*parent = name[0] != '\0' ? dir : 0;
+	return 0;
+}
+
+// Inode path names, or a negative errno
+static int filesys_find(FileSystem *fs, const char *path) {
+	unsigned int parent;
+	char name[AOFS_NAME_LEN];
+
+	int res = filesys_walk(fs, path, &parent, name);
+	if(res < 0)
+		return res;
+	if(parent == 0)
+		return AOFS_ROOT_INODE;
+	res = filesys_find_entry(fs, parent, name, NULL);
+	return res == -1 ? -ENOENT : res;
+}
+
+// Lock the inode name in directory parent names, shared or exclusive. The
+// entry is checked again under the lock, since an unlink may have freed
+// the inode between the lookup and the lock. Parent 0 stands for the root
+// itself. Returns the inode index or a negative errno.
+static int filesys_lock_entry(FileSystem *fs, unsigned int parent, const char *name, int exclusive) {
+	for(;;) {
+		int index = parent ? filesys_find_entry(fs, parent, name, NULL) : AOFS_ROOT_INODE;
+		if(index == -1)
+			return -ENOENT;
+		if(exclusive)
+			pthread_rwlock_wrlock(&fs->inodeLocks[index]);
+		else
+			pthread_rwlock_rdlock(&fs->inodeLocks[index]);
+		const Metadata *m = &fs->sb.metadata[index];
+		if(parent == 0 || (m->parent == parent && m->name != NULL && strcmp(m->name, name) == 0))
+			return index;
+		pthread_rwlock_unlock(&fs->inodeLocks[index]);
+	}
+}
+
+static int filesys_lock_path(FileSystem *fs, const char *path, int exclusive) {
+	unsigned int parent;
+	char name[AOFS_NAME_LEN];
+
+	int res = filesys_walk(fs, path, &parent, name);
+	if(res < 0)
+		return res;
+	return filesys_lock_entry(fs, parent, name, exclusive);
+}
+
+// Lock an inode of the inode API. With the caller holding a reference it
+// cannot have been freed; a free one means a stale number.
+static int filesys_lock_ino(FileSystem *fs, unsigned int ino, int exclusive) {
+	if(ino < AOFS_ROOT_INODE || ino >= fs->sb.inodeCount)
+		return -ESTALE;
+	if(exclusive)
+		pthread_rwlock_wrlock(&fs->inodeLocks[ino]);
+	else
+		pthread_rwlock_rdlock(&fs->inodeLocks[ino]);
+	if(fs->sb.metadata[ino].mode == 0) {
+		pthread_rwlock_unlock(&fs->inodeLocks[ino]);
+		return -ESTALE;
+	}
+	return ino;
+}
+
+static void filesys_unlock_file(FileSystem *fs, int index) {
+	pthread_rwlock_unlock(&fs->inodeLocks[index]);
+}
+
+// Image offset of sector s of a directory's content
+static off_t filesys_dir_sector(FileSystem *fs, const Metadata *m, uint32_t s) {
+	off_t pos = (off_t) s * AOFS_SECTOR_SIZE;
+	unsigned int run;
+	unsigned int pblock = extent_map(m, pos / fs->sb.blockSize, &run);
+	return pblock ? block_offset(&fs->sb, pblock) + pos % fs->sb.blockSize : 0;
+}
+
+// Log sector s of directory index
+static int filesys_write_dir_sector(FileSystem *fs, int index, uint32_t s) {
+	Metadata *m = &fs->sb.metadata[index];
+	off_t offset = filesys_dir_sector(fs, m, s);
+	int res = offset ? journal_log(&fs->journal, offset, m->dir->sectors[s], AOFS_SECTOR_SIZE) : -EIO;
+	if(res < 0)
+		TRACE_ERROR(TRACE_LOG_ERROR, index, res, s);
+	return res;
+}
+
+// Add an entry to directory parent, growing it by a sector when it is
+// full, and log the sector. The caller holds parent exclusively and logs
+// its inode.
+static int filesys_dir_add(FileSystem *fs, int parent, const char *name, int index, uint8_t type, uint32_t *offset) {
+	Metadata *dm = &fs->sb.metadata[parent];
+	uint32_t sectors = dm->dir->count;
+
+	int res = dir_add(dm->dir, &fs->dirPool, name, index, type, offset);
+	if(res < 0)
+		return res;
+	if(dm->dir->count > sectors) {
+		off_t size = (off_t) dm->dir->count * AOFS_SECTOR_SIZE;
+		int allocated = 0;
+		res = filesys_map_range(fs, dm, (size - 1) / fs->sb.blockSize, 1, &allocated);
+		if(allocated)
+			filesys_write_bitmap(fs);
+		if(res < 0) {
+			TRACE_ERROR(TRACE_NO_SPACE, parent, size, size);
+			dir_drop_last(dm->dir, &fs->dirPool);
+			return res;
+		}
+		dm->fileSize = size;
+	}
+	return filesys_write_dir_sector(fs, parent, *offset / AOFS_SECTOR_SIZE);
+}
+
+// Create an image, or overwrite an existing one, with the given geometry
+int filesys_format(const char *image, unsigned int blocks, unsigned int blockSize, unsigned int inodes) {
+	DiskSuperblock d;
+	Storage st;
+
+	int res = format_layout(&d, blocks, blockSize, inodes, 0);
+	if(res == 0)
+		res = storage_open(&st, image, 0);
+	if(res == 0) {
+		res = format_write(&st, &d);
+		storage_close(&st);
+	}
+	if(res < 0)
+		printf("filesys_format: unable to format %s\n", image);
+	return res;
+}
+
+static int filesys_reclaim_orphans(FileSystem *fs);
+
+// Stop the workers and free everything a mount set up. With commit, the
+// journal is committed and the cache written back first; without, the
+// mount failed partway and the next one replays the log instead. Returns
+// the first error of the commit or the write-back.
+static int filesys_release_mount(FileSystem *fs, int commit) {
+	int res = 0;
+	readahead_destroy(&fs->readahead);
+	if(commit) {
+		res = journal_close(&fs->journal);
+		int flushed = cache_flush(&fs->cache);
+		if(res == 0)
+			res = flushed;
+	}
+	else {
+		journal_destroy(&fs->journal);
+	}
+	cache_destroy(&fs->cache);
+	nameindex_destroy(&fs->index);
+	bitmap_destroy(&fs->sb.BitMap);
+	for(unsigned int i = 0; i < fs->sb.inodeCount; i++) {
+		if(fs->sb.metadata[i].dir != NULL) {
+			dir_destroy(fs->sb.metadata[i].dir);
+			free(fs->sb.metadata[i].dir);
+		}
+		free(fs->sb.metadata[i].extents);
+		free(fs->sb.metadata[i].data);
+		pthread_rwlock_destroy(&fs->inodeLocks[i]);
+	}
+	dir_pool_destroy(&fs->dirPool);
+	tail_destroy(&fs->tails);
+	dedup_destroy(&fs->shared);
+	free(fs->sb.metadata);
+	free(fs->inodeLocks);
+	fs->sb.metadata = NULL;
+	fs->inodeLocks = NULL;
+	pthread_mutex_destroy(&fs->namespaceLock);
+	pthread_mutex_destroy(&fs->allocLock);
+	storage_close(&fs->storage);
+	return res;
+}
+
+// Readahead's fill: bring the mapped blocks of [offset, offset + len) of
+// inode ino into the cache, up to AOFS_IO_RUNS runs per batch. A
+// compressed extent is prefetched whole, as its reads decompress it
+// whole. Small files and holes have nothing to prefetch; an inode freed
+// meanwhile is skipped.
+static void filesys_prefetch(void *ctx, unsigned int ino, off_t offset, size_t len) {
+	FileSystem *fs = ctx;
+	size_t blockSize = fs->sb.blockSize;
+	CacheSpan spans[AOFS_IO_RUNS];
+	int count = 0;
+	int index = filesys_lock_ino(fs, ino, 0);
+	if(index < 0)
+		return;
+
+	uint64_t start = stats_now();
+	Metadata *m = &fs->sb.metadata[index];
+	if(m->dir == NULL && !(m->flags & (AOFS_INODE_INLINE | AOFS_INODE_TAIL)) && offset < m->fileSize) {
+		if((off_t) len > m->fileSize - offset)
+			len = m->fileSize - offset;
+		unsigned int lblock = offset / blockSize;
+		unsigned int last = (offset + len - 1) / blockSize;
+		while(lblock <= last) {
+			unsigned int run;
+			unsigned int pblock = extent_map(m, lblock, &run);
+			if(pblock == 0) {
+				if(run > last - lblock)
+					break;
+				lblock += run;
+				continue;
+			}
+			const Extent *e = extent_at(m, lblock);
+			if(e->flags & AOFS_EXTENT_COMPRESSED) {
+				spans[count].block = e->start;
+				spans[count].count = extent_blocks(fs, e);
+				lblock = e->logical + e->length;
+			}
+			else {
+				spans[count].block = pblock;
+				spans[count].count = run < last - lblock + 1 ? run : last - lblock + 1;
+				lblock += spans[count].count;
+			}
+			if(++count == AOFS_IO_RUNS) {
+				cache_prefetch(&fs->cache, spans, count);
+				count = 0;
+			}
+		}
+		if(count > 0)
+			cache_prefetch(&fs->cache, spans, count);
+	}
+	filesys_unlock_file(fs, index);
+	stats_end(STAT_READAHEAD, start);
+	TRACE_DEBUG(TRACE_READAHEAD, index, len, offset);
+}
+
+// Open and load an image. The image stays open for the whole mount, so
+// no operation ever has to open or ftruncate it again.
+int filesys_mount(FileSystem *fs, const char *image) {
+	int res = storage_open(&fs->storage, image, 0);
+	if(res < 0) {
+		printf("filesys_mount: unable to open %s\n", image);
+		return res;
+	}
+	// Before the cache, which offers its blocks to the queue
+	if(fs->batchBackend != STORAGE_PIO) {
+		res = storage_use_queue(&fs->storage, fs->batchBackend);
+		if(res < 0) {
+			printf("filesys_mount: unable to set up batched I/O\n");
+			storage_close(&fs->storage);
+			return res;
+		}
+	}
+	res = filesys_load(fs);
+	if(res < 0) {
+		storage_close(&fs->storage);
+		return res;
+	}
+	// A window past a quarter of the cache would evict itself before use
+	size_t window = fs->readaheadBytes;
+	if(fs->cacheBytes > 0 && window > fs->cacheBytes / 4)
+		window = fs->cacheBytes / 4;
+	readahead_init(&fs->readahead, window, filesys_prefetch, fs);
+	res = filesys_build_index(fs);
+	if(res < 0)
+		printf("filesys_mount: unable to index the files in %s\n", image);
+	if(res == 0)
+		res = filesys_reclaim_orphans(fs);
+	// Map only once the image has its final size
+	if(res == 0 && fs->useMmap) {
+		res = storage_use_mmap(&fs->storage, fs->syncPolicy, fs->syncInterval);
+		if(res < 0)
+			printf("filesys_mount: unable to map %s\n", image);
+	}
+	// Everything filesys_load set up goes too, uncommitted
+	if(res < 0)
+		filesys_release_mount(fs, 0);
+	return res;
+}
+
+// Commit the journal, write everything back and release the mount
+int filesys_unmount(FileSystem *fs) {
+	return filesys_release_mount(fs, 1);
+}
+
+// Fill st from an inode the caller holds at least shared
+static void filesys_fill_stat(FileSystem *fs, int index, struct stat *st) {
+	const Metadata *m = &fs->sb.metadata[index];
+	memset(st, 0, sizeof(*st));
+	st->st_ino = index;
+	st->st_mode = m->mode;
+	st->st_nlink = m->nlink;
+	st->st_size = m->fileSize;
+	st->st_blksize = fs->sb.blockSize;
+	// Storage in 512-byte units, so holes and compression show in du
+	blkcnt_t blocks = 0;
+	for(unsigned int i = 0; i < m->extentCount; i++) {
+		const Extent *e = &m->extents[i];
+		blocks += (e->flags & AOFS_EXTENT_COMPRESSED) ? blocks_for(e->flags & AOFS_EXTENT_BYTES, fs->sb.blockSize) : e->length;
+	}
+	st->st_blocks = (m->flags & AOFS_INODE_TAIL) ? m->tailSectors : blocks * (fs->sb.blockSize / 512);
+	st->st_atime = m->timeAccessed;
+	st->st_mtime = m->timeUpdated;
+}
+
+// Fill st for an inode from filesys_lock_path or filesys_lock_ino and
+// unlock it, or pass on their error. Returns the inode number.
+static int filesys_stat_locked(FileSystem *fs, int index, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	if(index < 0) {
+		TRACE_INFO(TRACE_GETATTR, -1, index, 0);
+		return index;
+	}
+	filesys_fill_stat(fs, index, st);
+	filesys_unlock_file(fs, index);
+	TRACE_INFO(TRACE_GETATTR, index, 0, 0);
+	return index;
+}
+
+// Fill st for path. Returns the inode number.
+int filesys_lookup(FileSystem *fs, const char *path, struct stat *st) {
+	return filesys_stat_locked(fs, filesys_lock_path(fs, path, 0), st);
+}
+
+int filesys_getattr_ino(FileSystem *fs, unsigned int ino, struct stat *st) {
+	return filesys_stat_locked(fs, filesys_lock_ino(fs, ino, 0), st);
+}
+
+// Fill st for name in directory parent and take a reference to its inode.
+// Returns the inode number.
+int filesys_lookup_at(FileSystem *fs, unsigned int parent, const char *name, struct stat *st) {
+	int index = -ENOENT;
+	if(strlen(name) >= AOFS_NAME_LEN)
+		index = -ENAMETOOLONG;
+	else if(parent != 0)
+		index = filesys_lock_entry(fs, parent, name, 0);
+	if(index >= 0)
+		__atomic_add_fetch(&fs->sb.metadata[index].lookups, 1, __ATOMIC_RELAXED);
+	return filesys_stat_locked(fs, index, st);
+}
+
+// Directory dir of the inode API as the parent of a new entry, under
+// namespaceLock. A removed directory takes none.
+static int filesys_check_dir(FileSystem *fs, unsigned int dir) {
+	if(dir < AOFS_ROOT_INODE || dir >= fs->sb.inodeCount || fs->sb.metadata[dir].mode == 0)
+		return -ESTALE;
+	const Metadata *m = &fs->sb.metadata[dir];
+	if(m->dir == NULL)
+		return -ENOTDIR;
+	if(dir != AOFS_ROOT_INODE && m->name == NULL)
+		return -ENOENT;
+	return 0;
+}
+
+// Create name in directory parent, a file or a directory for an S_IFDIR
+// mode. Called under namespaceLock, which it releases. Given st, it fills
+// st and takes a reference to the new inode. Returns the inode number.
+static int filesys_make(FileSystem *fs, unsigned int parent, const char *name, mode_t mode, struct stat *st) {
+	/*
+		When you create a file, you take the first free inode from the inode
+		table. Content blocks are only allocated once data is written, so
+		creating a file rewrites just the sector holding its inode, the
+		sector of the directory that gets its entry and the directory's
+		inode.
+	*/
+
+	int isDir = S_ISDIR(mode);
+	int index = -1;
+	size_t len = strlen(name);
+	int res = 0;
+
+	if(len >= AOFS_NAME_LEN)
+		res = -ENAMETOOLONG;
+	else if(len == 0 || strchr(name, '/') != NULL)
+		res = -EINVAL;
+	else if(filesys_find_entry(fs, parent, name, NULL) != -1)
+		res = -EEXIST;
+	if(res < 0) {
+		pthread_mutex_unlock(&fs->namespaceLock);
+		return res;
+	}
+
+	// Inodes 0 and 1 are never handed out; the search picks up where the
+	// last one ended
+	for(unsigned int n = 0; fs->sb.freeInodes > 0 && n < fs->sb.inodeCount; n++) {
+		unsigned int i = fs->sb.inodeCursor + n;
+		if(i >= fs->sb.inodeCount)
+			i -= fs->sb.inodeCount - AOFS_ROOT_INODE - 1;
+		if(fs->sb.metadata[i].mode == 0) {
+			index = i;
+			break;
+		}
+	}
+	if(index == -1) {
+		TRACE_ERROR(TRACE_NO_INODES, 0, 0, 0);
+		pthread_mutex_unlock(&fs->namespaceLock);
+		return -ENOSPC;
+	}
+	Directory *dir = NULL;
+	if(isDir) {
+		dir = malloc(sizeof(Directory));
+		if(dir == NULL) {
+			pthread_mutex_unlock(&fs->namespaceLock);
+			return -ENOMEM;
+		}
+		dir_init(dir);
+	}
+
+	time_t timeCreated = time(NULL);
+
+	// Anyone still holding this inode from before an unlink finds the new
+	// entry under the lock and looks again
+	Metadata *dm = &fs->sb.metadata[parent];
+	Metadata *m = &fs->sb.metadata[index];
+	pthread_rwlock_wrlock(&fs->inodeLocks[parent]);
+	pthread_rwlock_wrlock(&fs->inodeLocks[index]);
+	journal_begin(&fs->journal);
+	uint32_t offset;
+	res = filesys_dir_add(fs, parent, name, index, isDir ? AOFS_DIRENT_DIR : AOFS_DIRENT_FILE, &offset);
+	if(res == 0) {
+		memset(m, 0, sizeof(*m));
+		m->fileSize = 0;
+		m->mode = (mode & ~S_IFMT) | (isDir ? S_IFDIR : S_IFREG);
+		m->flags = isDir ? 0 : AOFS_INODE_INLINE | (fs->compress ? AOFS_INODE_COMPRESS : 0);
+		m->nlink = isDir ? 2 : 1;
+		m->timeCreated = timeCreated;
+		m->timeAccessed = timeCreated;
+		m->parent = parent;
+		m->direntOffset = offset;
+		m->name = dir_entry(dm->dir, offset)->name;
+		m->dir = dir;
+		nameindex_insert(&fs->index, parent, m->name, index | (isDir ? DENTRY_DIR : 0));
+		fs->sb.freeInodes--;
+		fs->sb.inodeCursor = (unsigned int) index + 1 < fs->sb.inodeCount ? index + 1 : AOFS_ROOT_INODE + 1;
+
+		// A subdirectory's ".." links its parent
+		if(isDir)
+			dm->nlink++;
+		dm->timeUpdated = timeCreated;
+		res = filesys_write_inode(fs, index);
+		if(res == 0)
+			res = filesys_write_inode(fs, parent);
+		if(st != NULL) {
+			filesys_fill_stat(fs, index, st);
+			m->lookups = 1;
+		}
+	}
+	else {
+		free(dir);
+	}
+	pthread_rwlock_unlock(&fs->inodeLocks[index]);
+	pthread_rwlock_unlock(&fs->inodeLocks[parent]);
+	pthread_mutex_unlock(&fs->namespaceLock);
+	int committed = journal_end(&fs->journal);
+	if(res == 0)
+		res = committed;
+	TRACE_INFO(isDir ? TRACE_MKDIR : TRACE_CREATE, index, res, 0);
+	return res < 0 ? res : index;
+}
+
+static int filesys_make_path(FileSystem *fs, const char *path, mode_t mode) {
+	unsigned int parent;
+	char name[AOFS_NAME_LEN];
+
+	// The walk happens under the lock, so the directory cannot go away
+	pthread_mutex_lock(&fs->namespaceLock);
+	int res = filesys_walk(fs, path, &parent, name);
+	if(res == 0 && parent == 0)
+		res = -EEXIST;
+	if(res < 0) {
+		pthread_mutex_unlock(&fs->namespaceLock);
+		return res;
+	}
+	res = filesys_make(fs, parent, name, mode, NULL);
+	return res < 0 ? res : 0;
+}
+
+static int filesys_make_at(FileSystem *fs, unsigned int parent, const char *name, mode_t mode, struct stat *st) {
+	pthread_mutex_lock(&fs->namespaceLock);
+	int res = filesys_check_dir(fs, parent);
+	if(res < 0) {
+		pthread_mutex_unlock(&fs->namespaceLock);
+		return res;
+	}
+	return filesys_make(fs, parent, name, mode, st);
+}
+
+int filesys_create(FileSystem *fs, const char *path, mode_t mode) {
+	return filesys_make_path(fs, path, (mode & ~S_IFMT) | S_IFREG);
+}
+
+int filesys_mkdir(FileSystem *fs, const char *path, mode_t mode) {
+	return filesys_make_path(fs, path, (mode & ~S_IFMT) | S_IFDIR);
+}
+
+int filesys_create_at(FileSystem *fs, unsigned int parent, const char *name, mode_t mode, struct stat *st) {
+	return filesys_make_at(fs, parent, name, (mode & ~S_IFMT) | S_IFREG, st);
+}
+
+int filesys_mkdir_at(FileSystem *fs, unsigned int parent, const char *name, mode_t mode, struct stat *st) {
+	return filesys_make_at(fs, parent, name, (mode & ~S_IFMT) | S_IFDIR, st);
+}
+
+// Note the access to a locked inode and unlock it. *unchanged, if given,
+// is set when the content has not been written or truncated since the
+// previous open, so whatever a caller cached of it then is still good.
+static int filesys_open_locked(FileSystem *fs, int index, int *unchanged) {
+	if(index < 0) {
+		TRACE_INFO(TRACE_OPEN, -1, index, 0);
+		return index;
+	}
+	Metadata *m = &fs->sb.metadata[index];
+	m->timeAccessed = time(NULL);
+	if(unchanged != NULL)
+		*unchanged = m->openedChanges == m->changes;
+	m->openedChanges = m->changes;
+	filesys_unlock_file(fs, index);
+	TRACE_INFO(TRACE_OPEN, index, 0, 0);
+	return 0;
+}
+
+// Check that path exists and note the access, see filesys_open_locked
+int filesys_open(FileSystem *fs, const char *path, int *unchanged) {
+	return filesys_open_locked(fs, filesys_lock_path(fs, path, 1), unchanged);
+}
+
+int filesys_open_ino(FileSystem *fs, unsigned int ino, int *unchanged) {
+	return filesys_open_locked(fs, filesys_lock_ino(fs, ino, 1), unchanged);
+}
+
+// Read from an inode locked shared, and unlock it. With a stream, a
+// sequential reader also has the next part of the file prefetched.
+static ssize_t filesys_read_locked(FileSystem *fs, int index, ReadStream *rs, char *buf, size_t size, off_t offset) {
+	ssize_t res;
+
+	if(index < 0) {
+		TRACE_INFO(TRACE_READ, -1, index, offset);
+		return index;
+	}
+
+	time_t timeAccessed = time(NULL);
+	Metadata *m = &fs->sb.metadata[index];
+	if(m->dir != NULL) {
+		filesys_unlock_file(fs, index);
+		return -EISDIR;
+	}
+
+	// Short read at end of file
+	if(offset >= m->fileSize) {
+		filesys_unlock_file(fs, index);
+		TRACE_INFO(TRACE_READ, index, 0, offset);
+		return 0;
+	}
+	if((off_t) size > m->fileSize - offset)
+		size = m->fileSize - offset;
+
+	// Queued first, so the workers fetch ahead while this read waits
+	off_t aheadStart;
+	size_t ahead = rs != NULL ? readahead_note(&fs->readahead, rs, offset, size, &aheadStart) : 0;
+	if(ahead > 0 && aheadStart < m->fileSize)
+		readahead_queue(&fs->readahead, index, aheadStart, ahead);
+
+	// Only the blocks covering [offset, offset + size), one read per extent
+	res = filesys_io(fs, m, buf, size, offset, 0);
+	if(res >= 0) {
+		// Concurrent readers may all store it; any of their times will do
+		__atomic_store_n(&m->timeAccessed, timeAccessed, __ATOMIC_RELAXED);
+	}
+	filesys_unlock_file(fs, index);
+	if(res < 0)
+		TRACE_ERROR(TRACE_IO_ERROR, index, res, 0);
+	TRACE_INFO(TRACE_READ, index, res, offset);
+	return res;
+}
+
+// Readers share the inode, so reads of one file run in parallel too
+ssize_t filesys_read(FileSystem *fs, const char *path, char *buf, size_t size, off_t offset) {
+	return filesys_read_locked(fs, filesys_lock_path(fs, path, 0), NULL, buf, size, offset);
+}
+
+ssize_t filesys_read_ino(FileSystem *fs, unsigned int ino, char *buf, size_t size, off_t offset) {
+	return filesys_read_locked(fs, filesys_lock_ino(fs, ino, 0), NULL, buf, size, offset);
+}
+
+// Read through an open file's stream, see filesys_read_locked. A zeroed
+// ReadStream starts one; concurrent reads may share it.
+ssize_t filesys_read_stream(FileSystem *fs, const char *path, ReadStream *rs, char *buf, size_t size, off_t offset) {
+	return filesys_read_locked(fs, filesys_lock_path(fs, path, 0), rs, buf, size, offset);
+}
+
+ssize_t filesys_read_stream_ino(FileSystem *fs, unsigned int ino, ReadStream *rs, char *buf, size_t size, off_t offset) {
+	return filesys_read_locked(fs, filesys_lock_ino(fs, ino, 0), rs, buf, size, offset);
+}
+
+// Record a write of size bytes ending at end
+static ssize_t filesys_write_done(FileSystem *fs, int index, off_t end, size_t size, int allocated) {
+	Metadata *m = &fs->sb.metadata[index];
+	time_t timeUpdated = time(NULL);
+	if(end > m->fileSize)
+		m->fileSize = end;
+	m->timeUpdated = timeUpdated;
+	m->timeAccessed = timeUpdated;
+	m->changes++;
+
+	if(allocated) {
+		filesys_write_bitmap(fs);
+	}
+	int res = filesys_write_inode(fs, index);
+	if(res < 0)
+		return res;
+	return size;
+}
+
+// Drop all content of a file and leave it empty and inline
+static void filesys_empty_file(FileSystem *fs, Metadata *m) {
+	if(m->flags & AOFS_INODE_TAIL)
+		filesys_tail_free(fs, m->tailBlock, m->tailSector, m->tailSectors);
+	else if(!(m->flags & AOFS_INODE_INLINE))
+		filesys_shrink(fs, m, 0);
+	free(m->data);
+	m->data = NULL;
+	m->flags = (m->flags & AOFS_INODE_COMPRESS) | AOFS_INODE_INLINE;
+	m->tailBlock = 0;
+	m->tailSector = 0;
+	m->tailSectors = 0;
+}
+
+// Make room for end bytes in a file kept in its inode or a tail: as is if
+// they fit, else in a tail of enough sectors, or in a block of its own
+// past AOFS_TAIL_LIMIT. The content so far moves over, zero padded. The
+// caller holds the inode exclusively and writes the bitmap if *moved.
+static int filesys_grow_small(FileSystem *fs, Metadata *m, off_t end, int *moved) {
+	size_t blockSize = fs->sb.blockSize;
+	if((m->flags & AOFS_INODE_INLINE) && end <= AOFS_INLINE_DATA) {
+		if(m->data == NULL && (m->data = calloc(1, AOFS_INLINE_DATA)) == NULL)
+			return -ENOMEM;
+		return 0;
+	}
+	if((m->flags & AOFS_INODE_TAIL) && end <= (off_t) m->tailSectors * AOFS_SECTOR_SIZE)
+		return 0;
+
+	size_t room = end <= (off_t) AOFS_TAIL_LIMIT(blockSize) ? blocks_for(end, AOFS_SECTOR_SIZE) * AOFS_SECTOR_SIZE : blockSize;
+	char *content = calloc(1, room);
+	if(content == NULL)
+		return -ENOMEM;
+	ssize_t res = filesys_io(fs, m, content, m->fileSize, 0, 0);
+	Metadata old = *m;
+	if(res >= 0 && room < blockSize) {
+		uint32_t block;
+		unsigned int sector;
+		res = filesys_tail_alloc(fs, room / AOFS_SECTOR_SIZE, old.tailBlock, &block, &sector);
+		if(res == 0) {
+			m->flags = (m->flags & ~AOFS_INODE_SMALL) | AOFS_INODE_TAIL;
+			m->tailBlock = block;
+			m->tailSector = sector;
+			m->tailSectors = room / AOFS_SECTOR_SIZE;
+		}
+	}
+	else if(res >= 0) {
+		m->flags &= ~AOFS_INODE_SMALL;
+		res = filesys_map_range(fs, m, 0, 1, moved);
+		if(res < 0)
+			m->flags = old.flags;
+	}
+	if(res < 0) {
+		free(content);
+		return res;
+	}
+	res = filesys_io(fs, m, content, room, 0, 1);
+	free(content);
+
+	// The new place is the file's even if filling it failed; let go of the
+	// old one
+	*moved = 1;
+	m->data = NULL;
+	if(old.flags & AOFS_INODE_TAIL)
+		filesys_tail_free(fs, old.tailBlock, old.tailSector, old.tailSectors);
+	else
+		free(old.data);
+	if(!(m->flags & AOFS_INODE_TAIL)) {
+		m->tailBlock = 0;
+		m->tailSector = 0;
+		m->tailSectors = 0;
+	}
+	return res < 0 ? res : 0;
+}
+
+// Look up the full blocks of a write of [offset, end) by content. One
+// whose bytes some block already holds is shared: the file's extent names
+// that block, which gains a reference, and shared[i] is set for file
+// block i past the first of the write. prints[i] is the fingerprint of
+// each other full block, entered once it is written, and 0 for the rest.
+static int filesys_dedup(FileSystem *fs, Metadata *m, const char *buf, off_t offset, off_t end, uint64_t *prints, char *shared, int *allocated) {
+	size_t blockSize = fs->sb.blockSize;
+	unsigned int first = offset / blockSize;
+	unsigned int count = (end - 1) / blockSize - first + 1;
+	memset(prints, 0, count * sizeof(uint64_t));
+	memset(shared, 0, count);
+	char *stored = malloc(blockSize);
+	if(stored == NULL)
+		return 0;
+
+	int res = 0;
+	for(unsigned int i = 0; i < count && res == 0; i++) {
+		off_t at = (off_t) (first + i) * blockSize;
+		if(at < offset || at + (off_t) blockSize > end)
+			continue;
+		const char *data = buf + (at - offset);
+		uint64_t start = stats_now();
+		prints[i] = dedup_print(data, blockSize);
+		if(prints[i] == 0)
+			prints[i] = 1;
+		pthread_mutex_lock(&fs->allocLock);
+		uint32_t block = dedup_find(&fs->shared, prints[i]);
+		pthread_mutex_unlock(&fs->allocLock);
+		// Sharing adds up to two extents, which must leave room for the
+		// rest of the file
+		unsigned int run;
+		if(block != 0 && block != extent_map(m, first + i, &run) && m->extentCount + 2 < extent_limit(fs)
+				&& cache_read(&fs->cache, stored, blockSize, block_offset(&fs->sb, block)) == (ssize_t) blockSize
+				&& memcmp(stored, data, blockSize) == 0) {
+			// A block changed after the read has lost its fingerprint
+			pthread_mutex_lock(&fs->allocLock);
+			shared[i] = dedup_find(&fs->shared, prints[i]) == block && dedup_ref(&fs->shared, block) == 0;
+			if(shared[i])
+				fs->shared.hits++;
+			pthread_mutex_unlock(&fs->allocLock);
+		}
+		stats_end(STAT_DEDUP, start);
+		if(!shared[i])
+			continue;
+		*allocated = 1;
+		res = filesys_unmap_range(fs, m, first + i, 1);
+		if(res == 0)
+			res = extent_insert(fs, m, first + i, block, 1, 0);
+		if(res < 0) {
+			shared[i] = 0;
+			filesys_free(fs, block, 1);
+		}
+	}
+	free(stored);
+	if(res == 0)
+		res = filesys_update_indirect(fs, m);
+	return res;
+}
+
+// Write into a file whose inode the caller holds exclusively
+static ssize_t filesys_write_file(FileSystem *fs, int index, const char *buf, size_t size, off_t offset)
+{
+	ssize_t res;
+	int allocated = 0;
+	Metadata *m = &fs->sb.metadata[index];
+	size_t blockSize = fs->sb.blockSize;
+	off_t end = offset + size;
+	if(end / blockSize >= UINT32_MAX)
+		return -EFBIG;
+
+	// A small file stays small while it can; bytes past its end are zero
+	if(m->flags & AOFS_INODE_SMALL) {
+		res = filesys_grow_small(fs, m, end, &allocated);
+		if(res < 0) {
+			TRACE_ERROR(TRACE_NO_SPACE, index, 0, end);
+			if(allocated)
+				filesys_write_bitmap(fs);
+			return res;
+		}
+	}
+	if(m->flags & AOFS_INODE_SMALL) {
+		res = filesys_io(fs, m, (char *) buf, size, offset, 1);
+		if(res < 0) {
+			TRACE_ERROR(TRACE_IO_ERROR, index, res, 0);
+			return res;
+		}
+		return filesys_write_done(fs, index, end, size, allocated);
+	}
+
+	// A compressed file is rewritten a cluster at a time
+	if(m->flags & AOFS_INODE_COMPRESS) {
+		size_t clusterBytes = (size_t) cluster_blocks(fs) * blockSize;
+		off_t newSize = end > m->fileSize ? end : m->fileSize;
+		res = 0;
+		for(off_t pos = offset; pos < end && res == 0; ) {
+			off_t next = (pos / clusterBytes + 1) * clusterBytes;
+			if(next > end)
+				next = end;
+			res = filesys_write_cluster(fs, m, pos / clusterBytes, buf + (pos - offset), next - pos, pos, newSize, &allocated);
+			pos = next;
+		}
+		if(res < 0) {
+			TRACE_ERROR(res == -ENOSPC ? TRACE_NO_SPACE : TRACE_IO_ERROR, index, res, offset);
+			if(allocated)
+				filesys_write_bitmap(fs);
+			return res;
+		}
+		return filesys_write_done(fs, index, end, size, allocated);
+	}
+
+	// Blocks shared with other files are copied first, then full blocks
+	// whose content is already stored share that block instead
+	unsigned int first = offset / blockSize;
+	unsigned int last = (end - 1) / blockSize;
+	unsigned int count = last - first + 1;
+	uint64_t *prints = NULL;
+	char *shared = NULL;
+	res = filesys_unshare(fs, m, first, count, offset, end, 0, &allocated);
+	if(res >= 0 && fs->dedup && size >= blockSize) {
+		prints = malloc(count * (sizeof(uint64_t) + 1));
+		if(prints != NULL) {
+			shared = (char *) (prints + count);
+			res = filesys_dedup(fs, m, buf, offset, end, prints, shared, &allocated);
+		}
+	}
+
+	// Map the rest; existing content is left alone
+	unsigned int run;
+	int firstNew = extent_map(m, first, &run) == 0;
+	int lastNew = extent_map(m, last, &run) == 0;
+	if(res >= 0)
+		res = filesys_map_range(fs, m, first, last - first + 1, &allocated);
+	if(res < 0) {
+		TRACE_ERROR(res == -ENOSPC ? TRACE_NO_SPACE : TRACE_IO_ERROR, index, first, last);
+		free(prints);
+		if(allocated)
+			filesys_write_bitmap(fs);
+		return res;
+	}
+
+	// Fresh blocks may hold stale bytes: clear what this write does not
+	// cover, and the gap between the old end of file and offset
+	if(firstNew && offset % blockSize)
+		res = filesys_zero(fs, m, offset - offset % blockSize, offset, &allocated);
+	if(res >= 0 && lastNew && end % blockSize)
+		res = filesys_zero(fs, m, end, end - end % blockSize + blockSize, &allocated);
+	if(res >= 0 && offset > m->fileSize)
+		res = filesys_zero(fs, m, m->fileSize, offset, &allocated);
+
+	// Write around the shared blocks, then let later writes find the others
+	for(off_t pos = offset; pos < end && res >= 0; ) {
+		off_t next = pos;
+		while(next < end && !(shared != NULL && shared[next / blockSize - first]))
+			next = (next / blockSize + 1) * (off_t) blockSize;
+		if(next > end)
+			next = end;
+		if(next > pos)
+			res = filesys_io(fs, m, (char *) buf + (pos - offset), next - pos, pos, 1);
+		else
+			next = pos + blockSize;
+		pos = next;
+	}
+	if(res >= 0 && prints != NULL) {
+		pthread_mutex_lock(&fs->allocLock);
+		for(unsigned int i = 0; i < count; i++) {
+			if(prints[i] != 0 && !shared[i])
+				dedup_add(&fs->shared, extent_map(m, first + i, &run), prints[i]);
+		}
+		pthread_mutex_unlock(&fs->allocLock);
+	}
+	free(prints);
+	if(res < 0) {
+		TRACE_ERROR(TRACE_IO_ERROR, index, res, 0);
+		if(allocated)
+			filesys_write_bitmap(fs);
+		return res;
+	}
+	return filesys_write_done(fs, index, end, size, allocated);
+}
+
+// Blocks freed since the last commit only come free with it. An operation
+// on inode index that ran out of space while some wait logs what it did
+// so far and commits, with its inode still locked, and returns nonzero so
+// that it tries again.
+static int filesys_commit_freed(FileSystem *fs, int index) {
+	pthread_mutex_lock(&fs->allocLock);
+	uint32_t pending = fs->sb.BitMap.pendingCount;
+	pthread_mutex_unlock(&fs->allocLock);
+	if(pending == 0)
+		return 0;
+	filesys_write_bitmap(fs);
+	int res = filesys_write_inode(fs, index);
+	journal_end(&fs->journal);
+	if(res == 0)
+		res = journal_commit(&fs->journal);
+	journal_begin(&fs->journal);
+	return res == 0;
+}
+
+static ssize_t filesys_write_locked(FileSystem *fs, int index, const char *buf, size_t size, off_t offset) {
+	ssize_t res;
+
+	if(index < 0) {
+		TRACE_INFO(TRACE_WRITE, -1, index, offset);
+		return index;
+	}
+	if(size == 0 || fs->sb.metadata[index].dir != NULL) {
+		filesys_unlock_file(fs, index);
+		return size == 0 ? 0 : -EISDIR;
+	}
+	journal_begin(&fs->journal);
+	res = filesys_write_file(fs, index, buf, size, offset);
+	if(res == -ENOSPC && filesys_commit_freed(fs, index))
+		res = filesys_write_file(fs, index, buf, size, offset);
+	filesys_unlock_file(fs, index);
+	int committed = journal_end(&fs->journal);
+	if(res >= 0 && committed < 0)
+		res = committed;
+	TRACE_INFO(TRACE_WRITE, index, res, offset);
+	return res;
+}
+
+ssize_t filesys_write(FileSystem *fs, const char *path, const char *buf, size_t size, off_t offset) {
+	return filesys_write_locked(fs, filesys_lock_path(fs, path, 1), buf, size, offset);
+}
+
+ssize_t filesys_write_ino(FileSystem *fs, unsigned int ino, const char *buf, size_t size, off_t offset) {
+	return filesys_write_locked(fs, filesys_lock_ino(fs, ino, 1), buf, size, offset);
+}
+
+// Set the size of an inode locked exclusively, and unlock it. Shrinking
+// releases the blocks past the new end, and to 0 makes the file inline
+// again; growing leaves the new range unmapped so it reads back as zeros,
+// or moves a small file to a bigger home.
+static int filesys_truncate_locked(FileSystem *fs, int index, off_t size) {
+	if(index < 0) {
+		TRACE_INFO(TRACE_TRUNCATE, -1, index, size);
+		return index;
+	}
+	if(fs->sb.metadata[index].dir != NULL) {
+		filesys_unlock_file(fs, index);
+		return -EISDIR;
+	}
+
+	journal_begin(&fs->journal);
+	Metadata *m = &fs->sb.metadata[index];
+	size_t blockSize = fs->sb.blockSize;
+	unsigned int oldBlocks = extent_end(m);
+	unsigned int oldFlags = m->flags;
+	int moved = 0;
+	int res = 0;
+	if(size == 0) {
+		filesys_empty_file(fs, m);
+	}
+	else if(size < m->fileSize && (m->flags & AOFS_INODE_SMALL)) {
+		res = filesys_zero(fs, m, size, m->fileSize, &moved);
+	}
+	else if(size < m->fileSize && (m->flags & AOFS_INODE_COMPRESS)) {
+		// The cluster the new end falls in is rewritten without what follows
+		size_t clusterBytes = (size_t) cluster_blocks(fs) * blockSize;
+		if(size % clusterBytes)
+			res = filesys_write_cluster(fs, m, size / clusterBytes, NULL, 0, size, size, &moved);
+		if(res == 0)
+			filesys_shrink(fs, m, blocks_for(size, blockSize));
+	}
+	else if(size < m->fileSize) {
+		filesys_shrink(fs, m, blocks_for(size, blockSize));
+	}
+	else if(size > m->fileSize && (m->flags & AOFS_INODE_SMALL)) {
+		res = filesys_grow_small(fs, m, size, &moved);
+	}
+	else if(size > m->fileSize) {
+		res = filesys_zero(fs, m, m->fileSize, size, &moved);
+	}
+	if(res == 0) {
+		m->fileSize = size;
+		m->timeUpdated = time(NULL);
+		m->changes++;
+		if(extent_end(m) != oldBlocks || m->flags != oldFlags || moved) {
+			filesys_write_bitmap(fs);
+		}
+		res = filesys_write_inode(fs, index);
+	}
+	filesys_unlock_file(fs, index);
+	int committed = journal_end(&fs->journal);
+	if(res == 0)
+		res = committed;
+	TRACE_INFO(TRACE_TRUNCATE, index, res, size);
+	return res;
+}
+
+int filesys_truncate(FileSystem *fs, const char *path, off_t size) {
+	return filesys_truncate_locked(fs, filesys_lock_path(fs, path, 1), size);
+}
+
+int filesys_truncate_ino(FileSystem *fs, unsigned int ino, off_t size) {
+	return filesys_truncate_locked(fs, filesys_lock_ino(fs, ino, 1), size);
+}
+
+// Make image blocks [start, start + count) read as zeros: punched out of
+// the image where the host allows, written over otherwise
+static int filesys_clear_blocks(FileSystem *fs, uint32_t start, uint32_t count) {
+	off_t at = block_offset(&fs->sb, start);
+	off_t len = (off_t) count * fs->sb.blockSize;
+	cache_discard(&fs->cache, start, count);
+	if(storage_discard(&fs->storage, at, len) == 0)
+		return 0;
+	return filesys_zero_image(fs, at, len);
+}
+
+// Give the holes in [offset, end) blocks of their own, cleared so that
+// they still read as zeros. A small file only moves to the storage end
+// bytes need, and a compressed one reserves nothing, since its clusters
+// are rewritten whole.
+static int filesys_preallocate(FileSystem *fs, Metadata *m, off_t offset, off_t end, int *allocated) {
+	size_t blockSize = fs->sb.blockSize;
+	if(m->flags & AOFS_INODE_SMALL) {
+		int res = end > m->fileSize ? filesys_grow_small(fs, m, end, allocated) : 0;
+		if(res < 0 || (m->flags & AOFS_INODE_SMALL))
+			return res;
+	}
+	if(m->flags & AOFS_INODE_COMPRESS)
+		return 0;
+
+	unsigned int lblock = offset / blockSize;
+	unsigned int last = blocks_for(end, blockSize);
+	while(lblock < last) {
+		unsigned int run;
+		if(extent_map(m, lblock, &run) != 0) {
+			lblock = run > last - lblock ? last : lblock + run;
+			continue;
+		}
+		unsigned int want = run > last - lblock ? last - lblock : run;
+		int res = filesys_map_range(fs, m, lblock, want, allocated);
+		// Whatever got mapped is cleared, even if not all of it did
+		for(unsigned int b = lblock; b < lblock + want; b += run) {
+			uint32_t pblock = extent_map(m, b, &run);
+			if(run > lblock + want - b)
+				run = lblock + want - b;
+			int cleared = pblock != 0 ? filesys_clear_blocks(fs, pblock, run) : 0;
+			if(res == 0)
+				res = cleared;
+		}
+		if(res < 0)
+			return res;
+		lblock += want;
+	}
+	return 0;
+}
+
+// Make [from, to) a hole: the blocks wholly inside it are freed, and the
+// rest of it zeroed. A compressed cluster goes whole, or is rewritten
+// without the range.
+static int filesys_punch(FileSystem *fs, Metadata *m, off_t from, off_t to, int *allocated) {
+	size_t blockSize = fs->sb.blockSize;
+	int res = 0;
+	if(m->flags & (AOFS_INODE_SMALL | AOFS_INODE_COMPRESS)) {
+		// Nothing past the end of file is stored
+		if(to > m->fileSize)
+			to = m->fileSize;
+		if(from >= to)
+			return 0;
+	}
+	if(m->flags & AOFS_INODE_SMALL)
+		return filesys_zero(fs, m, from, to, allocated);
+
+	if(m->flags & AOFS_INODE_COMPRESS) {
+		size_t clusterBytes = (size_t) cluster_blocks(fs) * blockSize;
+		char *zeros = NULL;
+		for(off_t pos = from; pos < to && res == 0; ) {
+			off_t next = (pos / clusterBytes + 1) * clusterBytes;
+			if(next > to)
+				next = to;
+			if(pos % clusterBytes == 0 && (next % clusterBytes == 0 || next == m->fileSize)) {
+				res = filesys_unmap_range(fs, m, pos / blockSize, cluster_blocks(fs));
+			}
+			else if(zeros != NULL || (zeros = calloc(1, clusterBytes)) != NULL) {
+				res = filesys_write_cluster(fs, m, pos / clusterBytes, zeros, next - pos, pos, m->fileSize, allocated);
+			}
+			else {
+				res = -ENOMEM;
+			}
+			*allocated = 1;
+			pos = next;
+		}
+		free(zeros);
+		return res;
+	}
+
+	// The blocks the range only partly covers are zeroed in copies, so a
+	// crash before the punch commits finds the old ones as they were
+	off_t head = (off_t) blocks_for(from, blockSize) * blockSize;
+	off_t tail = to - to % blockSize;
+	if(head >= tail) {
+		res = filesys_unshare(fs, m, from / blockSize, blocks_for(to, blockSize) - from / blockSize, from, to, 1, allocated);
+		return res < 0 ? res : filesys_zero(fs, m, from, to, allocated);
+	}
+	res = filesys_unshare(fs, m, from / blockSize, head / blockSize - from / blockSize, from, head, 1, allocated);
+	if(res == 0)
+		res = filesys_unshare(fs, m, tail / blockSize, blocks_for(to, blockSize) - tail / blockSize, tail, to, 1, allocated);
+	if(res == 0)
+		res = filesys_zero(fs, m, from, head, allocated);
+	if(res == 0)
+		res = filesys_zero(fs, m, tail, to, allocated);
+	if(res == 0) {
+		*allocated = 1;
+		res = filesys_unmap_range(fs, m, head / blockSize, (tail - head) / blockSize);
+	}
+	return res;
+}
+
+static int filesys_fallocate_locked(FileSystem *fs, int index, int mode, off_t offset, off_t len) {
+	if(index < 0) {
+		TRACE_INFO(TRACE_FALLOCATE, -1, index, offset);
+		return index;
+	}
+	Metadata *m = &fs->sb.metadata[index];
+	int res = 0;
+	if(m->dir != NULL)
+		res = -EISDIR;
+	else if(offset < 0 || len <= 0)
+		res = -EINVAL;
+	else if(len >= (off_t) UINT32_MAX * fs->sb.blockSize - offset)
+		res = -EFBIG;
+	if(res < 0) {
+		filesys_unlock_file(fs, index);
+		return res;
+	}
+	off_t end = offset + len;
+
+	journal_begin(&fs->journal);
+	int allocated = 0;
+	if(mode & AOFS_FALLOC_PUNCH_HOLE) {
+		res = filesys_punch(fs, m, offset, end, &allocated);
+	}
+	else {
+		// What the file grows over reads as zeros, as after a truncate; a
+		// small file's storage already does past its end
+		int grow = !(mode & AOFS_FALLOC_KEEP_SIZE) && end > m->fileSize;
+		if(grow && !(m->flags & AOFS_INODE_SMALL))
+			res = filesys_zero(fs, m, m->fileSize, end, &allocated);
+		if(res == 0)
+			res = filesys_preallocate(fs, m, offset, end, &allocated);
+		if(res == -ENOSPC && filesys_commit_freed(fs, index))
+			res = filesys_preallocate(fs, m, offset, end, &allocated);
+		if(res == 0 && grow)
+			m->fileSize = end;
+	}
+	// Whatever changed before a failure is logged too
+	m->timeUpdated = time(NULL);
+	m->changes++;
+	if(allocated)
+		filesys_write_bitmap(fs);
+	int logged = filesys_write_inode(fs, index);
+	if(res == 0)
+		res = logged;
+	filesys_unlock_file(fs, index);
+	int committed = journal_end(&fs->journal);
+	if(res == 0)
+		res = committed;
+	TRACE_INFO(TRACE_FALLOCATE, index, res, offset);
+	return res;
+}
+
+// Reserve storage for [offset, offset + len) of a file, growing it unless
+// mode has AOFS_FALLOC_KEEP_SIZE, or with AOFS_FALLOC_PUNCH_HOLE (which
+// needs AOFS_FALLOC_KEEP_SIZE) free it, leaving a hole that reads as zeros
+int filesys_fallocate(FileSystem *fs, const char *path, int mode, off_t offset, off_t len) {
+	if((mode & ~(AOFS_FALLOC_KEEP_SIZE | AOFS_FALLOC_PUNCH_HOLE)) || mode == AOFS_FALLOC_PUNCH_HOLE)
+		return -EOPNOTSUPP;
+	return filesys_fallocate_locked(fs, filesys_lock_path(fs, path, 1), mode, offset, len);
+}
+
+int filesys_fallocate_ino(FileSystem *fs, unsigned int ino, int mode, off_t offset, off_t len) {
+	if((mode & ~(AOFS_FALLOC_KEEP_SIZE | AOFS_FALLOC_PUNCH_HOLE)) || mode == AOFS_FALLOC_PUNCH_HOLE)
+		return -EOPNOTSUPP;
+	return filesys_fallocate_locked(fs, filesys_lock_ino(fs, ino, 1), mode, offset, len);
+}
+
+// Turn compression of a regular file on or off. Only an empty file can
+// change, so a file never mixes the two kinds of writes.
+int filesys_set_compress_ino(FileSystem *fs, unsigned int ino, int on) {
+	int index = filesys_lock_ino(fs, ino, 1);
+	if(index < 0)
+		return index;
+	Metadata *m = &fs->sb.metadata[index];
+	unsigned int flags = on ? m->flags | AOFS_INODE_COMPRESS : m->flags & ~AOFS_INODE_COMPRESS;
+	if(m->dir != NULL || flags == m->flags) {
+		filesys_unlock_file(fs, index);
+		return m->dir != NULL ? -EISDIR : 0;
+	}
+	if(m->fileSize != 0) {
+		filesys_unlock_file(fs, index);
+		return -EBUSY;
+	}
+	journal_begin(&fs->journal);
+	m->flags = flags;
+	int res = filesys_write_inode(fs, index);
+	filesys_unlock_file(fs, index);
+	int committed = journal_end(&fs->journal);
+	return res < 0 ? res : committed;
+}
+
+// 1 if a file is compressed, else 0
+int filesys_get_compress_ino(FileSystem *fs, unsigned int ino) {
+	int index = filesys_lock_ino(fs, ino, 0);
+	if(index < 0)
+		return index;
+	int res = (fs->sb.metadata[index].flags & AOFS_INODE_COMPRESS) != 0;
+	filesys_unlock_file(fs, index);
+	return res;
+}
+
+// Drop the content of an empty directory. Nothing logged for its sectors
+// may be replayed over whatever the blocks hold next.
+static void filesys_drop_dir(FileSystem *fs, Metadata *m) {
+	for(uint32_t s = 0; s < m->dir->count; s++)
+		journal_revoke(&fs->journal, filesys_dir_sector(fs, m, s));
+	dir_release(m->dir, &fs->dirPool);
+	filesys_shrink(fs, m, 0);
+	m->fileSize = 0;
+}
+
+// Give back the blocks and the inode of a file no entry names. The caller
+// holds it exclusively under namespaceLock, or is mounting.
+static int filesys_free_inode(FileSystem *fs, int index) {
+	Metadata *m = &fs->sb.metadata[index];
+
+	// Nothing is written over the content: its blocks are punched out of
+	// the image as they are freed
+	filesys_empty_file(fs, m);
+	free(m->extents);
+	free(m->dir);
+	memset(m, 0, sizeof(Metadata));
+	fs->sb.freeInodes++;
+
+	filesys_write_bitmap(fs);
+	return filesys_write_inode(fs, index);
+}
+
+// Free the inodes that were unlinked while referenced and still were when
+// the last mount ended. Nothing names them, so nothing can use them.
+static int filesys_reclaim_orphans(FileSystem *fs) {
+	int res = 0;
+	int orphans = 0;
+	for(unsigned int i = AOFS_ROOT_INODE + 1; i < fs->sb.inodeCount && res == 0; i++) {
+		Metadata *m = &fs->sb.metadata[i];
+		if(m->mode == 0 || m->name != NULL)
+			continue;
+		// rmdir only removes empty directories
+		if(m->dir != NULL && m->dir->entries > 0) {
+			printf("filesys_reclaim_orphans: removed directory %u has entries\n", i);
+			res = -EINVAL;
+			break;
+		}
+		if(orphans++ == 0)
+			journal_begin(&fs->journal);
+		if(m->dir != NULL)
+			filesys_drop_dir(fs, m);
+		res = filesys_free_inode(fs, i);
+	}
+	// Committed right away, so that their blocks can be used from the start
+	if(orphans > 0) {
+		int committed = journal_end(&fs->journal);
+		if(res == 0)
+			res = committed;
+		if(res == 0)
+			res = journal_commit(&fs->journal);
+	}
+	return res;
+}
+
+// Delete the entry of inode index in directory parent, and the inode too
+// unless the inode API holds a reference to it; filesys_forget frees it
+// then, or the next mount does. The caller holds both exclusively, under
+// namespaceLock.
+static int filesys_unlink_file(FileSystem *fs, int parent, int index) {
+	Metadata *dm = &fs->sb.metadata[parent];
+	Metadata *m = &fs->sb.metadata[index];
+
+	if(m->dir != NULL) {
+		filesys_drop_dir(fs, m);
+		dm->nlink--;
+	}
+
+	// The index lets go of the name before its bytes can be reused
+	nameindex_remove(&fs->index, parent, m->name);
+	dir_remove(dm->dir, m->direntOffset);
+	dm->timeUpdated = time(NULL);
+	int res = filesys_write_dir_sector(fs, parent, m->direntOffset / AOFS_SECTOR_SIZE);
+	m->parent = 0;
+	m->direntOffset = 0;
+	m->name = NULL;
+	m->nlink = 0;
+
+	// References are only taken under the inode's lock, which is ours
+	int freed;
+	if(__atomic_load_n(&m->lookups, __ATOMIC_RELAXED) == 0) {
+		freed = filesys_free_inode(fs, index);
+	}
+	else {
+		filesys_write_bitmap(fs);
+		freed = filesys_write_inode(fs, index);
+	}
+	if(res == 0)
+		res = freed;
+	if(res == 0)
+		res = filesys_write_inode(fs, parent);
+	return res;
+}
+
+// Remove name from directory parent: a file for unlink, an empty directory
+// for rmdir. Called under namespaceLock, which it releases.
+static int filesys_remove(FileSystem *fs, unsigned int parent, const char *name, int rmdir) {
+	int isDir = 0;
+	int res = 0;
+
+	// find the name in its directory
+	int index = filesys_find_entry(fs, parent, name, &isDir);
+	if(index == -1)
+		res = -ENOENT;
+	else if(isDir != rmdir)
+		res = rmdir ? -ENOTDIR : -EISDIR;
+	// Entries only come and go under namespaceLock
+	else if(rmdir && fs->sb.metadata[index].dir->entries > 0)
+		res = -ENOTEMPTY;
+	if(res < 0) {
+		pthread_mutex_unlock(&fs->namespaceLock);
+		TRACE_INFO(rmdir ? TRACE_RMDIR : TRACE_UNLINK, index, res, 0);
+		return res;
+	}
+
+	pthread_rwlock_wrlock(&fs->inodeLocks[parent]);
+	pthread_rwlock_wrlock(&fs->inodeLocks[index]);
+	journal_begin(&fs->journal);
+	res = filesys_unlink_file(fs, parent, index);
+	pthread_rwlock_unlock(&fs->inodeLocks[index]);
+	pthread_rwlock_unlock(&fs->inodeLocks[parent]);
+	pthread_mutex_unlock(&fs->namespaceLock);
+	int committed = journal_end(&fs->journal);
+	if(res == 0)
+		res = committed;
+	TRACE_INFO(rmdir ? TRACE_RMDIR : TRACE_UNLINK, index, res, 0);
+	return res;
+}
+
+static int filesys_remove_path(FileSystem *fs, const char *path, int rmdir) {
+	unsigned int parent;
+	char name[AOFS_NAME_LEN];
+
+	pthread_mutex_lock(&fs->namespaceLock);
+	int res = filesys_walk(fs, path, &parent, name);
+	if(res == 0 && parent == 0)
+		res = rmdir ? -EBUSY : -EISDIR;
+	if(res < 0) {
+		pthread_mutex_unlock(&fs->namespaceLock);
+		TRACE_INFO(rmdir ? TRACE_RMDIR : TRACE_UNLINK, -1, res, 0);
+		return res;
+	}
+	return filesys_remove(fs, parent, name, rmdir);
+}
+
+static int filesys_remove_at(FileSystem *fs, unsigned int parent, const char *name, int rmdir) {
+	pthread_mutex_lock(&fs->namespaceLock);
+	int res = filesys_check_dir(fs, parent);
+	if(res < 0) {
+		pthread_mutex_unlock(&fs->namespaceLock);
+		TRACE_INFO(rmdir ? TRACE_RMDIR : TRACE_UNLINK, -1, res, 0);
+		return res;
+	}
+	return filesys_remove(fs, parent, name, rmdir);
+}
+
+int filesys_unlink(FileSystem *fs, const char *path) {
+	return filesys_remove_path(fs, path, 0);
+}
+
+int filesys_rmdir(FileSystem *fs, const char *path) {
+	return filesys_remove_path(fs, path, 1);
+}
+
+int filesys_unlink_at(FileSystem *fs, unsigned int parent, const char *name) {
+	return filesys_remove_at(fs, parent, name, 0);
+}
+
+int filesys_rmdir_at(FileSystem *fs, unsigned int parent, const char *name) {
+	return filesys_remove_at(fs, parent, name, 1);
+}
+
+// Drop count references taken by filesys_lookup_at, filesys_create_at or
+// filesys_mkdir_at. An inode unlinked while referenced goes with the last.
+int filesys_forget(FileSystem *fs, unsigned int ino, unsigned long count) {
+	if(ino <= AOFS_ROOT_INODE || ino >= fs->sb.inodeCount)
+		return 0;
+	Metadata *m = &fs->sb.metadata[ino];
+	if(__atomic_sub_fetch(&m->lookups, count, __ATOMIC_ACQ_REL) != 0)
+		return 0;
+
+	// A lookup may have taken a new reference before the lock, and only an
+	// inode with no entry left is freed
+	pthread_mutex_lock(&fs->namespaceLock);
+	pthread_rwlock_wrlock(&fs->inodeLocks[ino]);
+	int orphan = m->mode != 0 && m->name == NULL && __atomic_load_n(&m->lookups, __ATOMIC_RELAXED) == 0;
+	int res = 0;
+	if(orphan) {
+		journal_begin(&fs->journal);
+		res = filesys_free_inode(fs, ino);
+	}
+	pthread_rwlock_unlock(&fs->inodeLocks[ino]);
+	pthread_mutex_unlock(&fs->namespaceLock);
+	if(orphan) {
+		int committed = journal_end(&fs->journal);
+		if(res == 0)
+			res = committed;
+	}
+	TRACE_INFO(TRACE_FORGET, ino, res, count);
+	return res;
+}
+
+// Entries filesys_list copies out of a directory per hold of namespaceLock
+#define AOFS_LIST_BATCH 32
+
+// List directory index, or pass on its error, under namespaceLock, which
+// it releases; see filesys_readdir. Entries are copied out a batch at a
+// time and their attributes filled in with namespaceLock dropped, so an
+// entry's inode lock, held long by a write, stalls only this listing.
+static int filesys_list(FileSystem *fs, int index, off_t offset, DirFiller filler, void *ctx) {
+	if(index < 0) {
+		pthread_mutex_unlock(&fs->namespaceLock);
+		TRACE_INFO(TRACE_READDIR, 0, index, 0);
+		return index;
+	}
+	struct {
+		uint32_t inode;
+		uint32_t offset;
+		char name[AOFS_NAME_LEN];
+	} batch[AOFS_LIST_BATCH];
+	int entries = 0;
+	int done = 0;
+	uint32_t pos = offset < UINT32_MAX ? offset : UINT32_MAX;
+	while(!done) {
+		// The directory may have gone while the lock was dropped
+		const Metadata *dm = &fs->sb.metadata[index];
+		int count = 0;
+		if(dm->mode != 0 && dm->dir != NULL) {
+			for(const DiskDirent *e; count < AOFS_LIST_BATCH && (e = dir_next(dm->dir, &pos)) != NULL; pos++) {
+				batch[count].inode = e->inode;
+				batch[count].offset = pos;
+				memcpy(batch[count].name, e->name, e->nameLen);
+				batch[count].name[e->nameLen] = '\0';
+				count++;
+			}
+		}
+		pthread_mutex_unlock(&fs->namespaceLock);
+		done = count < AOFS_LIST_BATCH;
+
+		for(int i = 0; i < count; i++) {
+			// The attributes come along, so a long listing needs no lookup
+			// per entry afterwards. An entry removed since it was copied is
+			// left out, as it would be had the listing come later.
+			struct stat st;
+			uint32_t ino = batch[i].inode;
+			const Metadata *m = &fs->sb.metadata[ino];
+			pthread_rwlock_rdlock(&fs->inodeLocks[ino]);
+			int live = m->mode != 0 && m->name != NULL && m->parent == (unsigned int) index && m->direntOffset == batch[i].offset;
+			if(live)
+				filesys_fill_stat(fs, ino, &st);
+			pthread_rwlock_unlock(&fs->inodeLocks[ino]);
+			if(!live)
+				continue;
+			if(filler(ctx, batch[i].name, &st, (off_t) batch[i].offset + 1)) {
+				done = 1;
+				break;
+			}
+			entries++;
+		}
+		if(!done)
+			pthread_mutex_lock(&fs->namespaceLock);
+	}
+	TRACE_INFO(TRACE_READDIR, entries, 0, 0);
+	return 0;
+}
+
+// Pass every entry of the directory from offset on to filler, with its
+// attributes, without "." and "..". 0 starts at the beginning; any other
+// offset is one filler was given. An offset is an entry's position in the
+// directory plus one, and entries never move, so a listing resumed from
+// one neither repeats nor skips entries that stayed, however many come
+// and go in between; a page of a huge directory costs the same as the first.
+int filesys_readdir(FileSystem *fs, const char *path, off_t offset, DirFiller filler, void *ctx) {
+	if(offset < 0)
+		return -EINVAL;
+	// Entries only change under namespaceLock
+	pthread_mutex_lock(&fs->namespaceLock);
+	int index = filesys_find(fs, path);
+	if(index >= 0 && fs->sb.metadata[index].dir == NULL)
+		index = -ENOTDIR;
+	return filesys_list(fs, index, offset, filler, ctx);
+}
+
+// A directory removed while referenced lists as empty
+int filesys_readdir_ino(FileSystem *fs, unsigned int ino, off_t offset, DirFiller filler, void *ctx) {
+	if(offset < 0)
+		return -EINVAL;
+	pthread_mutex_lock(&fs->namespaceLock);
+	int index = ino;
+	if(ino < AOFS_ROOT_INODE || ino >= fs->sb.inodeCount || fs->sb.metadata[ino].mode == 0)
+		index = -ESTALE;
+	else if(fs->sb.metadata[ino].dir == NULL)
+		index = -ENOTDIR;
+	return filesys_list(fs, index, offset, filler, ctx);
+}
+
+// Last close of a file locked shared: write back its cached content blocks
+// and unlock it. Blocks of other files stay dirty in the cache, and its
+// metadata is the journal's.
+static int filesys_release_locked(FileSystem *fs, int index) {
+	if(index < 0)
+		return 0;
+
+	Metadata *m = &fs->sb.metadata[index];
+	int res = 0;
+	if(m->flags & AOFS_INODE_TAIL)
+		res = cache_flush_range(&fs->cache, m->tailBlock, 1);
+	for(unsigned int i = 0; i < m->extentCount && res == 0; i++) {
+		res = cache_flush_range(&fs->cache, m->extents[i].start, extent_blocks(fs, &m->extents[i]));
+	}
+	filesys_unlock_file(fs, index);
+	TRACE_INFO(TRACE_RELEASE, index, res, 0);
+	return res;
+}
+
+int filesys_release(FileSystem *fs, const char *path) {
+	return filesys_release_locked(fs, filesys_lock_path(fs, path, 0));
+}
+
+int filesys_release_ino(FileSystem *fs, unsigned int ino) {
+	return filesys_release_locked(fs, filesys_lock_ino(fs, ino, 0));
+}
+
+int filesys_statfs(FileSystem *fs, struct statvfs *st) {
+	memset(st, 0, sizeof(*st));
+	st->f_bsize = fs->sb.blockSize;
+	st->f_frsize = fs->sb.blockSize;
+	st->f_blocks = fs->sb.totalNumBlocks - fs->sb.dataStart;
+	st->f_bfree = fs->sb.BitMap.freeCount;
+	st->f_bavail = fs->sb.BitMap.freeCount;
+	st->f_files = fs->sb.inodeCount - 1;
+	st->f_ffree = fs->sb.freeInodes;
+	st->f_favail = fs->sb.freeInodes;
+	st->f_namemax = AOFS_NAME_LEN - 1;
+	TRACE_INFO(TRACE_STATFS, fs->sb.BitMap.freeCount, 0, 0);
+	return 0;
+}
+
+// Commit the journal and flush the image; with the mmap backend this is
+// where the default sync policy makes writes durable
+int filesys_sync(FileSystem *fs) {
+	int res = journal_commit(&fs->journal);
+	if(res == 0)
+		res = cache_flush(&fs->cache);
+	if(res == 0)
+		res = storage_sync(&fs->storage);
+	TRACE_INFO(TRACE_FSYNC, res, 0, 0);
+	return res;
+}
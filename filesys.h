@@ -0,0 +1,181 @@
+/*
+  AOFS engine
+
+  The file system itself, independent of FUSE: mounting an image, path
+  resolution, directories, extents, block allocation and the file
+  operations on top of them. hello.c is a thin FUSE shim over this API;
+  aofsbench and aofsfuzz call it directly on an image file, so neither
+  needs /dev/fuse.
+
+  Paths are absolute, e.g. "/dir/file", with components of up to
+  AOFS_NAME_LEN - 1 bytes. Calls return 0 or a byte count on success and a
+  negative errno on failure, and may run concurrently from any number of
+  threads; see the locking notes on FileSystem.
+
+  The same operations also take inode numbers, for a caller that keeps
+  them, like the FUSE low-level API does, and so never hands over a path:
+  the *_at calls name an entry by its directory's inode and its name, the
+  *_ino calls an inode directly, and the root is AOFS_ROOT_INODE.
+  The *_read_stream calls read like the others for a caller that keeps a
+  ReadStream per open file, which lets the engine spot sequential readers
+  and prefetch what they will read next.
+  filesys_lookup_at, filesys_create_at and filesys_mkdir_at each take a
+  reference to the inode they return, which filesys_forget drops. An
+  inode number stays valid while referenced: an unlink removes the entry
+  at once, but the inode and its content stay until the last reference
+  is dropped, or until the next mount if the unmount comes first.
+*/
+
+#ifndef AOFS_FILESYS_H
+#define AOFS_FILESYS_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+
+#include "bitmap.h"
+#include "cache.h"
+#include "dedup.h"
+#include "dir.h"
+#include "journal.h"
+#include "layout.h"
+#include "nameindex.h"
+#include "readahead.h"
+#include "storage.h"
+#include "tail.h"
+
+// Metadata struct
+typedef struct {
+	off_t fileSize;					// File Size
+	mode_t mode;					// File Mode, 0 if the inode is free
+	unsigned int nlink;				// Link count, see DiskInode
+	time_t timeCreated;				// File Creation Time
+	time_t timeUpdated;				// File Updated Time
+	time_t timeAccessed;			// File Accessed Time
+	unsigned int indirectBlock;		// Block holding extents past the inline ones, 0 if none
+	unsigned int extentCount;		// Extents in use
+	unsigned int extentCapacity;	// Extents allocated
+	int extentsDirty;				// Indirect block needs writing
+	Extent *extents;				// Content runs sorted by logical block
+	unsigned int parent;			// Directory holding its entry, 0 for the root
+	unsigned int direntOffset;		// Where the entry is in that directory
+	const char *name;				// The entry's name, in the directory's sector
+	Directory *dir;					// Entries, for a directory
+	unsigned int changes;			// Writes and truncates so far
+	unsigned int openedChanges;		// changes at the last open
+	unsigned long lookups;			// References of the inode API, see filesys_forget
+	unsigned int flags;				// AOFS_INODE_INLINE or AOFS_INODE_TAIL, see layout.h
+	uint32_t tailBlock;				// Where a tail file's content is
+	uint16_t tailSector;
+	uint16_t tailSectors;
+	char *data;						// AOFS_INLINE_DATA bytes of an inline file, NULL while empty
+} Metadata;
+
+// Superblock struct
+typedef struct {
+	unsigned int magicNumber;		// 0xfa19283e
+	unsigned int version;			// On-disk layout version
+    unsigned int totalNumBlocks;  	// Set at format time, see mkaofs
+    unsigned int blockSize;     	// 4KB to 64KB
+	unsigned int inodeCount;		// Number of entries in metadata
+	unsigned int bitmapStart;		// Block where the bitmap starts
+	unsigned int bitmapBlocks;
+	unsigned int inodeStart;		// Block where the inode table starts
+	unsigned int inodeBlocks;
+	unsigned int journalStart;		// Block holding the journal header, the log follows
+	unsigned int journalBlocks;
+	unsigned int dataStart;			// First block for file content
+	Bitmap BitMap;					// One bit per block, free or occupied
+	Metadata *metadata;				// inodeCount entries, index is the inode number
+	unsigned int freeInodes;
+	unsigned int inodeCursor;		// Where the search for a free inode starts
+} Superblock;
+
+
+// FileSystem struct
+//
+// Locking: namespaceLock serializes create, mkdir, unlink, rmdir, readdir
+// and freeing an inode on its last forget, which are all that change or
+// walk directory content or free inodes; path lookups go through the index
+// without it. Each inode has a reader/writer lock over its Metadata and
+// content, taken after namespaceLock, a directory's before that of an
+// entry in it. allocLock covers the bitmap, the tail map and the shared
+// block map and is taken last, around each allocation or release. The
+// cache, journal and storage lock themselves. Operations that change
+// metadata enter the journal after taking their locks, since a commit
+// waits for every operation in the open transaction to leave it.
+typedef struct {
+    Superblock sb;  				// Superblock
+	Storage storage;				// The image, open for the whole mount
+	NameIndex index;				// (directory, name) -> inode of every entry
+	DirPool dirPool;				// Sectors of removed directories
+	TailMap tails;					// Sectors in use in blocks shared by tails
+	DedupMap shared;				// References to blocks named by several extents
+	Cache cache;					// Metadata and data blocks between callbacks and the image
+	size_t cacheBytes;				// Cache size, set before mount
+	ReadAhead readahead;			// Prefetches for sequential readers
+	size_t readaheadBytes;			// Largest readahead window, 0 for none, set before mount
+	Journal journal;				// Every metadata change is logged here first
+	unsigned int commitInterval;	// Seconds between journal commits, set before mount
+	int useMmap;					// Map the image instead of pread/pwrite, set before mount
+	int syncPolicy;					// STORAGE_SYNC_* for the mapping
+	unsigned int syncInterval;		// Seconds between msyncs for STORAGE_SYNC_PERIODIC
+	int batchBackend;				// STORAGE_URING or STORAGE_THREADS runs I/O batches at once, set before mount
+	int compress;					// New files are compressed, set before mount
+	int dedup;						// Full blocks written share identical ones, set before mount
+	pthread_rwlock_t *inodeLocks;	// One per inode, guards its Metadata
+	pthread_mutex_t namespaceLock;
+	pthread_mutex_t allocLock;
+} FileSystem;
+
+// Called by filesys_readdir for each entry, with its attributes and the
+// offset that resumes the listing after it; nonzero stops the listing
+// before the entry, which the next call then starts with
+typedef int (*DirFiller)(void *ctx, const char *name, const struct stat *st, off_t next);
+
+// Modes of filesys_fallocate, as FALLOC_FL_KEEP_SIZE and FALLOC_FL_PUNCH_HOLE
+#define AOFS_FALLOC_KEEP_SIZE 1			// Blocks past the end of file, size unchanged
+#define AOFS_FALLOC_PUNCH_HOLE 2		// Free the range instead; needs KEEP_SIZE
+
+int filesys_format(const char *image, unsigned int blocks, unsigned int blockSize, unsigned int inodes);
+int filesys_mount(FileSystem *fs, const char *image);
+int filesys_unmount(FileSystem *fs);
+
+int filesys_lookup(FileSystem *fs, const char *path, struct stat *st);
+int filesys_create(FileSystem *fs, const char *path, mode_t mode);
+int filesys_open(FileSystem *fs, const char *path, int *unchanged);
+ssize_t filesys_read(FileSystem *fs, const char *path, char *buf, size_t size, off_t offset);
+ssize_t filesys_read_stream(FileSystem *fs, const char *path, ReadStream *rs, char *buf, size_t size, off_t offset);
+ssize_t filesys_write(FileSystem *fs, const char *path, const char *buf, size_t size, off_t offset);
+int filesys_truncate(FileSystem *fs, const char *path, off_t size);
+int filesys_fallocate(FileSystem *fs, const char *path, int mode, off_t offset, off_t len);
+int filesys_unlink(FileSystem *fs, const char *path);
+int filesys_mkdir(FileSystem *fs, const char *path, mode_t mode);
+int filesys_rmdir(FileSystem *fs, const char *path);
+int filesys_readdir(FileSystem *fs, const char *path, off_t offset, DirFiller filler, void *ctx);
+int filesys_release(FileSystem *fs, const char *path);
+
+int filesys_lookup_at(FileSystem *fs, unsigned int parent, const char *name, struct stat *st);
+int filesys_forget(FileSystem *fs, unsigned int ino, unsigned long count);
+int filesys_getattr_ino(FileSystem *fs, unsigned int ino, struct stat *st);
+int filesys_create_at(FileSystem *fs, unsigned int parent, const char *name, mode_t mode, struct stat *st);
+int filesys_open_ino(FileSystem *fs, unsigned int ino, int *unchanged);
+ssize_t filesys_read_ino(FileSystem *fs, unsigned int ino, char *buf, size_t size, off_t offset);
+ssize_t filesys_read_stream_ino(FileSystem *fs, unsigned int ino, ReadStream *rs, char *buf, size_t size, off_t offset);
+ssize_t filesys_write_ino(FileSystem *fs, unsigned int ino, const char *buf, size_t size, off_t offset);
+int filesys_truncate_ino(FileSystem *fs, unsigned int ino, off_t size);
+int filesys_fallocate_ino(FileSystem *fs, unsigned int ino, int mode, off_t offset, off_t len);
+int filesys_unlink_at(FileSystem *fs, unsigned int parent, const char *name);
+int filesys_mkdir_at(FileSystem *fs, unsigned int parent, const char *name, mode_t mode, struct stat *st);
+int filesys_rmdir_at(FileSystem *fs, unsigned int parent, const char *name);
+int filesys_readdir_ino(FileSystem *fs, unsigned int ino, off_t offset, DirFiller filler, void *ctx);
+int filesys_release_ino(FileSystem *fs, unsigned int ino);
+int filesys_set_compress_ino(FileSystem *fs, unsigned int ino, int on);
+int filesys_get_compress_ino(FileSystem *fs, unsigned int ino);
+
+int filesys_statfs(FileSystem *fs, struct statvfs *st);
+int filesys_sync(FileSystem *fs);
+
+#endif
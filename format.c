@@ -0,0 +1,151 @@
+/*
+  AOFS image geometry and formatting
+*/
+
+#include "format.h"
+#include "bitmap.h"
+#include "journal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static uint64_t blocks_for(uint64_t bytes, uint32_t blockSize) {
+	return (bytes + blockSize - 1) / blockSize;
+}
+
+static int power_of_two(uint32_t n) {
+	return n && (n & (n - 1)) == 0;
+}
+
+// Fill in a superblock for the requested geometry. inodeCount 0 picks one
+// inode per AOFS_DEFAULT_BYTES_PER_INODE of image, journalBlocks 0 a journal
+// of 1/64 of the image.
+int format_layout(DiskSuperblock *d, uint64_t totalNumBlocks, uint32_t blockSize, uint64_t inodeCount, uint32_t journalBlocks) {
+	memset(d, 0, sizeof(*d));
+	if(!power_of_two(blockSize) || blockSize < AOFS_MIN_BLOCK_SIZE || blockSize > AOFS_MAX_BLOCK_SIZE) {
+		printf("format_layout: block size must be a power of two from %d to %d\n", AOFS_MIN_BLOCK_SIZE, AOFS_MAX_BLOCK_SIZE);
+		return -EINVAL;
+	}
+	if(totalNumBlocks >= UINT32_MAX) {
+		printf("format_layout: at most %u blocks\n", UINT32_MAX - 1);
+		return -EFBIG;
+	}
+	if(inodeCount == 0)
+		inodeCount = totalNumBlocks * blockSize / AOFS_DEFAULT_BYTES_PER_INODE;
+	if(inodeCount < AOFS_MIN_INODES)
+		inodeCount = AOFS_MIN_INODES;
+	if(inodeCount > UINT32_MAX / 2)
+		inodeCount = UINT32_MAX / 2;
+	// Whole sectors of inodes, so writing one inode's sector never runs
+	// past the table
+	inodeCount += (AOFS_INODES_PER_SECTOR - inodeCount % AOFS_INODES_PER_SECTOR) % AOFS_INODES_PER_SECTOR;
+
+	d->magic = AOFS_MAGIC;
+	d->version = AOFS_VERSION;
+	d->blockSize = blockSize;
+	d->totalNumBlocks = totalNumBlocks;
+	d->inodeCount = inodeCount;
+
+	// Bitmap and inode table sit back to back right after the superblock
+	d->bitmapStart = 1;
+	d->bitmapBlocks = blocks_for((totalNumBlocks + 63) / 64 * 8, blockSize);
+	d->inodeStart = d->bitmapStart + d->bitmapBlocks;
+	d->inodeBlocks = blocks_for(inodeCount * AOFS_INODE_SIZE, blockSize);
+
+	// The journal must hold a transaction rewriting the whole bitmap a few
+	// times over, or one operation freeing many scattered runs could not
+	// be logged
+	uint32_t minJournal = journal_min_blocks(d->bitmapBlocks);
+	if(journalBlocks == 0) {
+		journalBlocks = totalNumBlocks / 64 < AOFS_MAX_JOURNAL_BLOCKS ? totalNumBlocks / 64 : AOFS_MAX_JOURNAL_BLOCKS;
+	}
+	if(journalBlocks < minJournal)
+		journalBlocks = minJournal;
+	d->journalStart = d->inodeStart + d->inodeBlocks;
+	d->journalBlocks = journalBlocks;
+	d->dataStart = d->journalStart + d->journalBlocks;
+	if(d->dataStart >= totalNumBlocks) {
+		printf("format_layout: %llu blocks leave no room for data\n", (unsigned long long) totalNumBlocks);
+		return -ENOSPC;
+	}
+	return 0;
+}
+
+// Check a superblock read from an image of imageSize bytes
+int format_validate(const DiskSuperblock *d, off_t imageSize) {
+	if(d->magic != AOFS_MAGIC)
+		return -EINVAL;
+	if(d->version != AOFS_VERSION) {
+		printf("format_validate: unsupported layout version %u\n", d->version);
+		return -EINVAL;
+	}
+	if(!power_of_two(d->blockSize) || d->blockSize < AOFS_MIN_BLOCK_SIZE || d->blockSize > AOFS_MAX_BLOCK_SIZE
+			|| d->inodeCount % AOFS_INODES_PER_SECTOR != 0
+			|| d->bitmapStart != 1
+			|| (uint64_t) d->bitmapBlocks * d->blockSize < ((uint64_t) d->totalNumBlocks + 63) / 64 * 8
+			|| d->inodeStart != d->bitmapStart + d->bitmapBlocks
+			|| (uint64_t) d->inodeBlocks * d->blockSize < (uint64_t) d->inodeCount * AOFS_INODE_SIZE
+			|| d->journalStart != d->inodeStart + d->inodeBlocks
+			|| d->journalBlocks < journal_min_blocks(d->bitmapBlocks)
+			|| d->dataStart != d->journalStart + d->journalBlocks
+			|| d->dataStart >= d->totalNumBlocks) {
+		printf("format_validate: inconsistent geometry in superblock\n");
+		return -EINVAL;
+	}
+	if((uint64_t) imageSize < (uint64_t) d->totalNumBlocks * d->blockSize) {
+		printf("format_validate: image is smaller than its %u blocks\n", d->totalNumBlocks);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+// Write a fresh file system to st. The image is cut back to nothing and
+// regrown, so the inode table and data start out as zeros without being
+// written (and sparse where the host supports it); only the superblock, the
+// journal header, the bitmap words covering the metadata blocks and the
+// sector holding the root directory's inode are written.
+int format_write(Storage *st, const DiskSuperblock *d) {
+	Bitmap bm;
+	char sector[AOFS_SECTOR_SIZE];
+	off_t size = (off_t) d->totalNumBlocks * d->blockSize;
+	int res;
+
+	res = storage_resize(st, 0);
+	if(res == 0)
+		res = storage_resize(st, size);
+	if(res < 0)
+		return res;
+
+	res = bitmap_init(&bm, d->totalNumBlocks);
+	if(res < 0)
+		return res;
+	bitmap_set_run(&bm, 0, d->dataStart);
+	res = bitmap_flush(&bm, st, (off_t) d->bitmapStart * d->blockSize);
+	bitmap_destroy(&bm);
+	if(res < 0)
+		return res;
+	res = journal_format(st, d);
+	if(res < 0)
+		return res;
+
+	// An empty root directory, so far without content sectors
+	memset(sector, 0, sizeof(sector));
+	DiskInode *root = (DiskInode *) sector + AOFS_ROOT_INODE % AOFS_INODES_PER_SECTOR;
+	root->mode = S_IFDIR | 0755;
+	root->nlink = 2;
+	root->timeCreated = root->timeUpdated = root->timeAccessed = time(NULL);
+	off_t rootOffset = (off_t) d->inodeStart * d->blockSize + AOFS_ROOT_INODE / AOFS_INODES_PER_SECTOR * AOFS_SECTOR_SIZE;
+	ssize_t written = storage_write(st, sector, sizeof(sector), rootOffset);
+	if(written < 0)
+		return written;
+
+	memset(sector, 0, sizeof(sector));
+	memcpy(sector, d, sizeof(*d));
+	written = storage_write(st, sector, sizeof(sector), 0);
+	if(written < 0)
+		return written;
+	return storage_sync(st);
+}
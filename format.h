@@ -0,0 +1,29 @@
+/*
+  AOFS image geometry and formatting
+
+  Shared by the daemon, which formats FS_FILE on first mount, and by the
+  mkaofs tool. Block count and block size are chosen at format time and
+  recorded in the superblock; everything else is derived from them here.
+*/
+
+#ifndef AOFS_FORMAT_H
+#define AOFS_FORMAT_H
+
+#include <stdint.h>
+
+#include "layout.h"
+#include "storage.h"
+
+#define AOFS_DEFAULT_BLOCKS 256				// 256 blocks
+#define AOFS_DEFAULT_BLOCK_SIZE 4096		// 4KB block size
+#define AOFS_MIN_BLOCK_SIZE 4096
+#define AOFS_MAX_BLOCK_SIZE 65536
+#define AOFS_DEFAULT_BYTES_PER_INODE 16384	// One inode per 16KB of image
+#define AOFS_MIN_INODES 16
+#define AOFS_MAX_JOURNAL_BLOCKS 16384		// Default journal is 1/64 of the image up to this
+
+int format_layout(DiskSuperblock *d, uint64_t totalNumBlocks, uint32_t blockSize, uint64_t inodeCount, uint32_t journalBlocks);
+int format_validate(const DiskSuperblock *d, off_t imageSize);
+int format_write(Storage *st, const DiskSuperblock *d);
+
+#endif
@@ -6,23 +6,19 @@
   See the file COPYING.
 
   gcc -Wall hello.c `pkg-config fuse --cflags --libs` -o hello
+
+  The FUSE side of AOFS, on the low-level API: mount options, the
+  statistics files and the callbacks. The kernel names files by inode
+  number, and these are the engine's own, so a callback hands the number
+  it gets straight to filesys.c; nothing resolves a path. The engine
+  keeps an inode alive for as long as the kernel remembers it, from the
+  lookup that hands it out to the forget that drops it.
 */
 
 #define FUSE_USE_VERSION 26
-#define MAX_BLOCK_SIZE 4096			// 4KB block size
-#define NUM_BLOCKS 256				// 256 blocks
-#define META_RANGE 1096				// 1096 BYTES used for meta data
-#define BIT_RANGE 8
-
-// Bitmap operations
-// SITED: http://www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html
-// http://www.cs.unh.edu/~jlw/cs610/notes/free-space-mgmt.pdf
-#define SETBIT(BitMap,k)     ( BitMap[(k/32)] |= (1 << (k%32)) )
-#define CLEARBIT(BitMap,k)   ( BitMap[(k/32)] &= ~(1 << (k%32)) )
-#define TESTBIT(BitMap,k)    ( BitMap[(k/32)] & (1 << (k%32)) )
 
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -30,156 +26,139 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#include <stddef.h>
+#include <pthread.h>
 
-// Metadata struct
-typedef struct {
-	char fileName[24];				// File Name
-	unsigned int fileSize;			// File Size
-	unsigned int blockIndex;		// File Block Index
-	unsigned int nextBlock;			// File Next Block Index if fileSize > 4KB
-	mode_t mode;					// File Mode
-	time_t timeCreated;				// File Creation Time
-	time_t timeUpdated;				// File Updated Time
-	time_t timeAccessed;			// File Accessed Time
-} Metadata;
-
-// Superblock struct
-typedef struct {
-	char *magicNumber;
-    unsigned int totalNumBlocks;  	// 256 blocks, 256 * 4KB = 1MB
-    unsigned int blockSize;     	// 4096 BYTES or 4KB 
-	unsigned int BitMap[BIT_RANGE];	// Bitmap of 256 bits to represent blocks of free or occupied
-	Metadata metadata[NUM_BLOCKS];	// Meta data goes here of size 256 as well
-} Superblock;
-
-
-// FileSystem struct
-typedef struct {
-    Superblock sb;  				// Superblock
-} FileSystem;
-
-
-// Initialize superblock at start up
-static void superblock_init(Superblock *sb, unsigned int totalNumBlocks, unsigned int blockSize) {
-    // sb->magicNumber = 0xfa19283e;
-	sb->magicNumber = "0xfa19283e ";
-    sb->totalNumBlocks = totalNumBlocks;
-    sb->blockSize = blockSize;
-	printf("superblock_init: size of int = %lu\n", sizeof(int));
-	
-	// Initialize all values in bitmap to 0 to set as free blocks
-	for(int i = 0; i < totalNumBlocks; i++) {
-		sb->metadata[i].fileName[0] = '\0';
-		sb->metadata[i].fileSize = 0;
-	}
-
-	for(int i = 0; i < BIT_RANGE; i++) {
-		sb->BitMap[i] = 0;
-	}
-
-	int fd = open("FS_FILE", O_WRONLY);
-	if(fd == -1) {
-		printf("filesys_init: unable to open FS_FILE\n");
-		exit(1);
-	}
-
-	lseek(fd, 0, SEEK_SET);
-	int res = write(fd, sb->magicNumber, strlen(sb->magicNumber));
-	if(res == -1) {
-		printf("Unable to write to first block of FS_FILE\n");
-		exit(1);
-	}
+#include "filesys.h"
+#include "format.h"
+#include "stats.h"
+#include "trace.h"
 
-	// Set index 0 of the bitmap = 1 since superblock occupies this
-	SETBIT(sb->BitMap, 0);
+// The kernel's inode numbers are the engine's, root included
+#if FUSE_ROOT_ID != AOFS_ROOT_INODE
+#error "the root inode must be FUSE_ROOT_ID"
+#endif
 
-	for(int i = 0; i < BIT_RANGE; i++) {
-		for(unsigned int j = 1 << 31; j > 0; j = j/2) {
-			(sb->BitMap[i] & j) ? write(fd, "1", 1) : write(fd, "0", 1);
-		}
-		write(fd, " ", 1);
-	}
-	close(fd);
-    printf("Initialized superblock with totalNumBlocks = %d and blockSize = %d and created bitmap for free blocks\n", sb->totalNumBlocks, sb->blockSize);
+static FileSystem fs;
+static unsigned int kernelCache;		// Seconds the kernel may cache attributes and names, 0 for no caching
+
+// Read-only files in the root showing the latency statistics, see stats.h.
+// They are not in the inode table; their inode numbers are the two past it.
+#define AOFS_STATS_NAME ".aofs_stats"
+#define AOFS_STATS_JSON_NAME ".aofs_stats.json"
+
+#define AOFS_KERNEL_CACHE_DEFAULT 60	// Seconds, see the kcache option
+#define AOFS_MAX_WRITE (128 * 1024)		// Largest write the kernel sends at once
+
+// 1 for the text stats file, 2 for the JSON one, 0 for any other inode
+static int stats_file(fuse_ino_t ino) {
+	if(ino == fs.sb.inodeCount)
+		return 1;
+	if(ino == fs.sb.inodeCount + 1)
+		return 2;
+	return 0;
 }
 
-// Initialize file system struct at start up
-static void filesys_init(FileSystem *filesystem, unsigned int totalNumBlocks, unsigned int blockSize) {
-    printf("Initializing file system struct ... \n");
-	int fd = open("FS_FILE", O_RDWR | O_TRUNC, 0644); // Open storage file
-	if(fd == -1) {
-		printf("filesys_init: unable to open FS_FILE\n");
-		exit(1);
-	}
-	printf("filesys_init: totalNumBlocks = %d and blockSize = %d\n", totalNumBlocks, blockSize);
-	unsigned int totalBytes = totalNumBlocks * blockSize;
-	printf("filesys_init: totalBytes = %d\n", totalBytes);
-	int res = ftruncate(fd, totalBytes);
-	if(res == -1) {
-		printf("filesys_init: unable to truncate file\n");
-	}
-	printf("filesys_init: truncated FS_FILE with size = %d bytes\n", totalNumBlocks * blockSize);
-	int position = lseek(fd, 0, SEEK_SET);
-	printf("filesys_init: lseek position = %d\n", position);
-	close(fd);
-    superblock_init(&filesystem->sb, totalNumBlocks, blockSize);
+// The same for a name in a directory
+static int stats_entry(fuse_ino_t parent, const char *name) {
+	if(parent != FUSE_ROOT_ID)
+		return 0;
+	if(strcmp(name, AOFS_STATS_NAME) == 0)
+		return 1;
+	if(strcmp(name, AOFS_STATS_JSON_NAME) == 0)
+		return 2;
+	return 0;
 }
 
-static void filesys_write_bitmap(FileSystem *fs) {
-
-	int fd = open("FS_FILE", O_WRONLY);
-	if(fd == -1) {
-		printf("filesys_init: unable to open FS_FILE\n");
-		exit(1);
-	}
-
-	lseek(fd, 11, SEEK_SET);
-	SETBIT(fs->sb.BitMap, 0);
-	for(int i = 0; i < BIT_RANGE; i++) {
-		for(unsigned int j = 1 << 31; j > 0; j = j/2) {
-			(fs->sb.BitMap[i] & j) ? write(fd, "1", 1) : write(fd, "0", 1);
-		}
-		write(fd, " ", 1);
-	}
-	close(fd);
-
+// A stats file as rendered at open, read from until release
+typedef struct {
+	size_t len;
+	char data[];
+} StatsSnapshot;
+
+static StatsSnapshot *stats_snapshot(int json) {
+	// Room for counts that gain digits between measuring and rendering
+	size_t size = stats_format(NULL, 0, json) + 1024;
+	StatsSnapshot *snap = malloc(sizeof(*snap) + size);
+	if(snap == NULL)
+		return NULL;
+	snap->len = stats_format(snap->data, size, json);
+	if(snap->len >= size)
+		snap->len = size - 1;
+	return snap;
 }
 
-static void filesys_load(FileSystem *fileSystem) {
-	// GO THROUGH FS_FILE AND FIND TO SEE IF CONTENT IS THERE. 
-	// IF THERE IS, LOAD IT INTO THE BITMAP WITH OCCUPIED = 1
-	// IF NOT, SET TO 0
-	// FOR EVERY INDEX * 4096 BYTES, CHECK IF CONTENT IS IN THERE
-	printf("Loading file system\n");
-	// fileSystem->FS_FILE = FS_FILE;
-	// fseek(FS_FILE, 0, SEEK_SET);
+static void stats_stat(int file, struct stat *stbuf) {
+	StatsSnapshot *snap = stats_snapshot(file == 2);
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = fs.sb.inodeCount - 1 + file;
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_size = snap ? snap->len : 0;
+	free(snap);
+}
 
-	// TEMPORARY HERE FOR TESTING
-	for(int i = 0; i < NUM_BLOCKS; i++) {
-		fileSystem->sb.metadata[i].fileName[0] = '\0';
-		fileSystem->sb.metadata[i].fileSize = 0;
-	}
+// Hand the kernel an entry found or made by the engine, which counts it as
+// a reference until the kernel forgets it
+static void reply_entry(fuse_req_t req, int res, const struct stat *st) {
+	struct fuse_entry_param e;
+
+	if(res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	memset(&e, 0, sizeof(e));
+	e.ino = res;
+	e.attr = *st;
+	e.attr_timeout = kernelCache;
+	e.entry_timeout = kernelCache;
+	fuse_reply_entry(req, &e);
 }
 
-static int filesys_find_file(FileSystem *fs, char *name) {
+// Every callback below gets inode numbers from the kernel and passes them
+// straight to the engine; only lookup, create, mknod, mkdir, unlink and
+// rmdir see a name, and only the one name within its directory.
 
-	printf("filesys_find_file called\n");
-	for(int i = 0; i < NUM_BLOCKS; i++) {
-		const char *fileTempName = fs->sb.metadata[i].fileName;
-		if(strcmp(fileTempName, name) == 0 && TESTBIT(fs->sb.BitMap, i)) {
-			printf("filesys_find_file: File was found with filename =%s\n", fs->sb.metadata[i].fileName);
-			return i;
-		}
-	}
-	return -1;
+static void aofs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	struct stat st;
+	int file = stats_entry(parent, name);
+	memset(&e, 0, sizeof(e));
+	if(file) {
+		// The size changes all the time
+		stats_stat(file, &e.attr);
+		e.ino = e.attr.st_ino;
+		e.entry_timeout = kernelCache;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	int res = filesys_lookup_at(&fs, parent, name, &st);
+	// A missing name is cached as long as a present one
+	if(res == -ENOENT && kernelCache > 0) {
+		e.entry_timeout = kernelCache;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	reply_entry(req, res, &st);
 }
 
+static void aofs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	filesys_forget(&fs, ino, nlookup);
+	fuse_reply_none(req);
+}
 
-static FileSystem fs;
-static const char *hello_str = "Hello World!\n";
-static const char *hello_path = "/hello";
+#if FUSE_VERSION >= 29
+static void aofs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	for(size_t i = 0; i < count; i++)
+		filesys_forget(&fs, forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+#endif
 
-static int aofs_getattr(const char *path, struct stat *stbuf)
+static void aofs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
 	// struct stat is the file's status
 	// struct stat {
@@ -197,728 +176,658 @@ static int aofs_getattr(const char *path, struct stat *stbuf)
 	// 	time_t    st_mtime;   /* time of last modification */
 	// 	time_t    st_ctime;   /* time of last status change */
 	// };
-	printf("aofs_getattr: attributes of path = %s requested\n", path);
-	memset(stbuf, 0, sizeof(struct stat));
-	char *name = malloc(strlen(path) + 1);
-	strcpy(name, path + 1);
-	printf("aofs_getattr: Filename = %s\n", name);
-	int res = 0;
-	int foundFlag = 0;
-	size_t fileSize = 0;
-	mode_t mode;
-	time_t atime;
-	time_t utime;
-	int index;
-
-	for(int i = 0; i < 10; i++) {
-		// TEST print first 3 fileNames in meta data bit map
-		printf("aofs_getattr: Index = %d, fileName = %s\n", i, fs.sb.metadata[i].fileName);
-	}
-
-	// Root directory
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-		free(name);
-		return res;
-	} 
-
-	index = filesys_find_file(&fs, name);
-	if(index != -1) {
-		foundFlag = 1;
-		fileSize = fs.sb.metadata[index].fileSize;
-		mode = fs.sb.metadata[index].mode;
-		atime = fs.sb.metadata[index].timeAccessed;
-		utime = fs.sb.metadata[index].timeUpdated;
-	}
-	// File was found in filesystem
-	if(foundFlag == 1) {
-		printf("aofs_getattr: %s: foundFlag was set, setting attributes\n", name);
-		stbuf->st_mode = mode;
-		stbuf->st_nlink = 1;
-		stbuf->st_size = fileSize;
-		stbuf->st_atime = atime;
-		stbuf->st_mtime = utime;
-	}
-	else {
-		printf("aofs_getattr: Path does not exist\n");
-		res = -ENOENT;
-	}
-	free(name);
-	return res;
+	(void) fi;
+	struct stat stbuf;
+	if(stats_file(ino)) {
+		stats_stat(stats_file(ino), &stbuf);
+		fuse_reply_attr(req, &stbuf, 0);
+		return;
+	}
+	int res = filesys_getattr_ino(&fs, ino, &stbuf);
+	if(res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_attr(req, &stbuf, kernelCache);
 }
 
-static int aofs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
+// Only the size can be set; the engine keeps no owner, and the times are
+// its own
+static void aofs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
 {
-	(void) offset;
 	(void) fi;
+	int res = 0;
+	if(stats_file(ino))
+		res = -EACCES;
+	else if(to_set & FUSE_SET_ATTR_SIZE)
+		res = filesys_truncate_ino(&fs, ino, attr->st_size);
+	if(res == 0) {
+		aofs_getattr(req, ino, NULL);
+		return;
+	}
+	fuse_reply_err(req, -res);
+}
 
-	printf("aofs_readdir: Grabbing list of files \n");
-	// -ENOENT Path doesn't exist
-	if (strcmp(path, "/") != 0)
-		return -ENOENT;
-
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
 
-	filler(buf, ".", NULL, 0); 		// Current directory
-	filler(buf, "..", NULL, 0); 	// Parent directory
+#if FUSE_VERSION >= 29
+// posix_fallocate, and on Linux fallocate(2) with KEEP_SIZE and PUNCH_HOLE
+static void aofs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	(void) fi;
+	int flags = (mode & FALLOC_FL_KEEP_SIZE ? AOFS_FALLOC_KEEP_SIZE : 0) | (mode & FALLOC_FL_PUNCH_HOLE ? AOFS_FALLOC_PUNCH_HOLE : 0);
+	int res;
+	if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		res = -EOPNOTSUPP;
+	else if(stats_file(ino))
+		res = -EACCES;
+	else
+		res = filesys_fallocate_ino(&fs, ino, flags, offset, length);
+	fuse_reply_err(req, -res);
+}
+#endif
 
-	for(int i = 0; i < NUM_BLOCKS; i++) {
-		if(strlen(fs.sb.metadata[i].fileName) != 0) {
-			printf("filesys_find_file: File was found with filename = %s\n", fs.sb.metadata[i].fileName);
-			filler(buf, fs.sb.metadata[i].fileName, NULL, 0);
-		}
-	}
+// Offsets given to the kernel: 1 to 4 for ".", ".." and, in the root, the
+// stats files, then the engine's offsets shifted past them
+#define AOFS_DIR_OFFSET_BASE 4
 
+// The reply buffer of one readdir call, for filesys_readdir_ino
+typedef struct {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+} ReaddirContext;
+
+static int readdir_add(ReaddirContext *rc, const char *name, const struct stat *st, off_t next) {
+	size_t len = fuse_add_direntry(rc->req, rc->buf + rc->used, rc->size - rc->used, name, st, next);
+	if(len > rc->size - rc->used)
+		return 1;
+	rc->used += len;
 	return 0;
 }
 
-static int aofs_open(const char *path, struct fuse_file_info *fi)
-{
-	printf("aofs_open: path = %s\n", path);
-	char *name = malloc(strlen(path) + 1);
-	strcpy(name, path + 1);	int fd;
-	int res;
+static int readdir_fill(void *ctx, const char *name, const struct stat *st, off_t next) {
+	return readdir_add(ctx, name, st, next + AOFS_DIR_OFFSET_BASE);
+}
 
-	// CHECK IF FILE EXISTS
-	// By for looping through the file 
-	res = filesys_find_file(&fs, name);
-	free(name);
-	if(res != -1) {
-		time_t timeAccessed = time(NULL);
-		fs.sb.metadata[res].timeAccessed = timeAccessed;
-		return 0;
-	}
-	// -EACCESS Requested permission isn't available
-	else if ((fi->flags & 3) != O_RDONLY)
-		return -EACCES;
-	else {
-		return -ENOENT;
+// ".", ".." and, in the root, the stats files; nonzero once the buffer is
+// full
+static int readdir_fixed(ReaddirContext *rc, fuse_ino_t ino, off_t offset) {
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFDIR | 0755;
+	if(offset < 1 && readdir_add(rc, ".", &st, 1)) 		// Current directory
+		return 1;
+	if(offset < 2 && readdir_add(rc, "..", &st, 2)) 	// Parent directory
+		return 1;
+	if(ino == FUSE_ROOT_ID) {
+		st.st_mode = S_IFREG | 0444;
+		if(offset < 3 && readdir_add(rc, AOFS_STATS_NAME, &st, 3))
+			return 1;
+		if(offset < 4 && readdir_add(rc, AOFS_STATS_JSON_NAME, &st, 4))
+			return 1;
 	}
+	return 0;
 }
 
-static int aofs_read(const char *path, char *buf, size_t size, off_t offset,
-		      struct fuse_file_info *fi)
+// The kernel calls again with the offset of the last entry it took until
+// a call adds nothing, so a large directory goes out one buffer per call
+static void aofs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t offset, struct fuse_file_info *fi)
 {
-	printf("aofs_read: path = %s\n", path);
-	printf("aofs_read: buf = %s\n", buf);
-	size_t len;
 	(void) fi;
-	char *name = malloc(strlen(path) + 1);
-	strcpy(name, path + 1);
-	int fd;
-	int res;
-	int index;
-	int fileOffSet;
-	int position;
-	int fileSize;
-
-	fd = open("FS_FILE", O_RDWR, 0644); // Open storage file
-	if(fd == -1) {
-		printf("aofs_read: FS_FILE was unable to open\n");
-		free(name);
-		exit(1);
-	}
-	index = filesys_find_file(&fs, name);
-	free(name);
-	if(index == -1) {
-		printf("filesys_find_file returned -1, unable to find file\n");
-		return -1;
-	}
+	ReaddirContext rc = { req, malloc(size), size, 0 };
+	int res = 0;
 
-	if(fs.sb.metadata[index].nextBlock) {
-		time_t timeAccessed = time(NULL);
-		printf("aofs_read: Detected a file with a next block filled\n");
-		int size1 = 3000;
-		int size2 = fs.sb.metadata[index].fileSize - size1;
-		fileSize = fs.sb.metadata[index].fileSize;
-		char buf1[size1];	// First 3000
-		char buf2[size2];	// Leftover
-		int nextIndex = fs.sb.metadata[index].nextBlock;
-
-		// Read from first block
-		fileOffSet = index * MAX_BLOCK_SIZE;
-		fileOffSet = fileOffSet + META_RANGE;
-		position = lseek(fd, fileOffSet, SEEK_SET);
-		res = read(fd, buf1, size1);
-		if(res == -1) {
-			printf("aofs_read: Unable to read from FS_FILE first block\n");
-			exit(1);
-		}
+	if(rc.buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	// -ENOENT Directory doesn't exist, -ENOTDIR it is a file
+	if(stats_file(ino))
+		res = -ENOTDIR;
+	else if(!readdir_fixed(&rc, ino, offset))
+		res = filesys_readdir_ino(&fs, ino, offset > AOFS_DIR_OFFSET_BASE ? offset - AOFS_DIR_OFFSET_BASE : 0, readdir_fill, &rc);
+	if(res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_buf(req, rc.buf, rc.used);
+	free(rc.buf);
+}
 
-		// Read from second block
-		fileOffSet = nextIndex * MAX_BLOCK_SIZE;
-		fileOffSet = fileOffSet + META_RANGE;
-		position = lseek(fd, fileOffSet, SEEK_SET);
-		res = read(fd, buf2, size2);
-		if(res == -1) {
-			printf("aofs_read: Unable to read from FS_FILe second block\n");
-			exit(1);
+static void aofs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	// The stats are rendered once, so a reader sees one consistent snapshot
+	if(stats_file(ino)) {
+		if((fi->flags & 3) != O_RDONLY) {
+			fuse_reply_err(req, EACCES);
+			return;
+		}
+		StatsSnapshot *snap = stats_snapshot(stats_file(ino) == 2);
+		if(snap == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
 		}
+		fi->fh = (uintptr_t) snap;
+		fi->direct_io = 1;
+		fuse_reply_open(req, fi);
+		return;
+	}
+
+	// Every change goes through this daemon and so through the kernel, but
+	// pages are only kept across opens when the content has not changed
+	// since the last one, so nothing stale is ever served
+	int unchanged = 0;
+	int res = filesys_open_ino(&fs, ino, &unchanged);
+	// Each open follows its own reads, for readahead
+	ReadStream *rs = res == 0 ? calloc(1, sizeof(ReadStream)) : NULL;
+	if(res == 0 && rs == NULL)
+		res = -ENOMEM;
+	if(res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	if(kernelCache > 0)
+		fi->keep_cache = unchanged;
+	fi->fh = (uintptr_t) rs;
+	if(fuse_reply_open(req, fi) == -ENOENT)
+		free(rs);
+}
 
-		// Combine buf1 and buf2
-		int j = 0;
-		for(int i = 0; i < fileSize; i++) {
-			if(i < 3000) {
-				// read buf1 into buf
-				buf[i] = buf1[i];
-			}
-			else {
-				// read buf2 into buf
-				buf[i] = buf2[j];
-				j++;
-			}
+static void aofs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+	// Each thread of the session loop reads into a buffer of its own
+	static __thread char *readBuf;
+	static __thread size_t readBufSize;
+
+	if(stats_file(ino)) {
+		StatsSnapshot *snap = (StatsSnapshot *) (uintptr_t) fi->fh;
+		if(offset >= (off_t) snap->len)
+			size = 0;
+		else if(size > snap->len - offset)
+			size = snap->len - offset;
+		fuse_reply_buf(req, snap->data + (size ? offset : 0), size);
+		return;
+	}
+	if(size > readBufSize) {
+		char *grown = realloc(readBuf, size);
+		if(grown == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
 		}
-		close(fd);
-		fs.sb.metadata[index].timeAccessed = timeAccessed;
-		return fileSize;
-	}
+		readBuf = grown;
+		readBufSize = size;
+	}
+	ssize_t res = filesys_read_stream_ino(&fs, ino, (ReadStream *) (uintptr_t) fi->fh, readBuf, size, offset);
+	if(res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_buf(req, readBuf, res);
+}
 
-	time_t timeAccessed = time(NULL);
-	
-	printf("aofs_read: found file: %s at index = %d\n", fs.sb.metadata[index].fileName, index);
-	fileSize = fs.sb.metadata[index].fileSize;
-	fileOffSet = index * MAX_BLOCK_SIZE;
-	fileOffSet = fileOffSet + META_RANGE;
-	position = lseek(fd, fileOffSet, SEEK_SET);
-	res = read(fd, buf, fileSize);		// Read first fileSize bytes for content data
-	printf("aofs_read: after read ... buf = %s\n", buf);
-	close(fd);
-	fs.sb.metadata[index].timeAccessed = timeAccessed;
-	return res;
-}
-
-static int aofs_write(const char *path, const char *buf, size_t size, off_t offset, 
+static void aofs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, 
 				struct fuse_file_info *fi)
 {
-	printf("aofs_write: path = %s\n", path);
-	printf("aofs_write: buf = %s\n", buf);
-	printf("aofs_write: size = %zu\n", size);
-	printf("aofs_write: offset = %ld\n", offset);
-	int fd;
-	int res;
-	int res1;
-	int index;
-	int index2;
-	int fileOffSet;
-	int position;
-	int FILE_BIG_FLAG = 0;
-	char *name = malloc(strlen(path) + 1);
-	strcpy(name, path + 1);
-	char metaBuf[META_RANGE] ="";
-
-	// O_TRUNC OVERWRITES EXISTING DATA
-	// O_APPEND APPENDS AFTER EXISTING DATA
-	// fd = open("FS_FILE", O_RDWR | O_TRUNC, 0644); // Open storage file // O_TRUNC literally overwrites everything
-	fd = open("FS_FILE", O_RDWR , 0644); // Open storage file
-	if(fd == -1) {
-		printf("aofs_write: FS_FILE was unable to open\n");
-		free(name);
-		exit(1);
-	}
+	(void) fi;
+	ssize_t res = stats_file(ino) ? -EACCES : filesys_write_ino(&fs, ino, buf, size, offset);
+	if(res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_write(req, res);
+}
 
-	index = filesys_find_file(&fs, name); // Check to make sure file is in FS_FILE
-	if(index == -1) {
-		printf("filesys_find_file returned -1, unable to find file\n");
-		free(name);
-		return -1;
-	}
+static void aofs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	// The stream comes first so running out of memory leaves no file behind
+	ReadStream *rs = calloc(1, sizeof(ReadStream));
+	int res = -ENOMEM;
+	if(rs != NULL)
+		res = stats_entry(parent, name) ? -EEXIST : filesys_create_at(&fs, parent, name, mode, &e.attr);
+	if(res < 0) {
+		free(rs);
+		fuse_reply_err(req, -res);
+		return;
+	}
+	e.ino = res;
+	e.attr_timeout = kernelCache;
+	e.entry_timeout = kernelCache;
+	fi->fh = (uintptr_t) rs;
+	if(fuse_reply_create(req, &e, fi) == -ENOENT)
+		free(rs);
+}
 
-	// Check if size of buf is greater than BLOCKSIZE - METARANGE
-	if(size > MAX_BLOCK_SIZE - META_RANGE) {
-		printf("aofs_write: file's buf is greater than 3000\n");
-		FILE_BIG_FLAG = 1;		// set flag to write to 2 files rather than 1
-		// Find an empty free block
-		for(int i = 1; i < NUM_BLOCKS; i++) {
-			if(!TESTBIT(fs.sb.BitMap, i)) {
-				printf("Bit %d is free\n", i);
-				index2 = i;
-				break;
-			}
-		}
-	}
-	
-	// Size is bigger than 4KB
-	if(FILE_BIG_FLAG) {
-		time_t timeUpdated = time(NULL);
-		time_t timeAccessed = time(NULL);
-		printf("aofs_write: size is greater than 3000\n");
-		int size2 = size - 3000;		// leftovers after writing to first file
-		int firstSize = MAX_BLOCK_SIZE - META_RANGE;
-		char buf1[3000];
-		char buf2[size2];
-
-		int j = 0;
-		for(int i = 0; i < size; i++) {
-			if(i >= firstSize) {
-				buf2[j] = buf[i];
-				j++;
-			}
-			else {
-				buf1[i] = buf[i];
-			}
-		}
+// Regular files only; there is nowhere to keep a device number
+static void aofs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+	(void) rdev;
+	struct stat st;
+	TRACE_INFO(TRACE_MKNOD, mode, 0, 0);
+	int res = -EPERM;
+	if(stats_entry(parent, name))
+		res = -EEXIST;
+	else if(S_ISREG(mode))
+		res = filesys_create_at(&fs, parent, name, mode, &st);
+	reply_entry(req, res, &st);
+}
 
+static void aofs_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	(void) ino;
+	(void) mask;
+	fuse_reply_err(req, 0);
+}
 
-		printf("aofs_write: buf1 = %s\n", buf1);
-		printf("aofs_write: buf2 = %s\n", buf2);
-
-		printf("aofs_write: leftover size = %d\n", size2);
-		
-		// Write to meta data of first block
-		fileOffSet = index * MAX_BLOCK_SIZE;
-		position = lseek(fd, fileOffSet, SEEK_SET);
-		sprintf(metaBuf, "FILE NAME = %s, FILE SIZE = %lu, BLOCK INDEX = %d, MODE = %d, TIME CREATED = %ld, TIME UPDATED = %ld, TIME ACCESSED = %ld", name, strlen(buf), index, fs.sb.metadata[index].mode, fs.sb.metadata[index].timeCreated, timeUpdated, timeAccessed);
-		res = write(fd, metaBuf, strlen(metaBuf));
-		if(res == -1) {
-			printf("aofs_write: File: %s was unable to write to FS_FILE disk with meta data\n", name);
-			free(name);
-			exit(1);
-		}
 
-		// Write to file content of first block
-		fileOffSet = fileOffSet + META_RANGE;
-		printf("aofs_write: File content fileOffSet = %d\n", fileOffSet);
-		position = lseek(fd, fileOffSet, SEEK_SET);
-		printf("aofs_write: lseek file content position = %d\n", position);
-		res1 = write(fd, &buf1, firstSize);
-		if(res1 == -1) {
-			printf("aofs_write: File: %s was unable to write to FS_FILE disk with file content data in first block\n", name);
-			free(name);
-			exit(1);
-		}
-		printf("aofs_write: this is leftover write buf = %s\n", buf);
-
-		// Write to meta data of second block
-		fileOffSet = index2 * MAX_BLOCK_SIZE;
-		position = lseek(fd, fileOffSet, SEEK_SET);
-		sprintf(metaBuf, "FILE NAME = %s, FILE SIZE = %lu, BLOCK INDEX = %d, MODE = %d, TIME CREATED = %ld, TIME UPDATED = %ld, TIME ACCESSED = %ld", name, strlen(buf), index2, fs.sb.metadata[index].mode, fs.sb.metadata[index].timeCreated, timeUpdated, timeAccessed);
-		int res2 = write(fd, metaBuf, strlen(metaBuf));
-		if(res2 == -1) {
-			printf("aofs_write: File: %s was unable to write to FS_FILE disk with meta data\n", name);
-			free(name);
-			exit(1);
-		}
-
-		// Write to file content of second block
-		fileOffSet = fileOffSet + META_RANGE;
-		position = lseek(fd, fileOffSet, SEEK_SET);
-		int res3 = write(fd, &buf2, strlen(buf2));
-		if(res3 == -1) {
-			printf("aofs_write: File: %s was unable to write to FS_FILE disk with content data in second block\n", name);
-			free(name);
-			exit(1);
-		}
+static void aofs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int res = stats_entry(parent, name) ? -EACCES : filesys_unlink_at(&fs, parent, name);
+	fuse_reply_err(req, -res);
+}
 
-		SETBIT(fs.sb.BitMap, index2);
-		strncpy(fs.sb.metadata[index].fileName, name, sizeof(fs.sb.metadata[index].fileName)-1);
-		// strncpy(fs.sb.metadata[index2].fileName, name, sizeof(fs.sb.metadata[index2].fileName)-1);
-		fs.sb.metadata[index].fileName[sizeof(fs.sb.metadata[index].fileName)-1] = '\0';
-		// fs.sb.metadata[index2].fileName[sizeof(fs.sb.metadata[index2].fileName)-1] = '\0';
-		fs.sb.metadata[index].fileSize = size;
-		// fs.sb.metadata[index2].fileSize = size;
-		fs.sb.metadata[index].blockIndex = index;
-		// fs.sb.metadata[index2].blockIndex = index2;
-		fs.sb.metadata[index].timeUpdated = timeUpdated;
-		// fs.sb.metadata[index2].timeUpdated = timeUpdated;
-		fs.sb.metadata[index].timeAccessed = timeAccessed;
-		// fs.sb.metadata[index2].timeAccessed = timeAccessed;
-		fs.sb.metadata[index].nextBlock = index2;
-		printf("aofs_write: time updated = %ld\n", fs.sb.metadata[index].timeUpdated);
-		printf("aofs_write: metadata fileSize = %d\n", fs.sb.metadata[index].fileSize);
-
-		int totalBytes = NUM_BLOCKS * MAX_BLOCK_SIZE;
-		int trunc = ftruncate(fd, totalBytes);
-		if(trunc == -1) {
-			printf("aofs_write: unable to truncate file\n");
-		}
-		filesys_write_bitmap(&fs);
+static void aofs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	struct stat st;
+	int res = stats_entry(parent, name) ? -EEXIST : filesys_mkdir_at(&fs, parent, name, mode, &st);
+	reply_entry(req, res, &st);
+}
 
-		close(fd);
-		free(name);
-		return size;
-	}
+static void aofs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int res = stats_entry(parent, name) ? -ENOTDIR : filesys_rmdir_at(&fs, parent, name);
+	fuse_reply_err(req, -res);
+}
 
+static void aofs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	(void) ino;
+	struct statvfs stbuf;
+	filesys_statfs(&fs, &stbuf);
+	fuse_reply_statfs(req, &stbuf);
+}
 
-	printf("aofs_write: found file: %s at index = %d\n", fs.sb.metadata[index].fileName, index);
-	time_t timeUpdated = time(NULL);
-	time_t timeAccessed = time(NULL);
-
-	// Write to block's metadata
-	fileOffSet = index * MAX_BLOCK_SIZE;
-	printf("aofs_write: metadata fileOffSet = %d\n", fileOffSet);
-	position = lseek(fd, fileOffSet, SEEK_SET);
-	printf("aofs_write: lseek metadata position = %d\n", position);
-	sprintf(metaBuf, "FILE NAME = %s, FILE SIZE = %lu, BLOCK INDEX = %d, MODE = %d, TIME CREATED = %ld, TIME UPDATED = %ld, TIME ACCESSED = %ld", name, strlen(buf), index, fs.sb.metadata[index].mode, fs.sb.metadata[index].timeCreated, timeUpdated, timeAccessed);
-	printf("aofs_write: metaBuf = %s\n", metaBuf);
-	res = write(fd, metaBuf, strlen(metaBuf));
-	if(res == -1) {
-		printf("aofs_write: File: %s was unable to write to FS_FILE disk with meta data\n", name);
-		free(name);
-		exit(1);
-	}
+static void aofs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	(void) ino;
+	(void) datasync;
+	(void) fi;
+	fuse_reply_err(req, -filesys_sync(&fs));
+}
 
-	// Write to block's content data
-	fileOffSet = fileOffSet + META_RANGE;
-	printf("aofs_write: File content fileOffSet = %d\n", fileOffSet);
-	position = lseek(fd, fileOffSet, SEEK_SET);
-	printf("aofs_write: lseek file content position = %d\n", position);
-	res1 = write(fd, buf, size);
-	if(res1 == -1) {
-		printf("aofs_write: File: %s was unable to write to FS_FILE disk with file content data\n", name);
-		free(name);
-		exit(1);
+static void aofs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int res = 0;
+	if(stats_file(ino)) {
+		free((StatsSnapshot *) (uintptr_t) fi->fh);
 	}
-
-	strncpy(fs.sb.metadata[index].fileName, name, sizeof(fs.sb.metadata[index].fileName)-1);
-	fs.sb.metadata[index].fileName[sizeof(fs.sb.metadata[index].fileName)-1] = '\0';
-	fs.sb.metadata[index].fileSize = size;
-	fs.sb.metadata[index].blockIndex = index;
-	// fs.sb.metadata[index].mode = S_IFREG | 0644;
-	fs.sb.metadata[index].timeUpdated = timeUpdated;
-	fs.sb.metadata[index].timeAccessed = timeAccessed;
-	printf("aofs_write: time updated = %ld\n", fs.sb.metadata[index].timeUpdated);
-	printf("aofs_write: metadata fileSize = %d\n", fs.sb.metadata[index].fileSize);
-
-	int totalBytes = NUM_BLOCKS * MAX_BLOCK_SIZE;
-	int trunc = ftruncate(fd, totalBytes);
-	if(trunc == -1) {
-		printf("aofs_write: unable to truncate file\n");
+	else {
+		free((ReadStream *) (uintptr_t) fi->fh);
+		res = filesys_release_ino(&fs, ino);
 	}
-
-	close(fd);
-	filesys_write_bitmap(&fs);
-	free(name);
-	return size;
+	fuse_reply_err(req, -res);
 }
 
-static int aofs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
-{
+// The one extended attribute: "1" if the file is compressed, else "0".
+// Setting it only works while the file is empty.
+#define AOFS_XATTR_COMPRESS "user.aofs.compress"
 
-	printf("aofs_create: path = %s\n", path);
-	char *name = malloc(strlen(path) + 1);
-	strcpy(name, path + 1);
-	printf("aofs_create: filename = %s\n", name);
-	
-	/*
-		When you create a file, you open FS_FILE and write to FS_FILE of the file content
-		by finding the first free block. In order to find a free block, iterate through the bitmap
-		and once you find a free block, do index of where bitmap was found multiplied by 4096 BYTES
-		which becomes the index byte to write to the FS_FILE. 
-	*/
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
 
+static void aofs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags)
+{
+	(void) flags;
 	int res;
-	int fd;
-	int index;
-	int fileOffSet;
-	char buf[META_RANGE] = "";
-	char *emptyBuf = "";
-	fd = open("FS_FILE", O_WRONLY);
-	if(fd == -1) {
-		printf("aofs_create: FS_FILE did not open correctly\n");
-		free(name);
-		exit(1);
-	}
-
-	// Find free block inside of superblock
-	// After writing to FS_FILE, set bitmap[index] = 1 for occupied
-	for(int i = 1; i < NUM_BLOCKS; i++) {
-		if(!TESTBIT(fs.sb.BitMap, i)) {
-			printf("Bit %d is free\n", i);
-			index = i;
-			break;
-		}
-	}
+	if(strcmp(name, AOFS_XATTR_COMPRESS) != 0)
+		res = -ENOTSUP;
+	else if(stats_file(ino))
+		res = -EACCES;
+	else if(size != 1 || (value[0] != '0' && value[0] != '1'))
+		res = -EINVAL;
+	else
+		res = filesys_set_compress_ino(&fs, ino, value[0] == '1');
+	fuse_reply_err(req, -res);
+}
 
-	time_t timeCreated = time(NULL);
-	time_t timeAccessed = time(NULL);
-
-	// Write to block's metadata
-	printf("aofs_create: Free index found at index = %d\n", index);
-	fileOffSet = index * MAX_BLOCK_SIZE;
-	printf("aofs_create: File meta data Offset = %d\n", fileOffSet);	
-	int position = lseek(fd, fileOffSet, SEEK_SET);
-	printf("aofs_create: lseek meta data position = %d\n", position);
-	sprintf(buf, "FILE NAME = %s, FILE SIZE = %d, BLOCK INDEX = %d, MODE = %d, TIME CREATED = %ld, TIME UPDATED = 0, TIME ACCESSED = %ld", name, 0, index, mode, timeCreated, timeAccessed);
-	printf("aofs_create: buf = %s\n", buf);
-	res = write(fd, &buf, strlen(buf));
-	if(res == -1) {
-		printf("aofs_create: File: %s was unable to write to FS_FILE disk Meta Data \n", name);
-		free(name);
-		exit(1);
-	}
+static void aofs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+	int res = strcmp(name, AOFS_XATTR_COMPRESS) != 0 || stats_file(ino) ? -ENOATTR : filesys_get_compress_ino(&fs, ino);
+	if(res < 0)
+		fuse_reply_err(req, -res);
+	else if(size == 0)
+		fuse_reply_xattr(req, 1);
+	else
+		fuse_reply_buf(req, res ? "1" : "0", 1);
+}
 
-	// Write to block's content data
-	fileOffSet = fileOffSet + META_RANGE;
-	printf("aofs_create: File content data Offset = %d\n", fileOffSet);
-	position = lseek(fd, fileOffSet, SEEK_SET);
-	printf("aofs_create: lseek file content position = %d\n", position);
-	res = write(fd, emptyBuf, 0);
-	if(res == -1) {
-		printf("aofs_create: File: %s was unable to write to FS_FILE disk Content Data \n", name);
-		free(name);
-		exit(1);
-	}
-	SETBIT(fs.sb.BitMap, index);
-	strncpy(fs.sb.metadata[index].fileName, name, sizeof(fs.sb.metadata[index].fileName)-1);
-	fs.sb.metadata[index].fileName[sizeof(fs.sb.metadata[index].fileName)-1] = '\0';
-	fs.sb.metadata[index].fileSize = 0;
-	fs.sb.metadata[index].blockIndex = index;
-	fs.sb.metadata[index].mode = mode;
-	fs.sb.metadata[index].timeCreated = timeCreated;
-	fs.sb.metadata[index].timeAccessed = timeAccessed;	
-	printf("aofs_create: FS_FILE time created = %ld\n", fs.sb.metadata[index].timeCreated);
-	printf("aofs_create: FS_FILE file name at index %d = %s\n", index, fs.sb.metadata[index].fileName);
-	
-	int totalBytes = NUM_BLOCKS * MAX_BLOCK_SIZE;
-	int trunc = ftruncate(fd, totalBytes);
-	if(trunc == -1) {
-		printf("aofs_write: unable to truncate file\n");
-	}
+// Each entry point is timed as a whole, reply included, into its
+// operation statistic
+#define AOFS_TIMED(stat, call) \
+	uint64_t start = stats_now(); \
+	call; \
+	stats_end(stat, start);
 
-	close(fd);
-	filesys_write_bitmap(&fs);
-	free(name);
-	return 0;
+static void timed_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	AOFS_TIMED(STAT_LOOKUP, aofs_lookup(req, parent, name))
 }
 
-// Update the last access time of the given object from ts[0] and the 
-// last modification time from ts[1]. Both time specifications are given 
-// to nanosecond resolution, but your filesystem doesn't have to be that 
-// precise; see utimensat(2) for full details. Note that the time specifications 
-// are allowed to have certain special values; however, I don't know if FUSE functions 
-// have to support them. This function isn't necessary but is nice to have in a fully functional filesystem.
-static int aofs_utimens(const char *path, const struct timespec ts[2], struct fuse_file_info *fi)
+static void timed_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
 {
-	(void) fi;
-	int res;
-	
-	printf("aofs_utimen: path = %s\n", path);
-	res = utimensat(0, path, ts, AT_SYMLINK_NOFOLLOW);
-	if (res == -1)
-			return -errno;
-	return 0;
+	AOFS_TIMED(STAT_FORGET, aofs_forget(req, ino, nlookup))
 }
 
-
-static int aofs_mknod(const char *path, mode_t mode, dev_t rdev)
+#if FUSE_VERSION >= 29
+static void timed_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
 {
-	printf("mknod function has been called!\n");
-	printf("path = %s\n", path);
-	return 0;
+	AOFS_TIMED(STAT_FORGET, aofs_forget_multi(req, count, forgets))
 }
+#endif
 
-static int aofs_access(const char *path, int i)
+static void timed_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	printf("aofs_access called\n");
-    return 0;
+	AOFS_TIMED(STAT_GETATTR, aofs_getattr(req, ino, fi))
 }
 
+static void timed_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	AOFS_TIMED(STAT_SETATTR, aofs_setattr(req, ino, attr, to_set, fi))
+}
 
-static int aofs_unlink(const char *path) {
-	printf("aofs_unlink function called\n");
-	char *name = malloc(strlen(path) + 1);
-	strcpy(name, path + 1);
-	printf("aofs_unlink: filename = %s\n", name);
+static void timed_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	AOFS_TIMED(STAT_READDIR, aofs_readdir(req, ino, size, offset, fi))
+}
 
-	int fileSize;
+static void timed_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	AOFS_TIMED(STAT_OPEN, aofs_open(req, ino, fi))
+}
 
-	// find the file name in the file system
-	int index = filesys_find_file(&fs, name);
-	if(index == -1) {
-		printf("filesys_find_file returned -1, unable to find file\n");
-		free(name);
-		return -1;
-	}
+static void timed_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+	AOFS_TIMED(STAT_READ, aofs_read(req, ino, size, offset, fi))
+}
 
-	fileSize = fs.sb.metadata[index].fileSize;
-	char emptyBuf[fileSize];
-	for(int i = 0; i < fileSize; i++) {
-		emptyBuf[i] = 0;
-	}
-	
-	char metaBuf[META_RANGE];
-	for(int i = 0; i < META_RANGE; i++) {
-		metaBuf[i] = 0;
-	}
-	
-	// index has file we want to delete from file system
-	// open up FS_FILE
-	int fd = open("FS_FILE", O_WRONLY); // Open storage file
-	if(fd == -1) {
-		printf("aofs_write: FS_FILE was unable to open\n");
-		free(name);
-		exit(1);
-	}
+static void timed_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+	AOFS_TIMED(STAT_CREATE, aofs_create(req, parent, name, mode, fi))
+}
 
-	// Check if there is nextBlock
-	int nextIndex = fs.sb.metadata[index].nextBlock;
-	if(nextIndex) {
-		printf("aofs_unlink: detected next block!\n");
-		char emptyThreeBuf[3000];
-		for(int i = 0; i < 3000; i++) {
-			emptyThreeBuf[i] = 0;
-		}
+static void timed_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi)
+{
+	AOFS_TIMED(STAT_WRITE, aofs_write(req, ino, buf, size, offset, fi))
+}
 
-		// Write to first block meta data
-		int fileOffSet = index * MAX_BLOCK_SIZE;
-		int position = lseek(fd, fileOffSet, SEEK_SET);
-		int res = write(fd, &metaBuf, META_RANGE);
-		if(res == -1) {
-			printf("aofs_unlink: Unable to write to FS_FILE disk first block meta data\n");
-			free(name);
-			exit(1);
-		}
+static void timed_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+	AOFS_TIMED(STAT_MKNOD, aofs_mknod(req, parent, name, mode, rdev))
+}
 
-		// Write to frst block file content data
-		fileOffSet = fileOffSet + META_RANGE;
-		position = lseek(fd, fileOffSet, SEEK_SET);
-		res = write(fd, &emptyThreeBuf, 3000);
-		if(res == -1) {
-			printf("aofs_unlink: Unable to write to FS_FILE disk first block content data\n");
-			free(name);
-			exit(1);
-		}
+static void timed_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	AOFS_TIMED(STAT_ACCESS, aofs_access(req, ino, mask))
+}
 
-		// Write to second block meta data
-		fileOffSet = nextIndex * MAX_BLOCK_SIZE;
-		position = lseek(fd, fileOffSet, SEEK_SET);
-		res = write(fd, &metaBuf, META_RANGE);
-		if(res == -1) {
-			printf("aofs_unlink: Unable to write to FS_FILE disk second block meta data\n");
-			free(name);
-			exit(1);
-		}
+static void timed_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	AOFS_TIMED(STAT_UNLINK, aofs_unlink(req, parent, name))
+}
 
-		// Write to second block content data
-		fileOffSet = fileOffSet + META_RANGE;
-		position = lseek(fd, fileOffSet, SEEK_SET);
-		res = write(fd, &emptyThreeBuf, 3000);
-		if(res == -1) {
-			printf("aofs_unlink: Unable to write to FS_FILE disk second block meta data\n");
-			free(name);
-			exit(1);
-		}
-		// Upon successful deletion of the file
-		CLEARBIT(fs.sb.BitMap, index);
-		CLEARBIT(fs.sb.BitMap, nextIndex);
-		for(int i = 0; i < 24; i++) {
-			fs.sb.metadata[index].fileName[i] = 0;
-		}
-		fs.sb.metadata[index].fileSize = 0;
-		fs.sb.metadata[index].blockIndex = 0;
-		fs.sb.metadata[index].mode = 0;
-		fs.sb.metadata[index].timeCreated = 0;
-		fs.sb.metadata[index].timeUpdated = 0;
-
-		int totalBytes = NUM_BLOCKS * MAX_BLOCK_SIZE;
-		int trunc = ftruncate(fd, totalBytes);
-		if(trunc == -1) {
-			printf("aofs_write: unable to truncate file\n");
-		}
-		close(fd);
-		filesys_write_bitmap(&fs);
-		return 0;
+static void timed_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	AOFS_TIMED(STAT_MKDIR, aofs_mkdir(req, parent, name, mode))
+}
 
-	}
+static void timed_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	AOFS_TIMED(STAT_RMDIR, aofs_rmdir(req, parent, name))
+}
 
-	// Write to meta data
-	int fileOffSet = index * MAX_BLOCK_SIZE;		// Meta data offset
-	printf("aofs_unlink: File meta data Offset = %d\n", fileOffSet);	
-	int position = lseek(fd, fileOffSet, SEEK_SET);
-	printf("aofs_unlink: lseek meta data position = %d\n", position);
-	int res = write(fd, &metaBuf, META_RANGE);
-	if(res == -1) {
-		printf("aofs_unlink: File: %s was unable to write to FS_FILE disk Meta Data \n", name);
-		free(name);
-		exit(1);
-	}
+static void timed_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	AOFS_TIMED(STAT_STATFS, aofs_statfs(req, ino))
+}
 
-	// Write to block's content data
-	fileOffSet = fileOffSet + META_RANGE;
-	printf("aofs_unlink: File content data Offset = %d\n", fileOffSet);
-	position = lseek(fd, fileOffSet, SEEK_SET);
-	printf("aofs_unlink: lseek file content position = %d\n", position);
-	res = write(fd, &emptyBuf, fileSize);
-	if(res == -1) {
-		printf("aofs_unlink: File: %s was unable to write to FS_FILE disk Content Data \n", name);
-		free(name);
-		exit(1);
-	}
+static void timed_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	AOFS_TIMED(STAT_FSYNC, aofs_fsync(req, ino, datasync, fi))
+}
 
-	// Upon successful deletion of the file
-	CLEARBIT(fs.sb.BitMap, index);
-	for(int i = 0; i < 24; i++) {
-		fs.sb.metadata[index].fileName[i] = 0;
-	}
-	fs.sb.metadata[index].fileSize = 0;
-	fs.sb.metadata[index].blockIndex = 0;
-	fs.sb.metadata[index].mode = 0;
-	fs.sb.metadata[index].timeCreated = 0;
-	fs.sb.metadata[index].timeUpdated = 0;
-
-	int totalBytes = NUM_BLOCKS * MAX_BLOCK_SIZE;
-	int trunc = ftruncate(fd, totalBytes);
-	if(trunc == -1) {
-		printf("aofs_write: unable to truncate file\n");
-	}
-	close(fd);
-	filesys_write_bitmap(&fs);
-	return 0;
+static void timed_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	AOFS_TIMED(STAT_RELEASE, aofs_release(req, ino, fi))
 }
 
-static int aofs_statfs(const char *path, struct statvfs *stbuf) {
-	printf("aofs_statfs function called\n");
-	int res;
-	char *name = malloc(strlen(path) + 1);
-	strcpy(name, path + 1);
-	res = statvfs(name, stbuf);
-	free(name);
-	if(res == -ENOENT) {
-		return -errno;
-	}
-	return 0;
+static void timed_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags)
+{
+	AOFS_TIMED(STAT_SETXATTR, aofs_setxattr(req, ino, name, value, size, flags))
 }
 
-static int aofs_truncate(const char *path, off_t size)
+static void timed_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
 {
-	(void) path;
-	(void) size;
-	printf("aofs_truncate function called\n");
+	AOFS_TIMED(STAT_GETXATTR, aofs_getxattr(req, ino, name, size))
+}
 
-    return 0;
+#if FUSE_VERSION >= 29
+static void timed_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	AOFS_TIMED(STAT_FALLOCATE, aofs_fallocate(req, ino, mode, offset, length, fi))
 }
+#endif
+
+static struct fuse_lowlevel_ops aofs_oper = {
+	.lookup		= timed_lookup,
+	.forget		= timed_forget,
+#if FUSE_VERSION >= 29
+	.forget_multi	= timed_forget_multi,
+#endif
+	.getattr	= timed_getattr,
+	.setattr	= timed_setattr,
+	.readdir	= timed_readdir,
+	.open		= timed_open,
+	.read		= timed_read,
+	.create		= timed_create,
+	.write		= timed_write,
+	.mknod		= timed_mknod,
+	.access		= timed_access,
+	.unlink		= timed_unlink,
+	.mkdir		= timed_mkdir,
+	.rmdir		= timed_rmdir,
+	.statfs		= timed_statfs,
+	.fsync		= timed_fsync,
+	.release	= timed_release,
+	.setxattr	= timed_setxattr,
+	.getxattr	= timed_getxattr,
+#if FUSE_VERSION >= 29
+	.fallocate	= timed_fallocate,
+#endif
+};
 
+// Mount options, e.g. -o image=/data/vol.img,blocks=2621440,blocksize=65536
+// The geometry options only apply when the image does not exist yet;
+// mkaofs formats an image ahead of time.
+// backend=mmap maps the image instead of using pread/pwrite; backend=uring
+// issues the block transfers of each operation together through io_uring,
+// backend=threads through worker threads (uring falls back to those where
+// io_uring is unavailable). sync=fsync (default), periodic or always
+// decides when the mapping is msynced, and sync_interval sets the period
+// in seconds for sync=periodic.
+// cache_size=N is the block cache in MB, 0 to turn it off; the mmap backend
+// has no cache since the page cache already holds the mapping.
+// commit=N commits the metadata journal every N seconds (default 5); 0
+// commits before each operation returns.
+// trace=path records binary trace events into path for aofstrace.
+// kcache=N lets the kernel cache attributes, names and missing names for N
+// seconds and keep file pages across opens (default 60); 0 sends every
+// lookup and read to the daemon. Writes of up to AOFS_MAX_WRITE arrive in
+// one call, unless -o max_write says otherwise.
+// compress has every file created from then on compressed; the
+// user.aofs.compress attribute does the same for one empty file.
+// dedup has full blocks written from then on share a block already
+// holding the same bytes.
+// readahead=N is the largest window in KB prefetched ahead of a file read
+// sequentially (default 2048), 0 to turn readahead off.
+struct aofs_options {
+	char *image;
+	unsigned int blocks;
+	unsigned int blockSize;
+	unsigned int inodes;
+	char *backend;
+	char *sync;
+	unsigned int syncInterval;
+	unsigned int cacheSize;
+	unsigned int commitInterval;
+	char *trace;
+	unsigned int kernelCache;
+	int compress;
+	int dedup;
+	unsigned int readahead;
+};
 
-static struct fuse_operations aofs_oper = {
-	.getattr	= aofs_getattr,
-	.readdir	= aofs_readdir,
-	.open		= aofs_open,
-	.read		= aofs_read,
-	.create		= aofs_create,
-	.write		= aofs_write,
-	.mknod		= aofs_mknod,
-	.access		= aofs_access,
-	.utimens	= aofs_utimens,
-	.unlink		= aofs_unlink,
-	.statfs		= aofs_statfs,
-	.truncate	= aofs_truncate,
+#define AOFS_OPT(t, p) { t, offsetof(struct aofs_options, p), 1 }
+
+static const struct fuse_opt aofs_opts[] = {
+	AOFS_OPT("image=%s", image),
+	AOFS_OPT("blocks=%u", blocks),
+	AOFS_OPT("blocksize=%u", blockSize),
+	AOFS_OPT("inodes=%u", inodes),
+	AOFS_OPT("backend=%s", backend),
+	AOFS_OPT("sync=%s", sync),
+	AOFS_OPT("sync_interval=%u", syncInterval),
+	AOFS_OPT("cache_size=%u", cacheSize),
+	AOFS_OPT("commit=%u", commitInterval),
+	AOFS_OPT("trace=%s", trace),
+	AOFS_OPT("kcache=%u", kernelCache),
+	AOFS_OPT("compress", compress),
+	AOFS_OPT("dedup", dedup),
+	AOFS_OPT("readahead=%u", readahead),
+	FUSE_OPT_END
 };
 
 int main(int argc, char *argv[])
 {
-	FILE *FS_FILE = fopen("FS_FILE", "r+");
-	if(FS_FILE == NULL) {
-		FS_FILE = fopen("FS_FILE", "wb+");		// For write and read
-		printf("FS_FILE has been created\n");
-		fclose(FS_FILE);
-		filesys_init(&fs, NUM_BLOCKS, MAX_BLOCK_SIZE);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct aofs_options options = { NULL, AOFS_DEFAULT_BLOCKS, AOFS_DEFAULT_BLOCK_SIZE, 0, NULL, NULL, 0, CACHE_DEFAULT_MB, JOURNAL_DEFAULT_INTERVAL, NULL, AOFS_KERNEL_CACHE_DEFAULT, 0, 0,
+		READAHEAD_DEFAULT_MAX >> 10 };
+	char kernelOpts[64];
+	char *mountpoint;
+	int multithreaded;
+	int foreground;
+
+	if(fuse_opt_parse(&args, &options, aofs_opts, NULL) == -1)
+		return 1;
+
+	// Ahead of the command line's own -o, so those override these. The
+	// timeouts go out with each reply.
+	kernelCache = options.kernelCache;
+	snprintf(kernelOpts, sizeof(kernelOpts), "-obig_writes,max_write=%u", AOFS_MAX_WRITE);
+	if(fuse_opt_insert_arg(&args, 1, kernelOpts) == -1)
+		return 1;
+	const char *image = options.image ? options.image : "FS_FILE";
+
+	fs.syncPolicy = STORAGE_SYNC_FSYNC;
+	if(options.backend != NULL) {
+		if(strcmp(options.backend, "mmap") == 0)
+			fs.useMmap = 1;
+		else if(strcmp(options.backend, "uring") == 0)
+			fs.batchBackend = STORAGE_URING;
+		else if(strcmp(options.backend, "threads") == 0)
+			fs.batchBackend = STORAGE_THREADS;
+		else if(strcmp(options.backend, "pio") != 0) {
+			printf("Unknown backend %s, expected mmap, pio, uring or threads\n", options.backend);
+			return 1;
+		}
+	}
+	if(options.sync != NULL) {
+		if(strcmp(options.sync, "periodic") == 0)
+			fs.syncPolicy = STORAGE_SYNC_PERIODIC;
+		else if(strcmp(options.sync, "always") == 0)
+			fs.syncPolicy = STORAGE_SYNC_ALWAYS;
+		else if(strcmp(options.sync, "fsync") != 0) {
+			printf("Unknown sync policy %s, expected fsync, periodic or always\n", options.sync);
+			return 1;
+		}
+	}
+
+	if(options.trace != NULL && trace_open(options.trace, 0, 0) < 0) {
+		printf("Unable to create trace file %s\n", options.trace);
+		return 1;
+	}
+	fs.cacheBytes = fs.useMmap ? 0 : (size_t) options.cacheSize << 20;
+	fs.commitInterval = options.commitInterval;
+	fs.syncInterval = options.syncInterval;
+	fs.compress = options.compress;
+	fs.dedup = options.dedup;
+	fs.readaheadBytes = (size_t) options.readahead << 10;
+
+	if(access(image, F_OK) != 0) {
+		printf("%s has been created\n", image);
+		printf("Initializing file system struct ... \n");
+		printf("filesys_format: totalNumBlocks = %u and blockSize = %u\n", options.blocks, options.blockSize);
+		if(filesys_format(image, options.blocks, options.blockSize, options.inodes) < 0)
+			return 1;
 	}
 	else {
 		printf("FS_FILE is not NULL!\n");
-		filesys_load(&fs);
-		fclose(FS_FILE);
 	}
-
-	return fuse_main(argc, argv, &aofs_oper, NULL);
+	printf("Loading file system\n");
+	if(filesys_mount(&fs, image) < 0)
+		return 1;
+
+	int ret = 1;
+	if(fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 && mountpoint != NULL) {
+		struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+		if(ch != NULL) {
+			struct fuse_session *se = fuse_lowlevel_new(&args, &aofs_oper, sizeof(aofs_oper), NULL);
+			if(se != NULL) {
+				if(fuse_set_signal_handlers(se) != -1) {
+					fuse_session_add_chan(se, ch);
+					fuse_daemonize(foreground);
+					ret = (multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se)) != 0;
+					fuse_remove_signal_handlers(se);
+					fuse_session_remove_chan(ch);
+				}
+				fuse_session_destroy(se);
+			}
+			fuse_unmount(mountpoint, ch);
+		}
+		free(mountpoint);
+	}
+	fuse_opt_free_args(&args);
+	trace_close();
+	if(filesys_sync(&fs) < 0)
+		printf("Unable to write back %s\n", image);
+	Journal *j = &fs.journal;
+	printf("journal: %llu operations in %llu commits, %llu checkpoints, %llu bytes logged\n",
+		(unsigned long long) j->operations, (unsigned long long) j->commits,
+		(unsigned long long) j->checkpoints, (unsigned long long) j->bytesLogged);
+	CacheStats stats;
+	cache_stats(&fs.cache, &stats);
+	printf("cache: %llu hits, %llu misses, %llu blocks written back, %llu evictions, %llu read ahead\n",
+		(unsigned long long) stats.hits, (unsigned long long) stats.misses,
+		(unsigned long long) stats.writebacks, (unsigned long long) stats.evictions,
+		(unsigned long long) stats.prefetches);
+	printf("readahead: %llu streams, %llu bytes queued, %llu dropped\n",
+		(unsigned long long) fs.readahead.streams, (unsigned long long) fs.readahead.queued,
+		(unsigned long long) fs.readahead.dropped);
+	if(fs.storage.queue != NULL && fs.storage.queue->owner != 0)
+		printf("batches: run on %s\n", ioqueue_uses_rings(fs.storage.queue) ? "io_uring" : "worker threads");
+	if(fs.dedup)
+		printf("dedup: %llu blocks shared instead of written\n", (unsigned long long) fs.shared.hits);
+	if(filesys_unmount(&fs) < 0)
+		printf("Unable to commit the journal of %s\n", image);
+	return ret;
 }
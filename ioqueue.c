@@ -0,0 +1,393 @@
+/*
+  AOFS I/O queue
+
+  See ioqueue.h. io_uring is driven through its system calls directly,
+  so no library is needed. A batch holds one ring for as long as it
+  runs, keeping at most IOQUEUE_DEPTH transfers in flight so the
+  completion queue can never overflow, and anything the ring does not
+  finish in full (a short transfer, an error, a kernel without the
+  opcode) is completed with preadv/pwritev, which gives the final word
+  on the error.
+*/
+
+#include "ioqueue.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define IOQUEUE_URING 1
+#endif
+
+struct IoJob {
+	IoRequest *req;
+	int write;
+	int *pending;					// Jobs of its batch not finished
+	IoJob *next;
+};
+
+// Finish a transfer with preadv/pwritev from done bytes on
+static void ioqueue_finish(IoQueue *q, IoRequest *r, int write, size_t done) {
+	struct iovec rest[IOQUEUE_MAX_IOV];
+	for(;;) {
+		int n = 0;
+		size_t skip = done;
+		for(int i = 0; i < r->iovcnt && n < IOQUEUE_MAX_IOV; i++) {
+			if(skip >= r->iov[i].iov_len) {
+				skip -= r->iov[i].iov_len;
+				continue;
+			}
+			rest[n].iov_base = (char *) r->iov[i].iov_base + skip;
+			rest[n].iov_len = r->iov[i].iov_len - skip;
+			skip = 0;
+			n++;
+		}
+		if(n == 0)
+			break;
+		ssize_t res = write ? pwritev(q->fd, rest, n, r->offset + done) : preadv(q->fd, rest, n, r->offset + done);
+		if(res == -1 && errno == EINTR)
+			continue;
+		if(res == -1) {
+			r->res = -errno;
+			return;
+		}
+		if(res == 0)
+			break;
+		done += res;
+	}
+	r->res = done;
+}
+
+static size_t ioqueue_length(const IoRequest *r) {
+	size_t len = 0;
+	for(int i = 0; i < r->iovcnt; i++)
+		len += r->iov[i].iov_len;
+	return len;
+}
+
+#ifdef IOQUEUE_URING
+
+static void ioqueue_ring_close(IoRing *r) {
+	if(r->sqes != NULL)
+		munmap(r->sqes, r->sqesLen);
+	if(r->cqMap != NULL && r->cqMap != r->sqMap)
+		munmap(r->cqMap, r->cqMapLen);
+	if(r->sqMap != NULL)
+		munmap(r->sqMap, r->sqMapLen);
+	if(r->fd >= 0)
+		close(r->fd);
+	pthread_mutex_destroy(&r->lock);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+static int ioqueue_ring_open(IoQueue *q, IoRing *r) {
+	struct io_uring_params p;
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	pthread_mutex_init(&r->lock, NULL);
+	r->fd = syscall(__NR_io_uring_setup, IOQUEUE_DEPTH, &p);
+	if(r->fd < 0) {
+		int err = errno;
+		r->fd = -1;
+		ioqueue_ring_close(r);
+		return -err;
+	}
+
+	r->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(r->cqMapLen > r->sqMapLen)
+			r->sqMapLen = r->cqMapLen;
+		r->cqMapLen = r->sqMapLen;
+	}
+	r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+	void *sq = mmap(NULL, r->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->sqMap = sq == MAP_FAILED ? NULL : sq;
+	void *cq = r->sqMap;
+	if(r->sqMap != NULL && !(p.features & IORING_FEAT_SINGLE_MMAP))
+		cq = mmap(NULL, r->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->cqMap = cq == MAP_FAILED ? NULL : cq;
+	void *sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	r->sqes = sqes == MAP_FAILED ? NULL : sqes;
+	if(r->sqMap == NULL || r->cqMap == NULL || r->sqes == NULL) {
+		ioqueue_ring_close(r);
+		return -ENOMEM;
+	}
+
+	char *sqBase = r->sqMap, *cqBase = r->cqMap;
+	r->entries = p.sq_entries;
+	r->sqHead = (unsigned int *) (sqBase + p.sq_off.head);
+	r->sqTail = (unsigned int *) (sqBase + p.sq_off.tail);
+	r->sqMask = (unsigned int *) (sqBase + p.sq_off.ring_mask);
+	r->sqArray = (unsigned int *) (sqBase + p.sq_off.array);
+	r->cqHead = (unsigned int *) (cqBase + p.cq_off.head);
+	r->cqTail = (unsigned int *) (cqBase + p.cq_off.tail);
+	r->cqMask = (unsigned int *) (cqBase + p.cq_off.ring_mask);
+	r->cqes = cqBase + p.cq_off.cqes;
+
+	// Both are optimizations; without them the ring works the same
+	r->fixedFile = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, &q->fd, 1) == 0;
+	if(q->bufferCount > 0)
+		r->fixedBuffers = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, q->buffers, q->bufferCount) == 0;
+	return 0;
+}
+
+static void ioqueue_prep(IoQueue *q, IoRing *r, struct io_uring_sqe *sqe, const IoRequest *req, int write, unsigned int index) {
+	memset(sqe, 0, sizeof(*sqe));
+	if(req->iovcnt == 1 && req->buffer >= 0 && r->fixedBuffers) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t) req->iov[0].iov_base;
+		sqe->len = req->iov[0].iov_len;
+		sqe->buf_index = req->buffer;
+	}
+	else {
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (uintptr_t) req->iov;
+		sqe->len = req->iovcnt;
+	}
+	if(r->fixedFile) {
+		sqe->fd = 0;
+		sqe->flags = IOSQE_FIXED_FILE;
+	}
+	else {
+		sqe->fd = q->fd;
+	}
+	sqe->off = req->offset;
+	sqe->user_data = index;
+}
+
+// Run a batch on a ring the caller holds
+static void ioqueue_ring_batch(IoQueue *q, IoRing *r, IoRequest *reqs, int count, int write) {
+	struct io_uring_sqe *sqes = r->sqes;
+	struct io_uring_cqe *cqes = r->cqes;
+	unsigned int sqMask = *r->sqMask;
+	unsigned int cqMask = *r->cqMask;
+	int submitted = 0;
+	int completed = 0;
+
+	while(completed < count) {
+		unsigned int tail = *r->sqTail;
+		while(submitted < count && submitted - completed < (int) r->entries) {
+			ioqueue_prep(q, r, &sqes[tail & sqMask], &reqs[submitted], write, submitted);
+			r->sqArray[tail & sqMask] = tail & sqMask;
+			tail++;
+			submitted++;
+		}
+		__atomic_store_n(r->sqTail, tail, __ATOMIC_RELEASE);
+		unsigned int unseen = tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE);
+		if(syscall(__NR_io_uring_enter, r->fd, unseen, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+				errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			// Take back what the kernel has not seen and do it here
+			unsigned int head = __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE);
+			while(tail != head) {
+				tail--;
+				ioqueue_finish(q, &reqs[sqes[tail & sqMask].user_data], write, 0);
+				completed++;
+			}
+			__atomic_store_n(r->sqTail, head, __ATOMIC_RELEASE);
+		}
+
+		unsigned int head = *r->cqHead;
+		while(head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &cqes[head & cqMask];
+			IoRequest *req = &reqs[cqe->user_data];
+			if(cqe->res >= 0 && (size_t) cqe->res == ioqueue_length(req))
+				req->res = cqe->res;
+			else
+				ioqueue_finish(q, req, write, cqe->res > 0 ? cqe->res : 0);
+			head++;
+			completed++;
+		}
+		__atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+	}
+}
+
+#endif
+
+// Run the oldest queued job with the lock dropped; the lock is held
+static void ioqueue_take(IoQueue *q) {
+	IoJob *j = q->head;
+	q->head = j->next;
+	if(q->head == NULL)
+		q->tail = NULL;
+	pthread_mutex_unlock(&q->lock);
+	ioqueue_finish(q, j->req, j->write, 0);
+	pthread_mutex_lock(&q->lock);
+	if(--*j->pending == 0)
+		pthread_cond_broadcast(&q->done);
+}
+
+static void *ioqueue_worker(void *arg) {
+	IoQueue *q = arg;
+	pthread_mutex_lock(&q->lock);
+	for(;;) {
+		while(q->head == NULL && !q->stopping)
+			pthread_cond_wait(&q->work, &q->lock);
+		if(q->head == NULL)
+			break;
+		ioqueue_take(q);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+// Spread a batch over the workers, taking jobs here too until it is done
+static void ioqueue_thread_batch(IoQueue *q, IoRequest *reqs, int count, int write) {
+	IoJob local[16];
+	IoJob *jobs = count <= 16 ? local : malloc(count * sizeof(IoJob));
+	int pending = count;
+	if(jobs == NULL) {
+		for(int i = 0; i < count; i++)
+			ioqueue_finish(q, &reqs[i], write, 0);
+		return;
+	}
+	for(int i = 0; i < count; i++) {
+		jobs[i].req = &reqs[i];
+		jobs[i].write = write;
+		jobs[i].pending = &pending;
+		jobs[i].next = i + 1 < count ? &jobs[i + 1] : NULL;
+	}
+
+	pthread_mutex_lock(&q->lock);
+	if(q->tail != NULL)
+		q->tail->next = jobs;
+	else
+		q->head = jobs;
+	q->tail = &jobs[count - 1];
+	pthread_cond_broadcast(&q->work);
+	while(pending > 0) {
+		if(q->head != NULL)
+			ioqueue_take(q);
+		else
+			pthread_cond_wait(&q->done, &q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+	if(jobs != local)
+		free(jobs);
+}
+
+// Set up the rings, or else the workers, for the calling process; the
+// lock is held. Rings a parent set up before a fork are closed here,
+// which leaves the parent's own untouched; its workers are not here at all.
+static void ioqueue_start(IoQueue *q, pid_t pid) {
+#ifdef IOQUEUE_URING
+	for(int i = 0; i < q->rings; i++)
+		ioqueue_ring_close(&q->ring[i]);
+#endif
+	q->rings = 0;
+	q->workerCount = 0;
+	q->head = NULL;
+	q->tail = NULL;
+	q->stopping = 0;
+#ifdef IOQUEUE_URING
+	for(int i = 0; i < IOQUEUE_RINGS && q->wantRings; i++) {
+		if(ioqueue_ring_open(q, &q->ring[i]) < 0) {
+			while(i-- > 0)
+				ioqueue_ring_close(&q->ring[i]);
+			break;
+		}
+		q->rings = i + 1;
+	}
+#endif
+	for(int i = 0; i < IOQUEUE_WORKERS && q->rings == 0; i++) {
+		if(pthread_create(&q->workers[i], NULL, ioqueue_worker, q) != 0)
+			break;
+		q->workerCount = i + 1;
+	}
+	q->owner = pid;
+}
+
+void ioqueue_init(IoQueue *q, int fd, int rings) {
+	memset(q, 0, sizeof(*q));
+	q->fd = fd;
+	q->wantRings = rings;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->work, NULL);
+	pthread_cond_init(&q->done, NULL);
+}
+
+void ioqueue_destroy(IoQueue *q) {
+	if(q->owner == getpid()) {
+		pthread_mutex_lock(&q->lock);
+		q->stopping = 1;
+		pthread_cond_broadcast(&q->work);
+		pthread_mutex_unlock(&q->lock);
+		for(int i = 0; i < q->workerCount; i++)
+			pthread_join(q->workers[i], NULL);
+#ifdef IOQUEUE_URING
+		for(int i = 0; i < q->rings; i++)
+			ioqueue_ring_close(&q->ring[i]);
+#endif
+	}
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->work);
+	pthread_cond_destroy(&q->done);
+	memset(q, 0, sizeof(*q));
+}
+
+// Offer len bytes at buf, which many transfers will use, for registering
+// with the rings. Returns the index requests name it by, or -1 when it
+// cannot be registered; only buffers added before the first batch are.
+int ioqueue_add_buffer(IoQueue *q, void *buf, size_t len) {
+	int index = -1;
+	pthread_mutex_lock(&q->lock);
+	if(q->owner == 0 && q->bufferCount < IOQUEUE_MAX_BUFFERS) {
+		index = q->bufferCount++;
+		q->buffers[index].iov_base = buf;
+		q->buffers[index].iov_len = len;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return index;
+}
+
+// Run count transfers, all reads or all writes, setting the res of each
+void ioqueue_run(IoQueue *q, IoRequest *reqs, int count, int write) {
+	if(count == 1) {
+		ioqueue_finish(q, reqs, write, 0);
+		return;
+	}
+	pid_t pid = getpid();
+	pthread_mutex_lock(&q->lock);
+	if(q->owner != pid)
+		ioqueue_start(q, pid);
+	int rings = q->rings;
+	pthread_mutex_unlock(&q->lock);
+
+#ifdef IOQUEUE_URING
+	if(rings > 0) {
+		// A free ring if there is one, else wait for one
+		unsigned int first = __atomic_fetch_add(&q->nextRing, 1, __ATOMIC_RELAXED);
+		IoRing *r = NULL;
+		for(int i = 0; i < rings && r == NULL; i++) {
+			if(pthread_mutex_trylock(&q->ring[(first + i) % rings].lock) == 0)
+				r = &q->ring[(first + i) % rings];
+		}
+		if(r == NULL) {
+			r = &q->ring[first % rings];
+			pthread_mutex_lock(&r->lock);
+		}
+		ioqueue_ring_batch(q, r, reqs, count, write);
+		pthread_mutex_unlock(&r->lock);
+		return;
+	}
+#endif
+	ioqueue_thread_batch(q, reqs, count, write);
+}
+
+// Nonzero once batches go to io_uring rather than worker threads
+int ioqueue_uses_rings(IoQueue *q) {
+	pthread_mutex_lock(&q->lock);
+	int rings = q->rings;
+	pthread_mutex_unlock(&q->lock);
+	return rings > 0;
+}
@@ -0,0 +1,95 @@
+/*
+  AOFS I/O queue
+
+  Runs a batch of independent transfers against the image at once, so an
+  operation over scattered blocks waits about as long as its slowest
+  transfer instead of the sum of all of them. On Linux a batch goes to
+  io_uring: one io_uring_enter submits it and waits for the completions,
+  with the image registered as a fixed file and, when the kernel lets
+  them be pinned, the cache's block arrays as fixed buffers. Where
+  io_uring is missing or forbidden (old kernels, seccomp filters, other
+  systems) a few worker threads issue the transfers with preadv/pwritev
+  instead, the submitting thread taking its share.
+
+  Nothing is set up until the first batch, and a forked child sets up its
+  own: the daemon forks into the background after mounting, and threads
+  do not survive a fork.
+*/
+
+#ifndef AOFS_IOQUEUE_H
+#define AOFS_IOQUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define IOQUEUE_RINGS 4				// Batches from this many threads run side by side
+#define IOQUEUE_DEPTH 64			// Transfers in flight per ring
+#define IOQUEUE_WORKERS 8
+#define IOQUEUE_MAX_BUFFERS 16
+#define IOQUEUE_MAX_IOV 64			// Buffers per transfer
+
+// IoRequest struct, one transfer of a batch: the buffers of iov filled
+// from or written to the image at offset, in order
+typedef struct {
+	const struct iovec *iov;
+	int iovcnt;
+	off_t offset;
+	int buffer;						// Fixed buffer holding iov[0] if iovcnt is 1, -1 for none
+	ssize_t res;					// Bytes moved or -errno, set by the batch; short only at end of image
+} IoRequest;
+
+// IoRing struct, one io_uring and what is mapped of it
+typedef struct {
+	pthread_mutex_t lock;			// Held by the batch using the ring
+	int fd;
+	unsigned int entries;
+	unsigned int *sqHead;
+	unsigned int *sqTail;
+	unsigned int *sqMask;
+	unsigned int *sqArray;
+	void *sqes;						// struct io_uring_sqe[entries]
+	unsigned int *cqHead;
+	unsigned int *cqTail;
+	unsigned int *cqMask;
+	void *cqes;						// struct io_uring_cqe[cq_entries]
+	void *sqMap;
+	size_t sqMapLen;
+	void *cqMap;					// Same as sqMap with IORING_FEAT_SINGLE_MMAP
+	size_t cqMapLen;
+	size_t sqesLen;
+	int fixedFile;					// The image is registered file 0
+	int fixedBuffers;				// The queue's buffers are registered
+} IoRing;
+
+typedef struct IoJob IoJob;
+
+// IoQueue struct. lock guards starting and the job list.
+typedef struct {
+	int fd;							// The image
+	int wantRings;					// Try io_uring before worker threads
+	pthread_mutex_t lock;
+	pid_t owner;					// Process that set it up, 0 before the first batch
+	int rings;						// Rings set up; 0 when workers run the batches
+	IoRing ring[IOQUEUE_RINGS];
+	unsigned int nextRing;
+	struct iovec buffers[IOQUEUE_MAX_BUFFERS];
+	int bufferCount;
+	pthread_t workers[IOQUEUE_WORKERS];
+	int workerCount;
+	pthread_cond_t work;			// A job was queued, or the workers are to stop
+	pthread_cond_t done;			// The last job of some batch finished
+	IoJob *head;					// Jobs waiting for a thread, oldest first
+	IoJob *tail;
+	int stopping;
+} IoQueue;
+
+void ioqueue_init(IoQueue *q, int fd, int rings);
+void ioqueue_destroy(IoQueue *q);
+
+int ioqueue_add_buffer(IoQueue *q, void *buf, size_t len);
+void ioqueue_run(IoQueue *q, IoRequest *reqs, int count, int write);
+int ioqueue_uses_rings(IoQueue *q);
+
+#endif
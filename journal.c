@@ -0,0 +1,630 @@
+/*
+  AOFS metadata journal
+
+  See journal.h. A commit stops new operations from starting, waits for the
+  running ones to end, writes the open transaction at the head of the log
+  and syncs, then applies its records to the cache before letting
+  operations continue. Applying before anything else can run keeps a block
+  freed and reused for file content from being overwritten by an older
+  record for it. Blocks the transaction freed are handed to the discard
+  callback only then too: until the commit is durable, a crash brings
+  back the files that still name them, content included.
+
+  Replay walks the log from the tail twice: first collecting revoked
+  offsets, then writing every record no later revoke cancels.
+*/
+
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_MIN_SLOTS 64
+#define JOURNAL_MIN_BUFFER 4096
+
+// Revoked offset found during replay, with where the revoke was logged
+typedef struct {
+	uint64_t offset;
+	uint64_t seq;
+	uint64_t pos;
+} JournalRevoke;
+
+static uint32_t crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void journal_crc_init(void) {
+	for(uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for(int k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		crcTable[i] = c;
+	}
+}
+
+// CRC-32 (IEEE), continuing from crc
+static uint32_t journal_crc(uint32_t crc, const void *data, size_t len) {
+	const unsigned char *p = data;
+	crc = ~crc;
+	while(len--)
+		crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint64_t journal_round(uint64_t bytes, uint32_t blockSize) {
+	return (bytes + blockSize - 1) / blockSize * blockSize;
+}
+
+static size_t journal_record_size(uint32_t length) {
+	return sizeof(DiskJournalRecord) + ((length + 7) & ~7u);
+}
+
+// Room for a few transactions that rewrite the whole bitmap (in sector
+// records) plus an indirect block, and the header block
+uint32_t journal_min_blocks(uint32_t bitmapBlocks) {
+	return 1 + 4 * (bitmapBlocks + bitmapBlocks / 16 + 2);
+}
+
+static int journal_write_header(Storage *st, off_t offset, uint64_t seq, uint64_t tail) {
+	char sector[AOFS_SECTOR_SIZE];
+	DiskJournalHeader h;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = AOFS_JOURNAL_MAGIC;
+	h.tailSeq = seq;
+	h.tailOffset = tail;
+	memset(sector, 0, sizeof(sector));
+	memcpy(sector, &h, sizeof(h));
+	ssize_t res = storage_write(st, sector, sizeof(sector), offset);
+	return res < 0 ? res : 0;
+}
+
+// Empty journal for a freshly formatted image; the log itself is zeros
+int journal_format(Storage *st, const DiskSuperblock *d) {
+	return journal_write_header(st, (off_t) d->journalStart * d->blockSize, 1, 0);
+}
+
+static int journal_revoke_cmp(const void *a, const void *b) {
+	const JournalRevoke *x = a, *y = b;
+	if(x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+	if(x->seq != y->seq)
+		return x->seq < y->seq ? -1 : 1;
+	return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+// Whether a revoke logged after (seq, pos) cancels a record for offset
+static int journal_revoked(const JournalRevoke *revokes, size_t count, uint64_t offset, uint64_t seq, uint64_t pos) {
+	size_t lo = 0, hi = count;
+	// One past the last revoke for offset
+	while(lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if(revokes[mid].offset <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo == 0 || revokes[lo - 1].offset != offset)
+		return 0;
+	const JournalRevoke *last = &revokes[lo - 1];
+	return last->seq > seq || (last->seq == seq && last->pos > pos);
+}
+
+// Walk the complete transactions from (*seq, *pos). The first pass collects
+// revokes, the second writes records in place. Leaves *seq and *pos just
+// past the last complete transaction and returns how many were found.
+static int journal_scan(Journal *j, uint64_t *seq, uint64_t *pos, int apply, JournalRevoke **revokes, size_t *revokeCount, size_t *revokeCapacity) {
+	char *txn = NULL;
+	size_t txnCapacity = 0;
+	int count = 0;
+
+	for(uint64_t steps = 0; steps <= j->logSize / j->blockSize; steps++) {
+		DiskTxnHeader h;
+		if(*pos >= j->logSize)
+			*pos = 0;
+		if(storage_read(j->storage, &h, sizeof(h), j->logOffset + *pos) != sizeof(h))
+			break;
+		if(h.magic != AOFS_TXN_MAGIC || h.seq != *seq)
+			break;
+		if(h.type == AOFS_TXN_WRAP) {
+			*seq += 1;
+			*pos = 0;
+			continue;
+		}
+		if(h.type != AOFS_TXN_COMMIT || h.bytes > j->logSize - *pos - sizeof(h))
+			break;
+
+		size_t size = sizeof(h) + h.bytes;
+		if(size > txnCapacity) {
+			char *grown = realloc(txn, size);
+			if(grown == NULL)
+				break;
+			txn = grown;
+			txnCapacity = size;
+		}
+		if(storage_read(j->storage, txn, size, j->logOffset + *pos) != (ssize_t) size)
+			break;
+		DiskTxnHeader *th = (DiskTxnHeader *) txn;
+		uint32_t crc = th->crc;
+		th->crc = 0;
+		if(journal_crc(0, txn, size) != crc)
+			break;
+
+		for(size_t at = sizeof(h); at + sizeof(DiskJournalRecord) <= size; ) {
+			const DiskJournalRecord *r = (const DiskJournalRecord *) (txn + at);
+			if(journal_record_size(r->length) > size - at)
+				break;
+			if(!apply && r->type == AOFS_RECORD_REVOKE) {
+				if(*revokeCount == *revokeCapacity) {
+					size_t capacity = *revokeCapacity ? *revokeCapacity * 2 : 64;
+					JournalRevoke *grown = realloc(*revokes, capacity * sizeof(JournalRevoke));
+					if(grown == NULL) {
+						free(txn);
+						return -ENOMEM;
+					}
+					*revokes = grown;
+					*revokeCapacity = capacity;
+				}
+				(*revokes)[(*revokeCount)++] = (JournalRevoke) { r->offset, h.seq, at };
+			}
+			else if(apply && r->type == AOFS_RECORD_DATA
+					&& !journal_revoked(*revokes, *revokeCount, r->offset, h.seq, at)) {
+				ssize_t res = storage_write(j->storage, r + 1, r->length, r->offset);
+				if(res < 0) {
+					free(txn);
+					return res;
+				}
+			}
+			at += journal_record_size(r->length);
+		}
+		*seq += 1;
+		*pos += journal_round(size, j->blockSize);
+		count++;
+	}
+	free(txn);
+	return count;
+}
+
+// Read the journal header and replay whatever the log holds past the tail.
+// Runs at mount, before anything else reads the metadata blocks.
+int journal_open(Journal *j, Storage *st, const DiskSuperblock *d) {
+	DiskJournalHeader h;
+
+	memset(j, 0, sizeof(*j));
+	pthread_once(&crcOnce, journal_crc_init);
+	j->storage = st;
+	j->blockSize = d->blockSize;
+	j->headerOffset = (off_t) d->journalStart * d->blockSize;
+	j->logOffset = j->headerOffset + d->blockSize;
+	j->logSize = (uint64_t) (d->journalBlocks - 1) * d->blockSize;
+	if(storage_read(st, &h, sizeof(h), j->headerOffset) != sizeof(h) || h.magic != AOFS_JOURNAL_MAGIC
+			|| h.tailOffset >= j->logSize || h.tailOffset % d->blockSize != 0) {
+		printf("journal_open: journal header is damaged\n");
+		return -EINVAL;
+	}
+
+	JournalRevoke *revokes = NULL;
+	size_t revokeCount = 0, revokeCapacity = 0;
+	uint64_t seq = h.tailSeq, pos = h.tailOffset;
+	int count = journal_scan(j, &seq, &pos, 0, &revokes, &revokeCount, &revokeCapacity);
+	if(count > 0) {
+		uint64_t applySeq = h.tailSeq, applyPos = h.tailOffset;
+		if(revokeCount > 0)
+			qsort(revokes, revokeCount, sizeof(JournalRevoke), journal_revoke_cmp);
+		count = journal_scan(j, &applySeq, &applyPos, 1, &revokes, &revokeCount, &revokeCapacity);
+		TRACE_INFO(TRACE_REPLAY, count, h.tailSeq, 0);
+	}
+	free(revokes);
+	if(count < 0)
+		return count;
+
+	// Everything before pos is in place now, so the log starts out empty there
+	if(pos >= j->logSize)
+		pos = 0;
+	if(seq != h.tailSeq || pos != h.tailOffset) {
+		int res = storage_sync(st);
+		if(res == 0)
+			res = journal_write_header(st, j->headerOffset, seq, pos);
+		if(res == 0)
+			res = storage_sync(st);
+		if(res < 0)
+			return res;
+	}
+	j->head = pos;
+	j->nextSeq = seq;
+
+	j->bufCapacity = JOURNAL_MIN_BUFFER;
+	j->bufUsed = sizeof(DiskTxnHeader);
+	j->buf = malloc(j->bufCapacity);
+	j->slotCapacity = JOURNAL_MIN_SLOTS;
+	j->slots = calloc(j->slotCapacity, sizeof(JournalSlot));
+	if(j->buf == NULL || j->slots == NULL) {
+		free(j->buf);
+		free(j->slots);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->cond, NULL);
+	j->openGroup = 1;
+	j->doneGroup = 0;
+	return count;
+}
+
+// Start logging: home writes go through cache from here on, and blocks
+// freed by a transaction go to discard once it is committed
+void journal_start(Journal *j, Cache *cache, unsigned int interval, JournalDiscard discard, void *ctx) {
+	pthread_mutex_lock(&j->lock);
+	j->cache = cache;
+	j->interval = interval;
+	j->discard = discard;
+	j->discardCtx = ctx;
+	pthread_mutex_unlock(&j->lock);
+}
+
+// A large open transaction is committed before more operations join it
+static int journal_full(const Journal *j) {
+	return j->bufUsed > j->logSize / 8;
+}
+
+static JournalSlot *journal_slot(Journal *j, uint64_t offset) {
+	size_t mask = j->slotCapacity - 1;
+	size_t i = (offset * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+	while(j->slots[i].pos != 0 && j->slots[i].offset != offset)
+		i = (i + 1) & mask;
+	return &j->slots[i];
+}
+
+static int journal_grow_slots(Journal *j) {
+	JournalSlot *old = j->slots;
+	size_t oldCapacity = j->slotCapacity;
+	JournalSlot *slots = calloc(oldCapacity * 2, sizeof(JournalSlot));
+	if(slots == NULL)
+		return -ENOMEM;
+	j->slots = slots;
+	j->slotCapacity = oldCapacity * 2;
+	for(size_t i = 0; i < oldCapacity; i++) {
+		if(old[i].pos != 0)
+			*journal_slot(j, old[i].offset) = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+// Add a record to the open transaction; the lock is held
+static int journal_append(Journal *j, uint64_t offset, uint32_t type, const void *data, uint32_t length) {
+	size_t size = journal_record_size(length);
+	if(j->bufUsed + size > j->bufCapacity) {
+		size_t capacity = j->bufCapacity;
+		while(j->bufUsed + size > capacity)
+			capacity *= 2;
+		char *buf = realloc(j->buf, capacity);
+		if(buf == NULL)
+			return -ENOMEM;
+		j->buf = buf;
+		j->bufCapacity = capacity;
+	}
+	if((j->records + 1) * 2 > j->slotCapacity && journal_grow_slots(j) < 0)
+		return -ENOMEM;
+
+	DiskJournalRecord *r = (DiskJournalRecord *) (j->buf + j->bufUsed);
+	r->offset = offset;
+	r->length = length;
+	r->type = type;
+	if(length > 0)
+		memcpy(r + 1, data, length);
+	memset((char *) (r + 1) + length, 0, size - sizeof(*r) - length);
+	JournalSlot *slot = journal_slot(j, offset);
+	slot->offset = offset;
+	slot->pos = j->bufUsed;
+	j->bufUsed += size;
+	j->records++;
+	j->bytesLogged += size;
+	return 0;
+}
+
+// Record of the open transaction for offset, or NULL
+static DiskJournalRecord *journal_find(Journal *j, uint64_t offset) {
+	JournalSlot *slot = journal_slot(j, offset);
+	return slot->pos ? (DiskJournalRecord *) (j->buf + slot->pos) : NULL;
+}
+
+// Log length bytes that belong at image offset. Called between
+// journal_begin and journal_end.
+int journal_log(Journal *j, off_t offset, const void *data, uint32_t length) {
+	int res = 0;
+	pthread_mutex_lock(&j->lock);
+	DiskJournalRecord *old = journal_find(j, offset);
+	if(old != NULL && old->type == AOFS_RECORD_DATA && old->length == length) {
+		memcpy(old + 1, data, length);
+	}
+	else {
+		// A revoke stays: it still cancels records of older transactions,
+		// and this record comes after it
+		if(old != NULL && old->type == AOFS_RECORD_DATA)
+			old->type = AOFS_RECORD_SKIP;
+		res = journal_append(j, offset, AOFS_RECORD_DATA, data, length);
+	}
+	pthread_mutex_unlock(&j->lock);
+	return res;
+}
+
+// The block at offset was freed: no record logged for it so far may be
+// replayed, since the block may be rewritten as file content
+int journal_revoke(Journal *j, off_t offset) {
+	pthread_mutex_lock(&j->lock);
+	DiskJournalRecord *old = journal_find(j, offset);
+	if(old != NULL && old->type == AOFS_RECORD_DATA)
+		old->type = AOFS_RECORD_SKIP;
+	int res = journal_append(j, offset, AOFS_RECORD_REVOKE, NULL, 0);
+	pthread_mutex_unlock(&j->lock);
+	return res;
+}
+
+// The operation freed count blocks from block on. They are discarded once
+// the transaction is durable; if this fails they are simply kept.
+int journal_free(Journal *j, uint32_t block, uint32_t count) {
+	int res = 0;
+	pthread_mutex_lock(&j->lock);
+	JournalRun *last = j->freedCount > 0 ? &j->freed[j->freedCount - 1] : NULL;
+	if(last != NULL && last->block + last->count == block) {
+		last->count += count;
+	}
+	else {
+		if(j->freedCount == j->freedCapacity) {
+			size_t capacity = j->freedCapacity ? j->freedCapacity * 2 : JOURNAL_MIN_SLOTS;
+			JournalRun *freed = realloc(j->freed, capacity * sizeof(JournalRun));
+			if(freed == NULL) {
+				res = -ENOMEM;
+			}
+			else {
+				j->freed = freed;
+				j->freedCapacity = capacity;
+			}
+		}
+		if(res == 0) {
+			j->freed[j->freedCount].block = block;
+			j->freed[j->freedCount].count = count;
+			j->freedCount++;
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+	return res;
+}
+
+// Write every applied record to its home block and sync, so the whole log
+// can be reused
+static int journal_checkpoint(Journal *j) {
+	int res = cache_flush(j->cache);
+	if(res == 0)
+		res = storage_sync(j->storage);
+	if(res == 0)
+		res = journal_write_header(j->storage, j->headerOffset, j->nextSeq, j->head);
+	if(res == 0)
+		res = storage_sync(j->storage);
+	if(res == 0) {
+		j->used = 0;
+		j->checkpoints++;
+	}
+	TRACE_INFO(TRACE_CHECKPOINT, res, j->head, 0);
+	return res;
+}
+
+// Hand the records of the open transaction to the cache
+static int journal_apply(Journal *j) {
+	int ret = 0;
+	for(size_t at = sizeof(DiskTxnHeader); at < j->bufUsed; ) {
+		const DiskJournalRecord *r = (const DiskJournalRecord *) (j->buf + at);
+		if(r->type == AOFS_RECORD_DATA) {
+			ssize_t res = cache_write(j->cache, r + 1, r->length, r->offset);
+			if(res < 0)
+				ret = res;
+		}
+		at += journal_record_size(r->length);
+	}
+	return ret;
+}
+
+// Append the open transaction to the log and sync it. Only the committing
+// thread touches the log, and no operation is running.
+static int journal_write(Journal *j) {
+	size_t size = j->bufUsed;
+	uint64_t need = journal_round(size, j->blockSize);
+	int res;
+
+	if(need > j->logSize / 2) {
+		// Larger than the journal can take: write it in place without the
+		// crash protection
+		printf("journal_write: %zu byte transaction does not fit the journal\n", size);
+		res = journal_apply(j);
+		if(res == 0)
+			res = journal_checkpoint(j);
+		return res;
+	}
+	uint64_t waste = j->head + need > j->logSize ? j->logSize - j->head : 0;
+	if(j->used + waste + need > j->logSize / 2) {
+		res = journal_checkpoint(j);
+		if(res < 0)
+			return res;
+	}
+
+	if(waste) {
+		DiskTxnHeader w;
+		memset(&w, 0, sizeof(w));
+		w.magic = AOFS_TXN_MAGIC;
+		w.type = AOFS_TXN_WRAP;
+		w.seq = j->nextSeq++;
+		w.crc = journal_crc(0, &w, sizeof(w));
+		ssize_t written = storage_write(j->storage, &w, sizeof(w), j->logOffset + j->head);
+		if(written < 0)
+			return written;
+		j->used += waste;
+		j->head = 0;
+	}
+
+	DiskTxnHeader *h = (DiskTxnHeader *) j->buf;
+	memset(h, 0, sizeof(*h));
+	h->magic = AOFS_TXN_MAGIC;
+	h->type = AOFS_TXN_COMMIT;
+	h->seq = j->nextSeq++;
+	h->bytes = size - sizeof(*h);
+	h->records = j->records;
+	h->crc = journal_crc(0, j->buf, size);
+	ssize_t written = storage_write(j->storage, j->buf, size, j->logOffset + j->head);
+	if(written < 0)
+		return written;
+	res = storage_sync(j->storage);
+	if(res < 0)
+		return res;
+	j->head += need;
+	if(j->head == j->logSize)
+		j->head = 0;
+	j->used += need;
+	j->commits++;
+	TRACE_INFO(TRACE_COMMIT, j->records, size, h->seq);
+	return journal_apply(j);
+}
+
+// Make everything logged before this call durable. Whoever finds no commit
+// running commits the open transaction for every operation in it; the
+// others wait for that commit.
+int journal_commit(Journal *j) {
+	int res = 0;
+
+	pthread_mutex_lock(&j->lock);
+	uint64_t target = j->records ? j->openGroup : j->openGroup - 1;
+	while(j->doneGroup < target) {
+		if(j->committing) {
+			pthread_cond_wait(&j->cond, &j->lock);
+			continue;
+		}
+		j->committing = 1;
+		j->closing = 1;
+		while(j->active > 0)
+			pthread_cond_wait(&j->cond, &j->lock);
+		uint64_t group = j->openGroup++;
+		pthread_mutex_unlock(&j->lock);
+
+		uint64_t start = stats_now();
+		res = journal_write(j);
+		stats_end(STAT_COMMIT, start);
+		if(res < 0)
+			printf("journal_commit: unable to commit transaction %llu\n", (unsigned long long) group);
+		// Still no operation runs, so none can take the blocks meanwhile
+		for(size_t i = 0; i < j->freedCount && res == 0 && j->discard != NULL; i++)
+			j->discard(j->discardCtx, j->freed[i].block, j->freed[i].count);
+
+		pthread_mutex_lock(&j->lock);
+		j->bufUsed = sizeof(DiskTxnHeader);
+		j->records = 0;
+		j->freedCount = 0;
+		memset(j->slots, 0, j->slotCapacity * sizeof(JournalSlot));
+		j->doneGroup = group;
+		j->committing = 0;
+		j->closing = 0;
+		pthread_cond_broadcast(&j->cond);
+	}
+	pthread_mutex_unlock(&j->lock);
+	return res;
+}
+
+// Background commits every interval seconds. Started by the first
+// operation, since fuse_main forks after mount; if an operation of the
+// mount itself (reclaiming orphans) started it, the child finds it
+// missing and starts it again.
+static void *journal_flusher(void *arg) {
+	Journal *j = arg;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&j->lock);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += j->interval;
+	while(j->flusherRunning) {
+		if(pthread_cond_timedwait(&j->cond, &j->lock, &deadline) != ETIMEDOUT)
+			continue;
+		pthread_mutex_unlock(&j->lock);
+		journal_commit(j);
+		pthread_mutex_lock(&j->lock);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += j->interval;
+	}
+	pthread_mutex_unlock(&j->lock);
+	return NULL;
+}
+
+// An operation is about to change metadata. Waits while a commit is
+// closing the open transaction.
+void journal_begin(Journal *j) {
+	pthread_mutex_lock(&j->lock);
+	int full = journal_full(j);
+	pthread_mutex_unlock(&j->lock);
+	if(full)
+		journal_commit(j);
+
+	pthread_mutex_lock(&j->lock);
+	while(j->closing)
+		pthread_cond_wait(&j->cond, &j->lock);
+	j->active++;
+	pthread_mutex_unlock(&j->lock);
+}
+
+// The operation's records are all logged. With a commit interval of 0 this
+// returns once they are durable.
+int journal_end(Journal *j) {
+	pthread_mutex_lock(&j->lock);
+	j->active--;
+	j->operations++;
+	if(j->active == 0 && j->closing)
+		pthread_cond_broadcast(&j->cond);
+	if(j->interval > 0 && (!j->flusherRunning || j->flusherOwner != getpid())) {
+		j->flusherRunning = 1;
+		j->flusherOwner = getpid();
+		if(pthread_create(&j->flusher, NULL, journal_flusher, j) != 0)
+			j->flusherRunning = 0;
+	}
+	int commit = j->interval == 0 || journal_full(j);
+	pthread_mutex_unlock(&j->lock);
+	if(commit)
+		return journal_commit(j);
+	return 0;
+}
+
+static void journal_stop_flusher(Journal *j) {
+	pthread_mutex_lock(&j->lock);
+	// A flusher of the parent process did not survive the fork
+	int running = j->flusherRunning && j->flusherOwner == getpid();
+	j->flusherRunning = 0;
+	pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+	if(running)
+		pthread_join(j->flusher, NULL);
+}
+
+// Unmount: commit what is left and checkpoint, so the next mount has
+// nothing to replay
+int journal_close(Journal *j) {
+	int res = journal_commit(j);
+	journal_stop_flusher(j);
+	if(res == 0)
+		res = journal_checkpoint(j);
+	journal_destroy(j);
+	return res;
+}
+
+// Drop the journal without committing, for a mount that failed after
+// journal_open; the next mount replays what the log holds
+void journal_destroy(Journal *j) {
+	journal_stop_flusher(j);
+	free(j->buf);
+	free(j->slots);
+	free(j->freed);
+	j->buf = NULL;
+	j->slots = NULL;
+	j->freed = NULL;
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->cond);
+}
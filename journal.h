@@ -0,0 +1,109 @@
+/*
+  AOFS metadata journal
+
+  Every change to the bitmap, the inode table, an indirect block or a
+  directory sector is logged as a record in the open transaction instead of
+  being written in place. Operations bracket their changes with
+  journal_begin()/journal_end(), so a transaction always holds whole
+  operations. Committing appends the open transaction to the circular log
+  in the image with one sequential write and one sync, then hands the
+  records to the cache for their home blocks. Commits happen every commit
+  interval, when the open transaction grows large, and on fsync; with an
+  interval of 0 every operation waits for its commit, and operations
+  finishing together share one (group commit).
+
+  A record for an offset already in the open transaction overwrites it, so
+  many updates of one inode or bitmap chunk cost one record. Log space is
+  reclaimed by a checkpoint, which writes back the cache and moves the tail
+  of the log to its head. At mount, journal_open() replays every complete
+  transaction after the tail.
+
+  File content is not journaled. After a crash a file's metadata is
+  consistent, but blocks written shortly before may hold older content.
+*/
+
+#ifndef AOFS_JOURNAL_H
+#define AOFS_JOURNAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "layout.h"
+#include "storage.h"
+
+#define JOURNAL_DEFAULT_INTERVAL 5	// Seconds between background commits
+
+// JournalSlot struct, empty when pos is 0
+typedef struct {
+	uint64_t offset;				// Home offset of a record in the open transaction
+	size_t pos;						// Where its DiskJournalRecord starts in buf
+} JournalSlot;
+
+// JournalRun struct, blocks the open transaction freed
+typedef struct {
+	uint32_t block;
+	uint32_t count;
+} JournalRun;
+
+// Called once a commit is durable, for each run of blocks it freed
+typedef void (*JournalDiscard)(void *ctx, uint32_t block, uint32_t count);
+
+// Journal struct
+typedef struct {
+	Storage *storage;
+	Cache *cache;					// Home blocks are written through it after commit
+	uint32_t blockSize;
+	off_t headerOffset;				// Image offset of the journal header block
+	off_t logOffset;				// Image offset of the log
+	uint64_t logSize;				// Bytes in the log
+	uint64_t head;					// Where the next transaction goes, bytes into the log
+	uint64_t used;					// Log bytes written since the last checkpoint
+	uint64_t nextSeq;				// Sequence number the next transaction gets
+	JournalDiscard discard;			// Set by journal_start
+	void *discardCtx;
+
+	pthread_mutex_t lock;			// Everything below
+	pthread_cond_t cond;
+	char *buf;						// Open transaction: DiskTxnHeader, then records
+	size_t bufUsed;
+	size_t bufCapacity;
+	uint32_t records;
+	JournalRun *freed;				// Blocks freed by the open transaction
+	size_t freedCount;
+	size_t freedCapacity;
+	JournalSlot *slots;				// Record offsets of the open transaction
+	size_t slotCapacity;
+	int active;						// Operations between journal_begin and journal_end
+	int closing;					// A commit is waiting for active operations to end
+	int committing;
+	uint64_t openGroup;				// Commit group of the open transaction
+	uint64_t doneGroup;				// Last commit group that is durable
+	unsigned int interval;			// Seconds between commits, 0 to commit every operation
+	int flusherRunning;
+	pthread_t flusher;
+	pid_t flusherOwner;				// Process that started it; a forked child starts its own
+
+	uint64_t commits;
+	uint64_t operations;			// journal_end calls, so operations / commits is the group size
+	uint64_t checkpoints;
+	uint64_t bytesLogged;
+} Journal;
+
+uint32_t journal_min_blocks(uint32_t bitmapBlocks);
+int journal_format(Storage *st, const DiskSuperblock *d);
+
+int journal_open(Journal *j, Storage *st, const DiskSuperblock *d);
+void journal_start(Journal *j, Cache *cache, unsigned int interval, JournalDiscard discard, void *ctx);
+int journal_close(Journal *j);
+void journal_destroy(Journal *j);
+
+void journal_begin(Journal *j);
+int journal_log(Journal *j, off_t offset, const void *data, uint32_t length);
+int journal_revoke(Journal *j, off_t offset);
+int journal_free(Journal *j, uint32_t block, uint32_t count);
+int journal_end(Journal *j);
+int journal_commit(Journal *j);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+  AOFS on-disk layout
+
+  FS_FILE is an array of blocks:
+
+	block 0                     superblock (first sector)
+	bitmapStart .. +bitmapBlocks   packed free-block bitmap, one bit per block
+	inodeStart .. +inodeBlocks     inode table, fixed-size DiskInode records
+	journalStart .. +journalBlocks metadata journal: header block, then the log
+	dataStart ..                   file and directory content, indirect extent blocks
+
+  Inode 1 is the root directory; inode 0 is never used. An inode is free
+  when its mode is 0. A directory's content is a run of sectors of
+  DiskDirent records naming its entries, see dir.h.
+
+  A file's content is described by extents, runs of consecutive blocks.
+  The first AOFS_INLINE_EXTENTS live in the inode; a file with more has
+  an indirect block holding the rest as a plain Extent array. Small files
+  have no extents: up to AOFS_INLINE_DATA bytes live in the inode itself,
+  in place of the extents (AOFS_INODE_INLINE), and files of up to half a
+  block take a run of sectors in a block shared with other small files
+  (AOFS_INODE_TAIL), see tail.h. Bytes past the end of a file in either
+  are zero.
+
+  A file with AOFS_INODE_COMPRESS set stores its content in clusters of
+  AOFS_COMPRESS_CLUSTER bytes, each compressed with lz.h on its own. A
+  cluster that shrinks by at least a block gets an extent of its own
+  flagged AOFS_EXTENT_COMPRESSED: length counts the file blocks it covers
+  and the low bits of flags the compressed bytes, which fill the fewest
+  image blocks from start on. Other clusters are stored as they are.
+
+  The bitmap and inode table are contiguous so mount can pull all of the
+  file system state in with one read after the superblock. Integers are
+  stored in host byte order; version is bumped whenever a record changes.
+
+  Changes to the bitmap, the inode table, indirect blocks and directory
+  sectors are written to the journal first, as transactions of
+  DiskJournalRecords, and reach their home blocks afterwards. The log is
+  circular; each transaction starts on a block boundary with a
+  DiskTxnHeader, and the header block says where the oldest transaction not
+  yet known to be in place begins. */
+
+#ifndef AOFS_LAYOUT_H
+#define AOFS_LAYOUT_H
+
+#include <stdint.h>
+
+#define AOFS_MAGIC 0xfa19283e
+#define AOFS_VERSION 5
+#define AOFS_SECTOR_SIZE 512		// Unit of metadata writes
+#define AOFS_NAME_LEN 256			// Longest name plus its NUL
+#define AOFS_INLINE_EXTENTS 3
+#define AOFS_ROOT_INODE 1
+#define AOFS_INLINE_DATA 64			// Most content an inode holds itself
+
+#define AOFS_INODE_INLINE 1			// Content in the inode record
+#define AOFS_INODE_TAIL 2			// Content in sectors of a shared block
+#define AOFS_INODE_COMPRESS 4		// New content is compressed
+
+#define AOFS_COMPRESS_CLUSTER (64 * 1024)	// Bytes compressed as a unit, at least 2 blocks
+#define AOFS_EXTENT_COMPRESSED 0x80000000u
+#define AOFS_EXTENT_BYTES 0x00ffffffu		// Compressed size, in a compressed extent's flags
+
+// On-disk superblock, lives at the start of block 0
+typedef struct __attribute__((packed)) {
+	uint32_t magic;					// AOFS_MAGIC
+	uint32_t version;				// AOFS_VERSION
+	uint32_t blockSize;				// Bytes per block
+	uint32_t totalNumBlocks;		// Blocks in the image, including metadata
+	uint32_t inodeCount;			// Records in the inode table
+	uint32_t bitmapStart;			// First block of the bitmap
+	uint32_t bitmapBlocks;			// Blocks used by the bitmap
+	uint32_t inodeStart;			// First block of the inode table
+	uint32_t inodeBlocks;			// Blocks used by the inode table
+	uint32_t journalStart;			// First block of the journal
+	uint32_t journalBlocks;			// Blocks used by the journal, header included
+	uint32_t dataStart;				// First block available for file content
+} DiskSuperblock;
+
+// Extent, a run of blocks. Same record in memory, in the inode and in an
+// indirect block; a file's extents are sorted by logical.
+typedef struct __attribute__((packed)) {
+	uint32_t logical;				// First file block covered by the run
+	uint32_t start;					// First image block of the run
+	uint32_t length;				// Blocks in the run, file blocks if compressed
+	uint32_t flags;					// AOFS_EXTENT_COMPRESSED and the size, or 0
+} Extent;
+
+// On-disk inode, mirrors Metadata with fixed-width fields
+typedef struct __attribute__((packed)) {
+	uint64_t fileSize;				// File Size
+	uint32_t mode;					// File Mode, 0 if the inode is free
+	uint32_t extentCount;			// Extents in use, inline and indirect
+	int64_t timeCreated;			// File Creation Time
+	int64_t timeUpdated;			// File Updated Time
+	int64_t timeAccessed;			// File Accessed Time
+	uint32_t indirectBlock;			// Block holding extents past the inline ones, 0 if none
+	uint32_t nlink;					// Directory entries naming it, plus subdirectories for a directory
+	uint32_t flags;					// AOFS_INODE_*, 0 for content in extents
+	uint32_t tailBlock;				// Shared block holding the content, for AOFS_INODE_TAIL
+	uint16_t tailSector;			// First sector of it there
+	uint16_t tailSectors;			// Sectors it has
+	uint32_t reserved;
+	union {
+		Extent extents[AOFS_INLINE_EXTENTS];
+		uint8_t data[AOFS_INLINE_DATA];	// Content, for AOFS_INODE_INLINE
+	};
+} DiskInode;
+
+#define AOFS_DIRENT_FILE 1
+#define AOFS_DIRENT_DIR 2
+
+// Directory entry. Entries are 8-byte aligned and never cross a sector;
+// recLen runs to the next entry or the end of the sector, so any room
+// after the name belongs to the entry before it. inode is 0 for the first
+// entry of a sector with nothing at its start.
+typedef struct __attribute__((packed)) {
+	uint32_t inode;
+	uint16_t recLen;				// Bytes from this entry to the next
+	uint8_t nameLen;				// Name bytes, without the NUL stored after them
+	uint8_t type;					// AOFS_DIRENT_*
+	char name[];
+} DiskDirent;
+
+// Bytes an entry with a name of len bytes needs
+#define AOFS_DIRENT_SIZE(len) ((sizeof(DiskDirent) + (len) + 1 + 7) / 8 * 8)
+
+#define AOFS_JOURNAL_MAGIC 0x4a524e4c
+#define AOFS_TXN_MAGIC 0x54584e31
+#define AOFS_TXN_COMMIT 1			// Records to apply
+#define AOFS_TXN_WRAP 2				// No room before the end of the log, continue at its start
+#define AOFS_RECORD_DATA 1			// Bytes for their home location
+#define AOFS_RECORD_REVOKE 2		// Block freed: skip earlier records for this offset
+#define AOFS_RECORD_SKIP 3			// Superseded within its own transaction
+
+// Journal header, first block of the journal
+typedef struct __attribute__((packed)) {
+	uint32_t magic;					// AOFS_JOURNAL_MAGIC
+	uint32_t reserved;
+	uint64_t tailSeq;				// Sequence number of the oldest transaction to replay
+	uint64_t tailOffset;			// Where it starts, in bytes into the log
+} DiskJournalHeader;
+
+// Transaction header, at the start of a log block
+typedef struct __attribute__((packed)) {
+	uint32_t magic;					// AOFS_TXN_MAGIC
+	uint32_t type;					// AOFS_TXN_COMMIT or AOFS_TXN_WRAP
+	uint64_t seq;					// One more than the transaction before it
+	uint64_t bytes;					// Record bytes following the header
+	uint32_t records;
+	uint32_t crc;					// CRC-32 of the header, with crc 0, and the records
+} DiskTxnHeader;
+
+// Journal record, followed by length bytes of data padded to 8
+typedef struct __attribute__((packed)) {
+	uint64_t offset;				// Image byte offset the data belongs at
+	uint32_t length;
+	uint32_t type;					// AOFS_RECORD_*
+} DiskJournalRecord;
+
+#define AOFS_INODE_SIZE ((uint32_t) sizeof(DiskInode))
+#define AOFS_INODES_PER_SECTOR (AOFS_SECTOR_SIZE / AOFS_INODE_SIZE)
+
+_Static_assert(sizeof(DiskSuperblock) <= AOFS_SECTOR_SIZE, "superblock must fit in one sector");
+_Static_assert(AOFS_SECTOR_SIZE % sizeof(DiskInode) == 0, "inodes must not straddle sectors");
+_Static_assert(sizeof(DiskInode) == 128, "inode record size is part of the layout");
+_Static_assert(sizeof(DiskDirent) == 8, "directory entry header size is part of the layout");
+_Static_assert(AOFS_DIRENT_SIZE(AOFS_NAME_LEN - 1) <= AOFS_SECTOR_SIZE, "any name must fit in a sector");
+
+#endif
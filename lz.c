@@ -0,0 +1,208 @@
+/*
+  AOFS compression codec
+
+  The format leaves the last 5 bytes of a block as literals and starts no
+  match in the last 12, as LZ4 does, so blocks written here stay readable
+  by any LZ4 block decoder. Decompression checks every length and offset
+  against both buffers, since a damaged image must not take the daemon
+  down.
+*/
+
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5			// Block ends with at least this many literals
+#define LZ_MATCH_LIMIT 12			// No match starts this close to the end
+#define LZ_MAX_OFFSET 65535
+#define LZ_SKIP_TRIGGER 6			// After 2^this misses in a row, step further each time
+#define LZ_WILD 8					// Bytes copied at a time when both buffers have room
+
+static uint32_t lz_read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// How many bytes at p match those at ref, up to limit, a word at a time
+static size_t lz_count(const uint8_t *p, const uint8_t *ref, const uint8_t *limit) {
+	const uint8_t *start = p;
+	while(limit - p >= 8) {
+		uint64_t a, b;
+		memcpy(&a, p, sizeof(a));
+		memcpy(&b, ref, sizeof(b));
+		uint64_t diff = a ^ b;
+		if(diff != 0) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return p - start + (__builtin_ctzll(diff) >> 3);
+#else
+			return p - start + (__builtin_clzll(diff) >> 3);
+#endif
+		}
+		p += 8;
+		ref += 8;
+	}
+	while(p < limit && *p == *ref) {
+		p++;
+		ref++;
+	}
+	return p - start;
+}
+
+// Copy len bytes, LZ_WILD at a time; may write up to LZ_WILD - 1 bytes
+// past dst + len, and reads as far past src + len
+static void lz_wild_copy(uint8_t *dst, const uint8_t *src, size_t len) {
+	uint8_t *end = dst + len;
+	do {
+		memcpy(dst, src, LZ_WILD);
+		dst += LZ_WILD;
+		src += LZ_WILD;
+	} while(dst < end);
+}
+
+// Append the bytes of a length past the 15 in the token
+static uint8_t *lz_put_length(uint8_t *op, size_t len) {
+	while(len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+// Append a sequence: the literals from anchor, then a match unless mlen
+// is 0. Returns NULL when it would not fit before oend.
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *anchor, size_t lit, size_t offset, size_t mlen) {
+	size_t need = 1 + lit + lit / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+	if(need > (size_t) (oend - op))
+		return NULL;
+	uint8_t *token = op++;
+	*token = (lit >= 15 ? 15 : lit) << 4;
+	if(lit >= 15)
+		op = lz_put_length(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+	if(mlen) {
+		mlen -= LZ_MIN_MATCH;
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		*token |= mlen >= 15 ? 15 : mlen;
+		if(mlen >= 15)
+			op = lz_put_length(op, mlen - 15);
+	}
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+	uint32_t table[1 << LZ_HASH_BITS];
+	const uint8_t *base = src;
+	const uint8_t *ip = base;
+	const uint8_t *anchor = base;
+	const uint8_t *iend = base + len;
+	uint8_t *op = dst;
+	uint8_t *oend = op + cap;
+
+	if(len > LZ_MATCH_LIMIT) {
+		const uint8_t *mflimit = iend - LZ_MATCH_LIMIT;
+		const uint8_t *matchlimit = iend - LZ_LAST_LITERALS;
+		unsigned int misses = 0;
+		memset(table, 0, sizeof(table));
+		ip++;
+		while(ip < mflimit) {
+			uint32_t h = lz_hash(lz_read32(ip));
+			const uint8_t *ref = base + table[h];
+			table[h] = ip - base;
+			if(ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != lz_read32(ip)) {
+				// Data that does not compress is skipped over ever faster
+				ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+				continue;
+			}
+			misses = 0;
+			while(ip > anchor && ref > base && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			const uint8_t *mp = ip + LZ_MIN_MATCH;
+			mp += lz_count(mp, ref + LZ_MIN_MATCH, matchlimit);
+			op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+			if(op == NULL)
+				return 0;
+			ip = mp;
+			anchor = ip;
+			table[lz_hash(lz_read32(ip - 2))] = ip - 2 - base;
+		}
+	}
+	op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	return op == NULL ? 0 : (size_t) (op - (uint8_t *) dst);
+}
+
+// Read the bytes of a length past the 15 in the token
+static int lz_get_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+	uint8_t b;
+	do {
+		if(*ip >= iend)
+			return -EINVAL;
+		b = *(*ip)++;
+		*len += b;
+	} while(b == 255);
+	return 0;
+}
+
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap) {
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + len;
+	uint8_t *op = dst;
+	uint8_t *oend = op + cap;
+
+	while(ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit = token >> 4;
+		if(lit == 15 && lz_get_length(&ip, iend, &lit) < 0)
+			return -EINVAL;
+		if(lit > (size_t) (iend - ip) || lit > (size_t) (oend - op))
+			return -EINVAL;
+		if(lit + LZ_WILD <= (size_t) (iend - ip) && lit + LZ_WILD <= (size_t) (oend - op))
+			lz_wild_copy(op, ip, lit);
+		else
+			memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if(ip == iend)
+			break;
+
+		if(iend - ip < 2)
+			return -EINVAL;
+		size_t offset = ip[0] | (size_t) ip[1] << 8;
+		ip += 2;
+		size_t mlen = token & 15;
+		if(mlen == 15 && lz_get_length(&ip, iend, &mlen) < 0)
+			return -EINVAL;
+		mlen += LZ_MIN_MATCH;
+		if(offset == 0 || offset > (size_t) (op - (uint8_t *) dst) || mlen > (size_t) (oend - op))
+			return -EINVAL;
+
+		// A match may overlap what it copies, repeating a short pattern
+		const uint8_t *ref = op - offset;
+		if(offset >= LZ_WILD && mlen + LZ_WILD <= (size_t) (oend - op)) {
+			lz_wild_copy(op, ref, mlen);
+			op += mlen;
+		}
+		else if(offset >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		}
+		else {
+			for(size_t i = 0; i < mlen; i++)
+				*op++ = *ref++;
+		}
+	}
+	return op - (uint8_t *) dst;
+}
@@ -0,0 +1,30 @@
+/*
+  AOFS compression codec
+
+  A byte-oriented LZ77 codec in the LZ4 block format: each sequence is a
+  token byte (literal count and match length, four bits each, 15 meaning
+  more length bytes follow), the literals, and a two-byte little-endian
+  offset back into the output. A greedy compressor with one hash table of
+  recent positions keeps it at memory speed in both directions, which is
+  what makes compressing every write cheaper than the I/O it saves. The
+  last sequence of a block has literals only.
+
+  Neither call allocates; the compressor keeps its table on the stack.
+*/
+
+#ifndef AOFS_LZ_H
+#define AOFS_LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Compress len bytes of src into dst, which has room for cap bytes.
+// Returns the compressed size, or 0 when it would not fit in cap.
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+// Decompress len bytes of src into dst, which has room for cap bytes.
+// Returns the decompressed size, or -EINVAL for a block that is damaged
+// or would not fit.
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+  mkaofs: format an AOFS image
+
+  mkaofs [-b blocksize] [-s size[K|M|G|T]] [-n blocks] [-i bytes-per-inode]
+         [-j journal-blocks] image
+
+  The image is created if needed and cut to exactly the requested size.
+  Block size is 4K to 64K (default 4K); larger blocks mean fewer extents
+  and longer sequential transfers for big files. The journal defaults to
+  1/64 of the image, at most AOFS_MAX_JOURNAL_BLOCKS blocks.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "format.h"
+#include "storage.h"
+
+static void usage(void) {
+	printf("usage: mkaofs [-b blocksize] [-s size[K|M|G|T]] [-n blocks] [-i bytes-per-inode] [-j journal-blocks] image\n");
+	exit(1);
+}
+
+// Parse a byte count with an optional K/M/G/T suffix
+static unsigned long long parse_size(const char *arg) {
+	char *end;
+	unsigned long long n = strtoull(arg, &end, 10);
+	switch(*end) {
+		case 'T': case 't': n <<= 10; /* fall through */
+		case 'G': case 'g': n <<= 10; /* fall through */
+		case 'M': case 'm': n <<= 10; /* fall through */
+		case 'K': case 'k': n <<= 10; end++; break;
+		case '\0': break;
+		default: usage();
+	}
+	if(*end != '\0' || n == 0)
+		usage();
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long blockSize = AOFS_DEFAULT_BLOCK_SIZE;
+	unsigned long long size = 0;
+	unsigned long long blocks = 0;
+	unsigned long long bytesPerInode = AOFS_DEFAULT_BYTES_PER_INODE;
+	unsigned long long journalBlocks = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "b:s:n:i:j:")) != -1) {
+		switch(opt) {
+			case 'b': blockSize = parse_size(optarg); break;
+			case 's': size = parse_size(optarg); break;
+			case 'n': blocks = parse_size(optarg); break;
+			case 'i': bytesPerInode = parse_size(optarg); break;
+			case 'j': journalBlocks = parse_size(optarg); break;
+			default: usage();
+		}
+	}
+	if(optind != argc - 1)
+		usage();
+	if(blocks == 0)
+		blocks = size ? size / blockSize : AOFS_DEFAULT_BLOCKS;
+
+	DiskSuperblock d;
+	if(format_layout(&d, blocks, blockSize, blocks * blockSize / bytesPerInode, journalBlocks) < 0)
+		return 1;
+
+	Storage st;
+	int res = storage_open(&st, argv[optind], 0);
+	if(res == 0)
+		res = format_write(&st, &d);
+	storage_close(&st);
+	if(res < 0) {
+		printf("mkaofs: unable to format %s: %s\n", argv[optind], strerror(-res));
+		return 1;
+	}
+
+	printf("%s: %u blocks of %u bytes (%llu MB), %u inodes, %u journal blocks, data starts at block %u\n",
+			argv[optind], d.totalNumBlocks, d.blockSize,
+			(unsigned long long) d.totalNumBlocks * d.blockSize >> 20, d.inodeCount, d.journalBlocks, d.dataStart);
+	return 0;
+}
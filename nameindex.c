@@ -0,0 +1,190 @@
+/*
+  AOFS name index
+
+  Lookups hash the directory and name once and probe forward from its home
+  slot until they hit the name or an empty slot. The table is kept at most
+  3/4 full, so the expected probe length stays constant however many
+  entries a directory, or the whole file system, holds.
+
+  A lookup reads the sequence count, probes, and accepts the result only if
+  the count is even and unchanged afterwards (a seqlock). A grow publishes
+  the larger table before its capacity, so a lookup pairing an old capacity
+  with a new table still stays in bounds.
+*/
+
+#include "nameindex.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define NAMEINDEX_MIN_CAPACITY 64
+
+// FNV-1a over the name, seeded with the directory and finished with the
+// murmur3 mixer so the low bits used for the slot number depend on every byte.
+uint64_t nameindex_hash(uint32_t parent, const char *name) {
+	uint64_t h = (0xcbf29ce484222325ULL ^ parent) * 0x100000001b3ULL;
+	for(const unsigned char *p = (const unsigned char *) name; *p; p++) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static size_t nameindex_capacity_for(size_t count) {
+	size_t capacity = NAMEINDEX_MIN_CAPACITY;
+	while(capacity - capacity / 4 <= count)
+		capacity *= 2;
+	return capacity;
+}
+
+int nameindex_init(NameIndex *idx, size_t expected) {
+	idx->capacity = nameindex_capacity_for(expected);
+	idx->count = 0;
+	idx->seq = 0;
+	idx->retired = NULL;
+	idx->retiredCount = 0;
+	idx->slots = calloc(idx->capacity, sizeof(NameSlot));
+	if(idx->slots == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void nameindex_destroy(NameIndex *idx) {
+	for(size_t i = 0; i < idx->retiredCount; i++)
+		free(idx->retired[i]);
+	free(idx->retired);
+	idx->retired = NULL;
+	idx->retiredCount = 0;
+	free(idx->slots);
+	idx->slots = NULL;
+	idx->capacity = 0;
+	idx->count = 0;
+}
+
+// Place an entry known not to be present
+static void nameindex_place(NameSlot *slots, size_t mask, const NameSlot *entry) {
+	size_t i = entry->hash & mask;
+	while(slots[i].name != NULL)
+		i = (i + 1) & mask;
+	slots[i] = *entry;
+}
+
+static int nameindex_grow(NameIndex *idx) {
+	size_t capacity = idx->capacity * 2;
+	NameSlot *slots = calloc(capacity, sizeof(NameSlot));
+	NameSlot **retired = realloc(idx->retired, (idx->retiredCount + 1) * sizeof(NameSlot *));
+	if(retired != NULL)
+		idx->retired = retired;
+	if(slots == NULL || retired == NULL) {
+		free(slots);
+		return -ENOMEM;
+	}
+	for(size_t i = 0; i < idx->capacity; i++) {
+		if(idx->slots[i].name != NULL)
+			nameindex_place(slots, capacity - 1, &idx->slots[i]);
+	}
+	idx->retired[idx->retiredCount++] = idx->slots;
+	__atomic_store_n(&idx->slots, slots, __ATOMIC_RELEASE);
+	__atomic_store_n(&idx->capacity, capacity, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void nameindex_write_begin(NameIndex *idx) {
+	__atomic_store_n(&idx->seq, idx->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void nameindex_write_end(NameIndex *idx) {
+	__atomic_store_n(&idx->seq, idx->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Slot holding name, or -1. At most capacity probes, since a slot being
+// moved by a concurrent remove may momentarily leave no empty slot in reach.
+static long nameindex_probe(const NameSlot *slots, size_t capacity, uint32_t parent, const char *name, uint64_t hash) {
+	size_t mask = capacity - 1;
+	size_t i = hash & mask;
+	for(size_t n = 0; n < capacity; n++, i = (i + 1) & mask) {
+		const char *key = slots[i].name;
+		if(key == NULL)
+			break;
+		if(slots[i].hash == hash && slots[i].parent == parent && strcmp(key, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static long nameindex_find(const NameIndex *idx, uint32_t parent, const char *name, uint64_t hash) {
+	return nameindex_probe(idx->slots, idx->capacity, parent, name, hash);
+}
+
+int nameindex_insert(NameIndex *idx, uint32_t parent, const char *name, uint32_t value) {
+	NameSlot entry = { nameindex_hash(parent, name), name, parent, value };
+
+	if(nameindex_find(idx, parent, name, entry.hash) != -1)
+		return -EEXIST;
+	if(idx->count + 1 > idx->capacity - idx->capacity / 4) {
+		int res = nameindex_grow(idx);
+		if(res < 0)
+			return res;
+	}
+	nameindex_write_begin(idx);
+	nameindex_place(idx->slots, idx->capacity - 1, &entry);
+	nameindex_write_end(idx);
+	idx->count++;
+	return 0;
+}
+
+int nameindex_lookup(const NameIndex *idx, uint32_t parent, const char *name, uint32_t *value) {
+	uint64_t hash = nameindex_hash(parent, name);
+	for(;;) {
+		unsigned int seq = __atomic_load_n(&idx->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1)
+			continue;
+		size_t capacity = __atomic_load_n(&idx->capacity, __ATOMIC_ACQUIRE);
+		const NameSlot *slots = __atomic_load_n(&idx->slots, __ATOMIC_ACQUIRE);
+		long i = nameindex_probe(slots, capacity, parent, name, hash);
+		uint32_t found = i == -1 ? 0 : slots[i].value;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&idx->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		if(i == -1)
+			return -ENOENT;
+		*value = found;
+		return 0;
+	}
+}
+
+// Backward-shift deletion: pull later members of the probe run into the hole
+// so no tombstones are needed and lookups never scan dead slots.
+int nameindex_remove(NameIndex *idx, uint32_t parent, const char *name) {
+	long found = nameindex_find(idx, parent, name, nameindex_hash(parent, name));
+	if(found == -1)
+		return -ENOENT;
+
+	size_t mask = idx->capacity - 1;
+	size_t hole = found;
+	nameindex_write_begin(idx);
+	size_t i = (hole + 1) & mask;
+	while(idx->slots[i].name != NULL) {
+		size_t home = idx->slots[i].hash & mask;
+		// Move slot i into the hole if its home is not in (hole, i]
+		if(((i - home) & mask) >= ((i - hole) & mask)) {
+			idx->slots[hole] = idx->slots[i];
+			hole = i;
+		}
+		i = (i + 1) & mask;
+	}
+	idx->slots[hole].name = NULL;
+	idx->slots[hole].hash = 0;
+	idx->slots[hole].parent = 0;
+	idx->slots[hole].value = 0;
+	nameindex_write_end(idx);
+	idx->count--;
+	return 0;
+}
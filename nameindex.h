@@ -0,0 +1,51 @@
+/*
+  AOFS name index
+
+  Open-addressing hash table (linear probing, backward-shift deletion)
+  mapping a directory and a name in it to an inode number: the dentry
+  cache, holding every entry of every directory. Names are not copied: the
+  index keeps a pointer to the caller's name, which must stay valid and
+  unchanged while the entry is present (a name in a directory sector
+  does, see dir.h).
+
+  Lookups take no lock. Insert and remove must be serialized by the caller;
+  they bump a sequence count to odd while they move slots and back to even
+  when done, and a lookup that saw the count change retries. Tables
+  replaced by a grow are kept until nameindex_destroy(), so a lookup still
+  probing one never reads freed memory.
+*/
+
+#ifndef AOFS_NAMEINDEX_H
+#define AOFS_NAMEINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// NameSlot struct, empty when name is NULL
+typedef struct {
+	uint64_t hash;					// Full hash of parent and name, checked before strcmp
+	const char *name;				// Caller-owned key
+	uint32_t parent;				// Directory holding the name
+	uint32_t value;					// Inode number
+} NameSlot;
+
+// NameIndex struct
+typedef struct {
+	NameSlot *slots;
+	size_t capacity;				// Always a power of two
+	size_t count;					// Slots in use
+	unsigned int seq;				// Odd while a writer is changing slots
+	NameSlot **retired;				// Tables replaced by a grow
+	size_t retiredCount;
+} NameIndex;
+
+int nameindex_init(NameIndex *idx, size_t expected);
+void nameindex_destroy(NameIndex *idx);
+
+uint64_t nameindex_hash(uint32_t parent, const char *name);
+
+int nameindex_insert(NameIndex *idx, uint32_t parent, const char *name, uint32_t value);
+int nameindex_lookup(const NameIndex *idx, uint32_t parent, const char *name, uint32_t *value);
+int nameindex_remove(NameIndex *idx, uint32_t parent, const char *name);
+
+#endif
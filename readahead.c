@@ -0,0 +1,118 @@
+/*
+  AOFS readahead
+
+  See readahead.h. The windows are only decided here; what a range of a
+  file means in image blocks is the fill callback's business.
+*/
+
+#include "readahead.h"
+
+#include <string.h>
+
+void readahead_init(ReadAhead *ra, size_t max, ReadAheadFill fill, void *ctx) {
+	memset(ra, 0, sizeof(*ra));
+	ra->max = max;
+	ra->fill = fill;
+	ra->ctx = ctx;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->work, NULL);
+}
+
+// Stop the workers; ranges still queued are dropped
+void readahead_destroy(ReadAhead *ra) {
+	pthread_mutex_lock(&ra->lock);
+	ra->running = 0;
+	ra->count = 0;
+	pthread_cond_broadcast(&ra->work);
+	pthread_mutex_unlock(&ra->lock);
+	for(int i = 0; i < ra->workerCount; i++)
+		pthread_join(ra->workers[i], NULL);
+	ra->workerCount = 0;
+	pthread_cond_destroy(&ra->work);
+	pthread_mutex_destroy(&ra->lock);
+}
+
+// Note a read of len bytes at offset by stream rs. Returns how many bytes
+// from *start on to prefetch, 0 for none.
+size_t readahead_note(ReadAhead *ra, ReadStream *rs, off_t offset, size_t len, off_t *start) {
+	off_t end = offset + len;
+	size_t res = 0;
+	if(ra->max == 0 || len == 0)
+		return 0;
+
+	pthread_mutex_lock(&ra->lock);
+	off_t gap = offset - rs->next;
+	if(gap >= -(off_t) len && gap <= (off_t) len) {
+		if(rs->run < 2 && ++rs->run == 2) {
+			// A stream again; a window shrunk by random reads keeps its size
+			size_t first = 2 * len > READAHEAD_MIN ? 2 * len : READAHEAD_MIN;
+			if(rs->window < first)
+				rs->window = first < ra->max ? first : ra->max;
+			ra->streams++;
+		}
+		if(rs->ahead < end)
+			rs->ahead = end;
+		// Top the window up once the reader is into its second half
+		if(rs->window > 0 && rs->ahead - end < (off_t) rs->window / 2) {
+			*start = rs->ahead;
+			res = end + rs->window - rs->ahead;
+			rs->ahead += res;
+			rs->window = rs->window * 2 < ra->max ? rs->window * 2 : ra->max;
+		}
+		if(end > rs->next)
+			rs->next = end;
+	}
+	else {
+		rs->run = 1;
+		rs->window /= 4;
+		if(rs->window < READAHEAD_MIN)
+			rs->window = 0;
+		rs->next = end;
+		rs->ahead = end;
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return res;
+}
+
+static void *readahead_worker(void *arg) {
+	ReadAhead *ra = arg;
+	pthread_mutex_lock(&ra->lock);
+	for(;;) {
+		while(ra->running && ra->count == 0)
+			pthread_cond_wait(&ra->work, &ra->lock);
+		if(!ra->running)
+			break;
+		ReadAheadJob job = ra->jobs[ra->head];
+		ra->head = (ra->head + 1) % READAHEAD_JOBS;
+		ra->count--;
+		pthread_mutex_unlock(&ra->lock);
+		ra->fill(ra->ctx, job.ino, job.offset, job.len);
+		pthread_mutex_lock(&ra->lock);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+// Have a worker prefetch [offset, offset + len) of inode ino
+void readahead_queue(ReadAhead *ra, unsigned int ino, off_t offset, size_t len) {
+	pthread_mutex_lock(&ra->lock);
+	if(ra->workerCount == 0) {
+		ra->running = 1;
+		while(ra->workerCount < READAHEAD_WORKERS &&
+				pthread_create(&ra->workers[ra->workerCount], NULL, readahead_worker, ra) == 0)
+			ra->workerCount++;
+	}
+	if(ra->workerCount == 0 || ra->count == READAHEAD_JOBS) {
+		ra->dropped += len;
+	}
+	else {
+		ReadAheadJob *job = &ra->jobs[(ra->head + ra->count) % READAHEAD_JOBS];
+		job->ino = ino;
+		job->offset = offset;
+		job->len = len;
+		ra->count++;
+		ra->queued += len;
+		pthread_cond_signal(&ra->work);
+	}
+	pthread_mutex_unlock(&ra->lock);
+}
@@ -0,0 +1,77 @@
+/*
+  AOFS readahead
+
+  Each open file keeps a ReadStream with where its last read ended. A
+  read that picks up where the previous one stopped, give or take its own
+  length since the kernel may send a stream's reads from several threads
+  out of order, is sequential; two in a row make a stream, and from then
+  on a window of the file past the reader is prefetched into the block
+  cache. The window starts at READAHEAD_MIN and doubles each time the
+  reader has used up half of what is ahead, up to the maximum; a read
+  elsewhere cuts it to a quarter, so a few random reads turn it off.
+
+  Prefetching happens on worker threads, so a read never waits for it:
+  readahead_queue hands the range over and the fill callback, the
+  engine's, maps it to image blocks and reads them into the cache. A full
+  queue drops the range, and the reader then fetches it itself. The
+  workers start with the first range, since the daemon forks after
+  mounting and threads do not survive a fork.
+*/
+
+#ifndef AOFS_READAHEAD_H
+#define AOFS_READAHEAD_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define READAHEAD_MIN (128 * 1024)
+#define READAHEAD_DEFAULT_MAX (2 * 1024 * 1024)
+#define READAHEAD_JOBS 64				// Ranges waiting for a worker
+#define READAHEAD_WORKERS 2
+
+// ReadStream struct, the reads of one open file so far; all zeros for a
+// file nothing has been read from
+typedef struct {
+	off_t next;						// Where a sequential read would start
+	off_t ahead;					// Prefetched up to here
+	size_t window;					// Bytes kept prefetched past the reader, 0 when off
+	unsigned int run;				// Sequential reads in a row
+} ReadStream;
+
+// Reads [offset, offset + len) of inode ino into the cache
+typedef void (*ReadAheadFill)(void *ctx, unsigned int ino, off_t offset, size_t len);
+
+// ReadAheadJob struct, a range waiting for a worker
+typedef struct {
+	unsigned int ino;
+	off_t offset;
+	size_t len;
+} ReadAheadJob;
+
+// ReadAhead struct. lock guards every ReadStream and everything below.
+typedef struct {
+	size_t max;						// Largest window, 0 turns readahead off
+	ReadAheadFill fill;
+	void *ctx;
+	pthread_mutex_t lock;
+	pthread_cond_t work;			// A range was queued, or the workers are to stop
+	ReadAheadJob jobs[READAHEAD_JOBS];
+	unsigned int head;				// Oldest queued range
+	unsigned int count;
+	int running;					// Workers started and not told to stop
+	pthread_t workers[READAHEAD_WORKERS];
+	int workerCount;
+	uint64_t streams;				// Sequential streams detected
+	uint64_t queued;				// Bytes handed to the workers
+	uint64_t dropped;				// Bytes not prefetched for a full queue
+} ReadAhead;
+
+void readahead_init(ReadAhead *ra, size_t max, ReadAheadFill fill, void *ctx);
+void readahead_destroy(ReadAhead *ra);
+
+size_t readahead_note(ReadAhead *ra, ReadStream *rs, off_t offset, size_t len, off_t *start);
+void readahead_queue(ReadAhead *ra, unsigned int ino, off_t offset, size_t len);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+  AOFS latency statistics
+
+  See stats.h. A thread claims a shard on its first record; past
+  STATS_SHARDS threads share shards. Every update is a relaxed atomic add,
+  which costs no more than a plain add while the shard has one writer and
+  stays correct once it has more.
+*/
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// StatsShard struct, one thread's statistics
+typedef struct {
+	StatsHistogram stats[STAT_COUNT];
+} __attribute__((aligned(64))) StatsShard;
+
+static StatsShard shards[STATS_SHARDS];
+static unsigned int shardsClaimed;
+static __thread StatsShard *threadShard;
+static uint64_t startTime;
+
+static const char *statNames[STAT_COUNT] = {
+	[STAT_LOOKUP] = "lookup",
+	[STAT_FORGET] = "forget",
+	[STAT_GETATTR] = "getattr",
+	[STAT_READDIR] = "readdir",
+	[STAT_OPEN] = "open",
+	[STAT_READ] = "read",
+	[STAT_WRITE] = "write",
+	[STAT_CREATE] = "create",
+	[STAT_MKNOD] = "mknod",
+	[STAT_ACCESS] = "access",
+	[STAT_SETATTR] = "setattr",
+	[STAT_UNLINK] = "unlink",
+	[STAT_STATFS] = "statfs",
+	[STAT_FSYNC] = "fsync",
+	[STAT_RELEASE] = "release",
+	[STAT_MKDIR] = "mkdir",
+	[STAT_RMDIR] = "rmdir",
+	[STAT_SETXATTR] = "setxattr",
+	[STAT_GETXATTR] = "getxattr",
+	[STAT_FALLOCATE] = "fallocate",
+	[STAT_NAME_INDEX] = "name_index",
+	[STAT_ALLOC] = "alloc",
+	[STAT_BITMAP] = "bitmap",
+	[STAT_COMMIT] = "journal_commit",
+	[STAT_STORAGE_READ] = "storage_read",
+	[STAT_STORAGE_WRITE] = "storage_write",
+	[STAT_STORAGE_SYNC] = "storage_sync",
+	[STAT_COMPRESS] = "compress",
+	[STAT_DECOMPRESS] = "decompress",
+	[STAT_DEDUP] = "dedup",
+	[STAT_READAHEAD] = "readahead",
+};
+
+uint64_t stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+const char *stats_name(int stat) {
+	return statNames[stat];
+}
+
+static unsigned int stats_bucket(uint64_t ns) {
+	if(ns < STATS_SUB)
+		return ns;
+	unsigned int msb = 63 - __builtin_clzll(ns);
+	unsigned int bucket = (msb - STATS_SUB_BITS + 1) * STATS_SUB + ((ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB - 1));
+	return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// Largest value that falls in bucket
+static uint64_t stats_bucket_limit(unsigned int bucket) {
+	if(bucket < STATS_SUB)
+		return bucket;
+	unsigned int octave = bucket / STATS_SUB;
+	uint64_t low = (uint64_t) (STATS_SUB + bucket % STATS_SUB) << (octave - 1);
+	return low + ((uint64_t) 1 << (octave - 1)) - 1;
+}
+
+static StatsShard *stats_shard(void) {
+	if(threadShard == NULL) {
+		unsigned int n = __atomic_fetch_add(&shardsClaimed, 1, __ATOMIC_RELAXED);
+		if(n == 0)
+			__atomic_store_n(&startTime, stats_now(), __ATOMIC_RELAXED);
+		threadShard = &shards[n % STATS_SHARDS];
+	}
+	return threadShard;
+}
+
+// Add one sample. Callers may share h, so every update is atomic.
+void stats_record(StatsHistogram *h, uint64_t ns) {
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->totalNs, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->buckets[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&h->maxNs, __ATOMIC_RELAXED);
+	while(ns > max && !__atomic_compare_exchange_n(&h->maxNs, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+// Record the time since start against stat
+void stats_end(int stat, uint64_t start) {
+	stats_record(&stats_shard()->stats[stat], stats_now() - start);
+}
+
+// Add the samples in from to into, which only the caller updates
+void stats_merge(StatsHistogram *into, const StatsHistogram *from) {
+	into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	into->totalNs += __atomic_load_n(&from->totalNs, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&from->maxNs, __ATOMIC_RELAXED);
+	if(max > into->maxNs)
+		into->maxNs = max;
+	for(int b = 0; b < STATS_BUCKETS; b++)
+		into->buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+}
+
+// Percentiles are the upper edge of the bucket holding them, capped at
+// the maximum
+void stats_histogram_summary(const StatsHistogram *h, StatsSummary *s) {
+	memset(s, 0, sizeof(*s));
+	s->count = h->count;
+	s->totalNs = h->totalNs;
+	s->maxNs = h->maxNs;
+
+	uint64_t total = 0;
+	for(int b = 0; b < STATS_BUCKETS; b++)
+		total += h->buckets[b];
+	uint64_t seen = 0;
+	uint64_t *targets[] = { &s->p50Ns, &s->p99Ns, &s->p999Ns };
+	const double fractions[] = { 0.5, 0.99, 0.999 };
+	int next = 0;
+	for(int b = 0; b < STATS_BUCKETS && next < 3; b++) {
+		seen += h->buckets[b];
+		while(next < 3 && total > 0 && seen >= fractions[next] * total) {
+			uint64_t limit = stats_bucket_limit(b);
+			*targets[next++] = limit < s->maxNs ? limit : s->maxNs;
+		}
+	}
+}
+
+// Sum the shards. Records racing with this may be half counted, which
+// only skews a snapshot by those few records.
+void stats_summary(int stat, StatsSummary *s) {
+	static __thread StatsHistogram sum;
+
+	memset(&sum, 0, sizeof(sum));
+	for(int i = 0; i < STATS_SHARDS; i++)
+		stats_merge(&sum, &shards[i].stats[stat]);
+	stats_histogram_summary(&sum, s);
+}
+
+// Render every statistic with a count as a table or as JSON. Returns the
+// length, which may exceed size like snprintf's.
+size_t stats_format(char *buf, size_t size, int json) {
+	size_t len = 0;
+	int first = 1;
+	uint64_t uptime = shardsClaimed ? stats_now() - startTime : 0;
+
+#define STATS_PRINT(...) \
+	do { \
+		int n = snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, __VA_ARGS__); \
+		if(n > 0) \
+			len += n; \
+	} while(0)
+
+	if(json)
+		STATS_PRINT("{\"uptime_ns\": %llu, \"operations\": {", (unsigned long long) uptime);
+	else
+		STATS_PRINT("%-16s %10s %12s %10s %10s %10s %10s\n", "operation", "count", "total_ms", "p50_us", "p99_us", "p999_us", "max_us");
+	for(int stat = 0; stat < STAT_COUNT; stat++) {
+		StatsSummary s;
+		if(stat == STAT_FIRST_STAGE) {
+			if(json)
+				STATS_PRINT("}, \"stages\": {");
+			else
+				STATS_PRINT("\nstage\n");
+			first = 1;
+		}
+		stats_summary(stat, &s);
+		if(s.count == 0)
+			continue;
+		if(json) {
+			STATS_PRINT("%s\"%s\": {\"count\": %llu, \"total_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+					first ? "" : ", ", statNames[stat], (unsigned long long) s.count, (unsigned long long) s.totalNs,
+					(unsigned long long) s.p50Ns, (unsigned long long) s.p99Ns, (unsigned long long) s.p999Ns,
+					(unsigned long long) s.maxNs);
+		}
+		else {
+			STATS_PRINT("%-16s %10llu %12.3f %10.1f %10.1f %10.1f %10.1f\n", statNames[stat], (unsigned long long) s.count,
+					s.totalNs / 1e6, s.p50Ns / 1e3, s.p99Ns / 1e3, s.p999Ns / 1e3, s.maxNs / 1e3);
+		}
+		first = 0;
+	}
+	if(json)
+		STATS_PRINT("}}\n");
+#undef STATS_PRINT
+	return len;
+}
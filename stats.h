@@ -0,0 +1,92 @@
+/*
+  AOFS latency statistics
+
+  A count, total, maximum and log-linear histogram per FUSE operation and
+  per internal stage. Histogram buckets split every power of two into
+  STATS_SUB equal parts, so a percentile read from them is within 1/8 of
+  the true value. Each thread adds to its own shard, so recording never
+  contends; readers sum the shards. The mount shows the result in
+  /.aofs_stats and /.aofs_stats.json.
+*/
+
+#ifndef AOFS_STATS_H
+#define AOFS_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_SUB_BITS 3
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (38 * STATS_SUB)	// Up to 2^40 ns, about 18 minutes
+#define STATS_SHARDS 32
+
+enum {
+	// FUSE operations
+	STAT_LOOKUP,
+	STAT_FORGET,
+	STAT_GETATTR,
+	STAT_READDIR,
+	STAT_OPEN,
+	STAT_READ,
+	STAT_WRITE,
+	STAT_CREATE,
+	STAT_MKNOD,
+	STAT_ACCESS,
+	STAT_SETATTR,
+	STAT_UNLINK,
+	STAT_STATFS,
+	STAT_FSYNC,
+	STAT_RELEASE,
+	STAT_MKDIR,
+	STAT_RMDIR,
+	STAT_SETXATTR,
+	STAT_GETXATTR,
+	STAT_FALLOCATE,
+	// Stages inside them
+	STAT_NAME_INDEX,
+	STAT_ALLOC,
+	STAT_BITMAP,
+	STAT_COMMIT,
+	STAT_STORAGE_READ,
+	STAT_STORAGE_WRITE,
+	STAT_STORAGE_SYNC,
+	STAT_COMPRESS,
+	STAT_DECOMPRESS,
+	STAT_DEDUP,
+	STAT_READAHEAD,
+	STAT_COUNT
+};
+
+#define STAT_FIRST_STAGE STAT_NAME_INDEX
+
+// StatsHistogram struct
+typedef struct {
+	uint64_t count;
+	uint64_t totalNs;
+	uint64_t maxNs;
+	uint64_t buckets[STATS_BUCKETS];
+} StatsHistogram;
+
+// Summary of one statistic across all shards
+typedef struct {
+	uint64_t count;
+	uint64_t totalNs;
+	uint64_t maxNs;
+	uint64_t p50Ns;
+	uint64_t p99Ns;
+	uint64_t p999Ns;
+} StatsSummary;
+
+// Time something: uint64_t start = stats_now(); ...; stats_end(STAT_X, start);
+uint64_t stats_now(void);
+void stats_end(int stat, uint64_t start);
+void stats_summary(int stat, StatsSummary *s);
+const char *stats_name(int stat);
+size_t stats_format(char *buf, size_t size, int json);
+
+// The same histograms for other measurements, such as aofsbench's
+void stats_record(StatsHistogram *h, uint64_t ns);
+void stats_merge(StatsHistogram *into, const StatsHistogram *from);
+void stats_histogram_summary(const StatsHistogram *h, StatsSummary *s);
+
+#endif
@@ -0,0 +1,474 @@
+/*
+  AOFS storage backend
+
+  All I/O against FS_FILE goes through here. The image is opened once in
+  storage_open() and kept open until unmount; reads and writes are issued
+  with pread/pwrite (preadv/pwritev when a caller has several buffers for
+  one contiguous range) so there is no shared file position to seek.
+
+  With the mmap backend the same calls copy to and from a MAP_SHARED
+  mapping of the whole image and no syscall is made at all, except the
+  msync the sync policy asks for. A store into a hole of a sparse image
+  raises SIGBUS instead of returning ENOSPC when the host disk is full, so
+  the image is fully allocated before it is mapped.
+
+  Freed blocks are punched out of the image (storage_discard) once the
+  journal has committed their release, so that freeing costs no writes
+  and the host gets the space back; a mapped image keeps its blocks for
+  the reason above.
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE					// fallocate and FALLOC_FL_PUNCH_HOLE
+#endif
+
+#include "storage.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define STORAGE_MAX_IOV 64
+
+// Open the image once for the lifetime of the mount. If size is non-zero the
+// image is grown to that many bytes here, so callers never need to ftruncate.
+int storage_open(Storage *st, const char *path, off_t size) {
+	struct stat sbuf;
+
+	memset(st, 0, sizeof(*st));
+	st->backend = STORAGE_PIO;
+	st->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(st->fd == -1) {
+		printf("storage_open: unable to open %s\n", path);
+		return -errno;
+	}
+	if(fstat(st->fd, &sbuf) == -1) {
+		int err = errno;
+		close(st->fd);
+		st->fd = -1;
+		return -err;
+	}
+	st->size = sbuf.st_size;
+	if(size > st->size) {
+		if(ftruncate(st->fd, size) == -1) {
+			int err = errno;
+			printf("storage_open: unable to size %s to %lld bytes\n", path, (long long) size);
+			close(st->fd);
+			st->fd = -1;
+			return -err;
+		}
+		st->size = size;
+	}
+	return 0;
+}
+
+static void storage_stop_flusher(Storage *st);
+
+void storage_close(Storage *st) {
+	if(st->backend == STORAGE_MMAP) {
+		storage_stop_flusher(st);
+		if(st->map != NULL) {
+			msync(st->map, st->size, MS_SYNC);
+			munmap(st->map, st->size);
+			st->map = NULL;
+		}
+		pthread_mutex_destroy(&st->flushLock);
+		pthread_cond_destroy(&st->flushCond);
+		st->backend = STORAGE_PIO;
+	}
+	if(st->queue != NULL) {
+		ioqueue_destroy(st->queue);
+		free(st->queue);
+		st->queue = NULL;
+		st->backend = STORAGE_PIO;
+	}
+	if(st->fd != -1) {
+		close(st->fd);
+		st->fd = -1;
+	}
+}
+
+// Map the image, or drop the mapping when size is 0
+static int storage_map(Storage *st) {
+	if(st->size == 0) {
+		st->map = NULL;
+		return 0;
+	}
+	int res = posix_fallocate(st->fd, 0, st->size);
+	if(res != 0)
+		return -res;
+	void *map = mmap(NULL, st->size, PROT_READ | PROT_WRITE, MAP_SHARED, st->fd, 0);
+	if(map == MAP_FAILED)
+		return -errno;
+	st->map = map;
+	// Metadata and small files are scattered; callers ask for readahead
+	// explicitly on large sequential reads
+	madvise(st->map, st->size, MADV_RANDOM);
+	return 0;
+}
+
+// Switch an open image to the mmap backend
+int storage_use_mmap(Storage *st, int syncPolicy, unsigned int syncInterval) {
+	if(st->backend == STORAGE_MMAP)
+		return 0;
+	pthread_mutex_init(&st->flushLock, NULL);
+	pthread_cond_init(&st->flushCond, NULL);
+	st->syncPolicy = syncPolicy;
+	st->syncInterval = syncInterval ? syncInterval : 5;
+	st->dirty = 0;
+	st->flusherRunning = 0;
+	int res = storage_map(st);
+	if(res < 0) {
+		printf("storage_use_mmap: unable to map the image\n");
+		pthread_mutex_destroy(&st->flushLock);
+		pthread_cond_destroy(&st->flushCond);
+		return res;
+	}
+	st->backend = STORAGE_MMAP;
+	return 0;
+}
+
+// Have batches of an open image run at once: backend is STORAGE_URING,
+// which falls back to worker threads where io_uring cannot be used, or
+// STORAGE_THREADS. Single transfers stay pread/pwrite.
+int storage_use_queue(Storage *st, int backend) {
+	if(st->backend != STORAGE_PIO)
+		return st->backend == backend ? 0 : -EINVAL;
+	st->queue = malloc(sizeof(IoQueue));
+	if(st->queue == NULL)
+		return -ENOMEM;
+	ioqueue_init(st->queue, st->fd, backend == STORAGE_URING);
+	st->backend = backend;
+	return 0;
+}
+
+// Offer a buffer many transfers go through (the cache's blocks) to be
+// registered with io_uring. Returns the index an IoRequest names it by,
+// or -1.
+int storage_add_buffer(Storage *st, void *buf, size_t len) {
+	return st->queue != NULL ? ioqueue_add_buffer(st->queue, buf, len) : -1;
+}
+
+// Periodic msync for STORAGE_SYNC_PERIODIC. Started on the first write rather
+// than at open, because fuse_main forks into the background after the image
+// is opened and threads do not survive the fork.
+static void *storage_flusher(void *arg) {
+	Storage *st = arg;
+	pthread_mutex_lock(&st->flushLock);
+	while(st->flusherRunning) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += st->syncInterval;
+		pthread_cond_timedwait(&st->flushCond, &st->flushLock, &deadline);
+		if(__atomic_exchange_n(&st->dirty, 0, __ATOMIC_RELAXED) && st->map != NULL) {
+			msync(st->map, st->size, MS_ASYNC);
+		}
+	}
+	pthread_mutex_unlock(&st->flushLock);
+	return NULL;
+}
+
+static void storage_stop_flusher(Storage *st) {
+	pthread_mutex_lock(&st->flushLock);
+	int running = st->flusherRunning;
+	st->flusherRunning = 0;
+	pthread_cond_signal(&st->flushCond);
+	pthread_mutex_unlock(&st->flushLock);
+	if(running)
+		pthread_join(st->flusher, NULL);
+}
+
+// Apply the sync policy to a range just written through the mapping
+static int storage_mapped_written(Storage *st, off_t offset, size_t len) {
+	if(st->syncPolicy == STORAGE_SYNC_ALWAYS) {
+		long page = sysconf(_SC_PAGESIZE);
+		off_t start = offset - offset % page;
+		if(msync(st->map + start, len + (offset - start), MS_SYNC) == -1)
+			return -errno;
+		return 0;
+	}
+	__atomic_store_n(&st->dirty, 1, __ATOMIC_RELAXED);
+	if(st->syncPolicy == STORAGE_SYNC_PERIODIC && !st->flusherRunning) {
+		pthread_mutex_lock(&st->flushLock);
+		if(!st->flusherRunning) {
+			st->flusherRunning = 1;
+			if(pthread_create(&st->flusher, NULL, storage_flusher, st) != 0)
+				st->flusherRunning = 0;
+		}
+		pthread_mutex_unlock(&st->flushLock);
+	}
+	return 0;
+}
+
+static ssize_t storage_read_at(Storage *st, void *buf, size_t len, off_t offset) {
+	size_t done = 0;
+	if(st->backend == STORAGE_MMAP) {
+		if(offset >= st->size)
+			return 0;
+		if((off_t) len > st->size - offset)
+			len = st->size - offset;
+		memcpy(buf, st->map + offset, len);
+		return len;
+	}
+	while(done < len) {
+		ssize_t res = pread(st->fd, (char *) buf + done, len - done, offset + done);
+		if(res == -1) {
+			if(errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if(res == 0)
+			break;
+		done += res;
+	}
+	return done;
+}
+
+static ssize_t storage_write_at(Storage *st, const void *buf, size_t len, off_t offset) {
+	size_t done = 0;
+	if(st->backend == STORAGE_MMAP) {
+		if(offset + (off_t) len > st->size)
+			return -ENOSPC;
+		memcpy(st->map + offset, buf, len);
+		int res = storage_mapped_written(st, offset, len);
+		return res < 0 ? res : (ssize_t) len;
+	}
+	while(done < len) {
+		ssize_t res = pwrite(st->fd, (const char *) buf + done, len - done, offset + done);
+		if(res == -1) {
+			if(errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += res;
+	}
+	return done;
+}
+
+// Read len bytes at offset, retrying short reads. Returns the number of bytes
+// read (less than len only at end of image) or -errno.
+ssize_t storage_read(Storage *st, void *buf, size_t len, off_t offset) {
+	uint64_t start = stats_now();
+	ssize_t res = storage_read_at(st, buf, len, offset);
+	stats_end(STAT_STORAGE_READ, start);
+	return res;
+}
+
+// Write len bytes at offset, retrying short writes. Returns len or -errno.
+ssize_t storage_write(Storage *st, const void *buf, size_t len, off_t offset) {
+	uint64_t start = stats_now();
+	ssize_t res = storage_write_at(st, buf, len, offset);
+	stats_end(STAT_STORAGE_WRITE, start);
+	return res;
+}
+
+// Skip the first done bytes of iov, copying what remains into out.
+static int storage_iov_advance(struct iovec *out, const struct iovec *iov, int iovcnt, size_t done) {
+	int n = 0;
+	for(int i = 0; i < iovcnt; i++) {
+		if(done >= iov[i].iov_len) {
+			done -= iov[i].iov_len;
+			continue;
+		}
+		out[n].iov_base = (char *) iov[i].iov_base + done;
+		out[n].iov_len = iov[i].iov_len - done;
+		done = 0;
+		n++;
+	}
+	return n;
+}
+
+static size_t storage_iov_length(const struct iovec *iov, int iovcnt) {
+	size_t len = 0;
+	for(int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+static ssize_t storage_readv_at(Storage *st, const struct iovec *iov, int iovcnt, off_t offset) {
+	struct iovec rest[STORAGE_MAX_IOV];
+	size_t len = storage_iov_length(iov, iovcnt);
+	size_t done = 0;
+
+	if(iovcnt > STORAGE_MAX_IOV)
+		return -EINVAL;
+	if(st->backend == STORAGE_MMAP) {
+		for(int i = 0; i < iovcnt && offset + (off_t) done < st->size; i++) {
+			ssize_t res = storage_read_at(st, iov[i].iov_base, iov[i].iov_len, offset + done);
+			done += res;
+		}
+		return done;
+	}
+	while(done < len) {
+		int n = storage_iov_advance(rest, iov, iovcnt, done);
+		ssize_t res = preadv(st->fd, rest, n, offset + done);
+		if(res == -1) {
+			if(errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if(res == 0)
+			break;
+		done += res;
+	}
+	return done;
+}
+
+static ssize_t storage_writev_at(Storage *st, const struct iovec *iov, int iovcnt, off_t offset) {
+	struct iovec rest[STORAGE_MAX_IOV];
+	size_t len = storage_iov_length(iov, iovcnt);
+	size_t done = 0;
+
+	if(iovcnt > STORAGE_MAX_IOV)
+		return -EINVAL;
+	if(st->backend == STORAGE_MMAP) {
+		if(offset + (off_t) len > st->size)
+			return -ENOSPC;
+		for(int i = 0; i < iovcnt; i++) {
+			memcpy(st->map + offset + done, iov[i].iov_base, iov[i].iov_len);
+			done += iov[i].iov_len;
+		}
+		int res = storage_mapped_written(st, offset, len);
+		return res < 0 ? res : (ssize_t) len;
+	}
+	while(done < len) {
+		int n = storage_iov_advance(rest, iov, iovcnt, done);
+		ssize_t res = pwritev(st->fd, rest, n, offset + done);
+		if(res == -1) {
+			if(errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += res;
+	}
+	return done;
+}
+
+// Scatter one contiguous range of the image into several buffers.
+ssize_t storage_readv(Storage *st, const struct iovec *iov, int iovcnt, off_t offset) {
+	uint64_t start = stats_now();
+	ssize_t res = storage_readv_at(st, iov, iovcnt, offset);
+	stats_end(STAT_STORAGE_READ, start);
+	return res;
+}
+
+// Gather several buffers into one contiguous range of the image, e.g. a
+// metadata header followed by file content.
+ssize_t storage_writev(Storage *st, const struct iovec *iov, int iovcnt, off_t offset) {
+	uint64_t start = stats_now();
+	ssize_t res = storage_writev_at(st, iov, iovcnt, offset);
+	stats_end(STAT_STORAGE_WRITE, start);
+	return res;
+}
+
+// The bytes of a range are no longer needed: punch them out of the image,
+// so that they read back as zeros and take no space on the host. Returns
+// -EOPNOTSUPP when the host cannot, and always for a mapped image.
+int storage_discard(Storage *st, off_t offset, off_t len) {
+	if(st->backend == STORAGE_MMAP || len <= 0)
+		return len <= 0 ? 0 : -EOPNOTSUPP;
+#if defined(FALLOC_FL_PUNCH_HOLE)
+	if(fallocate(st->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == -1)
+		return errno == ENOSYS ? -EOPNOTSUPP : -errno;
+	return 0;
+#elif defined(SPACECTL_DEALLOC)
+	struct spacectl_range range = { offset, len };
+	if(fspacectl(st->fd, SPACECTL_DEALLOC, &range, 0, NULL) == -1)
+		return -errno;
+	return 0;
+#else
+	(void) offset;
+	return -EOPNOTSUPP;
+#endif
+}
+
+// Transfer count ranges, all reads or all writes, independent of each
+// other, setting the res of each. With a queue they run at once, else
+// one after the other. Returns the bytes moved, or the first error.
+ssize_t storage_batch(Storage *st, IoRequest *reqs, int count, int write) {
+	uint64_t start = stats_now();
+	ssize_t total = 0;
+	if(st->queue != NULL) {
+		ioqueue_run(st->queue, reqs, count, write);
+	}
+	else {
+		for(int i = 0; i < count; i++)
+			reqs[i].res = write ? storage_writev_at(st, reqs[i].iov, reqs[i].iovcnt, reqs[i].offset) : storage_readv_at(st, reqs[i].iov, reqs[i].iovcnt, reqs[i].offset);
+	}
+	for(int i = 0; i < count && total >= 0; i++)
+		total = reqs[i].res < 0 ? reqs[i].res : total + reqs[i].res;
+	stats_end(write ? STAT_STORAGE_WRITE : STAT_STORAGE_READ, start);
+	return total;
+}
+
+// Access pattern hint for a range: madvise on the mapping, posix_fadvise
+// for the page cache behind pread
+void storage_advise(Storage *st, off_t offset, off_t len, int advice) {
+	if(st->backend == STORAGE_MMAP) {
+		static const int madv[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED };
+		long page = sysconf(_SC_PAGESIZE);
+		off_t start = offset - offset % page;
+		if(start < st->size)
+			madvise(st->map + start, len + (offset - start) < st->size - start ? len + (offset - start) : st->size - start, madv[advice]);
+	}
+	else {
+		static const int fadv[] = { POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, POSIX_FADV_WILLNEED };
+		posix_fadvise(st->fd, offset, len, fadv[advice]);
+	}
+}
+
+// Set the image to exactly size bytes, e.g. when formatting. A mapped image
+// is remapped to the new size; callers must not be inside a read or write.
+int storage_resize(Storage *st, off_t size) {
+	if(st->backend == STORAGE_MMAP && st->map != NULL) {
+		msync(st->map, st->size, MS_SYNC);
+	}
+	if(ftruncate(st->fd, size) == -1)
+		return -errno;
+	if(st->backend == STORAGE_MMAP) {
+		if(st->map != NULL && size > 0) {
+#ifdef MREMAP_MAYMOVE
+			if(size > st->size) {
+				int res = posix_fallocate(st->fd, st->size, size - st->size);
+				if(res != 0)
+					return -res;
+			}
+			void *map = mremap(st->map, st->size, size, MREMAP_MAYMOVE);
+			if(map == MAP_FAILED)
+				return -errno;
+			st->map = map;
+			st->size = size;
+			return 0;
+#endif
+		}
+		if(st->map != NULL)
+			munmap(st->map, st->size);
+		st->map = NULL;
+		st->size = size;
+		return storage_map(st);
+	}
+	st->size = size;
+	return 0;
+}
+
+// Make everything written so far durable
+int storage_sync(Storage *st) {
+	uint64_t start = stats_now();
+	int res = 0;
+	if(st->backend == STORAGE_MMAP && st->map != NULL) {
+		st->dirty = 0;
+		if(msync(st->map, st->size, MS_SYNC) == -1)
+			res = -errno;
+	}
+	if(res == 0 && fsync(st->fd) == -1)
+		res = -errno;
+	stats_end(STAT_STORAGE_SYNC, start);
+	return res;
+}
@@ -0,0 +1,74 @@
+/*
+  AOFS storage backend
+
+  FS_FILE is opened once at mount and every transfer is issued as a
+  positioned read or write against that single descriptor, so a callback
+  costs one syscall per contiguous range instead of open/lseek/write/close.
+
+  Alternatively the whole image can be mapped (storage_use_mmap), which
+  turns reads into a memcpy from the mapping and writes into plain stores.
+  Durability of a mapped image is then governed by its sync policy.
+
+  An operation touching several runs of blocks hands them over together
+  (storage_batch). With pread/pwrite they are issued one after the
+  other; storage_use_queue has them run at once instead, on io_uring or
+  on worker threads (see ioqueue.h).
+*/
+
+#ifndef AOFS_STORAGE_H
+#define AOFS_STORAGE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "ioqueue.h"
+
+#define STORAGE_PIO 0				// pread/pwrite
+#define STORAGE_MMAP 1				// memcpy to and from a shared mapping
+#define STORAGE_URING 2				// pread/pwrite, batches on io_uring, else as STORAGE_THREADS
+#define STORAGE_THREADS 3			// pread/pwrite, batches spread over worker threads
+
+#define STORAGE_SYNC_FSYNC 0		// msync only when the file system is asked to sync
+#define STORAGE_SYNC_PERIODIC 1		// msync every syncInterval seconds as well
+#define STORAGE_SYNC_ALWAYS 2		// msync the written range after every write
+
+#define STORAGE_ADVICE_NORMAL 0
+#define STORAGE_ADVICE_SEQUENTIAL 1
+#define STORAGE_ADVICE_RANDOM 2
+#define STORAGE_ADVICE_WILLNEED 3
+
+// Storage struct
+typedef struct {
+	int fd;							// Descriptor of the image, open for the whole mount
+	off_t size;						// Size of the image in bytes
+	int backend;					// STORAGE_PIO, STORAGE_MMAP, STORAGE_URING or STORAGE_THREADS
+	char *map;						// The whole image when backend is STORAGE_MMAP
+	int syncPolicy;					// STORAGE_SYNC_*
+	unsigned int syncInterval;		// Seconds between msyncs for STORAGE_SYNC_PERIODIC
+	int dirty;						// Mapping written since the last msync
+	int flusherRunning;				// Periodic msync thread started
+	pthread_t flusher;
+	pthread_mutex_t flushLock;
+	pthread_cond_t flushCond;
+	IoQueue *queue;					// Runs batches for STORAGE_URING and STORAGE_THREADS
+} Storage;
+
+int storage_open(Storage *st, const char *path, off_t size);
+int storage_use_mmap(Storage *st, int syncPolicy, unsigned int syncInterval);
+int storage_use_queue(Storage *st, int backend);
+int storage_add_buffer(Storage *st, void *buf, size_t len);
+void storage_close(Storage *st);
+
+ssize_t storage_read(Storage *st, void *buf, size_t len, off_t offset);
+ssize_t storage_write(Storage *st, const void *buf, size_t len, off_t offset);
+ssize_t storage_readv(Storage *st, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t storage_writev(Storage *st, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t storage_batch(Storage *st, IoRequest *reqs, int count, int write);
+
+void storage_advise(Storage *st, off_t offset, off_t len, int advice);
+int storage_discard(Storage *st, off_t offset, off_t len);
+int storage_resize(Storage *st, off_t size);
+int storage_sync(Storage *st);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+  AOFS tail blocks
+
+  A tail is a run of sectors, so a file of up to half a block can always
+  share; the search for room looks at a few blocks from where the last
+  tail went and starts a new block when none of them has it.
+*/
+
+#include "tail.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "layout.h"
+
+// Blocks the search for room looks at before asking for a new one
+#define TAIL_SEARCH 16
+
+static uint32_t tail_hash(uint32_t block) {
+	return block * 2654435761u;
+}
+
+int tail_init(TailMap *t, unsigned int blockSize) {
+	memset(t, 0, sizeof(*t));
+	t->sectors = blockSize / AOFS_SECTOR_SIZE;
+	if(t->sectors > TAIL_MAX_SECTORS)
+		return -EINVAL;
+	t->slotMask = 63;
+	t->slots = calloc(t->slotMask + 1, sizeof(uint32_t));
+	return t->slots != NULL ? 0 : -ENOMEM;
+}
+
+void tail_destroy(TailMap *t) {
+	free(t->blocks);
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+// Slot holding block, or the empty slot where it would go
+static uint32_t tail_slot(const TailMap *t, uint32_t block) {
+	uint32_t s = tail_hash(block) & t->slotMask;
+	while(t->slots[s] != 0 && t->blocks[t->slots[s] - 1].block != block)
+		s = (s + 1) & t->slotMask;
+	return s;
+}
+
+static int tail_grow(TailMap *t) {
+	uint32_t mask = t->slotMask * 2 + 1;
+	uint32_t *slots = calloc((size_t) mask + 1, sizeof(uint32_t));
+	if(slots == NULL)
+		return -ENOMEM;
+	free(t->slots);
+	t->slots = slots;
+	t->slotMask = mask;
+	for(uint32_t i = 0; i < t->count; i++)
+		t->slots[tail_slot(t, t->blocks[i].block)] = i + 1;
+	return 0;
+}
+
+// Empty slot hole, moving later entries of its probe run back into it
+static void tail_unslot(TailMap *t, uint32_t hole) {
+	t->slots[hole] = 0;
+	for(uint32_t s = (hole + 1) & t->slotMask; t->slots[s] != 0; s = (s + 1) & t->slotMask) {
+		uint32_t home = tail_hash(t->blocks[t->slots[s] - 1].block) & t->slotMask;
+		if(((s - home) & t->slotMask) >= ((s - hole) & t->slotMask)) {
+			t->slots[hole] = t->slots[s];
+			t->slots[s] = 0;
+			hole = s;
+		}
+	}
+}
+
+static int tail_run_free(const TailBlock *b, unsigned int sector, unsigned int sectors) {
+	for(unsigned int s = sector; s < sector + sectors; s++) {
+		if(b->taken[s / 64] >> (s % 64) & 1)
+			return 0;
+	}
+	return 1;
+}
+
+static void tail_mark(TailBlock *b, unsigned int sector, unsigned int sectors, int taken) {
+	for(unsigned int s = sector; s < sector + sectors; s++) {
+		if(taken)
+			b->taken[s / 64] |= 1ULL << (s % 64);
+		else
+			b->taken[s / 64] &= ~(1ULL << (s % 64));
+	}
+	if(taken)
+		b->used += sectors;
+	else
+		b->used -= sectors;
+}
+
+// Find a run of sectors free sectors in a block that already holds tails.
+// Returns 0 and where it is, or -ENOSPC when the caller should start a
+// new tail block.
+int tail_find(TailMap *t, unsigned int sectors, uint32_t *block, unsigned int *sector) {
+	for(uint32_t n = 0; n < TAIL_SEARCH && n < t->count; n++) {
+		uint32_t i = (t->cursor + n) % t->count;
+		TailBlock *b = &t->blocks[i];
+		if(t->sectors - b->used < sectors)
+			continue;
+		for(unsigned int s = 0; s + sectors <= t->sectors; s++) {
+			if(tail_run_free(b, s, sectors)) {
+				t->cursor = i;
+				*block = b->block;
+				*sector = s;
+				return 0;
+			}
+		}
+	}
+	// The new block goes at the end, and the search continues from there
+	t->cursor = t->count;
+	return -ENOSPC;
+}
+
+// Mark a run of sectors of block taken, adding the block when it holds no
+// tails yet. -EEXIST if any of them already is.
+int tail_take(TailMap *t, uint32_t block, unsigned int sector, unsigned int sectors) {
+	if(sectors == 0 || sector + sectors > t->sectors)
+		return -EINVAL;
+	uint32_t s = tail_slot(t, block);
+	if(t->slots[s] == 0) {
+		if(((size_t) t->count + 1) * 2 > (size_t) t->slotMask + 1) {
+			if(tail_grow(t) < 0)
+				return -ENOMEM;
+			s = tail_slot(t, block);
+		}
+		if(t->count == t->capacity) {
+			uint32_t capacity = t->capacity ? t->capacity * 2 : 64;
+			TailBlock *blocks = realloc(t->blocks, capacity * sizeof(TailBlock));
+			if(blocks == NULL)
+				return -ENOMEM;
+			t->blocks = blocks;
+			t->capacity = capacity;
+		}
+		TailBlock *b = &t->blocks[t->count];
+		memset(b, 0, sizeof(*b));
+		b->block = block;
+		t->slots[s] = ++t->count;
+	}
+	TailBlock *b = &t->blocks[t->slots[s] - 1];
+	if(!tail_run_free(b, sector, sectors))
+		return -EEXIST;
+	tail_mark(b, sector, sectors, 1);
+	return 0;
+}
+
+// Give a run of sectors back. Returns 1 when that empties the block, which
+// the caller then frees, 0 otherwise.
+int tail_release(TailMap *t, uint32_t block, unsigned int sector, unsigned int sectors) {
+	uint32_t s = tail_slot(t, block);
+	if(t->slots[s] == 0)
+		return 0;
+	uint32_t i = t->slots[s] - 1;
+	tail_mark(&t->blocks[i], sector, sectors, 0);
+	if(t->blocks[i].used > 0)
+		return 0;
+
+	tail_unslot(t, s);
+	// The last record fills the hole
+	uint32_t last = --t->count;
+	if(i != last) {
+		t->blocks[i] = t->blocks[last];
+		t->slots[tail_slot(t, t->blocks[i].block)] = i + 1;
+	}
+	if(t->cursor >= t->count)
+		t->cursor = 0;
+	return 1;
+}
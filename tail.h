@@ -0,0 +1,48 @@
+/*
+  AOFS tail blocks
+
+  Files too big for their inode but smaller than half a block do not get
+  blocks of their own: each takes a run of sectors in a block shared with
+  other such files, a tail block. This keeps which sectors of each tail
+  block are taken. None of it is stored; the inodes say where every tail
+  is, and mount rebuilds the map from them. A tail block is allocated in
+  the block bitmap like any other and freed there once its last tail goes.
+
+  A hash table (linear probing, backward-shift deletion) finds the block
+  record for a block number. Callers serialize every call (the engine
+  holds allocLock).
+*/
+
+#ifndef AOFS_TAIL_H
+#define AOFS_TAIL_H
+
+#include <stdint.h>
+
+#define TAIL_MAX_SECTORS 128		// Sectors of the largest block, 64KB
+
+// TailBlock struct
+typedef struct {
+	uint32_t block;
+	uint32_t used;					// Sectors taken
+	uint64_t taken[TAIL_MAX_SECTORS / 64];
+} TailBlock;
+
+// TailMap struct
+typedef struct {
+	TailBlock *blocks;				// Every block holding tails, in no order
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t *slots;				// Hash of block number to index in blocks plus one, 0 when empty
+	uint32_t slotMask;				// Slots minus one, a power of two minus one
+	unsigned int sectors;			// Sectors per block
+	uint32_t cursor;				// Where the search for room starts
+} TailMap;
+
+int tail_init(TailMap *t, unsigned int blockSize);
+void tail_destroy(TailMap *t);
+
+int tail_find(TailMap *t, unsigned int sectors, uint32_t *block, unsigned int *sector);
+int tail_take(TailMap *t, uint32_t block, unsigned int sector, unsigned int sectors);
+int tail_release(TailMap *t, uint32_t block, unsigned int sector, unsigned int sectors);
+
+#endif
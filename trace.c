@@ -0,0 +1,115 @@
+/*
+  AOFS tracing
+
+  See trace.h. A thread claims a ring the first time it records an event
+  and keeps it; threads past the ring count record nothing.
+*/
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+TraceHeader *traceHeader;
+static size_t traceBytes;
+
+static __thread TraceRing *traceRing;
+static __thread int traceNoRing;
+
+static uint64_t trace_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Create the trace file and map it. ringEvents is rounded up to a power
+// of two; 0 picks the defaults.
+int trace_open(const char *path, uint32_t ringCount, uint32_t ringEvents) {
+	uint32_t events = 1;
+
+	if(ringCount == 0)
+		ringCount = TRACE_DEFAULT_RINGS;
+	if(ringEvents == 0)
+		ringEvents = TRACE_DEFAULT_EVENTS;
+	while(events < ringEvents)
+		events <<= 1;
+	size_t bytes = sizeof(TraceHeader) + ringCount * trace_ring_bytes(events);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return -errno;
+	if(ftruncate(fd, bytes) < 0) {
+		int res = -errno;
+		close(fd);
+		return res;
+	}
+	TraceHeader *h = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(h == MAP_FAILED)
+		return -errno;
+
+	h->version = TRACE_VERSION;
+	h->ringCount = ringCount;
+	h->ringEvents = events;
+	h->pid = getpid();
+	h->startTime = trace_now();
+	// aofstrace checks the magic before trusting the rest
+	__atomic_store_n(&h->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+	traceBytes = bytes;
+	__atomic_store_n(&traceHeader, h, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Stop recording. Threads may still be inside trace_emit, so the mapping
+// is left in place; the file keeps what was recorded.
+void trace_close(void) {
+	TraceHeader *h = traceHeader;
+	if(h == NULL)
+		return;
+	__atomic_store_n(&traceHeader, NULL, __ATOMIC_RELEASE);
+	msync(h, traceBytes, MS_ASYNC);
+}
+
+static TraceRing *trace_claim(TraceHeader *h) {
+	uint32_t n = __atomic_fetch_add(&h->claimed, 1, __ATOMIC_RELAXED);
+	if(n >= h->ringCount) {
+		traceNoRing = 1;
+		return NULL;
+	}
+	TraceRing *ring = trace_ring(h, n);
+	ring->tid = syscall(SYS_gettid);
+	traceRing = ring;
+	return ring;
+}
+
+void trace_emit(uint16_t id, uint16_t level, int32_t a, int64_t b, int64_t c) {
+	TraceHeader *h = __atomic_load_n(&traceHeader, __ATOMIC_ACQUIRE);
+	TraceRing *ring = traceRing;
+
+	if(h == NULL || traceNoRing)
+		return;
+	if(ring == NULL && (ring = trace_claim(h)) == NULL)
+		return;
+
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if(head - tail >= h->ringEvents) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	TraceEvent *e = &ring->events[head & (h->ringEvents - 1)];
+	e->time = trace_now();
+	e->id = id;
+	e->level = level;
+	e->a = a;
+	e->b = b;
+	e->c = c;
+	// Publish the event before aofstrace can see the new head
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,114 @@
+/*
+  AOFS tracing
+
+  TRACE_ERROR/TRACE_INFO/TRACE_DEBUG record a binary event (see
+  trace_events.h) instead of formatting text. Levels above
+  AOFS_TRACE_LEVEL compile to nothing, so a build with
+  -DAOFS_TRACE_LEVEL=0 carries no tracing code at all.
+
+  At runtime events go to a trace file mapped shared by trace_open(),
+  holding one ring per thread. Each ring has a single writer, its thread,
+  and a single reader, aofstrace, which decodes them from another process;
+  the two only share head and tail counters, so recording an event takes
+  no lock. A full ring drops the event and counts it. Without trace_open()
+  an event costs one test of a global.
+*/
+
+#ifndef AOFS_TRACE_H
+#define AOFS_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO 2			// One event per callback
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef AOFS_TRACE_LEVEL
+#define AOFS_TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+
+#define TRACE_MAGIC 0x41545243
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_RINGS 64
+#define TRACE_DEFAULT_EVENTS 16384	// Per ring, a power of two
+
+enum {
+#define TRACE_EVENT(id, name, format) id,
+#include "trace_events.h"
+#undef TRACE_EVENT
+	TRACE_EVENT_COUNT
+};
+
+// TraceEvent struct
+typedef struct {
+	uint64_t time;					// CLOCK_MONOTONIC nanoseconds
+	uint16_t id;
+	uint16_t level;
+	int32_t a;
+	int64_t b;
+	int64_t c;
+} TraceEvent;
+
+// TraceRing struct, followed by its events in the trace file
+typedef struct {
+	uint64_t head;					// Events written, advanced by the thread
+	uint64_t tail;					// Events read, advanced by aofstrace
+	uint64_t dropped;				// Events lost to a full ring
+	uint32_t tid;
+	uint32_t reserved[9];
+	TraceEvent events[];
+} TraceRing;
+
+// TraceHeader struct, at the start of the trace file
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ringCount;
+	uint32_t ringEvents;
+	uint32_t claimed;				// Rings handed to threads so far
+	uint32_t pid;
+	uint64_t startTime;				// CLOCK_MONOTONIC nanoseconds at trace_open
+	uint64_t reserved[4];
+} TraceHeader;
+
+extern TraceHeader *traceHeader;
+
+int trace_open(const char *path, uint32_t ringCount, uint32_t ringEvents);
+void trace_close(void);
+void trace_emit(uint16_t id, uint16_t level, int32_t a, int64_t b, int64_t c);
+
+static inline size_t trace_ring_bytes(uint32_t ringEvents) {
+	return sizeof(TraceRing) + (size_t) ringEvents * sizeof(TraceEvent);
+}
+
+static inline TraceRing *trace_ring(TraceHeader *h, uint32_t n) {
+	return (TraceRing *) ((char *) (h + 1) + n * trace_ring_bytes(h->ringEvents));
+}
+
+// Only the branch on traceHeader is paid while no trace file is open
+#define TRACE_EMIT(level, id, a, b, c) \
+	do { \
+		if(__builtin_expect(traceHeader != NULL, 0)) \
+			trace_emit(id, level, a, b, c); \
+	} while(0)
+
+#if AOFS_TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(id, a, b, c) TRACE_EMIT(TRACE_LEVEL_ERROR, id, a, b, c)
+#else
+#define TRACE_ERROR(id, a, b, c) ((void) 0)
+#endif
+
+#if AOFS_TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(id, a, b, c) TRACE_EMIT(TRACE_LEVEL_INFO, id, a, b, c)
+#else
+#define TRACE_INFO(id, a, b, c) ((void) 0)
+#endif
+
+#if AOFS_TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(id, a, b, c) TRACE_EMIT(TRACE_LEVEL_DEBUG, id, a, b, c)
+#else
+#define TRACE_DEBUG(id, a, b, c) ((void) 0)
+#endif
+
+#endif
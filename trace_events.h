@@ -0,0 +1,36 @@
+/*
+  AOFS trace events
+
+  TRACE_EVENT(id, name, format) for every event. Each event carries an int
+  a and two long longs b and c; format prints them in that order and may
+  leave trailing ones out. Included by trace.h for the ids and by
+  aofstrace for the names. New events go at the end so older trace files
+  still decode.
+*/
+
+TRACE_EVENT(TRACE_GETATTR, "getattr", "inode %d res %lld")
+TRACE_EVENT(TRACE_READDIR, "readdir", "%d entries")
+TRACE_EVENT(TRACE_OPEN, "open", "inode %d res %lld")
+TRACE_EVENT(TRACE_READ, "read", "inode %d res %lld offset %lld")
+TRACE_EVENT(TRACE_WRITE, "write", "inode %d res %lld offset %lld")
+TRACE_EVENT(TRACE_CREATE, "create", "inode %d res %lld")
+TRACE_EVENT(TRACE_UNLINK, "unlink", "inode %d res %lld")
+TRACE_EVENT(TRACE_TRUNCATE, "truncate", "inode %d res %lld size %lld")
+TRACE_EVENT(TRACE_FSYNC, "fsync", "res %d")
+TRACE_EVENT(TRACE_RELEASE, "release", "inode %d res %lld")
+TRACE_EVENT(TRACE_STATFS, "statfs", "free blocks %d")
+TRACE_EVENT(TRACE_MKNOD, "mknod", "mode %d")
+TRACE_EVENT(TRACE_UTIMENS, "utimens", "res %d")
+TRACE_EVENT(TRACE_LOOKUP, "lookup", "inode %d")
+TRACE_EVENT(TRACE_NO_SPACE, "no space", "inode %d blocks %lld to %lld")
+TRACE_EVENT(TRACE_NO_INODES, "no free inodes", "")
+TRACE_EVENT(TRACE_IO_ERROR, "io error", "inode %d res %lld")
+TRACE_EVENT(TRACE_LOG_ERROR, "journal log error", "inode %d res %lld")
+TRACE_EVENT(TRACE_COMMIT, "commit", "%d records, %lld bytes, seq %lld")
+TRACE_EVENT(TRACE_CHECKPOINT, "checkpoint", "res %d head %lld")
+TRACE_EVENT(TRACE_MKDIR, "mkdir", "inode %d res %lld")
+TRACE_EVENT(TRACE_RMDIR, "rmdir", "inode %d res %lld")
+TRACE_EVENT(TRACE_FORGET, "forget", "inode %d res %lld count %lld")
+TRACE_EVENT(TRACE_FALLOCATE, "fallocate", "inode %d res %lld offset %lld")
+TRACE_EVENT(TRACE_READAHEAD, "readahead", "inode %d bytes %lld offset %lld")
+TRACE_EVENT(TRACE_REPLAY, "journal replay", "%d transactions, from seq %lld")